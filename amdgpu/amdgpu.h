@@ -133,6 +133,11 @@ typedef struct amdgpu_va *amdgpu_va_handle;
  */
 typedef struct amdgpu_semaphore *amdgpu_semaphore_handle;
 
+/**
+ * Define handle for a request queued with amdgpu_cs_submit_async()
+ */
+typedef struct amdgpu_cs_submission *amdgpu_cs_submission_handle;
+
 /*--------------------------------------------------------------------------*/
 /* -------------------------- Structures ---------------------------------- */
 /*--------------------------------------------------------------------------*/
@@ -233,6 +238,30 @@ struct amdgpu_bo_import_result {
 	uint64_t alloc_size;
 };
 
+/**
+ * Counters of the buffer reuse cache
+ *
+ * \sa amdgpu_bo_cache_enable(), amdgpu_bo_cache_query_stats()
+ *
+*/
+struct amdgpu_bo_cache_stats {
+	/** Allocations served with a cached buffer */
+	uint64_t hits;
+
+	/** Allocations the cache could have served but had to create */
+	uint64_t misses;
+
+	/** Misses because the matching buffers were still busy */
+	uint64_t busy;
+
+	/** Buffers released for exceeding the time or byte budget */
+	uint64_t evictions;
+
+	/** Buffers and bytes currently in the cache */
+	uint64_t count;
+	uint64_t bytes;
+};
+
 /**
  *
  * Structure to describe GDS partitioning information.
@@ -732,6 +761,74 @@ int amdgpu_bo_wait_for_idle(amdgpu_bo_handle buf_handle,
 			    uint64_t timeout_ns,
 			    bool *buffer_busy);
 
+/**
+ * Enable reuse of freed buffers
+ *
+ * Buffers from amdgpu_bo_alloc() are rounded up to a size class and, once
+ * freed, kept together with their CPU mapping and their GPU VA mapping from
+ * amdgpu_bo_alloc_mapped().  Allocations with the same size class, heap and
+ * flags take the oldest of them if the GPU is done with it.  Buffers which
+ * were exported, still have mappings made with amdgpu_bo_va_op() or were
+ * allocated with AMDGPU_GEM_CREATE_VRAM_CLEARED are never cached.
+ *
+ * \param   dev        - \c [in] Device handle.
+ *			       See #amdgpu_device_initialize()
+ * \param   max_bytes  - \c [in] Budget for the cached buffers, 0 disables
+ *			       the cache and releases everything in it
+ * \param   max_age_ms - \c [in] Time after which a cached buffer is released,
+ *			       0 for no limit
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \note The contents of a buffer served from the cache are undefined.
+ *
+ * \sa amdgpu_bo_cache_query_stats()
+*/
+int amdgpu_bo_cache_enable(amdgpu_device_handle dev,
+			   uint64_t max_bytes,
+			   uint64_t max_age_ms);
+
+/**
+ * Query the counters of the buffer reuse cache
+ *
+ * \param   dev   - \c [in] Device handle. See #amdgpu_device_initialize()
+ * \param   stats - \c [out] Counters since the device was initialized
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \sa amdgpu_bo_cache_enable()
+*/
+int amdgpu_bo_cache_query_stats(amdgpu_device_handle dev,
+				struct amdgpu_bo_cache_stats *stats);
+
+/**
+ * Allocate a buffer together with a GPU VA and, optionally, a CPU mapping
+ *
+ * The VA range is owned by the buffer and unmapped and released with it,
+ * so that buffers from the reuse cache come back already mapped.
+ *
+ * \param   dev          - \c [in] Device handle.
+ *				 See #amdgpu_device_initialize()
+ * \param   alloc_buffer - \c [in] Pointer to the structure describing an
+ *				 allocation request
+ * \param   buf_handle   - \c [out] Allocated buffer handle
+ * \param   va           - \c [out] GPU virtual address of the buffer
+ * \param   cpu          - \c [out] CPU address, NULL if not needed.  The
+ *				 mapping is released with amdgpu_bo_cpu_unmap()
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \sa amdgpu_bo_alloc(), amdgpu_bo_free()
+*/
+int amdgpu_bo_alloc_mapped(amdgpu_device_handle dev,
+			   struct amdgpu_bo_alloc_request *alloc_buffer,
+			   amdgpu_bo_handle *buf_handle,
+			   uint64_t *va,
+			   void **cpu);
+
 /**
  * Creates a BO list handle for command submission.
  *
@@ -899,6 +996,93 @@ int amdgpu_cs_submit(amdgpu_context_handle context,
 		     struct amdgpu_cs_request *ibs_request,
 		     uint32_t number_of_requests);
 
+/**
+ * Called once a request queued with amdgpu_cs_submit_async() went to the
+ * kernel.
+ *
+ * \param   data   - \c [in] Pointer given to amdgpu_cs_submit_async()
+ * \param   result - \c [in] 0 on success, <0 - Negative POSIX Error code
+ *			      of the submission
+ * \param   fence  - \c [in] Fence of the submission, only valid during
+ *			      the call
+ *
+ * \note The callback runs on the submission thread of the context and
+ *	 must not free the context.
+ *
+ * \sa amdgpu_cs_submit_async()
+*/
+typedef void (*amdgpu_cs_submit_callback)(void *data, int result,
+					  const struct amdgpu_cs_fence *fence);
+
+/**
+ * Queue a request for submission to the hardware.
+ *
+ * The request is handed to a submission thread of the context, started by
+ * the first call, and the function returns without waiting for the kernel.
+ * Requests queued back-to-back are submitted in one go.  Requests queued
+ * from the same thread are submitted in order; there is no order between
+ * them and amdgpu_cs_submit() calls on the same ring.
+ *
+ * The request, its IB and dependency arrays are copied and may be reused
+ * right away.  The resource list and the user fence buffer must be kept
+ * until the request was submitted.  Semaphores the ring waits for are
+ * picked up when the request reaches the kernel.
+ *
+ * \param   context    - \c [in]  GPU Context
+ * \param   flags      - \c [in]  Global submission flags
+ * \param   ibs_request - \c [in] Pointer to submission request
+ * \param   callback   - \c [in]  Called with the result, can be NULL
+ * \param   data       - \c [in]  Passed to the callback
+ * \param   submission - \c [out] Handle to wait for the result, can be NULL
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \note amdgpu_cs_ctx_free() submits whatever is still queued.
+ *
+ * \sa amdgpu_cs_submit(), amdgpu_cs_submission_wait(),
+ *     amdgpu_cs_submission_free()
+*/
+int amdgpu_cs_submit_async(amdgpu_context_handle context,
+			   uint64_t flags,
+			   struct amdgpu_cs_request *ibs_request,
+			   amdgpu_cs_submit_callback callback,
+			   void *data,
+			   amdgpu_cs_submission_handle *submission);
+
+/**
+ * Wait for a queued request to reach the kernel.
+ *
+ * \param   submission - \c [in]  Handle from amdgpu_cs_submit_async()
+ * \param   timeout_ns - \c [in]  Timeout value to wait
+ * \param   fence      - \c [out] Fence of the submission, can be NULL
+ *
+ * \return   0 on success\n
+ *          -ETIME if the request is still queued\n
+ *          <0 - Negative POSIX Error code of the submission
+ *
+ * \note Must not be called once the context is freed.
+ *
+ * \sa amdgpu_cs_submit_async(), amdgpu_cs_query_fence_status()
+*/
+int amdgpu_cs_submission_wait(amdgpu_cs_submission_handle submission,
+			      uint64_t timeout_ns,
+			      struct amdgpu_cs_fence *fence);
+
+/**
+ * Release a handle from amdgpu_cs_submit_async().
+ *
+ * The request is still submitted if it is queued.
+ *
+ * \param   submission - \c [in] Handle to release
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+ * \sa amdgpu_cs_submit_async()
+*/
+int amdgpu_cs_submission_free(amdgpu_cs_submission_handle submission);
+
 /**
  *  Query status of Command Buffer Submission
  *
@@ -1221,6 +1405,37 @@ int amdgpu_va_range_query(amdgpu_device_handle dev,
 			  uint64_t *start,
 			  uint64_t *end);
 
+/**
+ * Structure describing how fragmented a virtual address range is
+ *
+ * \sa amdgpu_va_range_query_fragmentation()
+*/
+struct amdgpu_va_fragmentation {
+	/** Number of free ranges between allocations */
+	uint64_t holes;
+	/** Total size of those ranges */
+	uint64_t hole_bytes;
+	/** Size of the largest of those ranges */
+	uint64_t largest_hole;
+	/** Free space above the highest allocation */
+	uint64_t unused_bytes;
+};
+
+/**
+ * Report the fragmentation of the library's VA allocator
+ *
+ * \param   dev   - \c [in] Device handle. See #amdgpu_device_initialize()
+ * \param   flags - \c [in] AMDGPU_VA_RANGE_32_BIT for the 32bit address space
+ * \param   frag  - \c [out] Fragmentation report
+ *
+ * \return   0 on success\n
+ *          <0 - Negative POSIX Error code
+ *
+*/
+int amdgpu_va_range_query_fragmentation(amdgpu_device_handle dev,
+					uint64_t flags,
+					struct amdgpu_va_fragmentation *frag);
+
 /**
  *  VA mapping/unmapping for the buffer object
  *
@@ -60,22 +60,33 @@ int amdgpu_bo_alloc(amdgpu_device_handle dev,
 	struct amdgpu_bo *bo;
 	union drm_amdgpu_gem_create args;
 	unsigned heap = alloc_buffer->preferred_heap;
+	uint64_t alloc_size;
 	int r = 0;
 
 	/* It's an error if the heap is not specified */
 	if (!(heap & (AMDGPU_GEM_DOMAIN_GTT | AMDGPU_GEM_DOMAIN_VRAM)))
 		return -EINVAL;
 
+	bo = amdgpu_bo_cache_get(dev, alloc_buffer, &alloc_size);
+	if (bo) {
+		*buf_handle = bo;
+		return 0;
+	}
+
 	bo = calloc(1, sizeof(struct amdgpu_bo));
 	if (!bo)
 		return -ENOMEM;
 
 	atomic_set(&bo->refcount, 1);
 	bo->dev = dev;
-	bo->alloc_size = alloc_buffer->alloc_size;
+	bo->alloc_size = alloc_size ? alloc_size : alloc_buffer->alloc_size;
+	bo->reusable = alloc_size != 0;
+	bo->heap = heap;
+	bo->flags = alloc_buffer->flags;
+	bo->phys_alignment = alloc_buffer->phys_alignment;
 
 	memset(&args, 0, sizeof(args));
-	args.in.bo_size = alloc_buffer->alloc_size;
+	args.in.bo_size = bo->alloc_size;
 	args.in.alignment = alloc_buffer->phys_alignment;
 
 	/* Set the placement. */
@@ -98,6 +109,61 @@ int amdgpu_bo_alloc(amdgpu_device_handle dev,
 	return 0;
 }
 
+int amdgpu_bo_alloc_mapped(amdgpu_device_handle dev,
+			   struct amdgpu_bo_alloc_request *alloc_buffer,
+			   amdgpu_bo_handle *buf_handle,
+			   uint64_t *va,
+			   void **cpu)
+{
+	amdgpu_bo_handle bo;
+	amdgpu_va_handle va_handle;
+	uint64_t addr;
+	int r;
+
+	r = amdgpu_bo_alloc(dev, alloc_buffer, &bo);
+	if (r)
+		return r;
+
+	/* A buffer coming out of the cache keeps its address. */
+	if (!bo->va_handle) {
+		r = amdgpu_va_range_alloc(dev, amdgpu_gpu_va_range_general,
+					  bo->alloc_size,
+					  bo->phys_alignment, 0, &addr,
+					  &va_handle, 0);
+		if (r)
+			goto error_free;
+
+		r = amdgpu_bo_va_op_raw(dev, bo, 0, bo->alloc_size, addr,
+					AMDGPU_VM_PAGE_READABLE |
+					AMDGPU_VM_PAGE_WRITEABLE |
+					AMDGPU_VM_PAGE_EXECUTABLE,
+					AMDGPU_VA_OP_MAP);
+		if (r) {
+			amdgpu_va_range_free(va_handle);
+			goto error_free;
+		}
+
+		/* Owned by the buffer, not by the caller. */
+		atomic_dec(&bo->va_map_count, 1);
+		bo->va_handle = va_handle;
+		bo->va = addr;
+	}
+
+	if (cpu) {
+		r = amdgpu_bo_cpu_map(bo, cpu);
+		if (r)
+			goto error_free;
+	}
+
+	*buf_handle = bo;
+	*va = bo->va;
+	return 0;
+
+error_free:
+	amdgpu_bo_free(bo);
+	return r;
+}
+
 int amdgpu_bo_set_metadata(amdgpu_bo_handle bo,
 			   struct amdgpu_bo_metadata *info)
 {
@@ -234,6 +300,9 @@ int amdgpu_bo_export(amdgpu_bo_handle bo,
 {
 	int r;
 
+	/* Somebody else may hold on to a shared buffer, never cache it. */
+	bo->reusable = false;
+
 	switch (type) {
 	case amdgpu_bo_handle_type_gem_flink_name:
 		r = amdgpu_bo_export_flink(bo);
@@ -394,6 +463,22 @@ int amdgpu_bo_import(amdgpu_device_handle dev,
 	return 0;
 }
 
+drm_private void amdgpu_bo_destroy(struct amdgpu_bo *bo)
+{
+	if (bo->cpu_ptr)
+		drm_munmap(bo->cpu_ptr, bo->alloc_size);
+
+	if (bo->va_handle) {
+		amdgpu_bo_va_op_raw(bo->dev, bo, 0, bo->alloc_size, bo->va, 0,
+				    AMDGPU_VA_OP_UNMAP);
+		amdgpu_va_range_free(bo->va_handle);
+	}
+
+	amdgpu_close_kms_handle(bo->dev, bo->handle);
+	pthread_mutex_destroy(&bo->cpu_access_mutex);
+	free(bo);
+}
+
 int amdgpu_bo_free(amdgpu_bo_handle buf_handle)
 {
 	struct amdgpu_device *dev;
@@ -413,15 +498,12 @@ int amdgpu_bo_free(amdgpu_bo_handle buf_handle)
 						(void*)(uintptr_t)bo->flink_name);
 		}
 
-		/* Release CPU access. */
-		if (bo->cpu_map_count > 0) {
-			bo->cpu_map_count = 1;
-			amdgpu_bo_cpu_unmap(bo);
-		}
+		/* Release CPU access.  The mapping itself stays with the
+		 * buffer until it is destroyed. */
+		bo->cpu_map_count = 0;
 
-		amdgpu_close_kms_handle(dev, bo->handle);
-		pthread_mutex_destroy(&bo->cpu_access_mutex);
-		free(bo);
+		if (!amdgpu_bo_cache_put(bo))
+			amdgpu_bo_destroy(bo);
 	}
 
 	pthread_mutex_unlock(&dev->bo_table_mutex);
@@ -437,8 +519,7 @@ int amdgpu_bo_cpu_map(amdgpu_bo_handle bo, void **cpu)
 	pthread_mutex_lock(&bo->cpu_access_mutex);
 
 	if (bo->cpu_ptr) {
-		/* already mapped */
-		assert(bo->cpu_map_count > 0);
+		/* already mapped, or kept mapped for reuse */
 		bo->cpu_map_count++;
 		*cpu = bo->cpu_ptr;
 		pthread_mutex_unlock(&bo->cpu_access_mutex);
@@ -490,8 +571,8 @@ int amdgpu_bo_cpu_unmap(amdgpu_bo_handle bo)
 	}
 
 	bo->cpu_map_count--;
-	if (bo->cpu_map_count > 0) {
-		/* mapped multiple times */
+	if (bo->cpu_map_count > 0 || bo->reusable) {
+		/* mapped multiple times, or keep the mapping for reuse */
 		pthread_mutex_unlock(&bo->cpu_access_mutex);
 		return 0;
 	}
@@ -720,6 +801,15 @@ int amdgpu_bo_va_op_raw(amdgpu_device_handle dev,
 	va.map_size = size;
 
 	r = drmCommandWriteRead(dev->fd, DRM_AMDGPU_GEM_VA, &va, sizeof(va));
+	if (r || !bo)
+		return r;
+
+	/* A buffer mapped by the caller can't be cached, the mapping
+	 * would come along with it. */
+	if (ops == AMDGPU_VA_OP_MAP || ops == AMDGPU_VA_OP_REPLACE)
+		atomic_inc(&bo->va_map_count);
+	else if (ops == AMDGPU_VA_OP_UNMAP)
+		atomic_dec(&bo->va_map_count, 1);
 
 	return r;
 }
@@ -0,0 +1,294 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Buffer reuse cache
+ *
+ * Freed buffers are kept in buckets keyed by size class, heap and creation
+ * flags, each ordered by the time the buffer was freed, and on a global LRU
+ * list that the time and byte budgets are enforced on.  An allocation only
+ * looks at the oldest buffer of its bucket: if the GPU is not done with that
+ * one, it is not done with the younger ones either.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+
+#include "amdgpu_drm.h"
+#include "amdgpu_internal.h"
+
+#define AMDGPU_BO_CACHE_MIN_SIZE	4096
+
+static uint64_t amdgpu_bo_cache_class_size(int index)
+{
+	uint64_t base;
+
+	/* 4K, 8K and 12K, then 16K, 20K, 24K, 28K, 32K, 40K... */
+	if (index < 3)
+		return (uint64_t)AMDGPU_BO_CACHE_MIN_SIZE * (index + 1);
+
+	base = (uint64_t)AMDGPU_BO_CACHE_MIN_SIZE << ((index - 3) / 4 + 2);
+	return base + (base / 4) * ((index - 3) % 4);
+}
+
+/* Index of the smallest class the size fits, or -1 if it is too large. */
+static int amdgpu_bo_cache_class(uint64_t size)
+{
+	int lo = 0, hi = AMDGPU_BO_CACHE_CLASSES - 1;
+
+	if (size > amdgpu_bo_cache_class_size(hi))
+		return -1;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (amdgpu_bo_cache_class_size(mid) < size)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static uint64_t amdgpu_bo_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct amdgpu_bo_cache_bucket *
+amdgpu_bo_cache_bucket(struct amdgpu_bo_cache *cache, int index,
+		       uint32_t heap, uint64_t flags, bool create)
+{
+	struct amdgpu_bo_cache_bucket *bucket;
+
+	LIST_FOR_EACH_ENTRY(bucket, &cache->classes[index], list) {
+		if (bucket->heap == heap && bucket->flags == flags)
+			return bucket;
+	}
+
+	if (!create)
+		return NULL;
+
+	bucket = calloc(1, sizeof(*bucket));
+	if (!bucket)
+		return NULL;
+
+	bucket->heap = heap;
+	bucket->flags = flags;
+	list_inithead(&bucket->bos);
+	list_addtail(&bucket->list, &cache->classes[index]);
+	return bucket;
+}
+
+/* Must be called with the cache mutex held. */
+static void amdgpu_bo_cache_remove(struct amdgpu_bo_cache *cache,
+				   struct amdgpu_bo *bo)
+{
+	list_del(&bo->bucket_link);
+	list_del(&bo->lru_link);
+	bo->bucket = NULL;
+	cache->stats.count--;
+	cache->stats.bytes -= bo->alloc_size;
+}
+
+/* Release whatever is over budget.  Must be called with the cache mutex
+ * held. */
+static void amdgpu_bo_cache_evict(struct amdgpu_bo_cache *cache,
+				  uint64_t now)
+{
+	struct amdgpu_bo *bo, *next;
+
+	LIST_FOR_EACH_ENTRY_SAFE(bo, next, &cache->lru, lru_link) {
+		if (cache->stats.bytes <= cache->max_bytes &&
+		    (!cache->max_age_ns ||
+		     now - bo->cache_time <= cache->max_age_ns))
+			break;
+
+		amdgpu_bo_cache_remove(cache, bo);
+		amdgpu_bo_destroy(bo);
+		cache->stats.evictions++;
+	}
+}
+
+drm_private void amdgpu_bo_cache_init(struct amdgpu_bo_cache *cache)
+{
+	int i;
+
+	pthread_mutex_init(&cache->mutex, NULL);
+	for (i = 0; i < AMDGPU_BO_CACHE_CLASSES; i++)
+		list_inithead(&cache->classes[i]);
+	list_inithead(&cache->lru);
+}
+
+drm_private void amdgpu_bo_cache_fini(struct amdgpu_bo_cache *cache)
+{
+	struct amdgpu_bo_cache_bucket *bucket, *next;
+	int i;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_bytes = 0;
+	cache->max_age_ns = 0;
+	amdgpu_bo_cache_evict(cache, 0);
+	for (i = 0; i < AMDGPU_BO_CACHE_CLASSES; i++) {
+		LIST_FOR_EACH_ENTRY_SAFE(bucket, next, &cache->classes[i], list)
+			free(bucket);
+		list_inithead(&cache->classes[i]);
+	}
+	pthread_mutex_unlock(&cache->mutex);
+	pthread_mutex_destroy(&cache->mutex);
+}
+
+/**
+ * Find an idle cached buffer for an allocation.
+ *
+ * \param alloc_size - [out] Size to create the buffer with on a miss, or 0
+ *		       if the allocation cannot be cached.
+ */
+drm_private struct amdgpu_bo *
+amdgpu_bo_cache_get(amdgpu_device_handle dev,
+		    const struct amdgpu_bo_alloc_request *request,
+		    uint64_t *alloc_size)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+	struct amdgpu_bo_cache_bucket *bucket;
+	struct amdgpu_bo *bo = NULL;
+	bool busy = false;
+	int index;
+
+	*alloc_size = 0;
+
+	if (request->flags & AMDGPU_GEM_CREATE_VRAM_CLEARED)
+		return NULL;
+
+	index = amdgpu_bo_cache_class(request->alloc_size);
+	if (index < 0)
+		return NULL;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (!cache->max_bytes) {
+		pthread_mutex_unlock(&cache->mutex);
+		return NULL;
+	}
+
+	amdgpu_bo_cache_evict(cache, amdgpu_bo_cache_now());
+
+	bucket = amdgpu_bo_cache_bucket(cache, index, request->preferred_heap,
+					request->flags, false);
+	if (bucket && !LIST_IS_EMPTY(&bucket->bos)) {
+		bo = LIST_ENTRY(struct amdgpu_bo, bucket->bos.next, bucket_link);
+		if (bo->phys_alignment < request->phys_alignment ||
+		    amdgpu_bo_wait_for_idle(bo, 0, &busy) || busy) {
+			cache->stats.busy += busy;
+			bo = NULL;
+		} else {
+			amdgpu_bo_cache_remove(cache, bo);
+		}
+	}
+
+	if (bo)
+		cache->stats.hits++;
+	else
+		cache->stats.misses++;
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (bo)
+		atomic_set(&bo->refcount, 1);
+	else
+		*alloc_size = amdgpu_bo_cache_class_size(index);
+	return bo;
+}
+
+/**
+ * Keep a buffer whose last reference is gone.
+ *
+ * \return true if the cache took the buffer, false if the caller has to
+ * destroy it.
+ */
+drm_private bool amdgpu_bo_cache_put(struct amdgpu_bo *bo)
+{
+	struct amdgpu_bo_cache *cache = &bo->dev->bo_cache;
+	struct amdgpu_bo_cache_bucket *bucket;
+	int index;
+
+	if (!bo->reusable || atomic_read(&bo->va_map_count))
+		return false;
+
+	index = amdgpu_bo_cache_class(bo->alloc_size);
+	if (index < 0)
+		return false;
+
+	pthread_mutex_lock(&cache->mutex);
+	if (bo->alloc_size > cache->max_bytes) {
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	bucket = amdgpu_bo_cache_bucket(cache, index, bo->heap, bo->flags,
+					true);
+	if (!bucket) {
+		pthread_mutex_unlock(&cache->mutex);
+		return false;
+	}
+
+	bo->bucket = bucket;
+	bo->cache_time = amdgpu_bo_cache_now();
+	list_addtail(&bo->bucket_link, &bucket->bos);
+	list_addtail(&bo->lru_link, &cache->lru);
+	cache->stats.count++;
+	cache->stats.bytes += bo->alloc_size;
+
+	amdgpu_bo_cache_evict(cache, bo->cache_time);
+	pthread_mutex_unlock(&cache->mutex);
+	return true;
+}
+
+int amdgpu_bo_cache_enable(amdgpu_device_handle dev,
+			   uint64_t max_bytes,
+			   uint64_t max_age_ms)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->max_bytes = max_bytes;
+	cache->max_age_ns = max_age_ms * 1000000ull;
+	amdgpu_bo_cache_evict(cache, amdgpu_bo_cache_now());
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
+
+int amdgpu_bo_cache_query_stats(amdgpu_device_handle dev,
+				struct amdgpu_bo_cache_stats *stats)
+{
+	struct amdgpu_bo_cache *cache = &dev->bo_cache;
+
+	pthread_mutex_lock(&cache->mutex);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->mutex);
+	return 0;
+}
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include <sched.h>
+#include <signal.h>
 #include <sys/ioctl.h>
 #ifdef HAVE_ALLOCA_H
 # include <alloca.h>
@@ -42,6 +43,7 @@
 
 static int amdgpu_cs_unreference_sem(amdgpu_semaphore_handle sem);
 static int amdgpu_cs_reset_sem(amdgpu_semaphore_handle sem);
+static void amdgpu_cs_queue_fini(amdgpu_context_handle context);
 
 /**
  * Create command submission context
@@ -73,6 +75,8 @@ int amdgpu_cs_ctx_create2(amdgpu_device_handle dev, uint32_t priority,
 	if (r)
 		goto error;
 
+	pthread_mutex_init(&gpu_context->scratch_mutex, NULL);
+
 	/* Create the context */
 	memset(&args, 0, sizeof(args));
 	args.in.op = AMDGPU_CTX_OP_ALLOC_CTX;
@@ -92,6 +96,7 @@ int amdgpu_cs_ctx_create2(amdgpu_device_handle dev, uint32_t priority,
 	return 0;
 
 error:
+	pthread_mutex_destroy(&gpu_context->scratch_mutex);
 	pthread_mutex_destroy(&gpu_context->sequence_mutex);
 	free(gpu_context);
 	return r;
@@ -120,7 +125,10 @@ int amdgpu_cs_ctx_free(amdgpu_context_handle context)
 	if (!context)
 		return -EINVAL;
 
+	amdgpu_cs_queue_fini(context);
 	pthread_mutex_destroy(&context->sequence_mutex);
+	pthread_mutex_destroy(&context->scratch_mutex);
+	free(context->scratch);
 
 	/* now deal with kernel side */
 	memset(&args, 0, sizeof(args));
@@ -166,6 +174,37 @@ int amdgpu_cs_query_reset_state(amdgpu_context_handle context,
 	return r;
 }
 
+/**
+ * Make sure scratch storage has room for \c size bytes.
+ *
+ * Grows geometrically, the old contents are not kept.
+ *
+ * \return  0 on success otherwise POSIX Error code
+*/
+static int amdgpu_cs_reserve_scratch(struct amdgpu_cs_scratch **scratch,
+				     size_t size)
+{
+	struct amdgpu_cs_scratch *old = *scratch, *new;
+	size_t alloc = old ? old->size : 1024;
+
+	if (old && old->size >= size)
+		return 0;
+
+	while (alloc < size)
+		alloc *= 2;
+
+	new = malloc(sizeof(struct amdgpu_cs_scratch) + alloc);
+	if (!new)
+		return -ENOMEM;
+
+	new->size = alloc;
+	free(old);
+	*scratch = new;
+	return 0;
+}
+
+#define SCRATCH_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
 /**
  * Submit command to kernel DRM
  * \param   dev - \c [in]  Device handle
@@ -183,17 +222,26 @@ static int amdgpu_cs_submit_one(amdgpu_context_handle context,
 	uint64_t *chunk_array;
 	struct drm_amdgpu_cs_chunk *chunks;
 	struct drm_amdgpu_cs_chunk_data *chunk_data;
-	struct drm_amdgpu_cs_chunk_dep *dependencies = NULL;
-	struct drm_amdgpu_cs_chunk_dep *sem_dependencies = NULL;
+	struct drm_amdgpu_cs_chunk_dep *dependencies;
+	struct drm_amdgpu_cs_chunk_dep *sem_dependencies;
+	struct amdgpu_cs_scratch *temp = NULL, **scratch;
 	struct list_head *sem_list;
 	amdgpu_semaphore_handle sem, tmp;
-	uint32_t i, size, sem_count = 0;
+	uint32_t i, num_chunks, sem_count = 0;
+	uint32_t ip_type, ip_instance, ring;
+	size_t array_size, chunks_size, data_size;
+	atomic_t *pending;
 	bool user_fence;
+	char *data;
 	int r = 0;
 
-	if (ibs_request->ip_type >= AMDGPU_HW_IP_NUM)
+	ip_type = ibs_request->ip_type;
+	ip_instance = ibs_request->ip_instance;
+	ring = ibs_request->ring;
+
+	if (ip_type >= AMDGPU_HW_IP_NUM)
 		return -EINVAL;
-	if (ibs_request->ring >= AMDGPU_CS_MAX_RINGS)
+	if (ring >= AMDGPU_CS_MAX_RINGS)
 		return -EINVAL;
 	if (ibs_request->number_of_ibs > AMDGPU_CS_MAX_IBS_PER_SUBMIT)
 		return -EINVAL;
@@ -203,14 +251,65 @@ static int amdgpu_cs_submit_one(amdgpu_context_handle context,
 	}
 	user_fence = (ibs_request->fence_info.handle != NULL);
 
-	size = ibs_request->number_of_ibs + (user_fence ? 2 : 1) + 1;
+	/* Another submission on this context owns the scratch storage */
+	if (pthread_mutex_trylock(&context->scratch_mutex))
+		scratch = &temp;
+	else
+		scratch = &context->scratch;
 
-	chunk_array = alloca(sizeof(uint64_t) * size);
-	chunks = alloca(sizeof(struct drm_amdgpu_cs_chunk) * size);
+	/* Semaphores are rare, don't take the mutex when there are none. */
+	pending = &context->sem_count[ip_type][ip_instance][ring];
+	if (atomic_read(pending)) {
+		pthread_mutex_lock(&context->sequence_mutex);
+		sem_count = atomic_read(pending);
+	}
 
-	size = ibs_request->number_of_ibs + (user_fence ? 1 : 0);
+	num_chunks = ibs_request->number_of_ibs + (user_fence ? 1 : 0) + 2;
+	array_size = SCRATCH_ALIGN(sizeof(uint64_t) * num_chunks);
+	chunks_size = SCRATCH_ALIGN(sizeof(struct drm_amdgpu_cs_chunk) *
+				    num_chunks);
+	data_size = SCRATCH_ALIGN(sizeof(struct drm_amdgpu_cs_chunk_data) *
+				  (ibs_request->number_of_ibs + 1));
+
+	r = amdgpu_cs_reserve_scratch(scratch, array_size + chunks_size +
+				      data_size +
+				      sizeof(struct drm_amdgpu_cs_chunk_dep) *
+				      (ibs_request->number_of_dependencies +
+				       sem_count));
+	if (r) {
+		if (sem_count)
+			pthread_mutex_unlock(&context->sequence_mutex);
+		goto out;
+	}
 
-	chunk_data = alloca(sizeof(struct drm_amdgpu_cs_chunk_data) * size);
+	data = (char *)(*scratch)->data;
+	chunk_array = (uint64_t *)data;
+	chunks = (struct drm_amdgpu_cs_chunk *)(data + array_size);
+	chunk_data = (struct drm_amdgpu_cs_chunk_data *)
+		(data + array_size + chunks_size);
+	dependencies = (struct drm_amdgpu_cs_chunk_dep *)
+		(data + array_size + chunks_size + data_size);
+	sem_dependencies = dependencies + ibs_request->number_of_dependencies;
+
+	if (sem_count) {
+		sem_list = &context->sem_list[ip_type][ip_instance][ring];
+		sem_count = 0;
+		LIST_FOR_EACH_ENTRY_SAFE(sem, tmp, sem_list, list) {
+			struct amdgpu_cs_fence *info = &sem->signal_fence;
+			struct drm_amdgpu_cs_chunk_dep *dep = &sem_dependencies[sem_count++];
+			dep->ip_type = info->ip_type;
+			dep->ip_instance = info->ip_instance;
+			dep->ring = info->ring;
+			dep->ctx_id = info->context->id;
+			dep->handle = info->fence;
+
+			list_del(&sem->list);
+			amdgpu_cs_reset_sem(sem);
+			amdgpu_cs_unreference_sem(sem);
+		}
+		atomic_set(pending, 0);
+		pthread_mutex_unlock(&context->sequence_mutex);
+	}
 
 	memset(&cs, 0, sizeof(cs));
 	cs.in.chunks = (uint64_t)(uintptr_t)chunk_array;
@@ -231,14 +330,12 @@ static int amdgpu_cs_submit_one(amdgpu_context_handle context,
 		chunk_data[i].ib_data._pad = 0;
 		chunk_data[i].ib_data.va_start = ib->ib_mc_address;
 		chunk_data[i].ib_data.ib_bytes = ib->size * 4;
-		chunk_data[i].ib_data.ip_type = ibs_request->ip_type;
-		chunk_data[i].ib_data.ip_instance = ibs_request->ip_instance;
-		chunk_data[i].ib_data.ring = ibs_request->ring;
+		chunk_data[i].ib_data.ip_type = ip_type;
+		chunk_data[i].ib_data.ip_instance = ip_instance;
+		chunk_data[i].ib_data.ring = ring;
 		chunk_data[i].ib_data.flags = ib->flags;
 	}
 
-	pthread_mutex_lock(&context->sequence_mutex);
-
 	if (user_fence) {
 		i = cs.in.num_chunks++;
 
@@ -256,13 +353,6 @@ static int amdgpu_cs_submit_one(amdgpu_context_handle context,
 	}
 
 	if (ibs_request->number_of_dependencies) {
-		dependencies = malloc(sizeof(struct drm_amdgpu_cs_chunk_dep) *
-			ibs_request->number_of_dependencies);
-		if (!dependencies) {
-			r = -ENOMEM;
-			goto error_unlock;
-		}
-
 		for (i = 0; i < ibs_request->number_of_dependencies; ++i) {
 			struct amdgpu_cs_fence *info = &ibs_request->dependencies[i];
 			struct drm_amdgpu_cs_chunk_dep *dep = &dependencies[i];
@@ -283,29 +373,7 @@ static int amdgpu_cs_submit_one(amdgpu_context_handle context,
 		chunks[i].chunk_data = (uint64_t)(uintptr_t)dependencies;
 	}
 
-	sem_list = &context->sem_list[ibs_request->ip_type][ibs_request->ip_instance][ibs_request->ring];
-	LIST_FOR_EACH_ENTRY(sem, sem_list, list)
-		sem_count++;
 	if (sem_count) {
-		sem_dependencies = malloc(sizeof(struct drm_amdgpu_cs_chunk_dep) * sem_count);
-		if (!sem_dependencies) {
-			r = -ENOMEM;
-			goto error_unlock;
-		}
-		sem_count = 0;
-		LIST_FOR_EACH_ENTRY_SAFE(sem, tmp, sem_list, list) {
-			struct amdgpu_cs_fence *info = &sem->signal_fence;
-			struct drm_amdgpu_cs_chunk_dep *dep = &sem_dependencies[sem_count++];
-			dep->ip_type = info->ip_type;
-			dep->ip_instance = info->ip_instance;
-			dep->ring = info->ring;
-			dep->ctx_id = info->context->id;
-			dep->handle = info->fence;
-
-			list_del(&sem->list);
-			amdgpu_cs_reset_sem(sem);
-			amdgpu_cs_unreference_sem(sem);
-		}
 		i = cs.in.num_chunks++;
 
 		/* dependencies chunk */
@@ -318,14 +386,21 @@ static int amdgpu_cs_submit_one(amdgpu_context_handle context,
 	r = drmCommandWriteRead(context->dev->fd, DRM_AMDGPU_CS,
 				&cs, sizeof(cs));
 	if (r)
-		goto error_unlock;
+		goto out;
 
 	ibs_request->seq_no = cs.out.handle;
-	context->last_seq[ibs_request->ip_type][ibs_request->ip_instance][ibs_request->ring] = ibs_request->seq_no;
-error_unlock:
+
+	/* Submissions racing on the same ring may finish the ioctl in any
+	 * order, the last sequence number must not go backwards. */
+	pthread_mutex_lock(&context->sequence_mutex);
+	if (ibs_request->seq_no > context->last_seq[ip_type][ip_instance][ring])
+		context->last_seq[ip_type][ip_instance][ring] = ibs_request->seq_no;
 	pthread_mutex_unlock(&context->sequence_mutex);
-	free(dependencies);
-	free(sem_dependencies);
+out:
+	if (scratch == &temp)
+		free(temp);
+	else
+		pthread_mutex_unlock(&context->scratch_mutex);
 	return r;
 }
 
@@ -351,6 +426,268 @@ int amdgpu_cs_submit(amdgpu_context_handle context,
 	return r;
 }
 
+static void
+amdgpu_cs_submission_unreference(struct amdgpu_cs_submission *submission)
+{
+	if (atomic_dec_and_test(&submission->refcount))
+		free(submission);
+}
+
+static void amdgpu_cs_submission_fence(struct amdgpu_cs_submission *submission,
+				       struct amdgpu_cs_fence *fence)
+{
+	fence->context = submission->context;
+	fence->ip_type = submission->request.ip_type;
+	fence->ip_instance = submission->request.ip_instance;
+	fence->ring = submission->request.ring;
+	fence->fence = submission->request.seq_no;
+}
+
+/* Take everything queued, oldest first. */
+static struct amdgpu_cs_submission *
+amdgpu_cs_queue_take(struct amdgpu_cs_queue *queue)
+{
+	struct amdgpu_cs_submission *list, *next, *oldest = NULL;
+
+	list = __sync_lock_test_and_set(&queue->pending, NULL);
+	while (list) {
+		next = list->next;
+		list->next = oldest;
+		oldest = list;
+		list = next;
+	}
+	return oldest;
+}
+
+static void *amdgpu_cs_queue_thread(void *data)
+{
+	struct amdgpu_cs_queue *queue = data;
+	struct amdgpu_cs_submission *submission, *next;
+	struct amdgpu_cs_fence fence;
+
+	for (;;) {
+		pthread_mutex_lock(&queue->mutex);
+		while (!(submission = amdgpu_cs_queue_take(queue)) &&
+		       !queue->stop)
+			pthread_cond_wait(&queue->queued, &queue->mutex);
+		pthread_mutex_unlock(&queue->mutex);
+
+		/* Stopped, and nothing left to submit */
+		if (!submission)
+			break;
+
+		for (; submission; submission = next) {
+			next = submission->next;
+
+			submission->result =
+				amdgpu_cs_submit_one(submission->context,
+						     &submission->request);
+			if (submission->callback) {
+				amdgpu_cs_submission_fence(submission, &fence);
+				submission->callback(submission->data,
+						     submission->result,
+						     &fence);
+			}
+
+			pthread_mutex_lock(&queue->mutex);
+			submission->done = true;
+			if (queue->waiters)
+				pthread_cond_broadcast(&queue->completed);
+			pthread_mutex_unlock(&queue->mutex);
+			amdgpu_cs_submission_unreference(submission);
+		}
+	}
+	return NULL;
+}
+
+/* Submitters look at the queue pointer without the mutex, the acquire pairs
+ * with the release in amdgpu_cs_queue_create(). */
+static struct amdgpu_cs_queue *amdgpu_cs_queue_get(amdgpu_context_handle context)
+{
+	return __atomic_load_n(&context->queue, __ATOMIC_ACQUIRE);
+}
+
+/* Must be called with the sequence mutex held. */
+static int amdgpu_cs_queue_create(amdgpu_context_handle context)
+{
+	struct amdgpu_cs_queue *queue;
+	pthread_condattr_t attr;
+	sigset_t all, old;
+	int r;
+
+	queue = calloc(1, sizeof(struct amdgpu_cs_queue));
+	if (!queue)
+		return -ENOMEM;
+
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->queued, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue->completed, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* Keep the application's signal handlers off the thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&queue->thread, NULL, amdgpu_cs_queue_thread, queue);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (r) {
+		pthread_cond_destroy(&queue->completed);
+		pthread_cond_destroy(&queue->queued);
+		pthread_mutex_destroy(&queue->mutex);
+		free(queue);
+		return -r;
+	}
+
+	/* The queue has to be set up before submitters can see it. */
+	__atomic_store_n(&context->queue, queue, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Submit what is still queued and stop the thread. */
+static void amdgpu_cs_queue_fini(amdgpu_context_handle context)
+{
+	struct amdgpu_cs_queue *queue = context->queue;
+
+	if (!queue)
+		return;
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->stop = true;
+	pthread_cond_signal(&queue->queued);
+	pthread_mutex_unlock(&queue->mutex);
+	pthread_join(queue->thread, NULL);
+
+	pthread_cond_destroy(&queue->completed);
+	pthread_cond_destroy(&queue->queued);
+	pthread_mutex_destroy(&queue->mutex);
+	free(queue);
+	context->queue = NULL;
+}
+
+int amdgpu_cs_submit_async(amdgpu_context_handle context,
+			   uint64_t flags,
+			   struct amdgpu_cs_request *ibs_request,
+			   amdgpu_cs_submit_callback callback,
+			   void *data,
+			   amdgpu_cs_submission_handle *submission)
+{
+	struct amdgpu_cs_submission *new, *head, *old;
+	struct amdgpu_cs_queue *queue;
+	size_t ibs_size, deps_size;
+	int r = 0;
+
+	if (!context || !ibs_request)
+		return -EINVAL;
+	if (ibs_request->ip_type >= AMDGPU_HW_IP_NUM)
+		return -EINVAL;
+	if (ibs_request->ring >= AMDGPU_CS_MAX_RINGS)
+		return -EINVAL;
+	if (ibs_request->number_of_ibs > AMDGPU_CS_MAX_IBS_PER_SUBMIT)
+		return -EINVAL;
+
+	queue = amdgpu_cs_queue_get(context);
+	if (!queue) {
+		pthread_mutex_lock(&context->sequence_mutex);
+		if (!amdgpu_cs_queue_get(context))
+			r = amdgpu_cs_queue_create(context);
+		queue = amdgpu_cs_queue_get(context);
+		pthread_mutex_unlock(&context->sequence_mutex);
+		if (r)
+			return r;
+	}
+
+	ibs_size = sizeof(struct amdgpu_cs_ib_info) *
+		ibs_request->number_of_ibs;
+	deps_size = sizeof(struct amdgpu_cs_fence) *
+		ibs_request->number_of_dependencies;
+
+	new = malloc(sizeof(struct amdgpu_cs_submission) + ibs_size + deps_size);
+	if (!new)
+		return -ENOMEM;
+
+	new->context = context;
+	atomic_set(&new->refcount, submission ? 2 : 1);
+	new->request = *ibs_request;
+	new->request.ibs = (struct amdgpu_cs_ib_info *)(new + 1);
+	new->request.dependencies = (struct amdgpu_cs_fence *)
+		((char *)(new + 1) + ibs_size);
+	if (ibs_size)
+		memcpy(new->request.ibs, ibs_request->ibs, ibs_size);
+	if (deps_size)
+		memcpy(new->request.dependencies, ibs_request->dependencies,
+		       deps_size);
+	new->callback = callback;
+	new->data = data;
+	new->done = false;
+	new->result = 0;
+
+	/* The thread only needs waking when the queue was empty, a
+	 * non-empty one is either about to be taken or still being
+	 * worked on. */
+	head = NULL;
+	do {
+		old = head;
+		new->next = old;
+	} while ((head = __sync_val_compare_and_swap(&queue->pending,
+						     old, new)) != old);
+
+	if (!old) {
+		pthread_mutex_lock(&queue->mutex);
+		pthread_cond_signal(&queue->queued);
+		pthread_mutex_unlock(&queue->mutex);
+	}
+
+	if (submission)
+		*submission = new;
+	return 0;
+}
+
+int amdgpu_cs_submission_wait(amdgpu_cs_submission_handle submission,
+			      uint64_t timeout_ns,
+			      struct amdgpu_cs_fence *fence)
+{
+	struct amdgpu_cs_queue *queue;
+	struct timespec abs_timeout;
+	uint64_t timeout;
+	int r = 0;
+
+	if (!submission)
+		return -EINVAL;
+
+	queue = amdgpu_cs_queue_get(submission->context);
+	timeout = amdgpu_cs_calculate_timeout(timeout_ns);
+	abs_timeout.tv_sec = timeout / 1000000000ull;
+	abs_timeout.tv_nsec = timeout % 1000000000ull;
+
+	pthread_mutex_lock(&queue->mutex);
+	queue->waiters++;
+	while (!submission->done && r != ETIMEDOUT) {
+		if (timeout == AMDGPU_TIMEOUT_INFINITE)
+			r = pthread_cond_wait(&queue->completed, &queue->mutex);
+		else
+			r = pthread_cond_timedwait(&queue->completed,
+						   &queue->mutex,
+						   &abs_timeout);
+	}
+	queue->waiters--;
+	r = submission->done ? submission->result : -ETIME;
+	pthread_mutex_unlock(&queue->mutex);
+
+	if (!r && fence)
+		amdgpu_cs_submission_fence(submission, fence);
+	return r;
+}
+
+int amdgpu_cs_submission_free(amdgpu_cs_submission_handle submission)
+{
+	if (!submission)
+		return -EINVAL;
+
+	amdgpu_cs_submission_unreference(submission);
+	return 0;
+}
+
 /**
  * Calculate absolute timeout.
  *
@@ -573,6 +910,7 @@ int amdgpu_cs_wait_semaphore(amdgpu_context_handle ctx,
 
 	pthread_mutex_lock(&ctx->sequence_mutex);
 	list_add(&sem->list, &ctx->sem_list[ip_type][ip_instance][ring]);
+	atomic_inc(&ctx->sem_count[ip_type][ip_instance][ring]);
 	pthread_mutex_unlock(&ctx->sequence_mutex);
 	return 0;
 }
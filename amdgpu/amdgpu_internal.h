@@ -46,19 +46,63 @@
 #define AMDGPU_INVALID_VA_ADDRESS	0xffffffffffffffff
 #define AMDGPU_NULL_SUBMIT_SEQ		0
 
+/* Intrusive treap node, see amdgpu_vamgr.c */
+struct amdgpu_va_node {
+	struct amdgpu_va_node *left;
+	struct amdgpu_va_node *right;
+	uint32_t priority;
+};
+
 struct amdgpu_bo_va_hole {
-	struct list_head list;
+	struct amdgpu_va_node by_offset;
+	struct amdgpu_va_node by_size;	/* ordered by size, then offset */
 	uint64_t offset;
 	uint64_t size;
 };
 
+/* Allocations smaller than this come out of per-thread slabs of up to
+ * AMDGPU_VA_SLAB_BYTES, one size class per power of two. */
+#define AMDGPU_VA_SLAB_MAX_SIZE	(2 * 1024 * 1024)
+#define AMDGPU_VA_SLAB_BYTES	(8 * 1024 * 1024)
+#define AMDGPU_VA_SLAB_CLASSES	10
+#define AMDGPU_VA_SLAB_SLOTS	32
+
+struct amdgpu_va_slab {
+	struct list_head list;		/* in the manager */
+	struct amdgpu_bo_va_mgr *mgr;
+	uint64_t base;
+	uint64_t slot_size;
+	unsigned slots;
+	unsigned size_class;
+	uint32_t free;			/* touched by the owning thread only */
+	atomic_t remote_free;		/* slots freed by other threads */
+	atomic_t used;			/* allocated slots, plus one while owned */
+};
+
+struct amdgpu_va_thread_cache {
+	struct list_head list;		/* in the manager */
+	struct amdgpu_bo_va_mgr *mgr;
+	struct amdgpu_va_slab *current[AMDGPU_VA_SLAB_CLASSES];
+};
+
 struct amdgpu_bo_va_mgr {
 	/* the start virtual address */
 	uint64_t va_offset;
 	uint64_t va_max;
-	struct list_head va_holes;
+	/* Holes below va_offset, indexed both ways */
+	struct amdgpu_va_node *holes_by_offset;
+	struct amdgpu_va_node *holes_by_size;
+	uint64_t hole_count;
+	uint64_t hole_bytes;
+	uint32_t seed;
 	pthread_mutex_t bo_va_mutex;
 	uint32_t va_alignment;
+
+	/* Per-thread slabs, only set up if a thread key was available */
+	bool slabs_enabled;
+	pthread_key_t slab_key;
+	struct list_head slabs;
+	struct list_head thread_caches;
 };
 
 struct amdgpu_va {
@@ -67,6 +111,27 @@ struct amdgpu_va {
 	uint64_t size;
 	enum amdgpu_gpu_va_range range;
 	struct amdgpu_bo_va_mgr *vamgr;
+	struct amdgpu_va_slab *slab;
+};
+
+/* Size classes of the BO cache: 4K, 8K, 12K, then four steps per power of
+ * two up to 64M.  Larger buffers are never cached. */
+#define AMDGPU_BO_CACHE_CLASSES	52
+
+struct amdgpu_bo_cache_bucket {
+	struct list_head list;		/* in the size class */
+	struct list_head bos;		/* oldest first */
+	uint32_t heap;
+	uint64_t flags;
+};
+
+struct amdgpu_bo_cache {
+	pthread_mutex_t mutex;
+	uint64_t max_bytes;		/* 0 while disabled */
+	uint64_t max_age_ns;
+	struct list_head classes[AMDGPU_BO_CACHE_CLASSES];
+	struct list_head lru;		/* all cached BOs, oldest first */
+	struct amdgpu_bo_cache_stats stats;
 };
 
 struct amdgpu_asic_id {
@@ -96,6 +161,8 @@ struct amdgpu_device {
 	struct amdgpu_bo_va_mgr vamgr;
 	/** The VA manager for the 32bit address space */
 	struct amdgpu_bo_va_mgr vamgr_32;
+	/** Idle buffers kept for reuse, see amdgpu_bo_cache_enable() */
+	struct amdgpu_bo_cache bo_cache;
 };
 
 struct amdgpu_bo {
@@ -110,6 +177,23 @@ struct amdgpu_bo {
 	pthread_mutex_t cpu_access_mutex;
 	void *cpu_ptr;
 	int cpu_map_count;
+
+	/** Mappings made with amdgpu_bo_va_op() and not yet unmapped */
+	atomic_t va_map_count;
+	/** GPU VA owned by the buffer, see amdgpu_bo_alloc_mapped() */
+	amdgpu_va_handle va_handle;
+	uint64_t va;
+
+	/** Allocated in a size class and never shared, so it may be cached */
+	bool reusable;
+	uint32_t heap;
+	uint64_t flags;
+	uint64_t phys_alignment;
+	/** While cached */
+	struct amdgpu_bo_cache_bucket *bucket;
+	struct list_head bucket_link;
+	struct list_head lru_link;
+	uint64_t cache_time;
 };
 
 struct amdgpu_bo_list {
@@ -118,15 +202,56 @@ struct amdgpu_bo_list {
 	uint32_t handle;
 };
 
+/* Storage for the chunks of a submission, reused from one to the next */
+struct amdgpu_cs_scratch {
+	size_t size;
+	uint64_t data[];
+};
+
+/* A request queued with amdgpu_cs_submit_async(), the IB and dependency
+ * arrays follow. */
+struct amdgpu_cs_submission {
+	struct amdgpu_cs_submission *next;
+	amdgpu_context_handle context;
+	atomic_t refcount;
+	struct amdgpu_cs_request request;
+	amdgpu_cs_submit_callback callback;
+	void *data;
+	/* Protected by the queue mutex */
+	bool done;
+	int result;
+};
+
+struct amdgpu_cs_queue {
+	/** Requests not yet taken by the thread, newest first.  Pushed
+	    without a lock, taken all at once. */
+	struct amdgpu_cs_submission *pending;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	/* Signaled when requests are pushed to an empty queue */
+	pthread_cond_t queued;
+	/* Broadcast when a request completes and someone waits */
+	pthread_cond_t completed;
+	unsigned waiters;
+	bool stop;
+};
+
 struct amdgpu_context {
 	struct amdgpu_device *dev;
-	/** Mutex for accessing fences and to maintain command submissions
-	    in good sequence. */
+	/** Mutex for accessing fences and the semaphore lists. */
 	pthread_mutex_t sequence_mutex;
 	/* context id*/
 	uint32_t id;
 	uint64_t last_seq[AMDGPU_HW_IP_NUM][AMDGPU_HW_IP_INSTANCE_MAX_COUNT][AMDGPU_CS_MAX_RINGS];
 	struct list_head sem_list[AMDGPU_HW_IP_NUM][AMDGPU_HW_IP_INSTANCE_MAX_COUNT][AMDGPU_CS_MAX_RINGS];
+	/* Length of each sem_list, readable without the mutex */
+	atomic_t sem_count[AMDGPU_HW_IP_NUM][AMDGPU_HW_IP_INSTANCE_MAX_COUNT][AMDGPU_CS_MAX_RINGS];
+	/** Held by the submission using scratch, others don't wait for it
+	    but use a temporary buffer. */
+	pthread_mutex_t scratch_mutex;
+	struct amdgpu_cs_scratch *scratch;
+	/* Submission thread, started by the first asynchronous request */
+	struct amdgpu_cs_queue *queue;
 };
 
 /**
@@ -155,6 +280,30 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 drm_private void
 amdgpu_vamgr_free_va(struct amdgpu_bo_va_mgr *mgr, uint64_t va, uint64_t size);
 
+drm_private uint64_t
+amdgpu_vamgr_slab_alloc(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
+			uint64_t alignment, struct amdgpu_va_slab **slab);
+
+drm_private void
+amdgpu_vamgr_slab_free(struct amdgpu_va_slab *slab, uint64_t va);
+
+drm_private void
+amdgpu_vamgr_query_fragmentation(struct amdgpu_bo_va_mgr *mgr,
+				 struct amdgpu_va_fragmentation *frag);
+
+drm_private void amdgpu_bo_destroy(struct amdgpu_bo *bo);
+
+drm_private void amdgpu_bo_cache_init(struct amdgpu_bo_cache *cache);
+
+drm_private void amdgpu_bo_cache_fini(struct amdgpu_bo_cache *cache);
+
+drm_private struct amdgpu_bo *
+amdgpu_bo_cache_get(amdgpu_device_handle dev,
+		    const struct amdgpu_bo_alloc_request *request,
+		    uint64_t *alloc_size);
+
+drm_private bool amdgpu_bo_cache_put(struct amdgpu_bo *bo);
+
 drm_private int amdgpu_parse_asic_ids(struct amdgpu_asic_id **asic_ids);
 
 drm_private int amdgpu_query_gpu_info_init(amdgpu_device_handle dev);
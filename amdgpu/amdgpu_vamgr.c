@@ -27,6 +27,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include "amdgpu.h"
 #include "amdgpu_drm.h"
@@ -44,6 +45,472 @@ int amdgpu_va_range_query(amdgpu_device_handle dev,
 	return -EINVAL;
 }
 
+/*
+ * Holes below va_offset live in two treaps sharing their nodes' priorities:
+ * one ordered by address, used to find the neighbours to coalesce with on
+ * free and the hole covering a required base, and one ordered by size, used
+ * for best-fit.  Both expect O(log n) per operation.
+ */
+
+typedef int (*amdgpu_va_node_compare)(const struct amdgpu_va_node *a,
+				      const struct amdgpu_va_node *b);
+
+#define hole_by_offset(node) \
+	container_of(node, (struct amdgpu_bo_va_hole *)NULL, by_offset)
+#define hole_by_size(node) \
+	container_of(node, (struct amdgpu_bo_va_hole *)NULL, by_size)
+
+static int amdgpu_va_compare_offset(const struct amdgpu_va_node *a,
+				    const struct amdgpu_va_node *b)
+{
+	const struct amdgpu_bo_va_hole *x = hole_by_offset(a);
+	const struct amdgpu_bo_va_hole *y = hole_by_offset(b);
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static int amdgpu_va_compare_size(const struct amdgpu_va_node *a,
+				  const struct amdgpu_va_node *b)
+{
+	const struct amdgpu_bo_va_hole *x = hole_by_size(a);
+	const struct amdgpu_bo_va_hole *y = hole_by_size(b);
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static struct amdgpu_va_node *
+amdgpu_va_node_insert(struct amdgpu_va_node *root, struct amdgpu_va_node *node,
+		      amdgpu_va_node_compare compare)
+{
+	struct amdgpu_va_node *child;
+
+	if (!root) {
+		node->left = node->right = NULL;
+		return node;
+	}
+
+	if (compare(node, root) < 0) {
+		child = amdgpu_va_node_insert(root->left, node, compare);
+		root->left = child;
+		if (child->priority > root->priority) {
+			root->left = child->right;
+			child->right = root;
+			return child;
+		}
+	} else {
+		child = amdgpu_va_node_insert(root->right, node, compare);
+		root->right = child;
+		if (child->priority > root->priority) {
+			root->right = child->left;
+			child->left = root;
+			return child;
+		}
+	}
+	return root;
+}
+
+static struct amdgpu_va_node *
+amdgpu_va_node_merge(struct amdgpu_va_node *a, struct amdgpu_va_node *b)
+{
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	if (a->priority > b->priority) {
+		a->right = amdgpu_va_node_merge(a->right, b);
+		return a;
+	}
+	b->left = amdgpu_va_node_merge(a, b->left);
+	return b;
+}
+
+static struct amdgpu_va_node *
+amdgpu_va_node_erase(struct amdgpu_va_node *root, struct amdgpu_va_node *node,
+		     amdgpu_va_node_compare compare)
+{
+	if (root == node)
+		return amdgpu_va_node_merge(node->left, node->right);
+
+	if (compare(node, root) < 0)
+		root->left = amdgpu_va_node_erase(root->left, node, compare);
+	else
+		root->right = amdgpu_va_node_erase(root->right, node, compare);
+	return root;
+}
+
+/* Hole with the highest offset <= va. */
+static struct amdgpu_bo_va_hole *
+amdgpu_vamgr_hole_below(struct amdgpu_bo_va_mgr *mgr, uint64_t va)
+{
+	struct amdgpu_va_node *node = mgr->holes_by_offset;
+	struct amdgpu_bo_va_hole *found = NULL;
+
+	while (node) {
+		struct amdgpu_bo_va_hole *hole = hole_by_offset(node);
+
+		if (hole->offset <= va) {
+			found = hole;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+	return found;
+}
+
+/* Hole with the lowest offset > va. */
+static struct amdgpu_bo_va_hole *
+amdgpu_vamgr_hole_above(struct amdgpu_bo_va_mgr *mgr, uint64_t va)
+{
+	struct amdgpu_va_node *node = mgr->holes_by_offset;
+	struct amdgpu_bo_va_hole *found = NULL;
+
+	while (node) {
+		struct amdgpu_bo_va_hole *hole = hole_by_offset(node);
+
+		if (hole->offset > va) {
+			found = hole;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return found;
+}
+
+static uint64_t amdgpu_vamgr_align(uint64_t offset, uint64_t alignment)
+{
+	uint64_t waste = offset % alignment;
+
+	return waste ? offset + alignment - waste : offset;
+}
+
+/* Smallest hole that fits, the lowest one of those on ties.  Visits the
+ * holes in size order and only skips over those too small for the
+ * alignment. */
+static struct amdgpu_bo_va_hole *
+amdgpu_vamgr_best_fit(struct amdgpu_va_node *node, uint64_t size,
+		      uint64_t alignment)
+{
+	struct amdgpu_bo_va_hole *hole, *found;
+
+	while (node) {
+		hole = hole_by_size(node);
+		if (hole->size < size) {
+			node = node->right;
+			continue;
+		}
+
+		found = amdgpu_vamgr_best_fit(node->left, size, alignment);
+		if (found)
+			return found;
+
+		if (amdgpu_vamgr_align(hole->offset, alignment) + size <=
+		    hole->offset + hole->size)
+			return hole;
+		node = node->right;
+	}
+	return NULL;
+}
+
+static struct amdgpu_bo_va_hole *
+amdgpu_vamgr_new_hole(struct amdgpu_bo_va_mgr *mgr)
+{
+	struct amdgpu_bo_va_hole *hole;
+
+	hole = calloc(1, sizeof(struct amdgpu_bo_va_hole));
+	if (!hole)
+		return NULL;
+
+	/* xorshift, the treaps only need the priorities to look random */
+	mgr->seed ^= mgr->seed << 13;
+	mgr->seed ^= mgr->seed >> 17;
+	mgr->seed ^= mgr->seed << 5;
+	hole->by_offset.priority = mgr->seed;
+	hole->by_size.priority = mgr->seed;
+	return hole;
+}
+
+static void amdgpu_vamgr_insert_hole(struct amdgpu_bo_va_mgr *mgr,
+				     struct amdgpu_bo_va_hole *hole)
+{
+	mgr->holes_by_offset = amdgpu_va_node_insert(mgr->holes_by_offset,
+						     &hole->by_offset,
+						     amdgpu_va_compare_offset);
+	mgr->holes_by_size = amdgpu_va_node_insert(mgr->holes_by_size,
+						   &hole->by_size,
+						   amdgpu_va_compare_size);
+	mgr->hole_count++;
+	mgr->hole_bytes += hole->size;
+}
+
+static void amdgpu_vamgr_remove_hole(struct amdgpu_bo_va_mgr *mgr,
+				     struct amdgpu_bo_va_hole *hole)
+{
+	mgr->holes_by_offset = amdgpu_va_node_erase(mgr->holes_by_offset,
+						    &hole->by_offset,
+						    amdgpu_va_compare_offset);
+	mgr->holes_by_size = amdgpu_va_node_erase(mgr->holes_by_size,
+						  &hole->by_size,
+						  amdgpu_va_compare_size);
+	mgr->hole_count--;
+	mgr->hole_bytes -= hole->size;
+	free(hole);
+}
+
+/* Move or resize a hole.  Its position relative to the other holes must
+ * not change, only the size index is updated. */
+static void amdgpu_vamgr_resize_hole(struct amdgpu_bo_va_mgr *mgr,
+				     struct amdgpu_bo_va_hole *hole,
+				     uint64_t offset, uint64_t size)
+{
+	mgr->holes_by_size = amdgpu_va_node_erase(mgr->holes_by_size,
+						  &hole->by_size,
+						  amdgpu_va_compare_size);
+	mgr->hole_bytes += size - hole->size;
+	hole->offset = offset;
+	hole->size = size;
+	mgr->holes_by_size = amdgpu_va_node_insert(mgr->holes_by_size,
+						   &hole->by_size,
+						   amdgpu_va_compare_size);
+}
+
+/* Take [offset, offset + size) out of a hole. */
+static bool amdgpu_vamgr_carve(struct amdgpu_bo_va_mgr *mgr,
+			       struct amdgpu_bo_va_hole *hole,
+			       uint64_t offset, uint64_t size)
+{
+	uint64_t head = offset - hole->offset;
+	uint64_t tail = hole->offset + hole->size - offset - size;
+	struct amdgpu_bo_va_hole *n;
+
+	if (head && tail) {
+		n = amdgpu_vamgr_new_hole(mgr);
+		if (!n)
+			return false;
+		n->offset = offset + size;
+		n->size = tail;
+		amdgpu_vamgr_insert_hole(mgr, n);
+		amdgpu_vamgr_resize_hole(mgr, hole, hole->offset, head);
+	} else if (head) {
+		amdgpu_vamgr_resize_hole(mgr, hole, hole->offset, head);
+	} else if (tail) {
+		amdgpu_vamgr_resize_hole(mgr, hole, offset + size, tail);
+	} else {
+		amdgpu_vamgr_remove_hole(mgr, hole);
+	}
+	return true;
+}
+
+static void amdgpu_vamgr_free_holes(struct amdgpu_va_node *node)
+{
+	while (node) {
+		struct amdgpu_va_node *right = node->right;
+
+		amdgpu_vamgr_free_holes(node->left);
+		free(hole_by_offset(node));
+		node = right;
+	}
+}
+
+/*
+ * Small allocations are served from slabs: VA chunks of up to
+ * AMDGPU_VA_SLAB_SLOTS naturally aligned slots of one power-of-two size,
+ * owned by one thread.  The owner allocates from and frees to its slabs
+ * without taking the manager's mutex; other threads hand slots back through
+ * the remote_free bitmap, which the owner only looks at once it ran out.
+ * A slab the owner moved on from goes back to the manager when its last
+ * slot is freed.
+ */
+
+static void amdgpu_vamgr_slab_release(struct amdgpu_va_slab *slab)
+{
+	struct amdgpu_bo_va_mgr *mgr = slab->mgr;
+
+	pthread_mutex_lock(&mgr->bo_va_mutex);
+	list_del(&slab->list);
+	pthread_mutex_unlock(&mgr->bo_va_mutex);
+
+	amdgpu_vamgr_free_va(mgr, slab->base, slab->slot_size * slab->slots);
+	free(slab);
+}
+
+/* Give up ownership. */
+static void amdgpu_vamgr_slab_detach(struct amdgpu_va_slab *slab)
+{
+	if (atomic_dec_and_test(&slab->used))
+		amdgpu_vamgr_slab_release(slab);
+}
+
+static void amdgpu_vamgr_thread_exit(void *data)
+{
+	struct amdgpu_va_thread_cache *cache = data;
+	struct amdgpu_bo_va_mgr *mgr = cache->mgr;
+	int i;
+
+	for (i = 0; i < AMDGPU_VA_SLAB_CLASSES; i++) {
+		if (cache->current[i])
+			amdgpu_vamgr_slab_detach(cache->current[i]);
+	}
+
+	pthread_mutex_lock(&mgr->bo_va_mutex);
+	list_del(&cache->list);
+	pthread_mutex_unlock(&mgr->bo_va_mutex);
+	free(cache);
+}
+
+static struct amdgpu_va_thread_cache *
+amdgpu_vamgr_thread_cache(struct amdgpu_bo_va_mgr *mgr)
+{
+	struct amdgpu_va_thread_cache *cache;
+
+	cache = pthread_getspecific(mgr->slab_key);
+	if (cache)
+		return cache;
+
+	cache = calloc(1, sizeof(struct amdgpu_va_thread_cache));
+	if (!cache)
+		return NULL;
+
+	cache->mgr = mgr;
+	if (pthread_setspecific(mgr->slab_key, cache)) {
+		free(cache);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&mgr->bo_va_mutex);
+	list_addtail(&cache->list, &mgr->thread_caches);
+	pthread_mutex_unlock(&mgr->bo_va_mutex);
+	return cache;
+}
+
+static struct amdgpu_va_slab *
+amdgpu_vamgr_slab_create(struct amdgpu_bo_va_mgr *mgr, unsigned size_class)
+{
+	uint64_t slot_size = (uint64_t)mgr->va_alignment << size_class;
+	unsigned slots = MIN2(AMDGPU_VA_SLAB_SLOTS,
+			      MAX2(AMDGPU_VA_SLAB_BYTES / slot_size, 1));
+	struct amdgpu_va_slab *slab;
+	uint64_t base;
+
+	base = amdgpu_vamgr_find_va(mgr, slot_size * slots, slot_size, 0);
+	if (base == AMDGPU_INVALID_VA_ADDRESS)
+		return NULL;
+
+	slab = calloc(1, sizeof(struct amdgpu_va_slab));
+	if (!slab) {
+		amdgpu_vamgr_free_va(mgr, base, slot_size * slots);
+		return NULL;
+	}
+
+	slab->mgr = mgr;
+	slab->base = base;
+	slab->slot_size = slot_size;
+	slab->slots = slots;
+	slab->size_class = size_class;
+	slab->free = slots == 32 ? ~0u : (1u << slots) - 1;
+	atomic_set(&slab->used, 1);
+
+	pthread_mutex_lock(&mgr->bo_va_mutex);
+	list_addtail(&slab->list, &mgr->slabs);
+	pthread_mutex_unlock(&mgr->bo_va_mutex);
+	return slab;
+}
+
+/* Atomically take all bits of a bitmap, or add some. */
+static uint32_t amdgpu_vamgr_bitmap_take(atomic_t *bitmap)
+{
+	int old;
+
+	do {
+		old = atomic_read(bitmap);
+	} while (old && atomic_cmpxchg(bitmap, old, 0) != old);
+	return old;
+}
+
+static void amdgpu_vamgr_bitmap_set(atomic_t *bitmap, uint32_t bits)
+{
+	int old;
+
+	do {
+		old = atomic_read(bitmap);
+	} while (atomic_cmpxchg(bitmap, old, old | bits) != old);
+}
+
+/**
+ * Allocate from the calling thread's slab of the size class.
+ *
+ * \return the address, or AMDGPU_INVALID_VA_ADDRESS if the allocation has
+ * to go to amdgpu_vamgr_find_va().
+ */
+drm_private uint64_t
+amdgpu_vamgr_slab_alloc(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
+			uint64_t alignment, struct amdgpu_va_slab **out)
+{
+	struct amdgpu_va_thread_cache *cache;
+	struct amdgpu_va_slab *slab;
+	unsigned size_class = 0;
+	uint64_t slot_size;
+	int slot;
+
+	if (!mgr->slabs_enabled || !size || size >= AMDGPU_VA_SLAB_MAX_SIZE ||
+	    alignment >= AMDGPU_VA_SLAB_MAX_SIZE)
+		return AMDGPU_INVALID_VA_ADDRESS;
+
+	slot_size = mgr->va_alignment;
+	while (slot_size < size || slot_size < alignment) {
+		slot_size <<= 1;
+		size_class++;
+	}
+	if (size_class >= AMDGPU_VA_SLAB_CLASSES)
+		return AMDGPU_INVALID_VA_ADDRESS;
+
+	cache = amdgpu_vamgr_thread_cache(mgr);
+	if (!cache)
+		return AMDGPU_INVALID_VA_ADDRESS;
+
+	slab = cache->current[size_class];
+	if (slab && !slab->free)
+		slab->free = amdgpu_vamgr_bitmap_take(&slab->remote_free);
+
+	if (!slab || !slab->free) {
+		cache->current[size_class] = NULL;
+		if (slab)
+			amdgpu_vamgr_slab_detach(slab);
+
+		slab = amdgpu_vamgr_slab_create(mgr, size_class);
+		if (!slab)
+			return AMDGPU_INVALID_VA_ADDRESS;
+		cache->current[size_class] = slab;
+	}
+
+	slot = ffs(slab->free) - 1;
+	slab->free &= ~(1u << slot);
+	atomic_inc(&slab->used);
+
+	*out = slab;
+	return slab->base + slot * slab->slot_size;
+}
+
+drm_private void
+amdgpu_vamgr_slab_free(struct amdgpu_va_slab *slab, uint64_t va)
+{
+	struct amdgpu_va_thread_cache *cache;
+	uint32_t bit = 1u << ((va - slab->base) / slab->slot_size);
+
+	cache = pthread_getspecific(slab->mgr->slab_key);
+	if (cache && cache->current[slab->size_class] == slab)
+		slab->free |= bit;
+	else
+		amdgpu_vamgr_bitmap_set(&slab->remote_free, bit);
+
+	if (atomic_dec_and_test(&slab->used))
+		amdgpu_vamgr_slab_release(slab);
+}
+
 drm_private void amdgpu_vamgr_init(struct amdgpu_bo_va_mgr *mgr, uint64_t start,
 			      uint64_t max, uint64_t alignment)
 {
@@ -51,17 +518,37 @@ drm_private void amdgpu_vamgr_init(struct amdgpu_bo_va_mgr *mgr, uint64_t start,
 	mgr->va_max = max;
 	mgr->va_alignment = alignment;
 
-	list_inithead(&mgr->va_holes);
+	mgr->holes_by_offset = NULL;
+	mgr->holes_by_size = NULL;
+	mgr->hole_count = 0;
+	mgr->hole_bytes = 0;
+	mgr->seed = 0x9e3779b9;
 	pthread_mutex_init(&mgr->bo_va_mutex, NULL);
+
+	list_inithead(&mgr->slabs);
+	list_inithead(&mgr->thread_caches);
+	mgr->slabs_enabled = !pthread_key_create(&mgr->slab_key,
+						 amdgpu_vamgr_thread_exit);
 }
 
 drm_private void amdgpu_vamgr_deinit(struct amdgpu_bo_va_mgr *mgr)
 {
-	struct amdgpu_bo_va_hole *hole, *tmp;
-	LIST_FOR_EACH_ENTRY_SAFE(hole, tmp, &mgr->va_holes, list) {
-		list_del(&hole->list);
-		free(hole);
+	struct amdgpu_va_thread_cache *cache, *next_cache;
+	struct amdgpu_va_slab *slab, *next_slab;
+
+	/* Whatever the slabs still hold goes away with the holes. */
+	if (mgr->slabs_enabled) {
+		pthread_key_delete(mgr->slab_key);
+		LIST_FOR_EACH_ENTRY_SAFE(cache, next_cache,
+					 &mgr->thread_caches, list)
+			free(cache);
+		LIST_FOR_EACH_ENTRY_SAFE(slab, next_slab, &mgr->slabs, list)
+			free(slab);
 	}
+
+	amdgpu_vamgr_free_holes(mgr->holes_by_offset);
+	mgr->holes_by_offset = NULL;
+	mgr->holes_by_size = NULL;
 	pthread_mutex_destroy(&mgr->bo_va_mutex);
 }
 
@@ -75,52 +562,29 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 	alignment = MAX2(alignment, mgr->va_alignment);
 	size = ALIGN(size, mgr->va_alignment);
 
-	if (base_required % alignment)
+	/* An empty range would be a zero sized hole once freed */
+	if (!size || base_required % alignment)
 		return AMDGPU_INVALID_VA_ADDRESS;
 
 	pthread_mutex_lock(&mgr->bo_va_mutex);
-	/* TODO: using more appropriate way to track the holes */
 	/* first look for a hole */
-	LIST_FOR_EACH_ENTRY_SAFE(hole, n, &mgr->va_holes, list) {
-		if (base_required) {
-			if(hole->offset > base_required ||
-				(hole->offset + hole->size) < (base_required + size))
-				continue;
-			waste = base_required - hole->offset;
-			offset = base_required;
-		} else {
-			offset = hole->offset;
-			waste = offset % alignment;
-			waste = waste ? alignment - waste : 0;
-			offset += waste;
-			if (offset >= (hole->offset + hole->size)) {
-				continue;
-			}
-		}
-		if (!waste && hole->size == size) {
-			offset = hole->offset;
-			list_del(&hole->list);
-			free(hole);
-			pthread_mutex_unlock(&mgr->bo_va_mutex);
-			return offset;
-		}
-		if ((hole->size - waste) > size) {
-			if (waste) {
-				n = calloc(1, sizeof(struct amdgpu_bo_va_hole));
-				n->size = waste;
-				n->offset = hole->offset;
-				list_add(&n->list, &hole->list);
-			}
-			hole->size -= (size + waste);
-			hole->offset += size + waste;
-			pthread_mutex_unlock(&mgr->bo_va_mutex);
-			return offset;
-		}
-		if ((hole->size - waste) == size) {
-			hole->size = waste;
-			pthread_mutex_unlock(&mgr->bo_va_mutex);
-			return offset;
-		}
+	if (base_required) {
+		hole = amdgpu_vamgr_hole_below(mgr, base_required);
+		if (hole && hole->offset + hole->size < base_required + size)
+			hole = NULL;
+		offset = base_required;
+	} else {
+		hole = amdgpu_vamgr_best_fit(mgr->holes_by_size, size,
+					     alignment);
+		if (hole)
+			offset = amdgpu_vamgr_align(hole->offset, alignment);
+	}
+
+	if (hole) {
+		if (!amdgpu_vamgr_carve(mgr, hole, offset, size))
+			offset = AMDGPU_INVALID_VA_ADDRESS;
+		pthread_mutex_unlock(&mgr->bo_va_mutex);
+		return offset;
 	}
 
 	if (base_required) {
@@ -132,8 +596,7 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 		waste = base_required - mgr->va_offset;
 	} else {
 		offset = mgr->va_offset;
-		waste = offset % alignment;
-		waste = waste ? alignment - waste : 0;
+		waste = amdgpu_vamgr_align(offset, alignment) - offset;
 	}
 
 	if (offset + waste + size > mgr->va_max) {
@@ -142,10 +605,22 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 	}
 
 	if (waste) {
-		n = calloc(1, sizeof(struct amdgpu_bo_va_hole));
-		n->size = waste;
-		n->offset = offset;
-		list_add(&n->list, &mgr->va_holes);
+		/* Grow the uppermost hole if it reaches the top, otherwise
+		 * leave a new one behind. */
+		hole = amdgpu_vamgr_hole_below(mgr, offset);
+		if (hole && hole->offset + hole->size == offset) {
+			amdgpu_vamgr_resize_hole(mgr, hole, hole->offset,
+						 hole->size + waste);
+		} else {
+			n = amdgpu_vamgr_new_hole(mgr);
+			if (!n) {
+				pthread_mutex_unlock(&mgr->bo_va_mutex);
+				return AMDGPU_INVALID_VA_ADDRESS;
+			}
+			n->offset = offset;
+			n->size = waste;
+			amdgpu_vamgr_insert_hole(mgr, n);
+		}
 	}
 
 	offset += waste;
@@ -157,73 +632,102 @@ amdgpu_vamgr_find_va(struct amdgpu_bo_va_mgr *mgr, uint64_t size,
 drm_private void
 amdgpu_vamgr_free_va(struct amdgpu_bo_va_mgr *mgr, uint64_t va, uint64_t size)
 {
-	struct amdgpu_bo_va_hole *hole;
-
-	if (va == AMDGPU_INVALID_VA_ADDRESS)
-		return;
+	struct amdgpu_bo_va_hole *lower, *upper;
 
 	size = ALIGN(size, mgr->va_alignment);
 
+	if (va == AMDGPU_INVALID_VA_ADDRESS || !size)
+		return;
+
 	pthread_mutex_lock(&mgr->bo_va_mutex);
+	lower = amdgpu_vamgr_hole_below(mgr, va);
+	if (lower && lower->offset + lower->size != va)
+		lower = NULL;
+
 	if ((va + size) == mgr->va_offset) {
 		mgr->va_offset = va;
 		/* Delete uppermost hole if it reaches the new top */
-		if (!LIST_IS_EMPTY(&mgr->va_holes)) {
-			hole = container_of(mgr->va_holes.next, hole, list);
-			if ((hole->offset + hole->size) == va) {
-				mgr->va_offset = hole->offset;
-				list_del(&hole->list);
-				free(hole);
-			}
-		}
-	} else {
-		struct amdgpu_bo_va_hole *next;
-
-		hole = container_of(&mgr->va_holes, hole, list);
-		LIST_FOR_EACH_ENTRY(next, &mgr->va_holes, list) {
-			if (next->offset < va)
-				break;
-			hole = next;
-		}
-
-		if (&hole->list != &mgr->va_holes) {
-			/* Grow upper hole if it's adjacent */
-			if (hole->offset == (va + size)) {
-				hole->offset = va;
-				hole->size += size;
-				/* Merge lower hole if it's adjacent */
-				if (next != hole
-						&& &next->list != &mgr->va_holes
-						&& (next->offset + next->size) == va) {
-					next->size += hole->size;
-					list_del(&hole->list);
-					free(hole);
-				}
-				goto out;
-			}
+		if (lower) {
+			mgr->va_offset = lower->offset;
+			amdgpu_vamgr_remove_hole(mgr, lower);
 		}
+		goto out;
+	}
 
-		/* Grow lower hole if it's adjacent */
-		if (next != hole && &next->list != &mgr->va_holes &&
-				(next->offset + next->size) == va) {
-			next->size += size;
-			goto out;
-		}
+	upper = amdgpu_vamgr_hole_above(mgr, va);
+	if (upper && upper->offset != va + size)
+		upper = NULL;
 
+	if (lower && upper) {
+		/* Merge the upper hole into the lower one */
+		size += upper->size;
+		amdgpu_vamgr_remove_hole(mgr, upper);
+		amdgpu_vamgr_resize_hole(mgr, lower, lower->offset,
+					 lower->size + size);
+	} else if (lower) {
+		amdgpu_vamgr_resize_hole(mgr, lower, lower->offset,
+					 lower->size + size);
+	} else if (upper) {
+		amdgpu_vamgr_resize_hole(mgr, upper, va, upper->size + size);
+	} else {
 		/* FIXME on allocation failure we just lose virtual address space
 		 * maybe print a warning
 		 */
-		next = calloc(1, sizeof(struct amdgpu_bo_va_hole));
-		if (next) {
-			next->size = size;
-			next->offset = va;
-			list_add(&next->list, &hole->list);
+		upper = amdgpu_vamgr_new_hole(mgr);
+		if (upper) {
+			upper->offset = va;
+			upper->size = size;
+			amdgpu_vamgr_insert_hole(mgr, upper);
 		}
 	}
 out:
 	pthread_mutex_unlock(&mgr->bo_va_mutex);
 }
 
+drm_private void
+amdgpu_vamgr_query_fragmentation(struct amdgpu_bo_va_mgr *mgr,
+				 struct amdgpu_va_fragmentation *frag)
+{
+	struct amdgpu_bo_va_hole *hole;
+	struct amdgpu_va_node *node;
+
+	pthread_mutex_lock(&mgr->bo_va_mutex);
+	frag->holes = mgr->hole_count;
+	frag->hole_bytes = mgr->hole_bytes;
+	frag->largest_hole = 0;
+	for (node = mgr->holes_by_size; node; node = node->right) {
+		hole = hole_by_size(node);
+		frag->largest_hole = hole->size;
+	}
+	frag->unused_bytes = mgr->va_max - mgr->va_offset;
+	pthread_mutex_unlock(&mgr->bo_va_mutex);
+}
+
+static uint64_t amdgpu_vamgr_alloc(struct amdgpu_bo_va_mgr *mgr,
+				   uint64_t size, uint64_t alignment,
+				   uint64_t base_required,
+				   struct amdgpu_va_slab **slab)
+{
+	uint64_t va = AMDGPU_INVALID_VA_ADDRESS;
+
+	*slab = NULL;
+	if (!base_required)
+		va = amdgpu_vamgr_slab_alloc(mgr, size, alignment, slab);
+	if (va == AMDGPU_INVALID_VA_ADDRESS)
+		va = amdgpu_vamgr_find_va(mgr, size, alignment, base_required);
+	return va;
+}
+
+static void amdgpu_vamgr_release(struct amdgpu_bo_va_mgr *mgr,
+				 struct amdgpu_va_slab *slab,
+				 uint64_t va, uint64_t size)
+{
+	if (slab)
+		amdgpu_vamgr_slab_free(slab, va);
+	else
+		amdgpu_vamgr_free_va(mgr, va, size);
+}
+
 int amdgpu_va_range_alloc(amdgpu_device_handle dev,
 			  enum amdgpu_gpu_va_range va_range_type,
 			  uint64_t size,
@@ -234,6 +738,7 @@ int amdgpu_va_range_alloc(amdgpu_device_handle dev,
 			  uint64_t flags)
 {
 	struct amdgpu_bo_va_mgr *vamgr;
+	struct amdgpu_va_slab *slab;
 
 	if (flags & AMDGPU_VA_RANGE_32_BIT)
 		vamgr = &dev->vamgr_32;
@@ -243,22 +748,25 @@ int amdgpu_va_range_alloc(amdgpu_device_handle dev,
 	va_base_alignment = MAX2(va_base_alignment, vamgr->va_alignment);
 	size = ALIGN(size, vamgr->va_alignment);
 
-	*va_base_allocated = amdgpu_vamgr_find_va(vamgr, size,
-					va_base_alignment, va_base_required);
+	*va_base_allocated = amdgpu_vamgr_alloc(vamgr, size,
+					va_base_alignment, va_base_required,
+					&slab);
 
 	if (!(flags & AMDGPU_VA_RANGE_32_BIT) &&
 	    (*va_base_allocated == AMDGPU_INVALID_VA_ADDRESS)) {
 		/* fallback to 32bit address */
 		vamgr = &dev->vamgr_32;
-		*va_base_allocated = amdgpu_vamgr_find_va(vamgr, size,
-					va_base_alignment, va_base_required);
+		*va_base_allocated = amdgpu_vamgr_alloc(vamgr, size,
+					va_base_alignment, va_base_required,
+					&slab);
 	}
 
 	if (*va_base_allocated != AMDGPU_INVALID_VA_ADDRESS) {
 		struct amdgpu_va* va;
 		va = calloc(1, sizeof(struct amdgpu_va));
 		if(!va){
-			amdgpu_vamgr_free_va(vamgr, *va_base_allocated, size);
+			amdgpu_vamgr_release(vamgr, slab, *va_base_allocated,
+					     size);
 			return -ENOMEM;
 		}
 		va->dev = dev;
@@ -266,6 +774,7 @@ int amdgpu_va_range_alloc(amdgpu_device_handle dev,
 		va->size = size;
 		va->range = va_range_type;
 		va->vamgr = vamgr;
+		va->slab = slab;
 		*va_range_handle = va;
 	} else {
 		return -EINVAL;
@@ -279,9 +788,24 @@ int amdgpu_va_range_free(amdgpu_va_handle va_range_handle)
 	if(!va_range_handle || !va_range_handle->address)
 		return 0;
 
-	amdgpu_vamgr_free_va(va_range_handle->vamgr,
+	amdgpu_vamgr_release(va_range_handle->vamgr,
+			va_range_handle->slab,
 			va_range_handle->address,
 			va_range_handle->size);
 	free(va_range_handle);
 	return 0;
 }
+
+int amdgpu_va_range_query_fragmentation(amdgpu_device_handle dev,
+					uint64_t flags,
+					struct amdgpu_va_fragmentation *frag)
+{
+	if (flags & ~AMDGPU_VA_RANGE_32_BIT)
+		return -EINVAL;
+
+	if (flags & AMDGPU_VA_RANGE_32_BIT)
+		amdgpu_vamgr_query_fragmentation(&dev->vamgr_32, frag);
+	else
+		amdgpu_vamgr_query_fragmentation(&dev->vamgr, frag);
+	return 0;
+}
@@ -41,6 +41,8 @@
    } while (0)
 
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/mman.h>
 
 #if defined(ANDROID) && !defined(__LP64__)
@@ -48,8 +50,8 @@
 
 extern void *__mmap2(void *, size_t, int, int, int, size_t);
 
-static inline void *drm_mmap(void *addr, size_t length, int prot, int flags,
-                             int fd, loff_t offset)
+static inline void *drm_sys_mmap(void *addr, size_t length, int prot,
+                                 int flags, int fd, loff_t offset)
 {
    /* offset must be aligned to 4096 (not necessarily the page size) */
    if (offset & 4095) {
@@ -60,18 +62,18 @@ static inline void *drm_mmap(void *addr, size_t length, int prot, int flags,
    return __mmap2(addr, length, prot, flags, fd, (size_t) (offset >> 12));
 }
 
-#  define drm_munmap(addr, length) \
+#  define drm_sys_munmap(addr, length) \
               munmap(addr, length)
 
 
 #else
 
 /* assume large file support exists */
-#  define drm_mmap(addr, length, prot, flags, fd, offset) \
+#  define drm_sys_mmap(addr, length, prot, flags, fd, offset) \
               mmap(addr, length, prot, flags, fd, offset)
 
 
-static inline int drm_munmap(void *addr, size_t length)
+static inline int drm_sys_munmap(void *addr, size_t length)
 {
    /* Copied from configure code generated by AC_SYS_LARGEFILE */
 #define LARGE_OFF_T ((((off_t) 1 << 31) << 31) - 1 + \
@@ -84,4 +86,18 @@ static inline int drm_munmap(void *addr, size_t length)
 }
 #endif
 
+/*
+ * All mappings of DRM objects go through drmMmap() so that an ioctl backend
+ * installed with drmSetIoctlBackend() can resolve the offsets it handed out.
+ */
+extern void *drmMmap(void *addr, size_t length, int prot, int flags,
+                     int fd, uint64_t offset);
+extern int drmMunmap(void *addr, size_t length);
+
+#define drm_mmap(addr, length, prot, flags, fd, offset) \
+              drmMmap(addr, length, prot, flags, fd, offset)
+
+#define drm_munmap(addr, length) \
+              drmMunmap(addr, length)
+
 #endif
@@ -0,0 +1,283 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "amdgpu.h"
+#include "amdgpu_drm.h"
+
+#include "util/common.h"
+
+/* The null backend with buffers that can be made to look busy. */
+static const drmIoctlBackend *null_backend;
+static unsigned gem_creates;
+static int gpu_busy;
+
+static int counting_ioctl(void *priv, int fd, unsigned long request, void *arg)
+{
+    int ret = null_backend->ioctl(null_backend->priv, fd, request, arg);
+
+    if (ret)
+        return ret;
+
+    switch (DRM_IOCTL_NR(request) - DRM_COMMAND_BASE) {
+    case DRM_AMDGPU_GEM_CREATE:
+        gem_creates++;
+        break;
+    case DRM_AMDGPU_GEM_WAIT_IDLE:
+        ((union drm_amdgpu_gem_wait_idle *)arg)->out.status = gpu_busy;
+        break;
+    }
+    return 0;
+}
+
+static void *counting_mmap(void *priv, void *addr, size_t length, int prot,
+                           int flags, int fd, uint64_t offset)
+{
+    return null_backend->mmap(null_backend->priv, addr, length, prot, flags,
+                              fd, offset);
+}
+
+static const drmIoctlBackend counting_backend = {
+    .ioctl = counting_ioctl,
+    .mmap = counting_mmap,
+};
+
+static int alloc(amdgpu_device_handle dev, uint64_t size, uint32_t heap,
+                 amdgpu_bo_handle *bo)
+{
+    struct amdgpu_bo_alloc_request request;
+
+    memset(&request, 0, sizeof(request));
+    request.alloc_size = size;
+    request.phys_alignment = 4096;
+    request.preferred_heap = heap;
+    return amdgpu_bo_alloc(dev, &request, bo);
+}
+
+static int test_disabled(amdgpu_device_handle dev)
+{
+    amdgpu_bo_handle bo;
+    unsigned creates = gem_creates;
+
+    CHECK(alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    amdgpu_bo_free(bo);
+    CHECK(alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    amdgpu_bo_free(bo);
+    CHECK(gem_creates == creates + 2);
+    return 0;
+}
+
+static int test_reuse(amdgpu_device_handle dev)
+{
+    struct amdgpu_bo_cache_stats stats;
+    amdgpu_bo_handle bo, again;
+    unsigned creates = gem_creates;
+
+    CHECK(amdgpu_bo_cache_enable(dev, 1 << 20, 0) == 0);
+
+    /* Rounded up to the 8K class, so a 6000 byte request fits too. */
+    CHECK(alloc(dev, 5000, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    amdgpu_bo_free(bo);
+    CHECK(alloc(dev, 6000, AMDGPU_GEM_DOMAIN_GTT, &again) == 0);
+    CHECK(again == bo && gem_creates == creates + 1);
+
+    /* Another heap is another bucket. */
+    amdgpu_bo_free(again);
+    CHECK(alloc(dev, 6000, AMDGPU_GEM_DOMAIN_VRAM, &bo) == 0);
+    CHECK(bo != again && gem_creates == creates + 2);
+    amdgpu_bo_free(bo);
+
+    /* The GPU still using the buffer makes it a miss. */
+    gpu_busy = 1;
+    CHECK(alloc(dev, 8192, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    gpu_busy = 0;
+    CHECK(bo != again && gem_creates == creates + 3);
+    amdgpu_bo_free(bo);
+
+    CHECK(amdgpu_bo_cache_query_stats(dev, &stats) == 0);
+    CHECK(stats.hits == 1 && stats.misses == 3 && stats.busy == 1);
+    CHECK(stats.count == 3 && stats.bytes == 3 * 8192);
+
+    /* Turning the cache off releases everything. */
+    CHECK(amdgpu_bo_cache_enable(dev, 0, 0) == 0);
+    CHECK(amdgpu_bo_cache_query_stats(dev, &stats) == 0);
+    CHECK(stats.count == 0 && stats.bytes == 0 && stats.evictions == 3);
+    return 0;
+}
+
+static int test_alignment(amdgpu_device_handle dev)
+{
+    struct amdgpu_bo_cache_stats before, after;
+    struct amdgpu_bo_alloc_request request;
+    amdgpu_bo_handle bo, again;
+
+    CHECK(amdgpu_bo_cache_enable(dev, 1 << 20, 0) == 0);
+    CHECK(amdgpu_bo_cache_query_stats(dev, &before) == 0);
+
+    CHECK(alloc(dev, 8192, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    amdgpu_bo_free(bo);
+
+    /* A cached buffer that is not aligned enough is a miss, not busy. */
+    memset(&request, 0, sizeof(request));
+    request.alloc_size = 8192;
+    request.phys_alignment = 65536;
+    request.preferred_heap = AMDGPU_GEM_DOMAIN_GTT;
+    CHECK(amdgpu_bo_alloc(dev, &request, &again) == 0);
+    CHECK(amdgpu_bo_cache_query_stats(dev, &after) == 0);
+    CHECK(after.misses == before.misses + 2);
+    CHECK(after.hits == before.hits && after.busy == before.busy);
+    amdgpu_bo_free(again);
+
+    CHECK(amdgpu_bo_cache_enable(dev, 0, 0) == 0);
+    return 0;
+}
+
+static int test_uncacheable(amdgpu_device_handle dev)
+{
+    struct amdgpu_bo_cache_stats stats;
+    amdgpu_bo_handle bo;
+    uint32_t handle;
+
+    CHECK(amdgpu_bo_cache_enable(dev, 1 << 20, 0) == 0);
+
+    /* Shared buffers may still be in use elsewhere. */
+    CHECK(alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    CHECK(amdgpu_bo_export(bo, amdgpu_bo_handle_type_kms, &handle) == 0);
+    amdgpu_bo_free(bo);
+
+    /* A GPU mapping made by the caller would outlive the buffer. */
+    CHECK(alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    CHECK(amdgpu_bo_va_op(bo, 0, 4096, 1 << 20, 0, AMDGPU_VA_OP_MAP) == 0);
+    amdgpu_bo_free(bo);
+
+    /* Unless it is gone again. */
+    CHECK(alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, &bo) == 0);
+    CHECK(amdgpu_bo_va_op(bo, 0, 4096, 1 << 20, 0, AMDGPU_VA_OP_MAP) == 0);
+    CHECK(amdgpu_bo_va_op(bo, 0, 4096, 1 << 20, 0, AMDGPU_VA_OP_UNMAP) == 0);
+    amdgpu_bo_free(bo);
+
+    CHECK(amdgpu_bo_cache_query_stats(dev, &stats) == 0);
+    CHECK(stats.count == 1);
+
+    CHECK(amdgpu_bo_cache_enable(dev, 0, 0) == 0);
+    return 0;
+}
+
+static int test_budget(amdgpu_device_handle dev)
+{
+    struct amdgpu_bo_cache_stats before, after;
+    amdgpu_bo_handle first, second;
+    unsigned creates;
+
+    CHECK(amdgpu_bo_cache_query_stats(dev, &before) == 0);
+    CHECK(amdgpu_bo_cache_enable(dev, 8192, 0) == 0);
+
+    CHECK(alloc(dev, 4096, AMDGPU_GEM_DOMAIN_GTT, &first) == 0);
+    CHECK(alloc(dev, 8192, AMDGPU_GEM_DOMAIN_GTT, &second) == 0);
+    amdgpu_bo_free(first);
+    amdgpu_bo_free(second);
+
+    /* The least recently freed buffer makes room. */
+    CHECK(amdgpu_bo_cache_query_stats(dev, &after) == 0);
+    CHECK(after.count == 1 && after.bytes == 8192);
+    CHECK(after.evictions == before.evictions + 1);
+
+    /* Too old to be kept, well past the 1 ms limit. */
+    before = after;
+    creates = gem_creates;
+    CHECK(amdgpu_bo_cache_enable(dev, 8192, 1) == 0);
+    usleep(50000);
+    CHECK(alloc(dev, 8192, AMDGPU_GEM_DOMAIN_GTT, &first) == 0);
+    CHECK(gem_creates == creates + 1);
+    CHECK(amdgpu_bo_cache_query_stats(dev, &after) == 0);
+    CHECK(after.hits == before.hits && after.count == 0);
+    CHECK(after.evictions == before.evictions + 1);
+    amdgpu_bo_free(first);
+
+    CHECK(amdgpu_bo_cache_enable(dev, 0, 0) == 0);
+    return 0;
+}
+
+static int test_mapped(amdgpu_device_handle dev)
+{
+    struct amdgpu_bo_alloc_request request;
+    amdgpu_bo_handle bo, again;
+    uint64_t va, va_again;
+    void *cpu, *cpu_again;
+
+    CHECK(amdgpu_bo_cache_enable(dev, 1 << 20, 0) == 0);
+
+    memset(&request, 0, sizeof(request));
+    request.alloc_size = 65536;
+    request.phys_alignment = 4096;
+    request.preferred_heap = AMDGPU_GEM_DOMAIN_GTT;
+
+    CHECK(amdgpu_bo_alloc_mapped(dev, &request, &bo, &va, &cpu) == 0);
+    CHECK(va && cpu);
+    memset(cpu, 0x5a, 65536);
+    amdgpu_bo_free(bo);
+
+    /* Both addresses come back with the buffer. */
+    CHECK(amdgpu_bo_alloc_mapped(dev, &request, &again, &va_again,
+                                 &cpu_again) == 0);
+    CHECK(again == bo && va_again == va && cpu_again == cpu);
+    CHECK(((unsigned char *)cpu_again)[65535] == 0x5a);
+    CHECK(amdgpu_bo_cpu_unmap(again) == 0);
+    amdgpu_bo_free(again);
+
+    CHECK(amdgpu_bo_cache_enable(dev, 0, 0) == 0);
+    return 0;
+}
+
+int main(void)
+{
+    amdgpu_device_handle dev;
+    uint32_t major, minor;
+    int fd, ret;
+
+    null_backend = drmNullBackend();
+    if (drmSetIoctlBackend(&counting_backend)) {
+        fprintf(stderr, "failed to install the null backend\n");
+        return 1;
+    }
+
+    fd = drmNullDeviceOpen("amdgpu");
+    CHECK(fd >= 0);
+    CHECK(amdgpu_device_initialize(fd, &major, &minor, &dev) == 0);
+
+    ret = test_disabled(dev) ||
+          test_reuse(dev) ||
+          test_alignment(dev) ||
+          test_uncacheable(dev) ||
+          test_budget(dev) ||
+          test_mapped(dev);
+
+    amdgpu_device_deinitialize(dev);
+    close(fd);
+    drmSetIoctlBackend(NULL);
+
+    printf("amdgpu bo cache: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
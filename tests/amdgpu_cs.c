@@ -0,0 +1,438 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "amdgpu.h"
+#include "amdgpu_drm.h"
+
+#include "util/common.h"
+
+/* The null backend, looking at the chunks of every submission. */
+static const drmIoctlBackend *null_backend;
+static pthread_mutex_t seen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Held to stall submissions, or make them fail. */
+static pthread_mutex_t hold_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int fail_submit;
+static uint64_t ib_bytes;
+
+static struct {
+    unsigned ibs;
+    unsigned fences;
+    unsigned dependencies;
+    uint64_t last_dependency;
+} seen;
+
+static int inspect_ioctl(void *priv, int fd, unsigned long request, void *arg)
+{
+    if (DRM_IOCTL_NR(request) - DRM_COMMAND_BASE == DRM_AMDGPU_CS) {
+        union drm_amdgpu_cs *cs = arg;
+        uint64_t *chunk_array = (uint64_t *)(uintptr_t)cs->in.chunks;
+        unsigned i;
+
+        pthread_mutex_lock(&hold_mutex);
+        pthread_mutex_unlock(&hold_mutex);
+
+        pthread_mutex_lock(&seen_mutex);
+        memset(&seen, 0, sizeof(seen));
+        for (i = 0; i < cs->in.num_chunks; i++) {
+            struct drm_amdgpu_cs_chunk *chunk =
+                (struct drm_amdgpu_cs_chunk *)(uintptr_t)chunk_array[i];
+            struct drm_amdgpu_cs_chunk_dep *deps =
+                (struct drm_amdgpu_cs_chunk_dep *)(uintptr_t)chunk->chunk_data;
+            unsigned count = chunk->length_dw * 4 / sizeof(*deps);
+
+            switch (chunk->chunk_id) {
+            case AMDGPU_CHUNK_ID_IB:
+                seen.ibs++;
+                ib_bytes += ((struct drm_amdgpu_cs_chunk_ib *)
+                             (uintptr_t)chunk->chunk_data)->ib_bytes;
+                break;
+            case AMDGPU_CHUNK_ID_FENCE:
+                seen.fences++;
+                break;
+            case AMDGPU_CHUNK_ID_DEPENDENCIES:
+                seen.dependencies += count;
+                seen.last_dependency = deps[count - 1].handle;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&seen_mutex);
+
+        if (fail_submit) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return null_backend->ioctl(null_backend->priv, fd, request, arg);
+}
+
+static void *inspect_mmap(void *priv, void *addr, size_t length, int prot,
+                          int flags, int fd, uint64_t offset)
+{
+    return null_backend->mmap(null_backend->priv, addr, length, prot, flags,
+                              fd, offset);
+}
+
+static const drmIoctlBackend inspect_backend = {
+    .ioctl = inspect_ioctl,
+    .mmap = inspect_mmap,
+};
+
+static int submit(amdgpu_context_handle ctx, uint32_t ring, unsigned ibs,
+                  struct amdgpu_cs_fence *deps, unsigned num_deps,
+                  amdgpu_bo_handle fence_bo, uint64_t *seq_no)
+{
+    struct amdgpu_cs_ib_info ib[4];
+    struct amdgpu_cs_request request;
+    int r;
+
+    memset(ib, 0, sizeof(ib));
+    memset(&request, 0, sizeof(request));
+    request.ip_type = AMDGPU_HW_IP_GFX;
+    request.ring = ring;
+    request.number_of_ibs = ibs;
+    request.ibs = ib;
+    request.number_of_dependencies = num_deps;
+    request.dependencies = deps;
+    request.fence_info.handle = fence_bo;
+
+    r = amdgpu_cs_submit(ctx, 0, &request, 1);
+    *seq_no = request.seq_no;
+    return r;
+}
+
+static int test_chunks(amdgpu_device_handle dev, amdgpu_context_handle ctx)
+{
+    struct amdgpu_bo_alloc_request alloc;
+    struct amdgpu_cs_fence deps[40];
+    amdgpu_bo_handle fence_bo;
+    uint64_t seq, prev = 0;
+    unsigned i;
+
+    memset(&alloc, 0, sizeof(alloc));
+    alloc.alloc_size = 4096;
+    alloc.preferred_heap = AMDGPU_GEM_DOMAIN_GTT;
+    CHECK(amdgpu_bo_alloc(dev, &alloc, &fence_bo) == 0);
+
+    memset(deps, 0, sizeof(deps));
+    for (i = 0; i < 40; i++) {
+        deps[i].context = ctx;
+        deps[i].fence = i + 1;
+    }
+
+    /* Growing and shrinking requests reuse the same storage. */
+    for (i = 0; i < 200; i++) {
+        unsigned ibs = 1 + i % 4, num_deps = (i * 7) % 41;
+
+        CHECK(submit(ctx, 0, ibs, deps, num_deps, i & 1 ? fence_bo : NULL,
+                     &seq) == 0);
+        CHECK(seq > prev);
+        CHECK(seen.ibs == ibs && seen.fences == (i & 1));
+        CHECK(seen.dependencies == num_deps);
+        CHECK(!num_deps || seen.last_dependency == num_deps);
+        prev = seq;
+    }
+
+    amdgpu_bo_free(fence_bo);
+    return 0;
+}
+
+static int test_semaphores(amdgpu_context_handle ctx)
+{
+    amdgpu_semaphore_handle first, second;
+    uint64_t seq, signaled;
+
+    CHECK(amdgpu_cs_create_semaphore(&first) == 0);
+    CHECK(amdgpu_cs_create_semaphore(&second) == 0);
+
+    CHECK(submit(ctx, 0, 1, NULL, 0, NULL, &signaled) == 0);
+    CHECK(amdgpu_cs_signal_semaphore(ctx, AMDGPU_HW_IP_GFX, 0, 0, first) == 0);
+    CHECK(amdgpu_cs_signal_semaphore(ctx, AMDGPU_HW_IP_GFX, 0, 0, second) == 0);
+    CHECK(amdgpu_cs_wait_semaphore(ctx, AMDGPU_HW_IP_GFX, 0, 1, first) == 0);
+    CHECK(amdgpu_cs_wait_semaphore(ctx, AMDGPU_HW_IP_GFX, 0, 1, second) == 0);
+
+    /* Another ring doesn't wait. */
+    CHECK(submit(ctx, 0, 1, NULL, 0, NULL, &seq) == 0);
+    CHECK(seen.dependencies == 0);
+
+    /* The waiting ring does, once. */
+    CHECK(submit(ctx, 1, 1, NULL, 0, NULL, &seq) == 0);
+    CHECK(seen.dependencies == 2 && seen.last_dependency == signaled);
+    CHECK(submit(ctx, 1, 1, NULL, 0, NULL, &seq) == 0);
+    CHECK(seen.dependencies == 0);
+
+    CHECK(amdgpu_cs_destroy_semaphore(first) == 0);
+    CHECK(amdgpu_cs_destroy_semaphore(second) == 0);
+    return 0;
+}
+
+#define THREADS 4
+#define SUBMITS 2000
+
+struct worker {
+    pthread_t thread;
+    amdgpu_context_handle ctx;
+    uint64_t max_seq;
+    int ret;
+};
+
+static void *worker(void *data)
+{
+    struct worker *w = data;
+    unsigned i;
+    uint64_t seq;
+
+    for (i = 0; i < SUBMITS && !w->ret; i++) {
+        w->ret = submit(w->ctx, 2, 1 + i % 3, NULL, 0, NULL, &seq);
+        if (seq > w->max_seq)
+            w->max_seq = seq;
+    }
+    return NULL;
+}
+
+/* Concurrent submissions on one context, the ring's last sequence number
+ * ends up the highest one. */
+static int test_threads(amdgpu_context_handle ctx)
+{
+    struct worker workers[THREADS];
+    amdgpu_semaphore_handle sem;
+    uint64_t max_seq = 0, seq;
+    unsigned i;
+
+    for (i = 0; i < THREADS; i++) {
+        workers[i].ctx = ctx;
+        workers[i].max_seq = 0;
+        workers[i].ret = 0;
+        CHECK(pthread_create(&workers[i].thread, NULL, worker,
+                             &workers[i]) == 0);
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+        CHECK(workers[i].ret == 0);
+        if (workers[i].max_seq > max_seq)
+            max_seq = workers[i].max_seq;
+    }
+
+    CHECK(amdgpu_cs_create_semaphore(&sem) == 0);
+    CHECK(amdgpu_cs_signal_semaphore(ctx, AMDGPU_HW_IP_GFX, 0, 2, sem) == 0);
+    CHECK(amdgpu_cs_wait_semaphore(ctx, AMDGPU_HW_IP_GFX, 0, 3, sem) == 0);
+    CHECK(submit(ctx, 3, 1, NULL, 0, NULL, &seq) == 0);
+    CHECK(seen.dependencies == 1 && seen.last_dependency == max_seq);
+    CHECK(amdgpu_cs_destroy_semaphore(sem) == 0);
+    return 0;
+}
+
+struct completions {
+    unsigned count;
+    uint64_t seq[8];
+    int result;
+};
+
+static void complete(void *data, int result, const struct amdgpu_cs_fence *fence)
+{
+    struct completions *c = data;
+
+    if (result || fence->ring != 1)
+        c->result = -1;
+    if (c->count < 8)
+        c->seq[c->count] = fence->fence;
+    c->count++;
+}
+
+static int test_async(amdgpu_device_handle dev)
+{
+    amdgpu_cs_submission_handle first, last, other;
+    struct amdgpu_cs_fence fence, last_fence;
+    struct amdgpu_cs_ib_info ib;
+    struct amdgpu_cs_request request;
+    struct completions c;
+    amdgpu_context_handle ctx;
+    uint64_t bytes;
+
+    CHECK(amdgpu_cs_ctx_create(dev, &ctx) == 0);
+
+    memset(&ib, 0, sizeof(ib));
+    memset(&request, 0, sizeof(request));
+    memset(&c, 0, sizeof(c));
+    request.ip_type = AMDGPU_HW_IP_NUM;
+    request.ring = 1;
+    request.number_of_ibs = 1;
+    request.ibs = &ib;
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, NULL, NULL,
+                                 &first) == -EINVAL);
+    request.ip_type = AMDGPU_HW_IP_GFX;
+
+    /* Nothing reaches the kernel while it is held. */
+    pthread_mutex_lock(&hold_mutex);
+    pthread_mutex_lock(&seen_mutex);
+    bytes = ib_bytes;
+    pthread_mutex_unlock(&seen_mutex);
+
+    ib.size = 7;
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, NULL, NULL, &first) == 0);
+    ib.size = 1;
+    CHECK(amdgpu_cs_submission_wait(first, 0, &fence) == -ETIME);
+    CHECK(amdgpu_cs_submission_wait(first, 1000000, &fence) == -ETIME);
+
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, complete, &c, NULL) == 0);
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, complete, &c, NULL) == 0);
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, complete, &c, &last) == 0);
+    pthread_mutex_unlock(&hold_mutex);
+
+    /* The request was copied, and everything went in order. */
+    CHECK(amdgpu_cs_submission_wait(last, AMDGPU_TIMEOUT_INFINITE,
+                                    &last_fence) == 0);
+    CHECK(amdgpu_cs_submission_wait(first, AMDGPU_TIMEOUT_INFINITE,
+                                    &fence) == 0);
+    CHECK(fence.context == ctx && fence.ring == 1);
+    CHECK(c.count == 3 && c.result == 0);
+    CHECK(fence.fence < c.seq[0] && c.seq[0] < c.seq[1] &&
+          c.seq[1] < c.seq[2] && c.seq[2] == last_fence.fence);
+    CHECK(ib_bytes == bytes + 4 * (7 + 3));
+    CHECK(amdgpu_cs_submission_free(first) == 0);
+    CHECK(amdgpu_cs_submission_free(last) == 0);
+
+    /* Errors come back the same way. */
+    fail_submit = 1;
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, NULL, NULL, &other) == 0);
+    CHECK(amdgpu_cs_submission_wait(other, AMDGPU_TIMEOUT_INFINITE,
+                                    &fence) == -EINVAL);
+    fail_submit = 0;
+    CHECK(amdgpu_cs_submission_free(other) == 0);
+
+    /* Nothing to submit, nothing to wait for. */
+    request.number_of_ibs = 0;
+    CHECK(amdgpu_cs_submit_async(ctx, 0, &request, NULL, NULL, &other) == 0);
+    CHECK(amdgpu_cs_submission_wait(other, AMDGPU_TIMEOUT_INFINITE,
+                                    &fence) == 0);
+    CHECK(fence.fence == 0);
+    CHECK(amdgpu_cs_submission_free(other) == 0);
+
+    CHECK(amdgpu_cs_ctx_free(ctx) == 0);
+    return 0;
+}
+
+struct producer {
+    pthread_t thread;
+    amdgpu_context_handle ctx;
+    unsigned completed;
+    uint64_t last_seq;
+    int out_of_order;
+    int ret;
+};
+
+static void produced(void *data, int result, const struct amdgpu_cs_fence *fence)
+{
+    struct producer *p = data;
+
+    if (result || fence->fence <= p->last_seq)
+        p->out_of_order = 1;
+    p->last_seq = fence->fence;
+    p->completed++;
+}
+
+static void *producer(void *data)
+{
+    struct producer *p = data;
+    struct amdgpu_cs_ib_info ib;
+    struct amdgpu_cs_request request;
+    unsigned i;
+
+    memset(&ib, 0, sizeof(ib));
+    memset(&request, 0, sizeof(request));
+    request.ip_type = AMDGPU_HW_IP_GFX;
+    request.number_of_ibs = 1;
+    request.ibs = &ib;
+
+    for (i = 0; i < SUBMITS && !p->ret; i++)
+        p->ret = amdgpu_cs_submit_async(p->ctx, 0, &request, produced, p,
+                                        NULL);
+    return NULL;
+}
+
+/* Requests from several threads, each in order, all submitted by the time
+ * the context is gone. */
+static int test_async_threads(amdgpu_device_handle dev)
+{
+    struct producer producers[THREADS];
+    amdgpu_context_handle ctx;
+    unsigned i;
+
+    CHECK(amdgpu_cs_ctx_create(dev, &ctx) == 0);
+
+    memset(producers, 0, sizeof(producers));
+    for (i = 0; i < THREADS; i++) {
+        producers[i].ctx = ctx;
+        CHECK(pthread_create(&producers[i].thread, NULL, producer,
+                             &producers[i]) == 0);
+    }
+    for (i = 0; i < THREADS; i++)
+        pthread_join(producers[i].thread, NULL);
+
+    CHECK(amdgpu_cs_ctx_free(ctx) == 0);
+
+    for (i = 0; i < THREADS; i++) {
+        CHECK(producers[i].ret == 0);
+        CHECK(producers[i].completed == SUBMITS);
+        CHECK(!producers[i].out_of_order);
+    }
+    return 0;
+}
+
+int main(void)
+{
+    amdgpu_device_handle dev;
+    amdgpu_context_handle ctx;
+    uint32_t major, minor;
+    int fd, ret;
+
+    null_backend = drmNullBackend();
+    if (drmSetIoctlBackend(&inspect_backend)) {
+        fprintf(stderr, "failed to install the null backend\n");
+        return 1;
+    }
+
+    fd = drmNullDeviceOpen("amdgpu");
+    CHECK(fd >= 0);
+    CHECK(amdgpu_device_initialize(fd, &major, &minor, &dev) == 0);
+    CHECK(amdgpu_cs_ctx_create(dev, &ctx) == 0);
+
+    ret = test_chunks(dev, ctx) ||
+          test_semaphores(ctx) ||
+          test_threads(ctx) ||
+          test_async(dev) ||
+          test_async_threads(dev);
+
+    amdgpu_cs_ctx_free(ctx);
+    amdgpu_device_deinitialize(dev);
+    close(fd);
+    drmSetIoctlBackend(NULL);
+
+    printf("amdgpu cs: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
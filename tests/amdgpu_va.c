@@ -0,0 +1,374 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Exercises the VA allocator of libdrm_amdgpu on its own, no GPU needed.
+ *
+ * The first part checks placement and coalescing on small cases, the second
+ * replays a synthetic trace shaped like a driver's: mostly small buffers with
+ * short lifetimes, a tail of large long-lived ones, now and then a 64K or 2M
+ * alignment.  Pass the number of operations to replay as the argument to use
+ * it as a benchmark.  The last part has threads allocating small ranges
+ * through amdgpu_va_range_alloc(), with and without the per-thread slabs,
+ * and freeing each other's.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* The allocator's entry points are not exported, build it in. */
+#include "amdgpu_vamgr.c"
+
+#include "util/common.h"
+
+#define PAGE 4096ull
+#define START (1ull << 20)
+#define MAX (1ull << 47)
+
+struct range {
+    uint64_t va;
+    uint64_t size;
+};
+
+static int test_placement(void)
+{
+    struct amdgpu_va_fragmentation frag;
+    struct amdgpu_bo_va_mgr mgr;
+    uint64_t base = START + PAGE, a, b, c, d, e, va;
+
+    amdgpu_vamgr_init(&mgr, base, base + 64 * PAGE, PAGE);
+
+    a = amdgpu_vamgr_find_va(&mgr, 4 * PAGE, 0, 0);
+    b = amdgpu_vamgr_find_va(&mgr, PAGE, 0, 0);
+    c = amdgpu_vamgr_find_va(&mgr, 2 * PAGE, 0, 0);
+    d = amdgpu_vamgr_find_va(&mgr, PAGE, 0, 0);
+    e = amdgpu_vamgr_find_va(&mgr, PAGE, 0, 0);
+    CHECK(a == base && b == a + 4 * PAGE && c == b + PAGE);
+    CHECK(d == c + 2 * PAGE && e == d + PAGE);
+
+    /* Holes of four and two pages: best fit picks the smaller one. */
+    amdgpu_vamgr_free_va(&mgr, a, 4 * PAGE);
+    amdgpu_vamgr_free_va(&mgr, c, 2 * PAGE);
+    va = amdgpu_vamgr_find_va(&mgr, PAGE, 0, 0);
+    CHECK(va == c);
+    amdgpu_vamgr_free_va(&mgr, va, PAGE);
+
+    /* Freeing what's between merges all three into one. */
+    amdgpu_vamgr_free_va(&mgr, b, PAGE);
+    amdgpu_vamgr_query_fragmentation(&mgr, &frag);
+    CHECK(frag.holes == 1 && frag.hole_bytes == 7 * PAGE);
+    CHECK(frag.largest_hole == 7 * PAGE);
+
+    /* Alignment the hole can't satisfy goes to the top. */
+    va = amdgpu_vamgr_find_va(&mgr, PAGE, 16 * PAGE, 0);
+    CHECK(va == base + 15 * PAGE);
+    amdgpu_vamgr_query_fragmentation(&mgr, &frag);
+    CHECK(frag.holes == 2 && frag.hole_bytes == 13 * PAGE);
+
+    /* A required base inside a hole, and one that is taken. */
+    CHECK(amdgpu_vamgr_find_va(&mgr, PAGE, 0, base + PAGE) == base + PAGE);
+    CHECK(amdgpu_vamgr_find_va(&mgr, PAGE, 0, base + PAGE) ==
+          AMDGPU_INVALID_VA_ADDRESS);
+    CHECK(amdgpu_vamgr_find_va(&mgr, PAGE, 0, d) ==
+          AMDGPU_INVALID_VA_ADDRESS);
+    CHECK(amdgpu_vamgr_find_va(&mgr, 64 * PAGE, 0, 0) ==
+          AMDGPU_INVALID_VA_ADDRESS);
+
+    /* Everything freed leaves nothing behind. */
+    amdgpu_vamgr_free_va(&mgr, base + PAGE, PAGE);
+    amdgpu_vamgr_free_va(&mgr, d, PAGE);
+    amdgpu_vamgr_free_va(&mgr, va, PAGE);
+    amdgpu_vamgr_free_va(&mgr, e, PAGE);
+    amdgpu_vamgr_query_fragmentation(&mgr, &frag);
+    CHECK(frag.holes == 0 && frag.unused_bytes == 64 * PAGE);
+
+    amdgpu_vamgr_deinit(&mgr);
+    return 0;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Mostly a few pages, about one in 64 up to 64M. */
+static uint64_t trace_size(uint64_t *state)
+{
+    uint64_t r = next_random(state);
+    unsigned shift = (r & 63) ? r % 5 : 4 + r % 11;
+
+    return PAGE << shift | ((r >> 32) % 4) * PAGE;
+}
+
+static uint64_t trace_alignment(uint64_t *state)
+{
+    uint64_t r = next_random(state) % 100;
+
+    return r < 90 ? 0 : r < 98 ? 64 * 1024 : 2 * 1024 * 1024;
+}
+
+static int compare_range(const void *a, const void *b)
+{
+    const struct range *x = a, *y = b;
+
+    return x->va < y->va ? -1 : x->va > y->va;
+}
+
+static int check_live(struct range *live, unsigned count)
+{
+    unsigned i;
+
+    qsort(live, count, sizeof(*live), compare_range);
+    for (i = 1; i < count; i++)
+        CHECK(live[i - 1].va + live[i - 1].size <= live[i].va);
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int test_trace(unsigned ops)
+{
+    struct amdgpu_va_fragmentation frag;
+    struct amdgpu_bo_va_mgr mgr;
+    unsigned max_live = 32768, count = 0, i;
+    struct range *live;
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    double start;
+
+    live = calloc(max_live, sizeof(*live));
+    CHECK(live);
+    amdgpu_vamgr_init(&mgr, START, MAX, PAGE);
+
+    start = now();
+    for (i = 0; i < ops; i++) {
+        uint64_t r = next_random(&state);
+
+        /* Keep the working set near three quarters of max_live. */
+        if (count && (count == max_live || r % 4 < (count * 4 > max_live * 3 ? 2 : 1))) {
+            /* Recent buffers die young. */
+            unsigned pick = r & 1 ? count - 1 - (r >> 8) % (count < 16 ? count : 16)
+                                  : (r >> 8) % count;
+
+            amdgpu_vamgr_free_va(&mgr, live[pick].va, live[pick].size);
+            live[pick] = live[--count];
+        } else {
+            live[count].size = trace_size(&state);
+            live[count].va = amdgpu_vamgr_find_va(&mgr, live[count].size,
+                                                  trace_alignment(&state), 0);
+            CHECK(live[count].va != AMDGPU_INVALID_VA_ADDRESS);
+            count++;
+        }
+    }
+    start = now() - start;
+
+    amdgpu_vamgr_query_fragmentation(&mgr, &frag);
+    printf("%u ops in %.3f s (%.0f ns/op), %u live\n", ops, start,
+           ops ? start * 1e9 / ops : 0, count);
+    printf("holes %llu, %llu MiB free in holes, largest %llu KiB, "
+           "%llu MiB in use up to the top\n",
+           (unsigned long long)frag.holes,
+           (unsigned long long)(frag.hole_bytes >> 20),
+           (unsigned long long)(frag.largest_hole >> 10),
+           (unsigned long long)((MAX - START - frag.unused_bytes) >> 20));
+
+    CHECK(check_live(live, count) == 0);
+
+    while (count--)
+        amdgpu_vamgr_free_va(&mgr, live[count].va, live[count].size);
+    amdgpu_vamgr_query_fragmentation(&mgr, &frag);
+    CHECK(frag.holes == 0 && frag.unused_bytes == MAX - START);
+
+    amdgpu_vamgr_deinit(&mgr);
+    free(live);
+    return 0;
+}
+
+#define THREADS 4
+#define PER_THREAD 512
+
+struct worker {
+    pthread_t thread;
+    struct amdgpu_device *dev;
+    unsigned ops;
+    uint64_t seed;
+    amdgpu_va_handle *own;
+    amdgpu_va_handle *other;
+    int ret;
+};
+
+static struct amdgpu_device *fake_device(void)
+{
+    struct amdgpu_device *dev = calloc(1, sizeof(*dev));
+
+    if (dev) {
+        amdgpu_vamgr_init(&dev->vamgr, START, MAX, PAGE);
+        amdgpu_vamgr_init(&dev->vamgr_32, 0, 0, PAGE);
+    }
+    return dev;
+}
+
+static void free_device(struct amdgpu_device *dev)
+{
+    amdgpu_vamgr_deinit(&dev->vamgr_32);
+    amdgpu_vamgr_deinit(&dev->vamgr);
+    free(dev);
+}
+
+static int range_alloc(struct worker *w, amdgpu_va_handle *handle)
+{
+    uint64_t va;
+
+    return amdgpu_va_range_alloc(w->dev, amdgpu_gpu_va_range_general,
+                                 PAGE + trace_size(&w->seed) % (1 << 20),
+                                 0, 0, &va, handle, 0);
+}
+
+/* Ranges passed between threads while they are running */
+#define MAILBOX 64
+static amdgpu_va_handle mailbox[MAILBOX];
+
+/* Fill our part of the table, then churn through it. */
+static void *worker_fill(void *data)
+{
+    struct worker *w = data;
+    unsigned i;
+
+    for (i = 0; i < PER_THREAD && !w->ret; i++)
+        w->ret = range_alloc(w, &w->own[i]);
+
+    for (i = 0; i < w->ops && !w->ret; i++) {
+        uint64_t r = next_random(&w->seed);
+        unsigned pick = r % PER_THREAD;
+
+        amdgpu_va_range_free(w->own[pick]);
+        w->ret = range_alloc(w, &w->own[pick]);
+
+        /* Trade one for whatever another thread left. */
+        if (!w->ret && (r >> 32) % 4 == 0)
+            w->own[pick] = __atomic_exchange_n(&mailbox[(r >> 40) % MAILBOX],
+                                               w->own[pick], __ATOMIC_ACQ_REL);
+    }
+    return NULL;
+}
+
+/* Free what another thread allocated. */
+static void *worker_drain(void *data)
+{
+    struct worker *w = data;
+    unsigned i;
+
+    for (i = 0; i < PER_THREAD; i++)
+        amdgpu_va_range_free(w->other[i]);
+    return NULL;
+}
+
+static int run_workers(struct worker *workers, void *(*func)(void *))
+{
+    unsigned i;
+
+    for (i = 0; i < THREADS; i++)
+        CHECK(pthread_create(&workers[i].thread, NULL, func,
+                             &workers[i]) == 0);
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(workers[i].thread, NULL);
+        CHECK(workers[i].ret == 0);
+    }
+    return 0;
+}
+
+static int test_threads(unsigned ops, bool slabs)
+{
+    struct amdgpu_va_fragmentation frag;
+    static amdgpu_va_handle handles[THREADS * PER_THREAD];
+    static struct range live[THREADS * PER_THREAD + MAILBOX];
+    struct worker workers[THREADS];
+    struct amdgpu_device *dev;
+    unsigned i, count;
+    double start;
+
+    dev = fake_device();
+    CHECK(dev);
+    dev->vamgr.slabs_enabled &= slabs;
+
+    for (i = 0; i < THREADS; i++) {
+        workers[i].dev = dev;
+        workers[i].ops = ops / THREADS;
+        workers[i].seed = 0x9e3779b97f4a7c15ull * (i + 1);
+        workers[i].own = &handles[i * PER_THREAD];
+        workers[i].other = &handles[(i + 1) % THREADS * PER_THREAD];
+        workers[i].ret = 0;
+    }
+
+    start = now();
+    CHECK(run_workers(workers, worker_fill) == 0);
+    start = now() - start;
+    printf("%u threads, %s slabs: %.0f ns/op\n", THREADS,
+           slabs ? "with" : "without", ops ? start * 1e9 / ops : 0);
+
+    for (i = 0, count = 0; i < THREADS * PER_THREAD + MAILBOX; i++) {
+        amdgpu_va_handle handle = i < THREADS * PER_THREAD ?
+            handles[i] : mailbox[i - THREADS * PER_THREAD];
+
+        if (handle) {
+            live[count].va = handle->address;
+            live[count++].size = handle->size;
+        }
+    }
+    CHECK(check_live(live, count) == 0);
+
+    /* With everything freed by threads that didn't allocate it, and the
+     * allocating threads gone, all slabs are back. */
+    CHECK(run_workers(workers, worker_drain) == 0);
+    for (i = 0; i < MAILBOX; i++) {
+        amdgpu_va_range_free(mailbox[i]);
+        mailbox[i] = NULL;
+    }
+    amdgpu_vamgr_query_fragmentation(&dev->vamgr, &frag);
+    CHECK(frag.holes == 0 && frag.unused_bytes == MAX - START);
+
+    free_device(dev);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 200000;
+    int ret;
+
+    ret = test_placement() ||
+          test_trace(ops) ||
+          test_threads(ops, false) ||
+          test_threads(ops, true);
+
+    printf("amdgpu vamgr: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
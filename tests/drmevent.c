@@ -0,0 +1,262 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+
+#include "util/common.h"
+
+/* The kernel's event queue is stood in for by a pipe, which like the drm
+ * fd returns as many queued bytes as fit. */
+static int fds[2];
+
+static int flips, sequences, vendor, unknown;
+static uint64_t last_sequence;
+
+static void flip_handler(int fd, const struct drm_event *event,
+                         uint64_t latency_ns, void *data)
+{
+    const struct drm_event_vblank *vblank = (const void *)event;
+
+    flips++;
+    /* Stamped a second ago. */
+    if (latency_ns < 1000000000ull || vblank->crtc_id != 42 ||
+        data != &flips)
+        flips = -1000;
+}
+
+static void sequence_handler(int fd, const struct drm_event *event,
+                             uint64_t latency_ns, void *data)
+{
+    const struct drm_event_crtc_sequence *seq = (const void *)event;
+
+    sequences++;
+    last_sequence = seq->sequence;
+}
+
+static void vendor_handler(int fd, const struct drm_event *event,
+                           uint64_t latency_ns, void *data)
+{
+    vendor++;
+    if (latency_ns != 0)
+        vendor = -1000;
+}
+
+static void default_handler(int fd, const struct drm_event *event,
+                            uint64_t latency_ns, void *data)
+{
+    unknown++;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void queue_flip(uint32_t sequence)
+{
+    struct drm_event_vblank vblank;
+    uint64_t stamp = now_ns() - 1000000000ull;
+
+    memset(&vblank, 0, sizeof(vblank));
+    vblank.base.type = DRM_EVENT_FLIP_COMPLETE;
+    vblank.base.length = sizeof(vblank);
+    vblank.tv_sec = stamp / 1000000000ull;
+    vblank.tv_usec = stamp % 1000000000ull / 1000;
+    vblank.sequence = sequence;
+    vblank.crtc_id = 42;
+    if (write(fds[1], &vblank, sizeof(vblank)) != sizeof(vblank))
+        abort();
+}
+
+static void queue_sequence(uint64_t sequence)
+{
+    struct drm_event_crtc_sequence seq;
+
+    memset(&seq, 0, sizeof(seq));
+    seq.base.type = DRM_EVENT_CRTC_SEQUENCE;
+    seq.base.length = sizeof(seq);
+    seq.time_ns = now_ns();
+    seq.sequence = sequence;
+    if (write(fds[1], &seq, sizeof(seq)) != sizeof(seq))
+        abort();
+}
+
+static void queue_raw(uint32_t type, uint32_t length)
+{
+    char buffer[64];
+    struct drm_event *e = (struct drm_event *)buffer;
+
+    memset(buffer, 0, sizeof(buffer));
+    e->type = type;
+    e->length = length;
+    if (write(fds[1], buffer, length) != (ssize_t)length)
+        abort();
+}
+
+static int test_dispatch(void)
+{
+    drmEventDispatcherPtr dispatcher = drmEventDispatcherCreate(0);
+    drmEventStats stats;
+    int i;
+
+    CHECK(dispatcher);
+    CHECK(drmEventDispatcherSetHandler(dispatcher, DRM_EVENT_FLIP_COMPLETE,
+                                       flip_handler, &flips) == 0);
+    CHECK(drmEventDispatcherSetHandler(dispatcher, DRM_EVENT_CRTC_SEQUENCE,
+                                       sequence_handler, NULL) == 0);
+    CHECK(drmEventDispatcherSetHandler(dispatcher, 0x80000001,
+                                       vendor_handler, NULL) == 0);
+    CHECK(drmEventDispatcherSetHandler(dispatcher, 0x40000000,
+                                       vendor_handler, NULL) == -EINVAL);
+
+    /* Nothing queued on a non-blocking fd. */
+    CHECK(drmEventDispatch(fds[0], dispatcher) == -EAGAIN);
+
+    /* Unhandled events are counted but do not stop the others. */
+    for (i = 0; i < 6; i++)
+        queue_flip(i);
+    queue_sequence(1ull << 40);
+    queue_raw(0x80000001, 16);
+    queue_raw(0x80000002, 24);
+    queue_raw(DRM_EVENT_VBLANK, 32);
+
+    CHECK(drmEventDispatch(fds[0], dispatcher) == 10);
+    CHECK(flips == 6);
+    CHECK(sequences == 1 && last_sequence == 1ull << 40);
+    CHECK(vendor == 1);
+
+    drmEventDispatcherGetStats(dispatcher, &stats);
+    CHECK(stats.count_reads == 1);
+    CHECK(stats.count_events == 10);
+    CHECK(stats.count_unhandled == 2);
+    CHECK(stats.max_latency_ns >= 1000000000ull);
+
+    /* Unknown types go to the default handler once there is one. */
+    CHECK(drmEventDispatcherSetHandler(dispatcher, DRM_EVENT_DEFAULT,
+                                       default_handler, NULL) == 0);
+    queue_raw(0x80000002, 24);
+    queue_raw(0x12345678, 8);
+    CHECK(drmEventDispatch(fds[0], dispatcher) == 2);
+    CHECK(unknown == 2);
+
+    drmEventDispatcherDestroy(dispatcher);
+    return 0;
+}
+
+static int test_drain(void)
+{
+    drmEventDispatcherPtr dispatcher = drmEventDispatcherCreate(2048);
+    drmEventStats stats;
+    int i;
+
+    CHECK(dispatcher);
+    CHECK(drmEventDispatcherSetHandler(dispatcher, DRM_EVENT_FLIP_COMPLETE,
+                                       flip_handler, &flips) == 0);
+
+    /* More than fits into the buffer at once: read until it is empty. */
+    flips = 0;
+    for (i = 0; i < 200; i++)
+        queue_flip(i);
+    CHECK(drmEventDispatch(fds[0], dispatcher) == 200);
+    CHECK(flips == 200);
+
+    drmEventDispatcherGetStats(dispatcher, &stats);
+    CHECK(stats.count_reads > 1);
+    CHECK(stats.count_events == 200);
+
+    drmEventDispatcherResetStats(dispatcher);
+    drmEventDispatcherGetStats(dispatcher, &stats);
+    CHECK(stats.count_events == 0);
+
+    /* A corrupt event is reported rather than looped on. */
+    queue_raw(DRM_EVENT_FLIP_COMPLETE, 4);
+    CHECK(drmEventDispatch(fds[0], dispatcher) == -EIO);
+
+    drmEventDispatcherDestroy(dispatcher);
+    return 0;
+}
+
+/* drm fds are blocking unless opened otherwise, a full buffer must not
+ * lead to another read with nothing queued. */
+static int test_blocking(void)
+{
+    drmEventDispatcherPtr dispatcher = drmEventDispatcherCreate(2048);
+    int i;
+
+    CHECK(dispatcher);
+    CHECK(drmEventDispatcherSetHandler(dispatcher, DRM_EVENT_FLIP_COMPLETE,
+                                       flip_handler, &flips) == 0);
+    CHECK(fcntl(fds[0], F_SETFL, 0) == 0);
+
+    /* A hang fails the test instead. */
+    alarm(10);
+
+    /* Exactly a buffer full. */
+    flips = 0;
+    for (i = 0; i < 2048 / (int)sizeof(struct drm_event_vblank); i++)
+        queue_flip(i);
+    CHECK(drmEventDispatch(fds[0], dispatcher) == i);
+    CHECK(flips == i);
+
+    /* Several buffers full. */
+    flips = 0;
+    for (i = 0; i < 200; i++)
+        queue_flip(i);
+    CHECK(drmEventDispatch(fds[0], dispatcher) == 200);
+    CHECK(flips == 200);
+
+    alarm(0);
+    CHECK(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+    drmEventDispatcherDestroy(dispatcher);
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+
+    if (pipe(fds) ||
+        fcntl(fds[0], F_SETFL, O_NONBLOCK)) {
+        perror("pipe");
+        return 1;
+    }
+
+    ret = test_dispatch() ||
+          test_drain() ||
+          test_blocking();
+
+    close(fds[0]);
+    close(fds[1]);
+
+    printf("event dispatch: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
@@ -56,35 +56,134 @@ static void print(void* list)
     }
 }
 
-static double do_time(int size, int iter)
+#ifdef DRM_SL_SKIP_LIST
+#define IMPLEMENTATION "skip list"
+#else
+#define IMPLEMENTATION "B+ tree"
+#endif
+
+static double elapsed(struct timeval *start)
 {
-    void           *list;
-    int            i, j;
-    unsigned long  keys[1000000];
-    unsigned long  previous;
-    unsigned long  key;
-    void           *value;
-    struct timeval start, stop;
-    double         usec;
-    void           *ranstate;
+    struct timeval stop;
+
+    gettimeofday(&stop, NULL);
+    return (double)(stop.tv_sec - start->tv_sec) +
+	   (double)(stop.tv_usec - start->tv_usec) / 1000000.0;
+}
 
+/* Insert, look up and delete keys in random order and compare against what
+ * has to be in the list.  The keys are unique, as multiplying by an odd
+ * number is a permutation. */
+static void check(int size)
+{
+    void          *list;
+    unsigned long *keys;
+    unsigned long key, previous;
+    void          *value;
+    int           i, count, first;
+
+    keys = malloc(size * sizeof(*keys));
     list = drmSLCreate();
-    ranstate = drmRandomCreate(12345);
 
     for (i = 0; i < size; i++) {
-	keys[i] = drmRandom(ranstate);
-	drmSLInsert(list, keys[i], NULL);
+	keys[i] = (i * 2654435761UL) & 0xffffffff;
+	if (drmSLInsert(list, keys[i], (void *)keys[i]) < 0) {
+	    fprintf(stderr, "Insert of %lu failed\n", keys[i]);
+	    exit(1);
+	}
     }
+    for (i = 0; i < size; i += 2)
+	drmSLDelete(list, keys[i]);
 
+    for (i = 0; i < size; i++) {
+	if (i % 2 == 0) {
+	    if (!drmSLLookup(list, keys[i], &value)) {
+		fprintf(stderr, "Deleted key %lu still found\n", keys[i]);
+		exit(1);
+	    }
+	} else if (drmSLLookup(list, keys[i], &value) ||
+		   value != (void *)keys[i]) {
+	    fprintf(stderr, "Key %lu not found\n", keys[i]);
+	    exit(1);
+	}
+    }
+
+    count = 0;
     previous = 0;
+    for (first = 1; first ? drmSLFirst(list, &key, &value) :
+			    drmSLNext(list, &key, &value); first = 0) {
+	if (count && key <= previous) {
+	    fprintf(stderr, "%lu !< %lu\n", previous, key);
+	    exit(1);
+	}
+	previous = key;
+	count++;
+	if (count % 7 == 0)	/* Modify behind the iteration */
+	    drmSLDelete(list, key);
+    }
+
+    for (i = 0; i < size; i++)
+	drmSLDelete(list, keys[i]);
     if (drmSLFirst(list, &key, &value)) {
+	fprintf(stderr, "List of %d keys not empty after deleting\n", size);
+	exit(1);
+    }
+    for (i = 0; i < size; i++)
+	drmSLInsert(list, keys[i], NULL);
+
+    count = 0;
+    if (drmSLFirstRange(list, 1UL << 30, 1UL << 31, &key, &value)) {
 	do {
-	    if (key <= previous) {
-		printf( "%lu !< %lu\n", previous, key);
+	    if (key < 1UL << 30 || key > 1UL << 31) {
+		fprintf(stderr, "Key %lu out of range\n", key);
+		exit(1);
 	    }
-	    previous = key;
+	    count++;
 	} while (drmSLNext(list, &key, &value));
     }
+    for (i = 0; i < size; i++)
+	if (keys[i] >= 1UL << 30 && keys[i] <= 1UL << 31)
+	    count--;
+    if (count) {
+	fprintf(stderr, "Range iteration is off by %d keys\n", count);
+	exit(1);
+    }
+
+    drmSLDestroy(list);
+    free(keys);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned long ka = *(const unsigned long *)a;
+    unsigned long kb = *(const unsigned long *)b;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+static void do_time(int size)
+{
+    void           *list;
+    int            i, j, iter;
+    unsigned long  *keys;
+    unsigned long  key;
+    void           *value;
+    struct timeval start;
+    double         insert, lookup, next, bulk, delete;
+    void           *ranstate;
+
+    keys = malloc(size * sizeof(*keys));
+    iter = size < 500000 ? 500000 / size : 1;
+
+    list = drmSLCreate();
+    ranstate = drmRandomCreate(12345);
+    for (i = 0; i < size; i++)
+	keys[i] = drmRandom(ranstate);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < size; i++)
+	drmSLInsert(list, keys[i], NULL);
+    insert = size / elapsed(&start);
 
     gettimeofday(&start, NULL);
     for (j = 0; j < iter; j++) {
@@ -93,17 +192,33 @@ static double do_time(int size, int iter)
 		printf("Error %lu %d\n", keys[i], i);
 	}
     }
-    gettimeofday(&stop, NULL);
+    lookup = (double)size * iter / elapsed(&start);
 
-    usec = (double)(stop.tv_sec * 1000000 + stop.tv_usec
-		    - start.tv_sec * 1000000 - start.tv_usec) / (size * iter);
+    gettimeofday(&start, NULL);
+    for (j = 0; j < iter; j++) {
+	if (drmSLFirst(list, &key, &value))
+	    while (drmSLNext(list, &key, &value));
+    }
+    next = (double)size * iter / elapsed(&start);
 
-    printf("%0.2f microseconds for list length %d\n", usec, size);
+    gettimeofday(&start, NULL);
+    for (i = 0; i < size; i++)
+	drmSLDelete(list, keys[i]);
+    delete = size / elapsed(&start);
+    drmSLDestroy(list);
 
-    drmRandomDouble(ranstate);
+    qsort(keys, size, sizeof(*keys), compare_keys);
+    list = drmSLCreate();
+    gettimeofday(&start, NULL);
+    drmSLInsertBulk(list, keys, NULL, size);
+    bulk = size / elapsed(&start);
     drmSLDestroy(list);
 
-    return usec;
+    printf("%8d %10.2f %10.2f %10.2f %10.2f %10.2f\n", size,
+	   insert / 1e6, lookup / 1e6, next / 1e6, bulk / 1e6, delete / 1e6);
+
+    drmRandomDestroy(ranstate);
+    free(keys);
 }
 
 static void print_neighbors(void *list, unsigned long key,
@@ -133,10 +248,11 @@ static void print_neighbors(void *list, unsigned long key,
     }
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
+    int      max = argc > 1 ? atoi(argv[1]) : 100000;
+    int      size;
     void*    list;
-    double   usec, usec2, usec3, usec4;
 
     list = drmSLCreate();
     printf( "list at %p\n", list);
@@ -167,18 +283,15 @@ int main(void)
     drmSLDestroy(list);
     printf("\n==============================\n\n");
 
-    usec  = do_time(100, 10000);
-    usec2 = do_time(1000, 500);
-    printf("Table size increased by %0.2f, search time increased by %0.2f\n",
-	   1000.0/100.0, usec2 / usec);
-
-    usec3 = do_time(10000, 50);
-    printf("Table size increased by %0.2f, search time increased by %0.2f\n",
-	   10000.0/100.0, usec3 / usec);
+    check(100);
+    check(10000);
+    check(100000);
 
-    usec4 = do_time(100000, 4);
-    printf("Table size increased by %0.2f, search time increased by %0.2f\n",
-	   100000.0/100.0, usec4 / usec);
+    printf("%s, millions of operations per second:\n", IMPLEMENTATION);
+    printf("    keys     insert     lookup       next       bulk     delete\n");
+    /* Pass a larger number of keys as the argument to go further. */
+    for (size = 1000; size <= max; size *= 10)
+	do_time(size);
 
     return 0;
 }
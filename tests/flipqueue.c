@@ -0,0 +1,233 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#include "util/common.h"
+
+#define MS 1000000ull
+#define PERIOD 16667000ull /* microsecond time stamps */
+
+/* The fake vblank clock, and what the last flip ioctl asked for. */
+static uint64_t now;
+static struct drm_mode_crtc_page_flip_target last_flip;
+static struct drm_mode_atomic last_atomic;
+
+static int completions;
+static void *last_user_data;
+static uint64_t last_sequence;
+
+static uint64_t fake_clock(void *data)
+{
+    return now;
+}
+
+static int flip_ioctl(void *priv, int fd, unsigned long request, void *arg)
+{
+    switch (request) {
+    case DRM_IOCTL_MODE_PAGE_FLIP:
+        last_flip = *(struct drm_mode_crtc_page_flip_target *)arg;
+        return 0;
+    case DRM_IOCTL_MODE_ATOMIC:
+        last_atomic = *(struct drm_mode_atomic *)arg;
+        return 0;
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+static const drmIoctlBackend flip_backend = {
+    .ioctl = flip_ioctl,
+};
+
+static void flip_done(uint32_t crtc_id, uint64_t sequence, uint64_t time_ns,
+                      void *user_data)
+{
+    completions++;
+    last_sequence = sequence;
+    last_user_data = user_data;
+}
+
+static int app_events;
+
+static void app_handler(int fd, const struct drm_event *event,
+                        uint64_t latency_ns, void *data)
+{
+    app_events++;
+}
+
+static struct drm_event_vblank flip_event(uint32_t crtc_id, uint32_t sequence,
+                                          uint64_t time_ns)
+{
+    struct drm_event_vblank vblank;
+
+    memset(&vblank, 0, sizeof(vblank));
+    vblank.base.type = DRM_EVENT_FLIP_COMPLETE;
+    vblank.base.length = sizeof(vblank);
+    vblank.user_data = crtc_id;
+    vblank.crtc_id = crtc_id;
+    vblank.sequence = sequence;
+    vblank.tv_sec = time_ns / 1000000000ull;
+    vblank.tv_usec = time_ns % 1000000000ull / 1000;
+    return vblank;
+}
+
+static int complete(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+                    uint32_t sequence, uint64_t time_ns)
+{
+    struct drm_event_vblank vblank = flip_event(crtc_id, sequence, time_ns);
+
+    return drmModeFlipQueueHandleEvent(queue, &vblank.base);
+}
+
+static int test_pacing(void)
+{
+    drmModeFlipQueuePtr queue;
+    drmModeFlipStats stats;
+    uint64_t sequence, time_ns, base = 1000 * MS;
+    int cookie;
+
+    queue = drmModeFlipQueueCreate(-1, NULL, flip_done, NULL);
+    CHECK(queue);
+    drmModeFlipQueueSetClock(queue, fake_clock, NULL);
+
+    now = base;
+    CHECK(drmModeFlipQueuePredict(queue, 7, &sequence, NULL) == -EAGAIN);
+    CHECK(drmModeFlipQueueFlip(queue, 7, 70, 0, &cookie) == 0);
+    CHECK(last_flip.crtc_id == 7 && last_flip.fb_id == 70);
+    CHECK(last_flip.flags == DRM_MODE_PAGE_FLIP_EVENT);
+    CHECK(drmModeFlipQueuePending(queue, 7) == 1);
+    CHECK(drmModeFlipQueueFlip(queue, 7, 71, 0, NULL) == -EBUSY);
+
+    /* Other CRTCs and stray events are left alone. */
+    CHECK(complete(queue, 8, 100, base + 10 * MS) == 0);
+    CHECK(complete(queue, 7, 100, base + 10 * MS) == 1);
+    CHECK(completions == 1 && last_user_data == &cookie);
+    CHECK(drmModeFlipQueuePending(queue, 7) == 0);
+
+    /* A second completion is enough to learn the refresh. */
+    now = base + 12 * MS;
+    CHECK(drmModeFlipQueueFlip(queue, 7, 71, 0, NULL) == 0);
+    CHECK(complete(queue, 7, 101, base + 10 * MS + PERIOD) == 1);
+
+    now = base + 30 * MS;
+    CHECK(drmModeFlipQueuePredict(queue, 7, &sequence, &time_ns) == 0);
+    CHECK(sequence == 102);
+    CHECK(time_ns == base + 10 * MS + 2 * PERIOD);
+
+    /* Expected on 102 but landed on 104. */
+    CHECK(drmModeFlipQueueFlip(queue, 7, 72, 0, NULL) == 0);
+    CHECK(complete(queue, 7, 104, base + 10 * MS + 4 * PERIOD) == 1);
+
+    CHECK(drmModeFlipQueueGetStats(queue, 7, &stats) == 0);
+    CHECK(stats.count_flips == 3);
+    CHECK(stats.count_missed == 2);
+    CHECK(stats.period_ns == PERIOD);
+    CHECK(stats.max_latency_ns == 10 * MS + 4 * PERIOD - 30 * MS);
+
+    /* Targeted flips go through drmModePageFlipTarget(). */
+    CHECK(drmModeFlipQueueFlip(queue, 7, 73, 110, NULL) == 0);
+    CHECK(last_flip.flags == (DRM_MODE_PAGE_FLIP_EVENT |
+                              DRM_MODE_PAGE_FLIP_TARGET_ABSOLUTE));
+    CHECK(last_flip.sequence == 110);
+    CHECK(complete(queue, 7, 110, base + 10 * MS + 10 * PERIOD) == 1);
+    CHECK(last_sequence == 110);
+    CHECK(drmModeFlipQueueGetStats(queue, 7, &stats) == 0);
+    CHECK(stats.count_missed == 2);
+    CHECK(drmModeFlipQueueGetStats(queue, 9, &stats) == -ENOENT);
+
+    drmModeFlipQueueDestroy(queue);
+    return 0;
+}
+
+static int test_atomic(void)
+{
+    drmEventDispatcherPtr dispatcher = drmEventDispatcherCreate(0);
+    drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+    struct drm_event_vblank vblank;
+    drmModeFlipQueuePtr queue;
+    int fds[2];
+
+    CHECK(dispatcher && req);
+    CHECK(pipe(fds) == 0);
+    CHECK(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+
+    queue = drmModeFlipQueueCreate(-1, dispatcher, flip_done, NULL);
+    CHECK(queue);
+    drmModeFlipQueueSetClock(queue, fake_clock, NULL);
+
+    drmModeAtomicAddProperty(req, 5, 1, 2);
+    CHECK(drmModeFlipQueueCommit(queue, 5, req, 0, req) == 0);
+    CHECK(last_atomic.flags == (DRM_MODE_ATOMIC_NONBLOCK |
+                                DRM_MODE_PAGE_FLIP_EVENT));
+    CHECK(last_atomic.user_data == 5);
+    CHECK(drmModeFlipQueueCommit(queue, 5, req, 0, NULL) == -EBUSY);
+
+    /* Older kernels leave crtc_id at 0, the user data still finds it. */
+    completions = 0;
+    vblank = flip_event(5, 1, now);
+    vblank.crtc_id = 0;
+    CHECK(write(fds[1], &vblank, sizeof(vblank)) == sizeof(vblank));
+    CHECK(drmEventDispatch(fds[0], dispatcher) == 1);
+    CHECK(completions == 1 && last_user_data == req);
+    CHECK(drmModeFlipQueuePending(queue, 5) == 0);
+
+    /* Destroying the queue keeps a handler set after its own. */
+    CHECK(drmEventDispatcherSetHandler(dispatcher, DRM_EVENT_FLIP_COMPLETE,
+                                       app_handler, NULL) == 0);
+    drmModeFlipQueueDestroy(queue);
+    CHECK(write(fds[1], &vblank, sizeof(vblank)) == sizeof(vblank));
+    CHECK(drmEventDispatch(fds[0], dispatcher) == 1);
+    CHECK(app_events == 1 && completions == 1);
+
+    close(fds[0]);
+    close(fds[1]);
+    drmModeAtomicFree(req);
+    drmEventDispatcherDestroy(dispatcher);
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+
+    if (drmSetIoctlBackend(&flip_backend)) {
+        fprintf(stderr, "failed to install the flip backend\n");
+        return 1;
+    }
+
+    ret = test_pacing() ||
+          test_atomic();
+
+    drmSetIoctlBackend(NULL);
+
+    printf("flip queue: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
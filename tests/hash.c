@@ -68,6 +68,7 @@
  *
  */
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -103,19 +104,16 @@ static void update_dist(int count)
 
 static void compute_dist(HashTablePtr table)
 {
-    int           i;
-    HashBucketPtr bucket;
+    unsigned long i, size = atomic_read(&table->size);
 
-    printf("Entries = %ld, hits = %ld, partials = %ld, misses = %ld\n",
-          table->entries, table->hits, table->partials, table->misses);
+    printf("Entries = %d, buckets = %lu\n",
+          atomic_read(&table->entries), size);
     clear_dist();
-    for (i = 0; i < HASH_SIZE; i++) {
-        bucket = table->buckets[i];
-        update_dist(count_entries(bucket));
-    }
+    for (i = 0; i < size; i++)
+        update_dist(count_entries(*HashSlot(table, i)));
     for (i = 0; i < DIST_LIMIT; i++) {
         if (i != DIST_LIMIT-1)
-            printf("%5d %10d\n", i, dist[i]);
+            printf("%5lu %10d\n", i, dist[i]);
         else
             printf("other %10d\n", dist[i]);
     }
@@ -152,6 +150,109 @@ static int check_table(HashTablePtr table,
     return retcode;
 }
 
+/* Every key present for the whole iteration must be returned exactly once,
+ * while keys inserted meanwhile keep splitting buckets. */
+static int check_iteration(void)
+{
+    HashTablePtr  table;
+    unsigned long i, key;
+    void          *value;
+    char          *seen;
+    int           ret = 0, count = 0, more;
+
+    printf("\n***** iteration while inserting ****\n");
+    seen  = calloc(3000, 1);
+    table = drmHashCreate();
+    for (i = 0; i < 1000; i++)
+        drmHashInsert(table, i, (void *)i);
+
+    for (more = drmHashFirst(table, &key, &value); more == 1;
+         more = drmHashNext(table, &key, &value)) {
+        if (key >= 3000 || (unsigned long)value != key || seen[key]++) {
+            printf("Bad key = %lu, value = %p\n", key, value);
+            ret = -1;
+        }
+        count++;
+        if (i < 3000) {
+            drmHashInsert(table, i, (void *)i);
+            i++;
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        if (!seen[i]) {
+            printf("Not iterated: key = %lu\n", i);
+            ret = -1;
+        }
+    }
+    printf("Iterated %d of %d entries\n", count, atomic_read(&table->entries));
+    compute_dist(table);
+    drmHashDestroy(table);
+    free(seen);
+    return ret;
+}
+
+#define THREADS 4
+#define THREAD_KEYS 20000
+
+struct thread_data {
+    pthread_t     thread;
+    HashTablePtr  table;
+    unsigned long base;
+    int           ret;
+};
+
+static void *insert_thread(void *arg)
+{
+    struct thread_data *data = arg;
+    unsigned long      i, key;
+    void               *value;
+
+    for (i = 0; i < THREAD_KEYS; i++) {
+        if (drmHashInsert(data->table, data->base + i, (void *)i))
+            data->ret = -1;
+
+        /* Every third key is deleted right away. */
+        key = i / 2;
+        if (key % 3 && (drmHashLookup(data->table, data->base + key, &value) ||
+                        (unsigned long)value != key))
+            data->ret = -1;
+        if (i % 3 == 0 && drmHashDelete(data->table, data->base + i))
+            data->ret = -1;
+    }
+    return NULL;
+}
+
+static int check_threads(void)
+{
+    struct thread_data data[THREADS];
+    HashTablePtr       table;
+    int                i, ret = 0;
+
+    printf("\n***** %d threads inserting %d keys each ****\n",
+           THREADS, THREAD_KEYS);
+    table = drmHashCreate();
+    for (i = 0; i < THREADS; i++) {
+        data[i].table = table;
+        data[i].base  = (unsigned long)i * THREAD_KEYS;
+        data[i].ret   = 0;
+        pthread_create(&data[i].thread, NULL, insert_thread, &data[i]);
+    }
+    for (i = 0; i < THREADS; i++) {
+        pthread_join(data[i].thread, NULL);
+        if (data[i].ret) {
+            printf("Thread %d failed\n", i);
+            ret = -1;
+        }
+    }
+    if (atomic_read(&table->entries) != THREADS * (THREAD_KEYS * 2 / 3)) {
+        printf("Bad entries = %d\n", atomic_read(&table->entries));
+        ret = -1;
+    }
+    compute_dist(table);
+    drmHashDestroy(table);
+    return ret;
+}
+
 int main(void)
 {
     HashTablePtr  table;
@@ -213,5 +314,8 @@ int main(void)
     compute_dist(table);
     drmHashDestroy(table);
 
+    ret |= check_iteration();
+    ret |= check_threads();
+
     return ret;
 }
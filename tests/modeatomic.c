@@ -0,0 +1,1026 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#include "util/common.h"
+
+#define U642VOID(x) ((void *)(unsigned long)(x))
+
+/* The last atomic commit seen by the backend. */
+static struct drm_mode_atomic last;
+static uint32_t objs[64], count_props[64], props[64];
+static uint64_t values[64];
+
+static int atomic_commits, fail_atomic;
+/* Commits touching this object fail, 0 for none, with EINVAL unless
+ * reject_error says otherwise. */
+static uint32_t reject_object;
+static int reject_error;
+
+static int capture_ioctl(void *priv, int fd, unsigned long request, void *arg)
+{
+    struct drm_mode_atomic *atomic = arg;
+    uint32_t i, total = 0;
+
+    if (request != DRM_IOCTL_MODE_ATOMIC) {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    atomic_commits++;
+    if (fail_atomic) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (i = 0; reject_object && i < atomic->count_objs; i++) {
+        if (((uint32_t *)U642VOID(atomic->objs_ptr))[i] == reject_object) {
+            errno = reject_error ? reject_error : EINVAL;
+            return -1;
+        }
+    }
+
+    last = *atomic;
+    memcpy(objs, U642VOID(atomic->objs_ptr), atomic->count_objs * sizeof(objs[0]));
+    memcpy(count_props, U642VOID(atomic->count_props_ptr),
+           atomic->count_objs * sizeof(count_props[0]));
+    for (i = 0; i < atomic->count_objs; i++)
+        total += count_props[i];
+    memcpy(props, U642VOID(atomic->props_ptr), total * sizeof(props[0]));
+    memcpy(values, U642VOID(atomic->prop_values_ptr), total * sizeof(values[0]));
+    return 0;
+}
+
+static const drmIoctlBackend capture_backend = {
+    .ioctl = capture_ioctl,
+};
+
+/* A tiny KMS device: crtc 10, connector 20 and plane 30 are listed by the
+ * resource ioctls, connector 40 is only found by id. */
+struct fake_object {
+    uint32_t id;
+    uint32_t count_props;
+    uint32_t props[2];
+};
+
+static const struct fake_object fake_objects[] = {
+    { 10, 2, { 1, 2 } },
+    { 20, 1, { 3 } },
+    { 30, 2, { 4, 3 } },
+    { 40, 1, { 3 } },
+};
+
+static const char *const fake_prop_names[] = {
+    NULL, "ACTIVE", "MODE_ID", "CRTC_ID", "FB_ID", "CRTC_X", "OUT_FENCE_PTR",
+};
+
+static int getproperty_calls, getproperties_calls;
+
+/* Connector 20 gains a mode after its next GETCONNECTOR while this is set. */
+static int hotplug_pending;
+static uint32_t connector_modes = 2;
+static int connector_probes;
+static uint32_t connector_connection = DRM_MODE_CONNECTED;
+static uint32_t crtc_fb = 60;
+static uint32_t next_blob = 1000;
+static int blobs_created, blobs_destroyed;
+
+static int kms_ioctl(void *priv, int fd, unsigned long request, void *arg)
+{
+    unsigned int i;
+
+    switch (request) {
+    case DRM_IOCTL_MODE_GETRESOURCES: {
+        struct drm_mode_card_res *res = arg;
+
+        if (res->count_crtcs >= 1 && res->crtc_id_ptr)
+            *(uint32_t *)U642VOID(res->crtc_id_ptr) = 10;
+        if (res->count_connectors >= 1 && res->connector_id_ptr)
+            *(uint32_t *)U642VOID(res->connector_id_ptr) = 20;
+        if (res->count_encoders >= 1 && res->encoder_id_ptr)
+            *(uint32_t *)U642VOID(res->encoder_id_ptr) = 50;
+        res->count_crtcs = 1;
+        res->count_connectors = 1;
+        res->count_encoders = 1;
+        res->count_fbs = 0;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_GETCONNECTOR: {
+        struct drm_mode_get_connector *conn = arg;
+        struct drm_mode_modeinfo *modes = U642VOID(conn->modes_ptr);
+
+        if (conn->connector_id != 20)
+            break;
+        if (!conn->count_modes)
+            connector_probes++;
+        if (conn->count_modes >= connector_modes) {
+            for (i = 0; i < connector_modes; i++) {
+                memset(&modes[i], 0, sizeof(modes[i]));
+                modes[i].hdisplay = 640 * (i + 1);
+            }
+        }
+        if (conn->count_encoders >= 1)
+            *(uint32_t *)U642VOID(conn->encoders_ptr) = 50;
+        if (conn->count_props >= 1) {
+            *(uint32_t *)U642VOID(conn->props_ptr) = 3;
+            *(uint64_t *)U642VOID(conn->prop_values_ptr) = 10;
+        }
+        conn->count_modes = connector_modes;
+        conn->count_encoders = 1;
+        conn->count_props = 1;
+        conn->encoder_id = 50;
+        conn->connection = connector_connection;
+        conn->subpixel = 0;
+        if (hotplug_pending) {
+            hotplug_pending = 0;
+            connector_modes++;
+        }
+        return 0;
+    }
+    case DRM_IOCTL_MODE_GETENCODER: {
+        struct drm_mode_get_encoder *enc = arg;
+
+        if (enc->encoder_id != 50)
+            break;
+        enc->crtc_id = 10;
+        enc->possible_crtcs = 1;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_GETCRTC: {
+        struct drm_mode_crtc *crtc = arg;
+
+        if (crtc->crtc_id != 10)
+            break;
+        memset(&crtc->mode, 0, sizeof(crtc->mode));
+        crtc->mode.hdisplay = 1920;
+        crtc->mode.vdisplay = 1080;
+        crtc->mode_valid = 1;
+        crtc->fb_id = crtc_fb;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_GETPLANE: {
+        struct drm_mode_get_plane *plane = arg;
+
+        if (plane->plane_id != 30)
+            break;
+        if (plane->count_format_types >= 2) {
+            uint32_t *formats = U642VOID(plane->format_type_ptr);
+
+            formats[0] = 0x34325258;
+            formats[1] = 0x34325241;
+        }
+        plane->count_format_types = 2;
+        plane->possible_crtcs = 1;
+        plane->crtc_id = 10;
+        plane->fb_id = 60;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_GETPLANERESOURCES: {
+        struct drm_mode_get_plane_res *res = arg;
+
+        if (res->count_planes >= 1 && res->plane_id_ptr)
+            *(uint32_t *)U642VOID(res->plane_id_ptr) = 30;
+        res->count_planes = 1;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_OBJ_GETPROPERTIES: {
+        struct drm_mode_obj_get_properties *get = arg;
+
+        /* drmModeObjectGetProperties() asks twice, count it once. */
+        if (!get->count_props)
+            getproperties_calls++;
+        for (i = 0; i < sizeof(fake_objects) / sizeof(fake_objects[0]); i++) {
+            const struct fake_object *obj = &fake_objects[i];
+
+            if (obj->id != get->obj_id)
+                continue;
+            if (get->count_props >= obj->count_props) {
+                memcpy(U642VOID(get->props_ptr), obj->props,
+                       obj->count_props * sizeof(uint32_t));
+                memset(U642VOID(get->prop_values_ptr), 0,
+                       obj->count_props * sizeof(uint64_t));
+            }
+            get->count_props = obj->count_props;
+            return 0;
+        }
+        break;
+    }
+    case DRM_IOCTL_MODE_GETPROPERTY: {
+        struct drm_mode_get_property *prop = arg;
+
+        getproperty_calls++;
+        if (prop->prop_id == 0 || prop->prop_id >= ARRAY_SIZE(fake_prop_names))
+            break;
+        strcpy(prop->name, fake_prop_names[prop->prop_id]);
+        prop->flags = DRM_MODE_PROP_RANGE;
+        prop->count_values = 0;
+        prop->count_enum_blobs = 0;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_CREATEPROPBLOB: {
+        struct drm_mode_create_blob *create = arg;
+
+        blobs_created++;
+        create->blob_id = next_blob++;
+        return 0;
+    }
+    case DRM_IOCTL_MODE_DESTROYPROPBLOB:
+        blobs_destroyed++;
+        return 0;
+    case DRM_IOCTL_MODE_ATOMIC:
+        return capture_ioctl(priv, fd, request, arg);
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+static const drmIoctlBackend kms_backend = {
+    .ioctl = kms_ioctl,
+};
+
+static int test_property_cache(void)
+{
+    drmModePropertyCachePtr cache;
+    drmModeAtomicReqPtr req;
+
+    drmSetIoctlBackend(&kms_backend);
+
+    cache = drmModePropertyCacheCreate(-1);
+    CHECK(cache);
+    /* Three objects, each property id named once. */
+    CHECK(getproperties_calls == 3);
+    CHECK(getproperty_calls == 4);
+
+    CHECK(drmModePropertyCacheGetId(cache, 10, "ACTIVE") == 1);
+    CHECK(drmModePropertyCacheGetId(cache, 10, "MODE_ID") == 2);
+    CHECK(drmModePropertyCacheGetId(cache, 20, "CRTC_ID") == 3);
+    CHECK(drmModePropertyCacheGetId(cache, 30, "CRTC_ID") == 3);
+    CHECK(drmModePropertyCacheGetId(cache, 30, "FB_ID") == 4);
+    CHECK(drmModePropertyCacheGetId(cache, 20, "FB_ID") == -ENOENT);
+    CHECK(drmModePropertyCacheGetId(cache, 10, "NOPE") == -ENOENT);
+    CHECK(getproperties_calls == 3 && getproperty_calls == 4);
+
+    /* Unlisted objects are fetched on first use, and only once. */
+    CHECK(drmModePropertyCacheGetId(cache, 40, "CRTC_ID") == 3);
+    CHECK(drmModePropertyCacheGetId(cache, 40, "ACTIVE") == -ENOENT);
+    CHECK(getproperties_calls == 4 && getproperty_calls == 4);
+
+    /* Invalidation refetches objects but not property names. */
+    drmModePropertyCacheInvalidate(cache);
+    CHECK(drmModePropertyCacheGetId(cache, 30, "FB_ID") == 4);
+    CHECK(getproperties_calls == 5 && getproperty_calls == 4);
+    CHECK(drmModePropertyCacheGetId(cache, 99, "ACTIVE") == -EINVAL);
+
+    req = drmModeAtomicAlloc();
+    CHECK(req);
+    CHECK(drmModeAtomicAddPropertyByName(req, cache, 10, "ACTIVE", 1) >= 0);
+    CHECK(drmModeAtomicAddPropertyByName(req, cache, 30, "FB_ID", 7) >= 0);
+    CHECK(drmModeAtomicAddPropertyByName(req, cache, 30, "BOGUS", 7) == -ENOENT);
+    CHECK(drmModeAtomicCommit(-1, req, 0, NULL) == 0);
+    CHECK(last.count_objs == 2);
+    CHECK(objs[0] == 10 && props[0] == 1 && values[0] == 1);
+    CHECK(objs[1] == 30 && props[1] == 4 && values[1] == 7);
+
+    drmModeAtomicFree(req);
+    drmModePropertyCacheFree(cache);
+    return 0;
+}
+
+static int test_snapshot(void)
+{
+    drmModeSnapshotPtr snap;
+    drmModeConnectorPtr conn;
+
+    drmSetIoctlBackend(&kms_backend);
+
+    snap = drmModeGetSnapshot(-1, DRM_MODE_SNAPSHOT_PROPERTIES);
+    CHECK(snap);
+    CHECK(connector_probes == 0);
+
+    CHECK(snap->res.count_connectors == 1 && snap->res.connectors[0] == 20);
+    CHECK(snap->res.count_encoders == 1 && snap->res.encoders[0] == 50);
+    CHECK(snap->res.count_crtcs == 1 && snap->res.crtcs[0] == 10);
+    CHECK(snap->res.count_fbs == 0 && !snap->res.fbs);
+
+    conn = &snap->connectors[0];
+    CHECK(conn->connector_id == 20 && conn->encoder_id == 50);
+    CHECK(conn->connection == DRM_MODE_CONNECTED);
+    CHECK(conn->subpixel == DRM_MODE_SUBPIXEL_UNKNOWN);
+    CHECK(conn->count_modes == 2);
+    CHECK(conn->modes[0].hdisplay == 640 && conn->modes[1].hdisplay == 1280);
+    CHECK(conn->count_encoders == 1 && conn->encoders[0] == 50);
+    CHECK(conn->count_props == 1 && conn->props[0] == 3 &&
+          conn->prop_values[0] == 10);
+
+    CHECK(snap->encoders[0].encoder_id == 50 && snap->encoders[0].crtc_id == 10);
+    CHECK(snap->crtcs[0].crtc_id == 10 && snap->crtcs[0].mode_valid);
+    CHECK(snap->crtcs[0].width == 1920 && snap->crtcs[0].height == 1080);
+    CHECK(snap->crtcs[0].buffer_id == 60);
+    CHECK(snap->crtc_props[0].count_props == 2);
+    CHECK(snap->crtc_props[0].props[0] == 1 && snap->crtc_props[0].props[1] == 2);
+
+    CHECK(snap->count_planes == 1);
+    CHECK(snap->planes[0].plane_id == 30 && snap->planes[0].count_formats == 2);
+    CHECK(snap->planes[0].formats[1] == 0x34325241);
+    CHECK(snap->plane_props[0].count_props == 2);
+    CHECK(snap->plane_props[0].props[0] == 4);
+    drmModeFreeSnapshot(snap);
+
+    /* A mode showing up between the two passes forces another round. */
+    hotplug_pending = 1;
+    snap = drmModeGetSnapshot(-1, DRM_MODE_SNAPSHOT_PROBE);
+    CHECK(snap);
+    CHECK(connector_probes == 2);
+    CHECK(snap->connectors[0].count_modes == 3);
+    CHECK(snap->connectors[0].modes[2].hdisplay == 1920);
+    CHECK(!snap->crtc_props && !snap->plane_props);
+    drmModeFreeSnapshot(snap);
+
+    return 0;
+}
+
+struct counting_allocator {
+    int live;
+};
+
+static void *counting_malloc(void *priv, size_t size)
+{
+    struct counting_allocator *a = priv;
+
+    a->live++;
+    return malloc(size);
+}
+
+static void *counting_calloc(void *priv, size_t nmemb, size_t size)
+{
+    struct counting_allocator *a = priv;
+
+    a->live++;
+    return calloc(nmemb, size);
+}
+
+static void *counting_realloc(void *priv, void *ptr, size_t size)
+{
+    struct counting_allocator *a = priv;
+
+    if (!ptr)
+        a->live++;
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *priv, void *ptr)
+{
+    struct counting_allocator *a = priv;
+
+    a->live--;
+    free(ptr);
+}
+
+/* Bump allocator that is only ever reset as a whole. */
+struct arena {
+    char buffer[16384];
+    size_t used;
+};
+
+static void *arena_malloc(void *priv, size_t size)
+{
+    struct arena *arena = priv;
+    void *ptr;
+
+    size = (size + 15) & ~(size_t)15;
+    if (arena->used + size > sizeof(arena->buffer))
+        return NULL;
+
+    ptr = arena->buffer + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+static int test_allocator(void)
+{
+    static struct counting_allocator counts;
+    static struct arena arena_storage;
+    const drmAllocator allocator = {
+        counting_malloc, counting_calloc, counting_realloc, counting_free,
+        &counts
+    };
+    const drmAllocator arena = {
+        arena_malloc, NULL, NULL, NULL, &arena_storage
+    };
+    const drmAllocator incomplete = {
+        counting_malloc, NULL, counting_realloc, counting_free, &counts
+    };
+    drmModeSnapshotPtr snap, other;
+    drmModePropertyCachePtr cache;
+    drmModeConnectorPtr conn;
+    drmModeAtomicReqPtr req;
+
+    drmSetIoctlBackend(&kms_backend);
+
+    CHECK(drmSetAllocator(&incomplete) == -EINVAL);
+    CHECK(drmSetAllocator(&allocator) == 0);
+
+    conn = drmModeGetConnector(-1, 20);
+    CHECK(conn && counts.live == 1);
+    drmModeFreeConnector(conn);
+    CHECK(counts.live == 0);
+
+    /* libdrm's own state does not come from the allocator, so it can
+     * outlive it. */
+    req = drmModeAtomicAlloc();
+    cache = drmModePropertyCacheCreate(-1);
+    CHECK(req && cache);
+    CHECK(drmModeAtomicAddProperty(req, 10, 1, 1) >= 0);
+    CHECK(drmModePropertyCacheGetId(cache, 20, "CRTC_ID") == 3);
+    CHECK(counts.live == 0);
+
+    snap = drmModeGetSnapshot(-1, DRM_MODE_SNAPSHOT_PROPERTIES);
+    CHECK(snap && counts.live == 1);
+
+    /* Only scratch memory of the arena snapshot comes from the global
+     * allocator, and freeing the snapshot itself is left to the arena. */
+    other = drmModeGetSnapshotArena(-1, DRM_MODE_SNAPSHOT_PROPERTIES, &arena);
+    CHECK(other && (char *)other == arena_storage.buffer);
+    CHECK(arena_storage.used > sizeof(*other));
+    CHECK(other->connectors[0].modes[1].hdisplay ==
+          snap->connectors[0].modes[1].hdisplay);
+    CHECK(other->plane_props[0].props[0] == 4);
+    drmModeFreeSnapshot(other);
+    CHECK(counts.live == 1);
+    arena_storage.used = 0;
+
+    drmModeFreeSnapshot(snap);
+    CHECK(counts.live == 0);
+
+    CHECK(drmSetAllocator(NULL) == 0);
+    drmModePropertyCacheFree(cache);
+    drmModeAtomicFree(req);
+    return 0;
+}
+
+static int test_hotplug(void)
+{
+    drmModeHotplugStatePtr state;
+    const drmModeHotplugChange *changes;
+    int probes;
+
+    drmSetIoctlBackend(&kms_backend);
+
+    state = drmModeHotplugStateCreate(-1);
+    CHECK(state);
+    probes = connector_probes;
+    CHECK(drmModeHotplugStateGetEpoch(state) == 0);
+
+    /* Nothing changed: nothing reported and nothing probed. */
+    CHECK(drmModeHotplugUpdate(-1, state, &changes) == 0);
+    CHECK(!changes);
+    CHECK(connector_probes == probes);
+    CHECK(drmModeHotplugStateGetEpoch(state) == 0);
+
+    /* Unplugging probes the one connector whose status changed. */
+    connector_connection = DRM_MODE_DISCONNECTED;
+    CHECK(drmModeHotplugUpdate(-1, state, &changes) == 1);
+    CHECK(connector_probes == probes + 1);
+    CHECK(changes[0].object_type == DRM_MODE_OBJECT_CONNECTOR);
+    CHECK(changes[0].object_id == 20);
+    CHECK(changes[0].flags == DRM_MODE_HOTPLUG_CONNECTION);
+    CHECK(drmModeHotplugStateGetEpoch(state) == 1);
+    CHECK(drmModeHotplugStateGetSnapshot(state)->connectors[0].connection ==
+          DRM_MODE_DISCONNECTED);
+
+    /* A new mode without a status change is noticed but not probed for. */
+    connector_modes++;
+    crtc_fb = 61;
+    CHECK(drmModeHotplugUpdate(-1, state, &changes) == 2);
+    CHECK(connector_probes == probes + 1);
+    CHECK(changes[0].object_id == 20 &&
+          changes[0].flags == DRM_MODE_HOTPLUG_MODES);
+    CHECK(changes[1].object_type == DRM_MODE_OBJECT_CRTC &&
+          changes[1].object_id == 10 &&
+          changes[1].flags == DRM_MODE_HOTPLUG_STATE);
+    CHECK(drmModeHotplugStateGetEpoch(state) == 2);
+
+    drmModeHotplugStateFree(state);
+    return 0;
+}
+
+static int test_blob_cache(void)
+{
+    drmModeBlobCachePtr cache;
+    drmModeBlobCacheStats stats;
+    static uint16_t lut[3][4096];
+    uint32_t a, b, c, d;
+
+    drmSetIoctlBackend(&kms_backend);
+
+    cache = drmModeBlobCacheCreate(-1);
+    CHECK(cache);
+
+    memset(lut, 0, sizeof(lut));
+    lut[1][4095] = 1;
+
+    CHECK(drmModeBlobCacheGet(cache, lut, sizeof(lut), &a) == 0);
+    CHECK(drmModeBlobCacheGet(cache, lut, sizeof(lut), &b) == 0);
+    CHECK(a == b);
+    CHECK(blobs_created == 1);
+
+    /* Different contents, or just a different length, is another blob. */
+    lut[2][0] = 7;
+    CHECK(drmModeBlobCacheGet(cache, lut, sizeof(lut), &c) == 0);
+    CHECK(drmModeBlobCacheGet(cache, lut, sizeof(lut) - 2, &d) == 0);
+    CHECK(c != a && d != a && d != c);
+    CHECK(blobs_created == 3);
+
+    drmModeBlobCacheGetStats(cache, &stats);
+    CHECK(stats.count_hits == 1 && stats.count_misses == 3);
+    CHECK(stats.count_blobs == 3);
+
+    /* Destroyed only once the last reference is gone. */
+    CHECK(drmModeBlobCacheRelease(cache, a) == 0);
+    CHECK(blobs_destroyed == 0);
+    CHECK(drmModeBlobCacheRef(cache, a) == 0);
+    CHECK(drmModeBlobCacheRelease(cache, a) == 0);
+    CHECK(drmModeBlobCacheRelease(cache, a) == 0);
+    CHECK(blobs_destroyed == 1);
+    CHECK(drmModeBlobCacheRelease(cache, a) == -ENOENT);
+
+    /* Gone means created afresh next time. */
+    lut[2][0] = 0;
+    CHECK(drmModeBlobCacheGet(cache, lut, sizeof(lut), &a) == 0);
+    CHECK(a != b && blobs_created == 4);
+
+    drmModeBlobCacheFree(cache);
+    CHECK(blobs_destroyed == 4);
+    return 0;
+}
+
+static int test_format_index(void)
+{
+    struct {
+        struct drm_format_modifier_blob header;
+        uint32_t formats[4];
+        struct drm_format_modifier modifiers[3];
+    } blob;
+    const uint64_t x_tiled = I915_FORMAT_MOD_X_TILED;
+    drmModeFormatIndexPtr index;
+    const uint64_t *mods;
+
+    memset(&blob, 0, sizeof(blob));
+    blob.header.version = FORMAT_BLOB_CURRENT;
+    blob.header.count_formats = 4;
+    blob.header.formats_offset = offsetof(__typeof__(blob), formats);
+    blob.header.count_modifiers = 3;
+    blob.header.modifiers_offset = offsetof(__typeof__(blob), modifiers);
+    /* NV12 is listed twice, the index must not care. */
+    blob.formats[0] = DRM_FORMAT_XRGB8888;
+    blob.formats[1] = DRM_FORMAT_ARGB8888;
+    blob.formats[2] = DRM_FORMAT_NV12;
+    blob.formats[3] = DRM_FORMAT_NV12;
+    blob.modifiers[0].modifier = DRM_FORMAT_MOD_LINEAR;
+    blob.modifiers[0].formats = 0x7;
+    blob.modifiers[1].modifier = x_tiled;
+    blob.modifiers[1].formats = 0x1;
+    /* The same modifier again, for more formats. */
+    blob.modifiers[2].modifier = x_tiled;
+    blob.modifiers[2].formats = 0x1;
+    blob.modifiers[2].offset = 3;
+
+    CHECK(!drmModeFormatIndexCreate(&blob, sizeof(blob.header) - 1));
+    blob.header.count_modifiers = 4;
+    CHECK(!drmModeFormatIndexCreate(&blob, sizeof(blob)));
+    blob.header.count_modifiers = 3;
+
+    index = drmModeFormatIndexCreate(&blob, sizeof(blob));
+    CHECK(index);
+    CHECK(drmModeFormatIndexHasFormat(index, DRM_FORMAT_NV12));
+    CHECK(!drmModeFormatIndexHasFormat(index, DRM_FORMAT_RGB565));
+    CHECK(drmModeFormatIndexSupports(index, DRM_FORMAT_XRGB8888, x_tiled));
+    CHECK(drmModeFormatIndexSupports(index, DRM_FORMAT_NV12, x_tiled));
+    CHECK(!drmModeFormatIndexSupports(index, DRM_FORMAT_ARGB8888, x_tiled));
+    CHECK(drmModeFormatIndexSupports(index, DRM_FORMAT_ARGB8888,
+                                     DRM_FORMAT_MOD_LINEAR));
+    CHECK(!drmModeFormatIndexSupports(index, DRM_FORMAT_XRGB8888,
+                                      DRM_FORMAT_MOD_INVALID));
+
+    CHECK(drmModeFormatIndexGetModifiers(index, DRM_FORMAT_NV12, &mods) == 2);
+    CHECK(mods[0] == DRM_FORMAT_MOD_LINEAR && mods[1] == x_tiled);
+    CHECK(drmModeFormatIndexGetModifiers(index, DRM_FORMAT_ARGB8888, &mods) == 1);
+    CHECK(drmModeFormatIndexGetModifiers(index, DRM_FORMAT_RGB565, &mods) == 0);
+    CHECK(!mods);
+    drmModeFreeFormatIndex(index);
+
+    /* Plane 30 has no IN_FORMATS, so its format list is used. */
+    drmSetIoctlBackend(&kms_backend);
+    index = drmModeGetPlaneFormatIndex(-1, 30);
+    CHECK(index);
+    CHECK(drmModeFormatIndexSupports(index, DRM_FORMAT_ARGB8888,
+                                     DRM_FORMAT_MOD_INVALID));
+    CHECK(!drmModeFormatIndexSupports(index, DRM_FORMAT_ARGB8888,
+                                      DRM_FORMAT_MOD_LINEAR));
+    CHECK(drmModeFormatIndexGetModifiers(index, DRM_FORMAT_XRGB8888, &mods) == 1);
+    drmModeFreeFormatIndex(index);
+
+    return 0;
+}
+
+static int solver_build(void *data, drmModeAtomicReqPtr req, uint32_t layer,
+                        uint32_t plane_id)
+{
+    return drmModeAtomicAddProperty(req, plane_id, 4, 100 + layer);
+}
+
+static int test_plane_solver(void)
+{
+    drmModePlaneSolverLayer layers[3];
+    drmModePlaneSolverStats stats;
+    drmModePlaneSolverPtr solver;
+    drmModeFormatIndexPtr xrgb_only;
+    drmModeAtomicReqPtr base, req;
+    uint32_t xrgb = DRM_FORMAT_XRGB8888;
+    drmModePlane plane;
+    int commits;
+
+    drmSetIoctlBackend(&capture_backend);
+
+    memset(&plane, 0, sizeof(plane));
+    plane.count_formats = 1;
+    plane.formats = &xrgb;
+    xrgb_only = drmModeFormatIndexCreateFromPlane(&plane);
+    CHECK(xrgb_only);
+
+    solver = drmModePlaneSolverCreate(-1);
+    CHECK(solver);
+    /* Added out of order; 33 is on another CRTC, 34 only does XRGB. */
+    CHECK(drmModePlaneSolverAddPlane(solver, 32, 1, 2, NULL) == 0);
+    CHECK(drmModePlaneSolverAddPlane(solver, 30, 1, 0, NULL) == 0);
+    CHECK(drmModePlaneSolverAddPlane(solver, 33, 2, 3, NULL) == 0);
+    CHECK(drmModePlaneSolverAddPlane(solver, 31, 1, 1, NULL) == 0);
+    CHECK(drmModePlaneSolverAddPlane(solver, 34, 1, 4, xrgb_only) == 0);
+
+    base = drmModeAtomicAlloc();
+    CHECK(base);
+    drmModeAtomicAddProperty(base, 10, 1, 1);
+
+    memset(layers, 0, sizeof(layers));
+    layers[0].key = 1;
+    layers[0].format = DRM_FORMAT_ARGB8888;
+    layers[0].modifier = DRM_FORMAT_MOD_INVALID;
+    layers[1].key = 2;
+    layers[1].format = DRM_FORMAT_XRGB8888;
+    layers[1].modifier = DRM_FORMAT_MOD_INVALID;
+    layers[2].key = 3;
+    layers[2].format = DRM_FORMAT_ARGB8888;
+    layers[2].modifier = DRM_FORMAT_MOD_INVALID;
+
+    /* Plane 32 fails its test and 33 and 34 don't fit, so the top layer
+     * is composited. */
+    reject_object = 32;
+    commits = atomic_commits;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 3,
+                                  solver_build, NULL, &req) == 2);
+    CHECK(layers[0].plane_id == 30 && layers[1].plane_id == 31);
+    CHECK(layers[2].plane_id == 0);
+    CHECK(atomic_commits == commits + 3);
+
+    CHECK(drmModeAtomicCommit(-1, req, 0, NULL) == 0);
+    CHECK(last.count_objs == 3);
+    CHECK(objs[1] == 30 && values[1] == 100);
+    CHECK(objs[2] == 31 && values[2] == 101);
+    drmModeAtomicFree(req);
+
+    /* The same scene again costs no tests at all. */
+    commits = atomic_commits;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 3,
+                                  solver_build, NULL, &req) == 2);
+    CHECK(atomic_commits == commits);
+    CHECK(layers[0].plane_id == 30 && layers[1].plane_id == 31);
+    drmModeAtomicFree(req);
+
+    /* An XRGB top layer can use plane 34; only its tests are new. */
+    layers[2].key = 4;
+    layers[2].format = DRM_FORMAT_XRGB8888;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 3,
+                                  solver_build, NULL, &req) == 3);
+    CHECK(layers[2].plane_id == 34);
+    CHECK(atomic_commits == commits + 2);
+    drmModeAtomicFree(req);
+
+    drmModePlaneSolverGetStats(solver, &stats);
+    CHECK(stats.count_tests == 5);
+    CHECK(stats.count_memo_hits == 5);
+
+    /* Forgetting everything means testing again. */
+    drmModePlaneSolverInvalidate(solver);
+    commits = atomic_commits;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 3,
+                                  solver_build, NULL, &req) == 3);
+    CHECK(atomic_commits == commits + 4);
+    drmModeAtomicFree(req);
+
+    reject_object = 0;
+    drmModePlaneSolverFree(solver);
+
+    /* The middle layer fits no plane: the top one must not go on a plane
+     * below the composition of the middle one. */
+    solver = drmModePlaneSolverCreate(-1);
+    CHECK(solver);
+    CHECK(drmModePlaneSolverAddPlane(solver, 40, 1, 0, NULL) == 0);
+    CHECK(drmModePlaneSolverAddPlane(solver, 41, 1, 1, xrgb_only) == 0);
+    CHECK(drmModePlaneSolverAddPlane(solver, 42, 1, 2, xrgb_only) == 0);
+    layers[1].key = 5;
+    layers[1].format = DRM_FORMAT_NV12;
+    layers[2].plane_id = 42;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 3,
+                                  solver_build, NULL, &req) == 1);
+    CHECK(layers[0].plane_id == 40);
+    CHECK(layers[1].plane_id == 0 && layers[2].plane_id == 0);
+    drmModeAtomicFree(req);
+
+    /* A transient failure is not remembered as a rejection. */
+    drmModePlaneSolverInvalidate(solver);
+    reject_object = 40;
+    reject_error = EBUSY;
+    commits = atomic_commits;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 1,
+                                  solver_build, NULL, &req) == 0);
+    CHECK(atomic_commits == commits + 1);
+    drmModeAtomicFree(req);
+    reject_object = 0;
+    reject_error = 0;
+    CHECK(drmModePlaneSolverSolve(solver, 0, base, 7, layers, 1,
+                                  solver_build, NULL, &req) == 1);
+    CHECK(layers[0].plane_id == 40 && atomic_commits == commits + 2);
+    drmModeAtomicFree(req);
+
+    drmModeAtomicFree(base);
+    drmModePlaneSolverFree(solver);
+    drmModeFreeFormatIndex(xrgb_only);
+    return 0;
+}
+
+static int test_getters(void)
+{
+    drmModeConnectorPtr conn;
+    drmModePropertyPtr prop;
+    drmModePlanePtr plane;
+
+    drmSetIoctlBackend(&kms_backend);
+
+    conn = drmModeGetConnector(-1, 20);
+    CHECK(conn);
+    CHECK(conn->count_modes == (int)connector_modes);
+    CHECK(conn->modes[1].hdisplay == 1280);
+    CHECK(conn->count_encoders == 1 && conn->encoders[0] == 50);
+    CHECK(conn->count_props == 1 && conn->props[0] == 3 &&
+          conn->prop_values[0] == 10);
+    /* One allocation, and arrays a caller swaps in are still freed. */
+    CHECK((char *)conn->encoders > (char *)conn &&
+          (char *)conn->encoders < (char *)conn + 4096);
+    conn->encoders = malloc(sizeof(uint32_t));
+    drmModeFreeConnector(conn);
+
+    plane = drmModeGetPlane(-1, 30);
+    CHECK(plane);
+    CHECK(plane->count_formats == 2 && plane->formats[0] == 0x34325258);
+    CHECK(plane->possible_crtcs == 1);
+    drmModeFreePlane(plane);
+
+    prop = drmModeGetProperty(-1, 3);
+    CHECK(prop);
+    CHECK(!strcmp(prop->name, "CRTC_ID"));
+    CHECK(prop->count_values == 0 && !prop->values && !prop->enums);
+    drmModeFreeProperty(prop);
+
+    CHECK(!drmModeGetConnector(-1, 21));
+    return 0;
+}
+
+static int test_dedup(void)
+{
+    drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+
+    CHECK(req);
+
+    /* Out of order, with the value of 20/2 set three times. */
+    drmModeAtomicAddProperty(req, 20, 2, 1);
+    drmModeAtomicAddProperty(req, 10, 5, 2);
+    drmModeAtomicAddProperty(req, 20, 2, 3);
+    drmModeAtomicAddProperty(req, 20, 1, 4);
+    drmModeAtomicAddProperty(req, 10, 3, 5);
+    drmModeAtomicAddProperty(req, 20, 2, 6);
+
+    CHECK(drmModeAtomicCommit(-1, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL) == 0);
+    CHECK(last.flags == DRM_MODE_ATOMIC_TEST_ONLY);
+    CHECK(last.count_objs == 2);
+    CHECK(objs[0] == 10 && count_props[0] == 2);
+    CHECK(objs[1] == 20 && count_props[1] == 2);
+    CHECK(props[0] == 3 && values[0] == 5);
+    CHECK(props[1] == 5 && values[1] == 2);
+    CHECK(props[2] == 1 && values[2] == 4);
+    CHECK(props[3] == 2 && values[3] == 6);
+
+    /* Committing again, after rewinding, reuses the scratch arrays. */
+    drmModeAtomicSetCursor(req, 1);
+    drmModeAtomicAddProperty(req, 30, 7, 8);
+    CHECK(drmModeAtomicCommit(-1, req, 0, NULL) == 0);
+    CHECK(last.count_objs == 2);
+    CHECK(objs[0] == 20 && count_props[0] == 1 && values[0] == 1);
+    CHECK(objs[1] == 30 && count_props[1] == 1 && values[1] == 8);
+
+    drmModeAtomicFree(req);
+    return 0;
+}
+
+static int test_tracked(void)
+{
+    drmModeAtomicStatePtr state = drmModeAtomicStateCreate();
+    drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+    uint64_t value;
+    int commits;
+
+    CHECK(state && req);
+    drmSetIoctlBackend(&capture_backend);
+
+    /* Plane 30: FB_ID 4, CRTC_X 5; CRTC 10: ACTIVE 1. */
+    drmModeAtomicAddProperty(req, 30, 4, 100);
+    drmModeAtomicAddProperty(req, 30, 5, 0);
+    drmModeAtomicAddProperty(req, 10, 1, 1);
+    CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == 0);
+    CHECK(last.count_objs == 2 && count_props[0] == 1 && count_props[1] == 2);
+    CHECK(drmModeAtomicStateGetValue(state, 30, 4, &value) == 0 && value == 100);
+
+    /* The next frame only flips: the rest is left out. */
+    drmModeAtomicSetCursor(req, 0);
+    drmModeAtomicAddProperty(req, 30, 4, 101);
+    drmModeAtomicAddProperty(req, 30, 5, 0);
+    drmModeAtomicAddProperty(req, 10, 1, 1);
+    CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == 0);
+    CHECK(last.count_objs == 1);
+    CHECK(objs[0] == 30 && count_props[0] == 1);
+    CHECK(props[0] == 4 && values[0] == 101);
+
+    /* Asking for an event keeps every object in the commit. */
+    drmModeAtomicSetCursor(req, 0);
+    drmModeAtomicAddProperty(req, 30, 4, 102);
+    drmModeAtomicAddProperty(req, 30, 5, 0);
+    drmModeAtomicAddProperty(req, 10, 1, 1);
+    CHECK(drmModeAtomicCommitTracked(-1, req, state,
+                                     DRM_MODE_PAGE_FLIP_EVENT, NULL) == 0);
+    CHECK(last.count_objs == 2);
+    CHECK(objs[0] == 10 && count_props[0] == 1 && props[0] == 1);
+    CHECK(objs[1] == 30 && count_props[1] == 1 && props[1] == 4);
+
+    /* Nothing changed: nothing to send. */
+    commits = atomic_commits;
+    CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == 0);
+    CHECK(atomic_commits == commits);
+
+    /* Failed and test-only commits leave the tracked state alone. */
+    drmModeAtomicSetCursor(req, 0);
+    drmModeAtomicAddProperty(req, 30, 5, 64);
+    fail_atomic = 1;
+    CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == -EINVAL);
+    fail_atomic = 0;
+    CHECK(drmModeAtomicCommitTracked(-1, req, state,
+                                     DRM_MODE_ATOMIC_TEST_ONLY, NULL) == 0);
+    CHECK(drmModeAtomicStateGetValue(state, 30, 5, &value) == 0 && value == 0);
+    CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == 0);
+    CHECK(drmModeAtomicStateGetValue(state, 30, 5, &value) == 0 && value == 64);
+
+    /* After invalidating everything is sent again. */
+    drmModeAtomicStateInvalidate(state);
+    CHECK(drmModeAtomicStateGetValue(state, 30, 5, &value) == -ENOENT);
+    drmModeAtomicSetCursor(req, 0);
+    drmModeAtomicAddProperty(req, 30, 4, 102);
+    drmModeAtomicAddProperty(req, 30, 5, 64);
+    drmModeAtomicAddProperty(req, 10, 1, 1);
+    CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == 0);
+    CHECK(last.count_objs == 2 && count_props[0] == 1 && count_props[1] == 2);
+
+    drmModeAtomicFree(req);
+    drmModeAtomicStateFree(state);
+    return 0;
+}
+
+/* An out-fence is written at every commit it is asked for, even into the
+ * same place. */
+static int test_tracked_fence(void)
+{
+    drmModeAtomicStatePtr state = drmModeAtomicStateCreate();
+    drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+    int32_t fence = -1;
+    int calls, i;
+
+    CHECK(state && req);
+    drmSetIoctlBackend(&kms_backend);
+
+    /* CRTC 10: ACTIVE 1, OUT_FENCE_PTR 6. */
+    for (i = 0; i < 3; i++) {
+        drmModeAtomicSetCursor(req, 0);
+        drmModeAtomicAddProperty(req, 10, 1, 1);
+        drmModeAtomicAddProperty(req, 10, 6, (uintptr_t)&fence);
+        calls = getproperty_calls;
+        CHECK(drmModeAtomicCommitTracked(-1, req, state, 0, NULL) == 0);
+        if (i == 0) {
+            CHECK(count_props[0] == 2);
+            continue;
+        }
+        CHECK(last.count_objs == 1 && count_props[0] == 1);
+        CHECK(props[0] == 6 && values[0] == (uintptr_t)&fence);
+        /* The name is only asked for once. */
+        CHECK(getproperty_calls == calls + (i == 1 ? 2 : 0));
+    }
+
+    drmSetIoctlBackend(&capture_backend);
+    drmModeAtomicFree(req);
+    drmModeAtomicStateFree(state);
+    return 0;
+}
+
+static int test_merge(void)
+{
+    drmModeAtomicReqPtr base = drmModeAtomicAlloc();
+    drmModeAtomicReqPtr augment = drmModeAtomicAlloc();
+    drmModeAtomicReqPtr copy;
+    int i;
+
+    CHECK(base && augment);
+
+    for (i = 0; i < 40; i++)
+        drmModeAtomicAddProperty(base, 1 + i % 4, 100 + i % 10, i);
+    drmModeAtomicAddProperty(augment, 2, 101, 1000);
+
+    /* The request being committed keeps its own scratch arrays. */
+    CHECK(drmModeAtomicCommit(-1, base, 0, NULL) == 0);
+    copy = drmModeAtomicDuplicate(base);
+    CHECK(copy);
+    CHECK(drmModeAtomicMerge(copy, augment) == 0);
+    CHECK(drmModeAtomicCommit(-1, copy, 0, NULL) == 0);
+
+    CHECK(last.count_objs == 4);
+    for (i = 0; i < 4; i++)
+        CHECK(objs[i] == 1 + (uint32_t)i && count_props[i] == 5);
+    /* 2/101 was last set to 21 by base, then to 1000 by augment. */
+    CHECK(props[5] == 101 && values[5] == 1000);
+    CHECK(props[6] == 103 && values[6] == 33);
+
+    drmModeAtomicFree(copy);
+    drmModeAtomicFree(augment);
+    drmModeAtomicFree(base);
+    return 0;
+}
+
+int main(void)
+{
+    int ret;
+
+    if (drmSetIoctlBackend(&capture_backend)) {
+        fprintf(stderr, "failed to install the capture backend\n");
+        return 1;
+    }
+
+    ret = test_dedup() ||
+          test_merge() ||
+          test_tracked() ||
+          test_property_cache() ||
+          test_snapshot() ||
+          test_hotplug() ||
+          test_blob_cache() ||
+          test_format_index() ||
+          test_plane_solver() ||
+          test_getters() ||
+          test_allocator() ||
+          test_tracked_fence();
+
+    drmSetIoctlBackend(NULL);
+
+    printf("atomic commit: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
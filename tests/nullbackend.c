@@ -0,0 +1,324 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xf86drm.h"
+#include "amdgpu_drm.h"
+
+#include "util/common.h"
+
+static int gem_create(int fd, uint64_t size, uint32_t *handle)
+{
+    union drm_amdgpu_gem_create args;
+    int ret;
+
+    memset(&args, 0, sizeof(args));
+    args.in.bo_size = size;
+    args.in.domains = AMDGPU_GEM_DOMAIN_GTT;
+    ret = drmCommandWriteRead(fd, DRM_AMDGPU_GEM_CREATE, &args, sizeof(args));
+    *handle = args.out.handle;
+    return ret;
+}
+
+static void *gem_map(int fd, uint32_t handle, uint64_t size)
+{
+    union drm_amdgpu_gem_mmap args;
+
+    memset(&args, 0, sizeof(args));
+    args.in.handle = handle;
+    if (drmCommandWriteRead(fd, DRM_AMDGPU_GEM_MMAP, &args, sizeof(args)))
+        return MAP_FAILED;
+
+    return drmMmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   args.out.addr_ptr);
+}
+
+static int gem_close(int fd, uint32_t handle)
+{
+    struct drm_gem_close args;
+
+    memset(&args, 0, sizeof(args));
+    args.handle = handle;
+    return drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &args);
+}
+
+static int test_version(int fd)
+{
+    drmVersionPtr version = drmGetVersion(fd);
+    char *busid;
+
+    CHECK(version);
+    CHECK(version->version_major == 3);
+    CHECK(!strcmp(version->name, "amdgpu"));
+    drmFreeVersion(version);
+
+    busid = drmGetBusid(fd);
+    CHECK(busid && !strcmp(busid, "null:amdgpu"));
+    drmFreeBusid(busid);
+    return 0;
+}
+
+static uint64_t ioctl_calls(unsigned long request)
+{
+    static drmIoctlStat stats[DRM_IOCTL_STATS_MAX_NR];
+
+    if (drmGetIoctlStats(stats, DRM_IOCTL_STATS_MAX_NR) < 0)
+        return ~0ull;
+    return stats[DRM_IOCTL_NR(request)].calls;
+}
+
+static int live_allocs;
+
+static void *counting_malloc(void *priv, size_t size)
+{
+    live_allocs++;
+    return malloc(size);
+}
+
+static void *counting_calloc(void *priv, size_t nmemb, size_t size)
+{
+    live_allocs++;
+    return calloc(nmemb, size);
+}
+
+static void *counting_realloc(void *priv, void *ptr, size_t size)
+{
+    if (!ptr)
+        live_allocs++;
+    return realloc(ptr, size);
+}
+
+static void counting_free(void *priv, void *ptr)
+{
+    live_allocs--;
+    free(ptr);
+}
+
+static int test_query_cache(int other)
+{
+    const drmAllocator allocator = {
+        counting_malloc, counting_calloc, counting_realloc, counting_free,
+        NULL
+    };
+    drmVersionPtr first, second;
+    uint64_t value, calls;
+    char *busid;
+    int enabled, fd;
+
+    enabled = drmIoctlStatsEnable(1);
+    drmResetIoctlStats();
+
+    fd = drmNullDeviceOpen("amdgpu");
+    CHECK(fd >= 0);
+
+    first = drmGetVersion(fd);
+    second = drmGetVersion(fd);
+    CHECK(first && second && first != second);
+    CHECK(ioctl_calls(DRM_IOCTL_VERSION) == 2);
+    drmFreeVersion(first);
+    CHECK(!strcmp(second->name, "amdgpu"));
+    drmFreeVersion(second);
+
+    /* A different file is a different cache entry. */
+    second = drmGetVersion(other);
+    CHECK(second && !strcmp(second->name, "amdgpu"));
+    drmFreeVersion(second);
+
+    CHECK(drmGetCap(fd, DRM_CAP_PRIME, &value) == 0);
+    calls = ioctl_calls(DRM_IOCTL_GET_CAP);
+    CHECK(drmGetCap(fd, DRM_CAP_PRIME, &value) == 0);
+    CHECK(value == (DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT));
+    CHECK(ioctl_calls(DRM_IOCTL_GET_CAP) == calls);
+
+    /* The bus ID belongs to the open file, not the device: it is not
+     * cached. */
+    busid = drmGetBusid(fd);
+    drmFreeBusid(busid);
+    calls = ioctl_calls(DRM_IOCTL_GET_UNIQUE);
+    busid = drmGetBusid(fd);
+    CHECK(busid && !strcmp(busid, "null:amdgpu"));
+    CHECK(ioctl_calls(DRM_IOCTL_GET_UNIQUE) == calls + 2);
+    drmFreeBusid(busid);
+
+    /* The fd number coming back for another file must not hit. */
+    close(fd);
+    CHECK(drmNullDeviceOpen("amdgpu") == fd);
+    calls = ioctl_calls(DRM_IOCTL_VERSION);
+    first = drmGetVersion(fd);
+    CHECK(first && ioctl_calls(DRM_IOCTL_VERSION) == calls + 2);
+    drmFreeVersion(first);
+    close(fd);
+
+    /* Only the caller's copy comes from the application allocator, the
+     * cached version outlives it. */
+    fd = drmNullDeviceOpen("amdgpu");
+    CHECK(fd >= 0);
+    CHECK(drmSetAllocator(&allocator) == 0);
+    first = drmGetVersion(fd);
+    CHECK(first && live_allocs == 1);
+    drmFreeVersion(first);
+    CHECK(live_allocs == 0);
+    CHECK(drmSetAllocator(NULL) == 0);
+    drmClose(fd);
+
+    drmIoctlStatsEnable(enabled);
+    return 0;
+}
+
+static int test_gem(int fd)
+{
+    uint32_t handle;
+    char *ptr;
+
+    CHECK(gem_create(fd, 4096, &handle) == 0);
+    CHECK(handle);
+
+    ptr = gem_map(fd, handle, 4096);
+    CHECK(ptr != MAP_FAILED);
+    memset(ptr, 0xa5, 4096);
+    drmMunmap(ptr, 4096);
+
+    ptr = gem_map(fd, handle, 4096);
+    CHECK(ptr != MAP_FAILED);
+    CHECK(ptr[0] == (char)0xa5 && ptr[4095] == (char)0xa5);
+    drmMunmap(ptr, 4096);
+
+    CHECK(gem_close(fd, handle) == 0);
+    CHECK(gem_close(fd, handle) == -1 && errno == EINVAL);
+    return 0;
+}
+
+static int test_prime(int fd, int other)
+{
+    uint32_t handle, imported, again;
+    int prime_fd;
+    char *ptr;
+
+    CHECK(gem_create(fd, 8192, &handle) == 0);
+    ptr = gem_map(fd, handle, 8192);
+    CHECK(ptr != MAP_FAILED);
+    strcpy(ptr + 4096, "shared");
+    drmMunmap(ptr, 8192);
+
+    CHECK(drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &prime_fd) == 0);
+    CHECK(drmPrimeFDToHandle(other, prime_fd, &imported) == 0);
+    CHECK(drmPrimeFDToHandle(other, prime_fd, &again) == 0);
+    CHECK(imported == again);
+    close(prime_fd);
+
+    /* The exporter's handle going away must not take the storage along. */
+    CHECK(gem_close(fd, handle) == 0);
+
+    ptr = gem_map(other, imported, 8192);
+    CHECK(ptr != MAP_FAILED);
+    CHECK(!strcmp(ptr + 4096, "shared"));
+    drmMunmap(ptr, 8192);
+
+    CHECK(gem_close(other, imported) == 0);
+    return 0;
+}
+
+static int test_syncobj(int fd, int other)
+{
+    uint32_t handle, imported;
+    int sync_fd;
+
+    CHECK(drmSyncobjCreate(fd, 0, &handle) == 0);
+    CHECK(drmSyncobjHandleToFD(fd, handle, &sync_fd) == 0);
+    CHECK(drmSyncobjFDToHandle(other, sync_fd, &imported) == 0);
+    close(sync_fd);
+
+    CHECK(drmSyncobjWait(other, &imported, 1, 0, 0, NULL) == 0);
+    CHECK(drmSyncobjDestroy(other, imported) == 0);
+    CHECK(drmSyncobjDestroy(fd, handle) == 0);
+    CHECK(drmSyncobjDestroy(fd, handle) != 0);
+    return 0;
+}
+
+static int test_submit(int fd)
+{
+    union drm_amdgpu_cs cs;
+    uint64_t first;
+
+    memset(&cs, 0, sizeof(cs));
+    CHECK(drmCommandWriteRead(fd, DRM_AMDGPU_CS, &cs, sizeof(cs)) == 0);
+    first = cs.out.handle;
+
+    memset(&cs, 0, sizeof(cs));
+    CHECK(drmCommandWriteRead(fd, DRM_AMDGPU_CS, &cs, sizeof(cs)) == 0);
+    CHECK(cs.out.handle == first + 1);
+    return 0;
+}
+
+static int test_passthrough(void)
+{
+    drm_version_t version;
+    int fd = open("/dev/null", O_RDWR);
+
+    CHECK(fd >= 0);
+    memset(&version, 0, sizeof(version));
+    CHECK(drmIoctl(fd, DRM_IOCTL_VERSION, &version) == -1);
+    CHECK(errno == ENOTTY);
+    close(fd);
+    return 0;
+}
+
+int main(void)
+{
+    int fd, other, ret;
+
+    /* Honoured even when the API is used before the first ioctl. */
+    setenv("LIBDRM_IOCTL_STATS", "1", 1);
+    CHECK(drmIoctlStatsEnable(0) == 1);
+
+    if (drmSetIoctlBackend(drmNullBackend())) {
+        fprintf(stderr, "failed to install the null backend\n");
+        return 1;
+    }
+
+    CHECK(drmNullDeviceOpen("nonexistent") == -ENODEV);
+
+    fd = drmNullDeviceOpen("amdgpu");
+    other = drmNullDeviceOpen("amdgpu");
+    CHECK(fd >= 0 && other >= 0);
+
+    ret = test_version(fd) ||
+          test_query_cache(other) ||
+          test_gem(fd) ||
+          test_prime(fd, other) ||
+          test_syncobj(fd, other) ||
+          test_submit(fd) ||
+          test_passthrough();
+
+    close(other);
+    close(fd);
+    drmSetIoctlBackend(NULL);
+
+    printf("null backend: %s\n", ret ? "FAILED" : "PASSED");
+    return ret;
+}
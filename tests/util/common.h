@@ -26,8 +26,18 @@
 #ifndef UTIL_COMMON_H
 #define UTIL_COMMON_H
 
+#include <stdio.h>
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #endif
 
+/* Make the calling test function fail when cond doesn't hold. */
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        return 1; \
+    } \
+} while (0)
+
 #endif /* UTIL_COMMON_H */
@@ -61,6 +61,7 @@
 #include <sys/sysmacros.h>
 #endif
 #include <math.h>
+#include <pthread.h>
 
 /* Not all systems have MAP_FAILED defined */
 #ifndef MAP_FAILED
@@ -69,6 +70,7 @@
 
 #include "xf86drm.h"
 #include "libdrm_macros.h"
+#include "xf86atomic.h"
 
 #include "util_math.h"
 
@@ -169,14 +171,437 @@ void *drmGetHashTable(void)
     return drmHashTable;
 }
 
+static const drmAllocator *drm_allocator;
+
+/**
+ * Route libdrm's result objects through an application allocator.
+ *
+ * \param allocator allocator to install, or NULL to go back to the C
+ * library.  The structure is referenced, not copied, and must stay valid
+ * until it is replaced.
+ *
+ * \return zero on success, or a negative error code.
+ *
+ * Everything allocated with drmMalloc() and drmRealloc() and released with
+ * drmFree() goes through the allocator: the structures returned by
+ * drmGetVersion(), drmGetBusid(), drmGetDevice() and friends and by all of
+ * the drmModeGet*() functions.  libdrm's own bookkeeping, such as the fd
+ * table, the hash and skip list tables and the state objects of
+ * xf86drmMode.h, outlives any one call and stays on the C library.
+ *
+ * \note Objects must be freed through the allocator that was installed when
+ * they were allocated, so the allocator is best set up once, before libdrm
+ * is used.
+ */
+int drmSetAllocator(const drmAllocator *allocator)
+{
+    if (allocator && (!allocator->malloc_fn || !allocator->calloc_fn ||
+                      !allocator->realloc_fn || !allocator->free_fn))
+        return -EINVAL;
+
+    drm_allocator = allocator;
+    return 0;
+}
+
 void *drmMalloc(int size)
 {
+    const drmAllocator *allocator = drm_allocator;
+
+    if (allocator)
+        return allocator->calloc_fn(allocator->priv, 1, size);
+
     return calloc(1, size);
 }
 
+void *drmRealloc(void *pt, size_t size)
+{
+    const drmAllocator *allocator = drm_allocator;
+
+    if (allocator)
+        return allocator->realloc_fn(allocator->priv, pt, size);
+
+    return realloc(pt, size);
+}
+
 void drmFree(void *pt)
 {
-    free(pt);
+    const drmAllocator *allocator = drm_allocator;
+
+    if (!pt)
+        return;
+
+    if (allocator)
+        allocator->free_fn(allocator->priv, pt);
+    else
+        free(pt);
+}
+
+static char *drmStrdup(const char *str)
+{
+    const drmAllocator *allocator = drm_allocator;
+    size_t size = strlen(str) + 1;
+    char *copy;
+
+    if (allocator)
+        copy = allocator->malloc_fn(allocator->priv, size);
+    else
+        copy = malloc(size);
+
+    if (copy)
+        memcpy(copy, str, size);
+
+    return copy;
+}
+
+/*
+ * Per-fd query cache
+ *
+ * The driver version and the device capabilities do not change while a
+ * file is open, yet drivers and loaders keep asking for them.  The
+ * answers are remembered per fd together with the identity of the file, so
+ * that one fstat() tells whether the fd was closed and reused behind our
+ * back.  Nothing is cached for file descriptors that cannot be stat'ed.
+ */
+#define DRM_FD_CACHE_CAPS 32
+
+/* drmVersion with its strings in the same allocation.  The cache keeps one
+ * on the C library, callers get copies from drmMalloc(). */
+struct drm_version_block {
+    drmVersion version;
+    size_t size;
+};
+
+struct drm_fd_cache_entry {
+    dev_t dev;
+    ino_t ino;
+    dev_t rdev;
+    drmVersionPtr version;
+    uint32_t caps_valid;
+    uint64_t caps[DRM_FD_CACHE_CAPS];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    void *by_fd;        /* fd -> struct drm_fd_cache_entry */
+} drm_fd_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static drmVersionPtr drmVersionCopy(drmVersionPtr version)
+{
+    struct drm_version_block *block = (void *)version, *copy;
+
+    copy = drmMalloc(block->size);
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, block, block->size);
+    copy->version.name = (char *)copy + (version->name - (char *)block);
+    copy->version.date = (char *)copy + (version->date - (char *)block);
+    copy->version.desc = (char *)copy + (version->desc - (char *)block);
+    return &copy->version;
+}
+
+static void drmFdCacheReset(struct drm_fd_cache_entry *entry)
+{
+    free(entry->version);
+    entry->version = NULL;
+    entry->caps_valid = 0;
+}
+
+/* Called with the lock held, returns NULL if fd cannot be cached. */
+static struct drm_fd_cache_entry *drmFdCacheGet(int fd)
+{
+    struct drm_fd_cache_entry *entry;
+    struct stat st;
+    void *value;
+
+    if (fd < 0 || fstat(fd, &st))
+        return NULL;
+
+    if (!drm_fd_cache.by_fd) {
+        drm_fd_cache.by_fd = drmHashCreate();
+        if (!drm_fd_cache.by_fd)
+            return NULL;
+    }
+
+    if (!drmHashLookup(drm_fd_cache.by_fd, fd, &value)) {
+        entry = value;
+        if (entry->dev == st.st_dev && entry->ino == st.st_ino &&
+            entry->rdev == st.st_rdev)
+            return entry;
+
+        drmFdCacheReset(entry);
+    } else {
+        entry = calloc(1, sizeof(*entry));
+        if (!entry)
+            return NULL;
+
+        if (drmHashInsert(drm_fd_cache.by_fd, fd, entry)) {
+            free(entry);
+            return NULL;
+        }
+    }
+
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->rdev = st.st_rdev;
+    return entry;
+}
+
+static void drmFdCacheForget(int fd)
+{
+    void *value;
+
+    pthread_mutex_lock(&drm_fd_cache.lock);
+    if (drm_fd_cache.by_fd &&
+        !drmHashLookup(drm_fd_cache.by_fd, fd, &value)) {
+        drmHashDelete(drm_fd_cache.by_fd, fd);
+        drmFdCacheReset(value);
+        free(value);
+    }
+    pthread_mutex_unlock(&drm_fd_cache.lock);
+}
+
+/* Whatever was cached was answered by the previous ioctl backend. */
+static void drmFdCacheFlush(void)
+{
+    unsigned long key;
+    void *value;
+
+    pthread_mutex_lock(&drm_fd_cache.lock);
+    if (drm_fd_cache.by_fd) {
+        if (drmHashFirst(drm_fd_cache.by_fd, &key, &value)) {
+            do {
+                drmFdCacheReset(value);
+                free(value);
+            } while (drmHashNext(drm_fd_cache.by_fd, &key, &value));
+        }
+        drmHashDestroy(drm_fd_cache.by_fd);
+        drm_fd_cache.by_fd = NULL;
+    }
+    pthread_mutex_unlock(&drm_fd_cache.lock);
+}
+
+/*
+ * Optional drmIoctl() hooks.
+ *
+ * Everything beyond the plain ioctl() restart loop hides behind a single
+ * flags word so that the common, unhooked case costs one predictable branch.
+ * The word starts out as DRM_IOCTL_HOOK_UNINIT, which routes the very first
+ * call through the slow path where the environment is inspected once.
+ */
+#define DRM_IOCTL_HOOK_UNINIT   (1 << 0)
+#define DRM_IOCTL_HOOK_STATS    (1 << 1)
+#define DRM_IOCTL_HOOK_BACKEND  (1 << 2)
+
+static atomic_t drm_ioctl_hooks = { DRM_IOCTL_HOOK_UNINIT };
+static const drmIoctlBackend *drm_ioctl_backend;
+
+static void drmIoctlHooksUpdate(int set, int clear)
+{
+    int old, new;
+
+    do {
+        old = atomic_read(&drm_ioctl_hooks);
+        new = (old | set) & ~clear;
+    } while (atomic_cmpxchg(&drm_ioctl_hooks, old, new) != old);
+}
+
+/*
+ * Per-thread ioctl statistics.
+ *
+ * Every thread that issues an ioctl while statistics are enabled owns a
+ * block of counters indexed by DRM_IOCTL_NR(request).  Only the owner ever
+ * writes to a block, so recording needs no locking.  Blocks are linked into
+ * a global list which is only ever pushed to; blocks of exited threads are
+ * recycled by new threads instead of being freed.
+ *
+ * drmResetIoctlStats() bumps a global epoch rather than touching other
+ * threads' counters: a block tagged with an older epoch is ignored by
+ * drmGetIoctlStats() and cleared by its owner on the next update.
+ */
+struct drm_ioctl_stats_block {
+    struct drm_ioctl_stats_block *next;
+    atomic_t owned;
+    int epoch;
+    drmIoctlStat stats[DRM_IOCTL_STATS_MAX_NR];
+};
+
+static struct drm_ioctl_stats_block *drm_ioctl_stats_blocks;
+static atomic_t drm_ioctl_stats_epoch;
+static pthread_key_t drm_ioctl_stats_key;
+static pthread_once_t drm_ioctl_stats_once = PTHREAD_ONCE_INIT;
+
+static void drmIoctlStatsRelease(void *data)
+{
+    struct drm_ioctl_stats_block *block = data;
+
+    atomic_set(&block->owned, 0);
+}
+
+static void drmIoctlStatsInitKey(void)
+{
+    pthread_key_create(&drm_ioctl_stats_key, drmIoctlStatsRelease);
+}
+
+static struct drm_ioctl_stats_block *drmIoctlStatsGetBlock(void)
+{
+    struct drm_ioctl_stats_block *block, *head;
+
+    pthread_once(&drm_ioctl_stats_once, drmIoctlStatsInitKey);
+
+    block = pthread_getspecific(drm_ioctl_stats_key);
+    if (block)
+        return block;
+
+    for (block = drm_ioctl_stats_blocks; block; block = block->next)
+        if (atomic_cmpxchg(&block->owned, 0, 1) == 0)
+            goto out;
+
+    block = calloc(1, sizeof(*block));
+    if (!block)
+        return NULL;
+
+    atomic_set(&block->owned, 1);
+    block->epoch = atomic_read(&drm_ioctl_stats_epoch);
+    do {
+        head = drm_ioctl_stats_blocks;
+        block->next = head;
+    } while (__sync_val_compare_and_swap(&drm_ioctl_stats_blocks,
+                                         head, block) != head);
+
+out:
+    pthread_setspecific(drm_ioctl_stats_key, block);
+    return block;
+}
+
+static void drmIoctlStatsRecord(unsigned long request, int ret,
+                                unsigned int retries, uint64_t ns)
+{
+    struct drm_ioctl_stats_block *block;
+    drmIoctlStatPtr stat;
+    int bucket, epoch;
+
+    block = drmIoctlStatsGetBlock();
+    if (!block)
+        return;
+
+    epoch = atomic_read(&drm_ioctl_stats_epoch);
+    if (block->epoch != epoch) {
+        memset(block->stats, 0, sizeof(block->stats));
+        block->epoch = epoch;
+    }
+
+    bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= DRM_IOCTL_STATS_BUCKETS)
+        bucket = DRM_IOCTL_STATS_BUCKETS - 1;
+
+    stat = &block->stats[DRM_IOCTL_NR(request) % DRM_IOCTL_STATS_MAX_NR];
+    stat->calls++;
+    stat->retries += retries;
+    stat->errors += ret != 0;
+    stat->total_ns += ns;
+    if (ns > stat->max_ns)
+        stat->max_ns = ns;
+    stat->histogram[bucket]++;
+}
+
+static void drmDumpIoctlStats(void)
+{
+    drmIoctlStat stats[DRM_IOCTL_STATS_MAX_NR];
+    int i, b;
+
+    drmGetIoctlStats(stats, DRM_IOCTL_STATS_MAX_NR);
+
+    fprintf(stderr, "libdrm: ioctl statistics for pid %d\n", (int)getpid());
+    fprintf(stderr, "  nr     calls  retries   errors   avg(us)   max(us)\n");
+    for (i = 0; i < DRM_IOCTL_STATS_MAX_NR; i++) {
+        if (!stats[i].calls)
+            continue;
+
+        fprintf(stderr, "  0x%02x %8llu %8llu %8llu %9.2f %9.2f\n", i,
+                (unsigned long long)stats[i].calls,
+                (unsigned long long)stats[i].retries,
+                (unsigned long long)stats[i].errors,
+                stats[i].total_ns / 1000.0 / stats[i].calls,
+                stats[i].max_ns / 1000.0);
+        fprintf(stderr, "        log2(ns):");
+        for (b = 0; b < DRM_IOCTL_STATS_BUCKETS; b++)
+            if (stats[i].histogram[b])
+                fprintf(stderr, " %d:%llu", b,
+                        (unsigned long long)stats[i].histogram[b]);
+        fprintf(stderr, "\n");
+    }
+}
+
+static atomic_t drm_ioctl_stats_dump;
+
+/* A destructor rather than atexit(), whose handler would be left pointing
+ * into unmapped code once libdrm is dlclose()d. */
+static void __attribute__((destructor)) drmIoctlStatsFini(void)
+{
+    if (atomic_read(&drm_ioctl_stats_dump))
+        drmDumpIoctlStats();
+}
+
+static void drmIoctlHooksInit(void)
+{
+    const char *env = getenv("LIBDRM_IOCTL_STATS");
+
+    if (env && *env && strcmp(env, "0")) {
+        atomic_set(&drm_ioctl_stats_dump, 1);
+        drmIoctlHooksUpdate(DRM_IOCTL_HOOK_STATS, DRM_IOCTL_HOOK_UNINIT);
+    } else {
+        drmIoctlHooksUpdate(0, DRM_IOCTL_HOOK_UNINIT);
+    }
+}
+
+static uint64_t drmIoctlTimestamp(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int drmIoctlSlow(int fd, unsigned long request, void *arg)
+{
+    const drmIoctlBackend *backend = NULL;
+    unsigned int retries = 0;
+    uint64_t start = 0;
+    int hooks, ret, err;
+
+    hooks = atomic_read(&drm_ioctl_hooks);
+    if (hooks & DRM_IOCTL_HOOK_UNINIT) {
+        drmIoctlHooksInit();
+        hooks = atomic_read(&drm_ioctl_hooks);
+    }
+
+    if (hooks & DRM_IOCTL_HOOK_BACKEND)
+        backend = drm_ioctl_backend;
+
+    if (hooks & DRM_IOCTL_HOOK_STATS)
+        start = drmIoctlTimestamp();
+
+    for (;;) {
+        if (backend)
+            ret = backend->ioctl(backend->priv, fd, request, arg);
+        else
+            ret = ioctl(fd, request, arg);
+        if (ret != -1 || (errno != EINTR && errno != EAGAIN))
+            break;
+        retries++;
+    }
+
+    if (hooks & DRM_IOCTL_HOOK_STATS) {
+        err = errno;
+        drmIoctlStatsRecord(request, ret, retries,
+                            drmIoctlTimestamp() - start);
+        errno = err;
+    }
+
+    return ret;
 }
 
 /**
@@ -187,12 +612,164 @@ drmIoctl(int fd, unsigned long request, void *arg)
 {
     int ret;
 
+    if (atomic_read(&drm_ioctl_hooks))
+        return drmIoctlSlow(fd, request, arg);
+
     do {
         ret = ioctl(fd, request, arg);
     } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
     return ret;
 }
 
+/**
+ * Enable or disable collection of drmIoctl() statistics.
+ *
+ * \param enable non-zero to start collecting, zero to stop.
+ *
+ * \return the previous state.
+ *
+ * \note Statistics can also be enabled for the whole process lifetime by
+ * setting the LIBDRM_IOCTL_STATS environment variable, in which case a
+ * summary is printed to stderr when libdrm is unloaded.
+ */
+int drmIoctlStatsEnable(int enable)
+{
+    int old;
+
+    /* The environment has to be looked at first, or it would be ignored
+     * once this cleared the flag. */
+    if (atomic_read(&drm_ioctl_hooks) & DRM_IOCTL_HOOK_UNINIT)
+        drmIoctlHooksInit();
+
+    old = atomic_read(&drm_ioctl_hooks);
+    if (enable)
+        drmIoctlHooksUpdate(DRM_IOCTL_HOOK_STATS, 0);
+    else
+        drmIoctlHooksUpdate(0, DRM_IOCTL_HOOK_STATS);
+
+    return !!(old & DRM_IOCTL_HOOK_STATS);
+}
+
+/**
+ * Retrieve the drmIoctl() statistics gathered since the last reset.
+ *
+ * \param stats array indexed by DRM_IOCTL_NR() of the request.
+ * \param count number of elements in \p stats, at most
+ * DRM_IOCTL_STATS_MAX_NR are filled in.
+ *
+ * \return the number of elements filled in, or a negative error code.
+ *
+ * \internal
+ * Sums up the counters of all threads.  Counters of threads still issuing
+ * ioctls are read without synchronisation and may lag by a few calls.
+ */
+int drmGetIoctlStats(drmIoctlStatPtr stats, int count)
+{
+    struct drm_ioctl_stats_block *block;
+    int epoch, i, b;
+
+    if (!stats || count < 0)
+        return -EINVAL;
+
+    if (count > DRM_IOCTL_STATS_MAX_NR)
+        count = DRM_IOCTL_STATS_MAX_NR;
+
+    memset(stats, 0, count * sizeof(*stats));
+    epoch = atomic_read(&drm_ioctl_stats_epoch);
+
+    for (block = drm_ioctl_stats_blocks; block; block = block->next) {
+        if (block->epoch != epoch)
+            continue;
+
+        for (i = 0; i < count; i++) {
+            const drmIoctlStat *src = &block->stats[i];
+
+            if (!src->calls)
+                continue;
+
+            stats[i].calls += src->calls;
+            stats[i].retries += src->retries;
+            stats[i].errors += src->errors;
+            stats[i].total_ns += src->total_ns;
+            if (src->max_ns > stats[i].max_ns)
+                stats[i].max_ns = src->max_ns;
+            for (b = 0; b < DRM_IOCTL_STATS_BUCKETS; b++)
+                stats[i].histogram[b] += src->histogram[b];
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Discard all drmIoctl() statistics gathered so far.
+ */
+void drmResetIoctlStats(void)
+{
+    atomic_inc(&drm_ioctl_stats_epoch);
+}
+
+/**
+ * Route drmIoctl() and drmMmap() through a userspace backend.
+ *
+ * \param backend backend to install, or NULL to talk to the kernel again.
+ * The structure is referenced, not copied, and must stay valid until it is
+ * replaced.
+ *
+ * \return zero on success, or a negative error code.
+ *
+ * \note The backend should be installed before other threads start issuing
+ * ioctls.  Mappings established through a backend must be released while
+ * it is still installed.
+ */
+int drmSetIoctlBackend(const drmIoctlBackend *backend)
+{
+    if (backend && !backend->ioctl)
+        return -EINVAL;
+
+    if (backend) {
+        drm_ioctl_backend = backend;
+        drmIoctlHooksUpdate(DRM_IOCTL_HOOK_BACKEND, 0);
+    } else {
+        drmIoctlHooksUpdate(0, DRM_IOCTL_HOOK_BACKEND);
+        drm_ioctl_backend = NULL;
+    }
+    drmFdCacheFlush();
+
+    return 0;
+}
+
+/**
+ * Map a DRM object into the address space.
+ *
+ * Same as mmap(), except that the request is handed to the ioctl backend if
+ * one is installed.  All of libdrm maps objects through this function.
+ */
+void *drmMmap(void *addr, size_t length, int prot, int flags,
+              int fd, uint64_t offset)
+{
+    const drmIoctlBackend *backend = drm_ioctl_backend;
+
+    if (backend && backend->mmap)
+        return backend->mmap(backend->priv, addr, length, prot, flags,
+                             fd, offset);
+
+    return drm_sys_mmap(addr, length, prot, flags, fd, offset);
+}
+
+/**
+ * Unmap a range previously mapped with drmMmap().
+ */
+int drmMunmap(void *addr, size_t length)
+{
+    const drmIoctlBackend *backend = drm_ioctl_backend;
+
+    if (backend && backend->munmap)
+        return backend->munmap(backend->priv, addr, length);
+
+    return drm_sys_munmap(addr, length);
+}
+
 static unsigned long drmGetKeyFromFd(int fd)
 {
     stat_t     st;
@@ -212,7 +789,7 @@ drmHashEntry *drmGetEntry(int fd)
         drmHashTable = drmHashCreate();
 
     if (drmHashLookup(drmHashTable, key, &value)) {
-        entry           = drmMalloc(sizeof(*entry));
+        entry           = calloc(1, sizeof(*entry));
         entry->fd       = fd;
         entry->f        = NULL;
         entry->tagTable = drmHashCreate();
@@ -562,6 +1139,48 @@ static const char *drmGetMinorName(int type)
     }
 }
 
+static int drmNameMapOpen(const char *name, const char *busid, int type);
+
+/**
+ * Check whether an open device has the given bus ID.
+ *
+ * \internal
+ * Sets up the interface version first, which makes the kernel assign the
+ * bus ID.
+ */
+static int drmCheckBusid(int fd, const char *busid)
+{
+    int        pci_domain_ok = 1;
+    const char *buf;
+    drmSetVersion sv;
+    int        ret;
+
+    /* We need to try for 1.4 first for proper PCI domain support
+     * and if that fails, we know the kernel is busted
+     */
+    sv.drm_di_major = 1;
+    sv.drm_di_minor = 4;
+    sv.drm_dd_major = -1;        /* Don't care */
+    sv.drm_dd_minor = -1;        /* Don't care */
+    if (drmSetInterfaceVersion(fd, &sv)) {
+#ifndef __alpha__
+        pci_domain_ok = 0;
+#endif
+        sv.drm_di_major = 1;
+        sv.drm_di_minor = 1;
+        sv.drm_dd_major = -1;       /* Don't care */
+        sv.drm_dd_minor = -1;       /* Don't care */
+        drmMsg("drmOpenByBusid: Interface 1.4 failed, trying 1.1\n");
+        drmSetInterfaceVersion(fd, &sv);
+    }
+    buf = drmGetBusid(fd);
+    drmMsg("drmOpenByBusid: drmGetBusid reports %s\n", buf);
+    ret = buf && drmMatchBusID(buf, busid, pci_domain_ok);
+    if (buf)
+        drmFreeBusid(buf);
+    return ret;
+}
+
 /**
  * Open the device by bus ID.
  *
@@ -571,53 +1190,34 @@ static const char *drmGetMinorName(int type)
  * \return a file descriptor on success, or a negative value on error.
  *
  * \internal
- * This function attempts to open every possible minor (up to DRM_MAX_MINOR),
+ * This function looks the bus ID up in the name map, and if that cannot
+ * tell, attempts to open every possible minor (up to DRM_MAX_MINOR),
  * comparing the device bus ID with the one supplied.
  *
  * \sa drmOpenMinor() and drmGetBusid().
  */
 static int drmOpenByBusid(const char *busid, int type)
 {
-    int        i, pci_domain_ok = 1;
+    int        i;
     int        fd;
-    const char *buf;
-    drmSetVersion sv;
     int        base = drmGetMinorBase(type);
 
     if (base < 0)
         return -1;
 
     drmMsg("drmOpenByBusid: Searching for BusID %s\n", busid);
+    fd = drmNameMapOpen(NULL, busid, type);
+    if (fd >= 0)
+        return fd;
+    if (fd == -ENOENT)
+        return -1;
+
     for (i = base; i < base + DRM_MAX_MINOR; i++) {
         fd = drmOpenMinor(i, 1, type);
         drmMsg("drmOpenByBusid: drmOpenMinor returns %d\n", fd);
         if (fd >= 0) {
-            /* We need to try for 1.4 first for proper PCI domain support
-             * and if that fails, we know the kernel is busted
-             */
-            sv.drm_di_major = 1;
-            sv.drm_di_minor = 4;
-            sv.drm_dd_major = -1;        /* Don't care */
-            sv.drm_dd_minor = -1;        /* Don't care */
-            if (drmSetInterfaceVersion(fd, &sv)) {
-#ifndef __alpha__
-                pci_domain_ok = 0;
-#endif
-                sv.drm_di_major = 1;
-                sv.drm_di_minor = 1;
-                sv.drm_dd_major = -1;       /* Don't care */
-                sv.drm_dd_minor = -1;       /* Don't care */
-                drmMsg("drmOpenByBusid: Interface 1.4 failed, trying 1.1\n");
-                drmSetInterfaceVersion(fd, &sv);
-            }
-            buf = drmGetBusid(fd);
-            drmMsg("drmOpenByBusid: drmGetBusid reports %s\n", buf);
-            if (buf && drmMatchBusID(buf, busid, pci_domain_ok)) {
-                drmFreeBusid(buf);
+            if (drmCheckBusid(fd, busid))
                 return fd;
-            }
-            if (buf)
-                drmFreeBusid(buf);
             close(fd);
         }
     }
@@ -643,7 +1243,7 @@ static int drmOpenByBusid(const char *busid, int type)
 static int drmOpenByName(const char *name, int type)
 {
     int           i;
-    int           fd;
+    int           fd, mapped;
     drmVersionPtr version;
     char *        id;
     int           base = drmGetMinorBase(type);
@@ -651,11 +1251,16 @@ static int drmOpenByName(const char *name, int type)
     if (base < 0)
         return -1;
 
+    mapped = drmNameMapOpen(name, NULL, type);
+    if (mapped >= 0)
+        return mapped;
+
     /*
      * Open the first minor number that matches the driver name and isn't
      * already in use.  If it's in use it will have a busid assigned already.
+     * Only needed if the name map could not tell.
      */
-    for (i = base; i < base + DRM_MAX_MINOR; i++) {
+    for (i = base; mapped != -ENOENT && i < base + DRM_MAX_MINOR; i++) {
         if ((fd = drmOpenMinor(i, 1, type)) >= 0) {
             if ((version = drmGetVersion(fd))) {
                 if (!strcmp(version->name, name)) {
@@ -788,61 +1393,79 @@ int drmOpenRender(int minor)
  * \param v pointer to the version information.
  *
  * \internal
- * It frees the memory pointed by \p %v as well as all the non-null strings
- * pointers in it.
+ * Frees the structure along with any string a caller has put in place of the
+ * ones it came with.
  */
 void drmFreeVersion(drmVersionPtr v)
 {
+    struct drm_version_block *block = (void *)v;
+    char *begin = (char *)block, *end;
+
     if (!v)
         return;
-    drmFree(v->name);
-    drmFree(v->date);
-    drmFree(v->desc);
-    drmFree(v);
+
+    end = begin + block->size;
+    if (v->name < begin || v->name >= end)
+        drmFree(v->name);
+    if (v->date < begin || v->date >= end)
+        drmFree(v->date);
+    if (v->desc < begin || v->desc >= end)
+        drmFree(v->desc);
+    drmFree(block);
 }
 
 
 /**
- * Free the non-public version information returned by the kernel.
- *
- * \param v pointer to the version information.
+ * Ask the kernel for the version information.
  *
  * \internal
- * Used by drmGetVersion() to free the memory pointed by \p %v as well as all
- * the non-null strings pointers in it.
+ * Used by drmGetVersion() on a cache miss.  A first DRM_IOCTL_VERSION with
+ * zeros gets the string lengths, the second one writes the strings straight
+ * into the space following the structure, which is zeroed and one byte
+ * longer than each string so that they are always null-terminated.  The
+ * result is kept by the cache, so it comes from the C library.
  */
-static void drmFreeKernelVersion(drm_version_t *v)
+static drmVersionPtr drmQueryVersion(int fd)
 {
-    if (!v)
-        return;
-    drmFree(v->name);
-    drmFree(v->date);
-    drmFree(v->desc);
-    drmFree(v);
-}
+    struct drm_version_block *block;
+    drm_version_t version;
+    size_t name_len, date_len, desc_len, size;
 
+    memclear(version);
+    if (drmIoctl(fd, DRM_IOCTL_VERSION, &version))
+        return NULL;
 
-/**
- * Copy version information.
- *
- * \param d destination pointer.
- * \param s source pointer.
- *
- * \internal
- * Used by drmGetVersion() to translate the information returned by the ioctl
- * interface in a private structure into the public structure counterpart.
- */
-static void drmCopyVersion(drmVersionPtr d, const drm_version_t *s)
-{
-    d->version_major      = s->version_major;
-    d->version_minor      = s->version_minor;
-    d->version_patchlevel = s->version_patchlevel;
-    d->name_len           = s->name_len;
-    d->name               = strdup(s->name);
-    d->date_len           = s->date_len;
-    d->date               = strdup(s->date);
-    d->desc_len           = s->desc_len;
-    d->desc               = strdup(s->desc);
+    name_len = version.name_len;
+    date_len = version.date_len;
+    desc_len = version.desc_len;
+    size = sizeof(*block) + name_len + date_len + desc_len + 3;
+
+    block = calloc(1, size);
+    if (!block)
+        return NULL;
+
+    version.name = (char *)(block + 1);
+    version.date = version.name + name_len + 1;
+    version.desc = version.date + date_len + 1;
+
+    if (drmIoctl(fd, DRM_IOCTL_VERSION, &version)) {
+        drmMsg("DRM_IOCTL_VERSION: %s\n", strerror(errno));
+        free(block);
+        return NULL;
+    }
+
+    block->version.version_major      = version.version_major;
+    block->version.version_minor      = version.version_minor;
+    block->version.version_patchlevel = version.version_patchlevel;
+    block->version.name_len           = MIN2(version.name_len, name_len);
+    block->version.name               = version.name;
+    block->version.date_len           = MIN2(version.date_len, date_len);
+    block->version.date               = version.date;
+    block->version.desc_len           = MIN2(version.desc_len, desc_len);
+    block->version.desc               = version.desc;
+    block->size = size;
+
+    return &block->version;
 }
 
 
@@ -857,42 +1480,39 @@ static void drmCopyVersion(drmVersionPtr d, const drm_version_t *s)
  * \note Similar information is available via /proc/dri.
  *
  * \internal
- * It gets the version information via successive DRM_IOCTL_VERSION ioctls,
- * first with zeros to get the string lengths, and then the actually strings.
- * It also null-terminates them since they might not be already.
+ * Only the first call for an fd reaches the kernel, later ones copy the
+ * cached structure.
  */
 drmVersionPtr drmGetVersion(int fd)
 {
-    drmVersionPtr retval;
-    drm_version_t *version = drmMalloc(sizeof(*version));
+    struct drm_fd_cache_entry *entry;
+    drmVersionPtr version, copy;
 
-    if (drmIoctl(fd, DRM_IOCTL_VERSION, version)) {
-        drmFreeKernelVersion(version);
-        return NULL;
+    pthread_mutex_lock(&drm_fd_cache.lock);
+    entry = drmFdCacheGet(fd);
+    if (entry && entry->version) {
+        copy = drmVersionCopy(entry->version);
+        pthread_mutex_unlock(&drm_fd_cache.lock);
+        return copy;
     }
+    pthread_mutex_unlock(&drm_fd_cache.lock);
 
-    if (version->name_len)
-        version->name    = drmMalloc(version->name_len + 1);
-    if (version->date_len)
-        version->date    = drmMalloc(version->date_len + 1);
-    if (version->desc_len)
-        version->desc    = drmMalloc(version->desc_len + 1);
-
-    if (drmIoctl(fd, DRM_IOCTL_VERSION, version)) {
-        drmMsg("DRM_IOCTL_VERSION: %s\n", strerror(errno));
-        drmFreeKernelVersion(version);
+    version = drmQueryVersion(fd);
+    if (!version)
         return NULL;
-    }
 
-    /* The results might not be null-terminated strings, so terminate them. */
-    if (version->name_len) version->name[version->name_len] = '\0';
-    if (version->date_len) version->date[version->date_len] = '\0';
-    if (version->desc_len) version->desc[version->desc_len] = '\0';
+    copy = drmVersionCopy(version);
 
-    retval = drmMalloc(sizeof(*retval));
-    drmCopyVersion(retval, version);
-    drmFreeKernelVersion(version);
-    return retval;
+    pthread_mutex_lock(&drm_fd_cache.lock);
+    entry = drmFdCacheGet(fd);
+    if (entry && !entry->version) {
+        entry->version = version;
+        version = NULL;
+    }
+    pthread_mutex_unlock(&drm_fd_cache.lock);
+
+    free(version);
+    return copy;
 }
 
 
@@ -906,12 +1526,15 @@ drmVersionPtr drmGetVersion(int fd)
  * \return version information.
  *
  * \internal
- * This function allocates and fills a drm_version structure with a hard coded
+ * This function allocates and fills a drmVersion structure with a hard coded
  * version number.
  */
 drmVersionPtr drmGetLibVersion(int fd)
 {
-    drm_version_t *version = drmMalloc(sizeof(*version));
+    struct drm_version_block *block = drmMalloc(sizeof(*block));
+
+    if (!block)
+        return NULL;
 
     /* Version history:
      *   NOTE THIS MUST NOT GO ABOVE VERSION 1.X due to drivers needing it
@@ -923,18 +1546,31 @@ drmVersionPtr drmGetLibVersion(int fd)
      *                    modified drmOpen to handle both busid and name
      *   revision 1.3.x = added server + memory manager
      */
-    version->version_major      = 1;
-    version->version_minor      = 3;
-    version->version_patchlevel = 0;
+    block->version.version_major      = 1;
+    block->version.version_minor      = 3;
+    block->version.version_patchlevel = 0;
+    block->size = sizeof(*block);
 
-    return (drmVersionPtr)version;
+    return &block->version;
 }
 
 int drmGetCap(int fd, uint64_t capability, uint64_t *value)
 {
+    struct drm_fd_cache_entry *entry;
     struct drm_get_cap cap;
     int ret;
 
+    if (capability < DRM_FD_CACHE_CAPS) {
+        pthread_mutex_lock(&drm_fd_cache.lock);
+        entry = drmFdCacheGet(fd);
+        if (entry && (entry->caps_valid & (1u << capability))) {
+            *value = entry->caps[capability];
+            pthread_mutex_unlock(&drm_fd_cache.lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&drm_fd_cache.lock);
+    }
+
     memclear(cap);
     cap.capability = capability;
 
@@ -942,6 +1578,16 @@ int drmGetCap(int fd, uint64_t capability, uint64_t *value)
     if (ret)
         return ret;
 
+    if (capability < DRM_FD_CACHE_CAPS) {
+        pthread_mutex_lock(&drm_fd_cache.lock);
+        entry = drmFdCacheGet(fd);
+        if (entry) {
+            entry->caps[capability] = cap.value;
+            entry->caps_valid |= 1u << capability;
+        }
+        pthread_mutex_unlock(&drm_fd_cache.lock);
+    }
+
     *value = cap.value;
     return 0;
 }
@@ -986,17 +1632,21 @@ void drmFreeBusid(const char *busid)
 char *drmGetBusid(int fd)
 {
     drm_unique_t u;
+    size_t len;
 
     memclear(u);
 
     if (drmIoctl(fd, DRM_IOCTL_GET_UNIQUE, &u))
         return NULL;
-    u.unique = drmMalloc(u.unique_len + 1);
+    len = u.unique_len;
+    u.unique = drmMalloc(len + 1);
+    if (!u.unique)
+        return NULL;
     if (drmIoctl(fd, DRM_IOCTL_GET_UNIQUE, &u)) {
         drmFree(u.unique);
         return NULL;
     }
-    u.unique[u.unique_len] = '\0';
+    u.unique[MIN2(u.unique_len, len)] = '\0';
 
     return u.unique;
 }
@@ -1240,13 +1890,15 @@ int drmClose(int fd)
     unsigned long key    = drmGetKeyFromFd(fd);
     drmHashEntry  *entry = drmGetEntry(fd);
 
+    drmFdCacheForget(fd);
+
     drmHashDestroy(entry->tagTable);
     entry->fd       = 0;
     entry->f        = NULL;
     entry->tagTable = NULL;
 
     drmHashDelete(drmHashTable, key);
-    drmFree(entry);
+    free(entry);
 
     return close(fd);
 }
@@ -2781,6 +3433,8 @@ int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle)
     return 0;
 }
 
+static char *drmNodeCacheGetNodeName(dev_t rdev, int type);
+
 static char *drmGetMinorNameForFD(int fd, int type)
 {
 #ifdef __linux__
@@ -2789,7 +3443,7 @@ static char *drmGetMinorNameForFD(int fd, int type)
     struct stat sbuf;
     const char *name = drmGetMinorName(type);
     int len;
-    char dev_name[64], buf[64];
+    char dev_name[64], buf[64], *node;
     long name_max;
     int maj, min;
 
@@ -2807,6 +3461,10 @@ static char *drmGetMinorNameForFD(int fd, int type)
     if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
         return NULL;
 
+    node = drmNodeCacheGetNodeName(sbuf.st_rdev, type);
+    if (node)
+        return node;
+
     snprintf(buf, sizeof(buf), "/sys/dev/char/%d:%d/device/drm", maj, min);
 
     sysdir = opendir(buf);
@@ -3199,11 +3857,11 @@ static void drmFreePlatformDevice(drmDevicePtr device)
             char **compatible = device->deviceinfo.platform->compatible;
 
             while (*compatible) {
-                free(*compatible);
+                drmFree(*compatible);
                 compatible++;
             }
 
-            free(device->deviceinfo.platform->compatible);
+            drmFree(device->deviceinfo.platform->compatible);
         }
     }
 }
@@ -3215,11 +3873,11 @@ static void drmFreeHost1xDevice(drmDevicePtr device)
             char **compatible = device->deviceinfo.host1x->compatible;
 
             while (*compatible) {
-                free(*compatible);
+                drmFree(*compatible);
                 compatible++;
             }
 
-            free(device->deviceinfo.host1x->compatible);
+            drmFree(device->deviceinfo.host1x->compatible);
         }
     }
 }
@@ -3241,7 +3899,7 @@ void drmFreeDevice(drmDevicePtr *device)
         }
     }
 
-    free(*device);
+    drmFree(*device);
     *device = NULL;
 }
 
@@ -3271,7 +3929,7 @@ static drmDevicePtr drmDeviceAlloc(unsigned int type, const char *node,
 
     size = sizeof(*device) + extra + bus_size + device_size;
 
-    device = calloc(1, size);
+    device = drmMalloc(size);
     if (!device)
         return NULL;
 
@@ -3294,6 +3952,7 @@ static drmDevicePtr drmDeviceAlloc(unsigned int type, const char *node,
     return device;
 }
 
+#ifdef __OpenBSD__
 static int drmProcessPciDevice(drmDevicePtr *device,
                                const char *node, int node_type,
                                int maj, int min, bool fetch_deviceinfo,
@@ -3331,9 +3990,10 @@ static int drmProcessPciDevice(drmDevicePtr *device,
     return 0;
 
 free_device:
-    free(dev);
+    drmFree(dev);
     return ret;
 }
+#endif
 
 static int drmParseUsbBusInfo(int maj, int min, drmUsbBusInfoPtr info)
 {
@@ -3403,45 +4063,6 @@ static int drmParseUsbDeviceInfo(int maj, int min, drmUsbDeviceInfoPtr info)
 #endif
 }
 
-static int drmProcessUsbDevice(drmDevicePtr *device, const char *node,
-                               int node_type, int maj, int min,
-                               bool fetch_deviceinfo, uint32_t flags)
-{
-    drmDevicePtr dev;
-    char *ptr;
-    int ret;
-
-    dev = drmDeviceAlloc(node_type, node, sizeof(drmUsbBusInfo),
-                         sizeof(drmUsbDeviceInfo), &ptr);
-    if (!dev)
-        return -ENOMEM;
-
-    dev->bustype = DRM_BUS_USB;
-
-    dev->businfo.usb = (drmUsbBusInfoPtr)ptr;
-
-    ret = drmParseUsbBusInfo(maj, min, dev->businfo.usb);
-    if (ret < 0)
-        goto free_device;
-
-    if (fetch_deviceinfo) {
-        ptr += sizeof(drmUsbBusInfo);
-        dev->deviceinfo.usb = (drmUsbDeviceInfoPtr)ptr;
-
-        ret = drmParseUsbDeviceInfo(maj, min, dev->deviceinfo.usb);
-        if (ret < 0)
-            goto free_device;
-    }
-
-    *device = dev;
-
-    return 0;
-
-free_device:
-    free(dev);
-    return ret;
-}
-
 static int drmParsePlatformBusInfo(int maj, int min, drmPlatformBusInfoPtr info)
 {
 #ifdef __linux__
@@ -3509,46 +4130,6 @@ free:
 #endif
 }
 
-static int drmProcessPlatformDevice(drmDevicePtr *device,
-                                    const char *node, int node_type,
-                                    int maj, int min, bool fetch_deviceinfo,
-                                    uint32_t flags)
-{
-    drmDevicePtr dev;
-    char *ptr;
-    int ret;
-
-    dev = drmDeviceAlloc(node_type, node, sizeof(drmPlatformBusInfo),
-                         sizeof(drmPlatformDeviceInfo), &ptr);
-    if (!dev)
-        return -ENOMEM;
-
-    dev->bustype = DRM_BUS_PLATFORM;
-
-    dev->businfo.platform = (drmPlatformBusInfoPtr)ptr;
-
-    ret = drmParsePlatformBusInfo(maj, min, dev->businfo.platform);
-    if (ret < 0)
-        goto free_device;
-
-    if (fetch_deviceinfo) {
-        ptr += sizeof(drmPlatformBusInfo);
-        dev->deviceinfo.platform = (drmPlatformDeviceInfoPtr)ptr;
-
-        ret = drmParsePlatformDeviceInfo(maj, min, dev->deviceinfo.platform);
-        if (ret < 0)
-            goto free_device;
-    }
-
-    *device = dev;
-
-    return 0;
-
-free_device:
-    free(dev);
-    return ret;
-}
-
 static int drmParseHost1xBusInfo(int maj, int min, drmHost1xBusInfoPtr info)
 {
 #ifdef __linux__
@@ -3616,44 +4197,48 @@ free:
 #endif
 }
 
-static int drmProcessHost1xDevice(drmDevicePtr *device,
-                                  const char *node, int node_type,
-                                  int maj, int min, bool fetch_deviceinfo,
-                                  uint32_t flags)
+static unsigned int drmDeviceHashBusInfo(drmDevicePtr device)
 {
-    drmDevicePtr dev;
-    char *ptr;
-    int ret;
-
-    dev = drmDeviceAlloc(node_type, node, sizeof(drmHost1xBusInfo),
-                         sizeof(drmHost1xDeviceInfo), &ptr);
-    if (!dev)
-        return -ENOMEM;
-
-    dev->bustype = DRM_BUS_HOST1X;
-
-    dev->businfo.host1x = (drmHost1xBusInfoPtr)ptr;
-
-    ret = drmParseHost1xBusInfo(maj, min, dev->businfo.host1x);
-    if (ret < 0)
-        goto free_device;
+    const unsigned char *data;
+    unsigned int hash = 2166136261u ^ device->bustype;
+    size_t i, size;
 
-    if (fetch_deviceinfo) {
-        ptr += sizeof(drmHost1xBusInfo);
-        dev->deviceinfo.host1x = (drmHost1xDeviceInfoPtr)ptr;
-
-        ret = drmParseHost1xDeviceInfo(maj, min, dev->deviceinfo.host1x);
-        if (ret < 0)
-            goto free_device;
+    switch (device->bustype) {
+    case DRM_BUS_PCI:
+        data = (const unsigned char *)device->businfo.pci;
+        size = sizeof(drmPciBusInfo);
+        break;
+    case DRM_BUS_USB:
+        data = (const unsigned char *)device->businfo.usb;
+        size = sizeof(drmUsbBusInfo);
+        break;
+    case DRM_BUS_PLATFORM:
+        data = (const unsigned char *)device->businfo.platform;
+        size = sizeof(drmPlatformBusInfo);
+        break;
+    case DRM_BUS_HOST1X:
+        data = (const unsigned char *)device->businfo.host1x;
+        size = sizeof(drmHost1xBusInfo);
+        break;
+    default:
+        return hash;
     }
 
-    *device = dev;
+    /* FNV-1a */
+    for (i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 16777619u;
 
-    return 0;
+    return hash;
+}
 
-free_device:
-    free(dev);
-    return ret;
+static void drmFoldDevice(drmDevicePtr into, drmDevicePtr *from)
+{
+    int node_type = log2((*from)->available_nodes);
+
+    into->available_nodes |= (*from)->available_nodes;
+    memcpy(into->nodes[node_type], (*from)->nodes[node_type],
+           drmGetMaxNodeName());
+    drmFreeDevice(from);
 }
 
 /* Consider devices located on the same bus as duplicate and fold the respective
@@ -3663,238 +4248,996 @@ free_device:
  */
 static void drmFoldDuplicatedDevices(drmDevicePtr local_devices[], int count)
 {
-    int node_type, i, j;
+    int stack_slots[64], *slots = stack_slots;
+    unsigned int size = 1, mask, slot;
+    int i, j;
+
+    /* Open addressing table of indices into local_devices, keyed by the
+     * bus info.  Twice as many slots as devices keeps the probes short. */
+    while (size < 2 * (unsigned int)count)
+        size <<= 1;
+
+    if (size > sizeof(stack_slots) / sizeof(stack_slots[0])) {
+        slots = malloc(size * sizeof(*slots));
+        if (!slots) {
+            for (i = 0; i < count; i++)
+                for (j = i + 1; j < count; j++)
+                    if (drmDevicesEqual(local_devices[i], local_devices[j]))
+                        drmFoldDevice(local_devices[i], &local_devices[j]);
+            return;
+        }
+    }
+
+    mask = size - 1;
+    for (slot = 0; slot < size; slot++)
+        slots[slot] = -1;
 
     for (i = 0; i < count; i++) {
-        for (j = i + 1; j < count; j++) {
-            if (drmDevicesEqual(local_devices[i], local_devices[j])) {
-                local_devices[i]->available_nodes |= local_devices[j]->available_nodes;
-                node_type = log2(local_devices[j]->available_nodes);
-                memcpy(local_devices[i]->nodes[node_type],
-                       local_devices[j]->nodes[node_type], drmGetMaxNodeName());
-                drmFreeDevice(&local_devices[j]);
-            }
-        }
+        if (!local_devices[i])
+            continue;
+
+        slot = drmDeviceHashBusInfo(local_devices[i]) & mask;
+        while ((j = slots[slot]) >= 0 &&
+               !drmDevicesEqual(local_devices[j], local_devices[i]))
+            slot = (slot + 1) & mask;
+
+        if (j >= 0)
+            drmFoldDevice(local_devices[j], &local_devices[i]);
+        else
+            slots[slot] = i;
     }
+
+    if (slots != stack_slots)
+        free(slots);
 }
 
 /* Check that the given flags are valid returning 0 on success */
 static int
 drm_device_validate_flags(uint32_t flags)
 {
-        return (flags & ~DRM_DEVICE_GET_PCI_REVISION);
+        return (flags & ~(DRM_DEVICE_GET_PCI_REVISION |
+                          DRM_DEVICE_GET_BUS_INFO_ONLY));
 }
 
-/**
- * Get information about the opened drm device
- *
- * \param fd file descriptor of the drm device
- * \param flags feature/behaviour bitmask
- * \param device the address of a drmDevicePtr where the information
- *               will be allocated in stored
- *
- * \return zero on success, negative error code otherwise.
- *
- * \note Unlike drmGetDevice it does not retrieve the pci device revision field
- * unless the DRM_DEVICE_GET_PCI_REVISION \p flag is set.
+/*
+ * Process-wide cache of the DRM device nodes.
+ *
+ * Every node found in DRM_DIR_NAME gets an entry keyed by its dev_t which
+ * remembers the bus type and bus info, and the device info once somebody
+ * asked for it.  The directory is only read again when its mtime changes,
+ * and entries are only parsed again when the node itself was re-created or
+ * drmDevicesCacheInvalidate() was called for it, so in the steady state
+ * drmGetDevices2() costs a single stat() plus the allocation of the result.
+ * drmGetDevice2(), drmGetDeviceNameFromFd2() and the primary/render node
+ * name lookups go through the same entries, found by the dev_t of the fd.
+ *
+ * The generation is bumped whenever the set of nodes or any of their
+ * information may have changed.
  */
-int drmGetDevice2(int fd, uint32_t flags, drmDevicePtr *device)
-{
-#ifdef __OpenBSD__
-    /*
-     * DRI device nodes on OpenBSD are not in their own directory, they reside
-     * in /dev along with a large number of statically generated /dev nodes.
-     * Avoid stat'ing all of /dev needlessly by implementing this custom path.
-     */
-    drmDevicePtr     d;
-    struct stat      sbuf;
-    char             node[PATH_MAX + 1];
-    const char      *dev_name;
-    int              node_type, subsystem_type;
-    int              maj, min, n, ret, base;
-
-    if (fd == -1 || device == NULL)
-        return -EINVAL;
-
-    if (fstat(fd, &sbuf))
-        return -errno;
+#define DRM_NODE_CACHE_DEVINFO      (1 << 0)
+#define DRM_NODE_CACHE_DEVINFO_REV  (1 << 1)
+
+struct drm_node_cache_entry {
+    unsigned int stamp; /* last scan which found the node */
+    dev_t rdev;
+    ino_t ino;
+    time_t ctime;
+    int node_type;
+    int bustype;        /* DRM_BUS_*, once businfo_valid is set */
+    unsigned int businfo_valid;
+    unsigned int deviceinfo_valid;
+    char *node;
+    char *devname;      /* as named by the kernel, NULL until asked for */
+    union {
+        drmPciBusInfo pci;
+        drmUsbBusInfo usb;
+        drmPlatformBusInfo platform;
+        drmHost1xBusInfo host1x;
+    } businfo;
+    union {
+        drmPciDeviceInfo pci[2]; /* without and with the revision */
+        drmUsbDeviceInfo usb;
+        drmPlatformDeviceInfo platform;
+        drmHost1xDeviceInfo host1x;
+    } deviceinfo;
+};
 
-    maj = major(sbuf.st_rdev);
-    min = minor(sbuf.st_rdev);
+static struct {
+    pthread_mutex_t lock;
+    uint32_t generation;
+    int scanned;
+    int stale;
+    ino_t dir_ino;
+    time_t dir_mtime;
+    long dir_mtime_nsec;
+    time_t scan_time;
+    unsigned int stamp;
+    void *by_rdev;      /* dev_t -> struct drm_node_cache_entry */
+    struct drm_node_cache_entry **entries; /* in directory order */
+    int count;
+} drm_node_cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-    if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
-        return -EINVAL;
+static void drmNodeCacheFreeCompatible(char **compatible)
+{
+    char **c;
 
-    node_type = drmGetMinorType(min);
-    if (node_type == -1)
-        return -ENODEV;
+    if (!compatible)
+        return;
 
-    switch (node_type) {
-    case DRM_NODE_PRIMARY:
-        dev_name = DRM_DEV_NAME;
-        break;
-    case DRM_NODE_CONTROL:
-        dev_name = DRM_CONTROL_DEV_NAME;
-        break;
-    case DRM_NODE_RENDER:
-        dev_name = DRM_RENDER_DEV_NAME;
-        break;
-    default:
-        return -EINVAL;
-    };
+    for (c = compatible; *c; c++)
+        free(*c);
+    free(compatible);
+}
 
-    base = drmGetMinorBase(node_type);
-    if (base < 0)
-        return -EINVAL;
+static void drmNodeCacheResetInfo(struct drm_node_cache_entry *entry)
+{
+    if (entry->deviceinfo_valid) {
+        if (entry->bustype == DRM_BUS_PLATFORM)
+            drmNodeCacheFreeCompatible(entry->deviceinfo.platform.compatible);
+        else if (entry->bustype == DRM_BUS_HOST1X)
+            drmNodeCacheFreeCompatible(entry->deviceinfo.host1x.compatible);
+    }
 
-    n = snprintf(node, PATH_MAX, dev_name, DRM_DIR_NAME, min - base);
-    if (n == -1 || n >= PATH_MAX)
-      return -errno;
-    if (stat(node, &sbuf))
-        return -EINVAL;
+    entry->bustype = 0;
+    entry->businfo_valid = 0;
+    entry->deviceinfo_valid = 0;
+    memset(&entry->deviceinfo, 0, sizeof(entry->deviceinfo));
+    free(entry->devname);
+    entry->devname = NULL;
+}
 
-    subsystem_type = drmParseSubsystemType(maj, min);
-    if (subsystem_type != DRM_BUS_PCI)
-        return -ENODEV;
+static void drmNodeCacheFreeEntry(struct drm_node_cache_entry *entry)
+{
+    drmNodeCacheResetInfo(entry);
+    free(entry->node);
+    free(entry);
+}
 
-    ret = drmProcessPciDevice(&d, node, node_type, maj, min, true, flags);
-    if (ret)
-        return ret;
+static time_t drmNodeCacheNow(void)
+{
+    struct timespec ts;
 
-    *device = d;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec;
+}
 
-    return 0;
+static long drmNodeCacheMtimeNsec(const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    return st->st_mtim.tv_nsec;
 #else
-    drmDevicePtr *local_devices;
-    drmDevicePtr d;
-    DIR *sysdir;
-    struct dirent *dent;
-    struct stat sbuf;
-    char node[PATH_MAX + 1];
-    int node_type, subsystem_type;
-    int maj, min;
-    int ret, i, node_count;
-    int max_count = 16;
-    dev_t find_rdev;
-
-    if (drm_device_validate_flags(flags))
-        return -EINVAL;
+    (void) st;
+    return 0;
+#endif
+}
 
-    if (fd == -1 || device == NULL)
-        return -EINVAL;
+static struct drm_node_cache_entry *drmNodeCacheLookup(dev_t rdev)
+{
+    struct drm_node_cache_entry *entry;
+    void *value;
 
-    if (fstat(fd, &sbuf))
-        return -errno;
+    if (!drm_node_cache.by_rdev ||
+        drmHashLookup(drm_node_cache.by_rdev, (unsigned long)rdev, &value))
+        return NULL;
 
-    find_rdev = sbuf.st_rdev;
-    maj = major(sbuf.st_rdev);
-    min = minor(sbuf.st_rdev);
+    entry = value;
+    return entry->rdev == rdev ? entry : NULL;
+}
 
-    if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
-        return -EINVAL;
+static struct drm_node_cache_entry *
+drmNodeCacheNewEntry(const char *node, int node_type, const struct stat *st)
+{
+    size_t node_size = ALIGN(drmGetMaxNodeName(), sizeof(void *));
+    size_t len = strlen(node);
+    struct drm_node_cache_entry *entry;
 
-    subsystem_type = drmParseSubsystemType(maj, min);
+    if (len >= node_size)
+        return NULL;
 
-    local_devices = calloc(max_count, sizeof(drmDevicePtr));
-    if (local_devices == NULL)
-        return -ENOMEM;
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        return NULL;
 
-    sysdir = opendir(DRM_DIR_NAME);
-    if (!sysdir) {
-        ret = -errno;
-        goto free_locals;
+    entry->node = calloc(1, node_size);
+    if (!entry->node) {
+        free(entry);
+        return NULL;
     }
 
-    i = 0;
-    while ((dent = readdir(sysdir))) {
+    entry->rdev = st->st_rdev;
+    entry->ino = st->st_ino;
+    entry->ctime = st->st_ctime;
+    entry->node_type = node_type;
+    memcpy(entry->node, node, len);
+
+    return entry;
+}
+
+/* Re-read the directory if it changed since the last scan.  Must be called
+ * with the cache lock held. */
+static int drmNodeCacheRevalidate(void)
+{
+    struct drm_node_cache_entry **entries, *entry;
+    char node[PATH_MAX + 1];
+    struct dirent *dent;
+    struct stat dir_st, st;
+    int i, count, size, node_type, changed;
+    unsigned int stamp;
+    time_t scan_time;
+    DIR *sysdir;
+
+    if (stat(DRM_DIR_NAME, &dir_st))
+        return -errno;
+
+    /* A change within the same second as the last scan may not have been
+     * visible to it, so such a directory is never trusted. */
+    if (drm_node_cache.scanned && !drm_node_cache.stale &&
+        dir_st.st_ino == drm_node_cache.dir_ino &&
+        dir_st.st_mtime == drm_node_cache.dir_mtime &&
+        drmNodeCacheMtimeNsec(&dir_st) == drm_node_cache.dir_mtime_nsec &&
+        dir_st.st_mtime < drm_node_cache.scan_time)
+        return 0;
+
+    if (!drm_node_cache.by_rdev) {
+        drm_node_cache.by_rdev = drmHashCreate();
+        if (!drm_node_cache.by_rdev)
+            return -ENOMEM;
+    }
+
+    scan_time = drmNodeCacheNow();
+    sysdir = opendir(DRM_DIR_NAME);
+    if (!sysdir)
+        return -errno;
+
+    size = drm_node_cache.count + 16;
+    entries = malloc(size * sizeof(*entries));
+    if (!entries) {
+        closedir(sysdir);
+        return -ENOMEM;
+    }
+
+    stamp = ++drm_node_cache.stamp;
+    changed = drm_node_cache.stale;
+    count = 0;
+
+    while ((dent = readdir(sysdir))) {
         node_type = drmGetNodeType(dent->d_name);
         if (node_type < 0)
             continue;
 
         snprintf(node, PATH_MAX, "%s/%s", DRM_DIR_NAME, dent->d_name);
-        if (stat(node, &sbuf))
+        if (stat(node, &st))
             continue;
 
-        maj = major(sbuf.st_rdev);
-        min = minor(sbuf.st_rdev);
-
-        if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
+        if (major(st.st_rdev) != DRM_MAJOR || !S_ISCHR(st.st_mode))
             continue;
 
-        if (drmParseSubsystemType(maj, min) != subsystem_type)
-            continue;
+        if (count >= size) {
+            struct drm_node_cache_entry **temp;
 
-        switch (subsystem_type) {
-        case DRM_BUS_PCI:
-            ret = drmProcessPciDevice(&d, node, node_type, maj, min, true, flags);
-            if (ret)
+            temp = realloc(entries, 2 * size * sizeof(*entries));
+            if (!temp)
                 continue;
+            entries = temp;
+            size *= 2;
+        }
 
-            break;
+        /* Reuse the old entry unless the node was re-created. */
+        entry = drmNodeCacheLookup(st.st_rdev);
+        if (entry && entry->stamp != stamp && entry->ino == st.st_ino &&
+            entry->ctime == st.st_ctime && !strcmp(entry->node, node)) {
+            entry->stamp = stamp;
+        } else {
+            /* Only the first node seen for a dev_t is indexed. */
+            int index = !entry || entry->stamp != stamp;
 
-        case DRM_BUS_USB:
-            ret = drmProcessUsbDevice(&d, node, node_type, maj, min, true, flags);
-            if (ret)
+            entry = drmNodeCacheNewEntry(node, node_type, &st);
+            if (!entry)
                 continue;
+            entry->stamp = stamp;
+            if (index) {
+                drmHashDelete(drm_node_cache.by_rdev,
+                              (unsigned long)st.st_rdev);
+                drmHashInsert(drm_node_cache.by_rdev,
+                              (unsigned long)st.st_rdev, entry);
+            }
+            changed = 1;
+        }
 
-            break;
+        entries[count++] = entry;
+    }
+    closedir(sysdir);
 
-        case DRM_BUS_PLATFORM:
-            ret = drmProcessPlatformDevice(&d, node, node_type, maj, min, true, flags);
-            if (ret)
-                continue;
+    /* Whatever was not found again, or was replaced, is gone. */
+    for (i = 0; i < drm_node_cache.count; i++) {
+        entry = drm_node_cache.entries[i];
+        if (entry->stamp == stamp)
+            continue;
 
-            break;
+        if (drmNodeCacheLookup(entry->rdev) == entry)
+            drmHashDelete(drm_node_cache.by_rdev, (unsigned long)entry->rdev);
+        drmNodeCacheFreeEntry(entry);
+        changed = 1;
+    }
+    free(drm_node_cache.entries);
+
+    drm_node_cache.entries = entries;
+    drm_node_cache.count = count;
+    drm_node_cache.dir_ino = dir_st.st_ino;
+    drm_node_cache.dir_mtime = dir_st.st_mtime;
+    drm_node_cache.dir_mtime_nsec = drmNodeCacheMtimeNsec(&dir_st);
+    drm_node_cache.scan_time = scan_time;
+    drm_node_cache.scanned = 1;
+    drm_node_cache.stale = 0;
+    if (changed)
+        drm_node_cache.generation++;
+
+    return 0;
+}
+
+static int drmNodeCacheGetBusInfo(struct drm_node_cache_entry *entry)
+{
+    int maj = major(entry->rdev), min = minor(entry->rdev);
+    int bustype, ret;
+
+    if (entry->businfo_valid)
+        return 0;
+
+    bustype = drmParseSubsystemType(maj, min);
+    switch (bustype) {
+    case DRM_BUS_PCI:
+        ret = drmParsePciBusInfo(maj, min, &entry->businfo.pci);
+        break;
+    case DRM_BUS_USB:
+        ret = drmParseUsbBusInfo(maj, min, &entry->businfo.usb);
+        break;
+    case DRM_BUS_PLATFORM:
+        ret = drmParsePlatformBusInfo(maj, min, &entry->businfo.platform);
+        break;
+    case DRM_BUS_HOST1X:
+        ret = drmParseHost1xBusInfo(maj, min, &entry->businfo.host1x);
+        break;
+    default:
+        return bustype < 0 ? bustype : -EINVAL;
+    }
 
+    if (ret < 0)
+        return ret;
+
+    entry->bustype = bustype;
+    entry->businfo_valid = 1;
+    return 0;
+}
+
+static int drmNodeCacheGetDeviceInfo(struct drm_node_cache_entry *entry,
+                                     uint32_t flags)
+{
+    int maj = major(entry->rdev), min = minor(entry->rdev);
+    unsigned int bit = DRM_NODE_CACHE_DEVINFO;
+    int rev, ret;
+
+    if (entry->bustype == DRM_BUS_PCI && (flags & DRM_DEVICE_GET_PCI_REVISION))
+        bit = DRM_NODE_CACHE_DEVINFO_REV;
+
+    if (entry->deviceinfo_valid & bit)
+        return 0;
+
+    switch (entry->bustype) {
+    case DRM_BUS_PCI:
+        rev = bit == DRM_NODE_CACHE_DEVINFO_REV;
+        ret = drmParsePciDeviceInfo(maj, min, &entry->deviceinfo.pci[rev],
+                                    flags);
+        break;
+    case DRM_BUS_USB:
+        ret = drmParseUsbDeviceInfo(maj, min, &entry->deviceinfo.usb);
+        break;
+    case DRM_BUS_PLATFORM:
+        ret = drmParsePlatformDeviceInfo(maj, min, &entry->deviceinfo.platform);
+        break;
+    case DRM_BUS_HOST1X:
+        ret = drmParseHost1xDeviceInfo(maj, min, &entry->deviceinfo.host1x);
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (ret < 0)
+        return ret;
+
+    entry->deviceinfo_valid |= bit;
+    return 0;
+}
+
+static char **drmNodeCacheCopyCompatible(char **compatible)
+{
+    unsigned int count = 0, i;
+    char **copy;
+
+    while (compatible[count])
+        count++;
+
+    /* The copy is handed out with a drmDevice, so it comes from
+     * drmMalloc() like the device itself. */
+    copy = drmMalloc((count + 1) * sizeof(*copy));
+    if (!copy)
+        return NULL;
+
+    for (i = 0; i < count; i++) {
+        copy[i] = drmStrdup(compatible[i]);
+        if (!copy[i]) {
+            while (i--)
+                drmFree(copy[i]);
+            drmFree(copy);
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+static size_t drmNodeCacheBusInfoSize(int bustype)
+{
+    switch (bustype) {
+    case DRM_BUS_PCI:
+        return sizeof(drmPciBusInfo);
+    case DRM_BUS_USB:
+        return sizeof(drmUsbBusInfo);
+    case DRM_BUS_PLATFORM:
+        return sizeof(drmPlatformBusInfo);
+    case DRM_BUS_HOST1X:
+        return sizeof(drmHost1xBusInfo);
+    default:
+        return 0;
+    }
+}
+
+/* Whether two entries with parsed bus info are nodes of the same device. */
+static bool drmNodeCacheSameDevice(struct drm_node_cache_entry *a,
+                                   struct drm_node_cache_entry *b)
+{
+    size_t size = drmNodeCacheBusInfoSize(a->bustype);
+
+    return size && a->bustype == b->bustype &&
+           memcmp(&a->businfo, &b->businfo, size) == 0;
+}
+
+/* Build a drmDevice out of a cache entry.  Must be called with the cache
+ * lock held. */
+static int drmNodeCacheGetDevice(struct drm_node_cache_entry *entry,
+                                 bool fetch_deviceinfo, uint32_t flags,
+                                 drmDevicePtr *device)
+{
+    size_t bus_size, device_size;
+    drmDevicePtr dev;
+    char *ptr;
+    int ret;
+
+    ret = drmNodeCacheGetBusInfo(entry);
+    if (ret)
+        return ret;
+
+    if (fetch_deviceinfo) {
+        ret = drmNodeCacheGetDeviceInfo(entry, flags);
+        if (ret)
+            return ret;
+    }
+
+    switch (entry->bustype) {
+    case DRM_BUS_PCI:
+        device_size = sizeof(drmPciDeviceInfo);
+        break;
+    case DRM_BUS_USB:
+        device_size = sizeof(drmUsbDeviceInfo);
+        break;
+    case DRM_BUS_PLATFORM:
+        device_size = sizeof(drmPlatformDeviceInfo);
+        break;
+    case DRM_BUS_HOST1X:
+        device_size = sizeof(drmHost1xDeviceInfo);
+        break;
+    default:
+        return -EINVAL;
+    }
+    bus_size = drmNodeCacheBusInfoSize(entry->bustype);
+
+    dev = drmDeviceAlloc(entry->node_type, entry->node, bus_size,
+                         device_size, &ptr);
+    if (!dev)
+        return -ENOMEM;
+
+    dev->bustype = entry->bustype;
+    dev->businfo.pci = (drmPciBusInfoPtr)ptr;
+    memcpy(ptr, &entry->businfo, bus_size);
+
+    if (fetch_deviceinfo) {
+        ptr += bus_size;
+        dev->deviceinfo.pci = (drmPciDeviceInfoPtr)ptr;
+
+        switch (entry->bustype) {
+        case DRM_BUS_PCI:
+            *dev->deviceinfo.pci = entry->deviceinfo.pci[
+                !!(flags & DRM_DEVICE_GET_PCI_REVISION)];
+            break;
+        case DRM_BUS_USB:
+            *dev->deviceinfo.usb = entry->deviceinfo.usb;
+            break;
+        case DRM_BUS_PLATFORM:
+            dev->deviceinfo.platform->compatible =
+                drmNodeCacheCopyCompatible(entry->deviceinfo.platform.compatible);
+            if (!dev->deviceinfo.platform->compatible)
+                goto free_device;
+            break;
         case DRM_BUS_HOST1X:
-            ret = drmProcessHost1xDevice(&d, node, node_type, maj, min, true, flags);
-            if (ret)
-                continue;
+            dev->deviceinfo.host1x->compatible =
+                drmNodeCacheCopyCompatible(entry->deviceinfo.host1x.compatible);
+            if (!dev->deviceinfo.host1x->compatible)
+                goto free_device;
+            break;
+        }
+    }
+
+    *device = dev;
+    return 0;
+
+free_device:
+    drmFree(dev);
+    return -ENOMEM;
+}
+
+/* Find the entry of an opened node and make sure its bus info is known.
+ * Must be called with the cache lock held. */
+static int drmNodeCacheFind(dev_t rdev, struct drm_node_cache_entry **entry)
+{
+    int ret;
+
+    ret = drmNodeCacheRevalidate();
+    if (ret)
+        return ret;
+
+    *entry = drmNodeCacheLookup(rdev);
+    if (!*entry)
+        return -ENODEV;
+
+    return drmNodeCacheGetBusInfo(*entry);
+}
+
+/* Get the node of the given type belonging to the same device as rdev.
+ * Returns NULL if either is unknown to the cache. */
+static char *drmNodeCacheGetNodeName(dev_t rdev, int type)
+{
+    struct drm_node_cache_entry *entry, *other;
+    char *name = NULL;
+    int i;
+
+    pthread_mutex_lock(&drm_node_cache.lock);
+    if (drmNodeCacheFind(rdev, &entry))
+        goto out;
+
+    if (entry->node_type == type) {
+        name = strdup(entry->node);
+        goto out;
+    }
+
+    for (i = 0; i < drm_node_cache.count; i++) {
+        other = drm_node_cache.entries[i];
+        if (other->node_type != type || drmNodeCacheGetBusInfo(other))
+            continue;
 
+        if (drmNodeCacheSameDevice(entry, other)) {
+            name = strdup(other->node);
             break;
+        }
+    }
 
-        default:
+out:
+    pthread_mutex_unlock(&drm_node_cache.lock);
+    return name;
+}
+
+/*
+ * Driver name and bus ID of every node, for drmOpenByName() and
+ * drmOpenByBusid().
+ *
+ * Both used to open every possible minor and ask it for its version and bus
+ * ID until one matched.  The map is filled in one pass over the nodes of a
+ * type the node cache knows about, taking PCI bus IDs from sysfs, and a hit
+ * only costs opening the node plus one fstat() to make sure it still is the
+ * same device.  A miss is trusted as long as the node cache generation did
+ * not change; if the map cannot be built, or found no node at all, the
+ * callers fall back to probing every minor.
+ */
+struct drm_name_map_node {
+    int minor;
+    dev_t rdev;
+    char *node;
+    char *name;
+    char *busid;        /* PCI only, NULL otherwise */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct {
+        int built;
+        uint32_t generation;
+        struct drm_name_map_node *nodes;
+        int count;
+    } types[DRM_NODE_MAX];
+} drm_name_map = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void drmNameMapDrop(int type)
+{
+    int i;
+
+    for (i = 0; i < drm_name_map.types[type].count; i++) {
+        free(drm_name_map.types[type].nodes[i].node);
+        free(drm_name_map.types[type].nodes[i].name);
+        free(drm_name_map.types[type].nodes[i].busid);
+    }
+    free(drm_name_map.types[type].nodes);
+    drm_name_map.types[type].nodes = NULL;
+    drm_name_map.types[type].count = 0;
+    drm_name_map.types[type].built = 0;
+}
+
+static int drmNameMapCompare(const void *a, const void *b)
+{
+    const struct drm_name_map_node *na = a, *nb = b;
+
+    return na->minor - nb->minor;
+}
+
+/* Must be called with the map lock held. */
+static int drmNameMapBuild(int type)
+{
+    struct drm_node_cache_entry *entry;
+    struct drm_name_map_node *nodes;
+    drmVersionPtr version;
+    uint32_t generation;
+    char busid[32];
+    int i, count, fd, ret;
+
+    drmNameMapDrop(type);
+
+    pthread_mutex_lock(&drm_node_cache.lock);
+    ret = drmNodeCacheRevalidate();
+    if (ret) {
+        pthread_mutex_unlock(&drm_node_cache.lock);
+        return ret;
+    }
+
+    nodes = calloc(drm_node_cache.count + 1, sizeof(*nodes));
+    if (!nodes) {
+        pthread_mutex_unlock(&drm_node_cache.lock);
+        return -ENOMEM;
+    }
+
+    for (i = count = 0; i < drm_node_cache.count; i++) {
+        entry = drm_node_cache.entries[i];
+        if (entry->node_type != type)
             continue;
+
+        nodes[count].minor = minor(entry->rdev);
+        nodes[count].rdev = entry->rdev;
+        nodes[count].node = strdup(entry->node);
+        if (!nodes[count].node)
+            continue;
+
+        if (!drmNodeCacheGetBusInfo(entry) && entry->bustype == DRM_BUS_PCI) {
+            snprintf(busid, sizeof(busid), "pci:%04x:%02x:%02x.%u",
+                     entry->businfo.pci.domain, entry->businfo.pci.bus,
+                     entry->businfo.pci.dev, entry->businfo.pci.func);
+            nodes[count].busid = strdup(busid);
         }
+        count++;
+    }
+    generation = drm_node_cache.generation;
+    pthread_mutex_unlock(&drm_node_cache.lock);
 
-        if (i >= max_count) {
-            drmDevicePtr *temp;
+    for (i = 0; i < count; i++) {
+        fd = open(nodes[i].node, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
 
-            max_count += 16;
-            temp = realloc(local_devices, max_count * sizeof(drmDevicePtr));
-            if (!temp)
-                goto free_devices;
-            local_devices = temp;
+        version = drmGetVersion(fd);
+        if (version) {
+            nodes[i].name = strdup(version->name);
+            drmFreeVersion(version);
+        }
+        drmFdCacheForget(fd);
+        close(fd);
+    }
+
+    qsort(nodes, count, sizeof(*nodes), drmNameMapCompare);
+
+    drm_name_map.types[type].nodes = nodes;
+    drm_name_map.types[type].count = count;
+    drm_name_map.types[type].generation = generation;
+    drm_name_map.types[type].built = 1;
+    return 0;
+}
+
+/* Whether the nodes of a type may have changed since the map was built. */
+static int drmNameMapStale(int type)
+{
+    int stale;
+
+    pthread_mutex_lock(&drm_node_cache.lock);
+    stale = drmNodeCacheRevalidate() ||
+            drm_node_cache.generation != drm_name_map.types[type].generation;
+    pthread_mutex_unlock(&drm_node_cache.lock);
+
+    return stale;
+}
+
+/**
+ * Open the first unused node of a driver, or the node with a bus ID.
+ *
+ * \return a file descriptor, -ENOENT if there is no such node, or another
+ * negative error code if the map cannot tell.
+ */
+static int drmNameMapOpen(const char *name, const char *busid, int type)
+{
+    struct drm_name_map_node *node;
+    int i, fd, ret, unknown, retried = 0;
+    struct stat st;
+    char *id;
+
+    if (type < 0 || type >= DRM_NODE_MAX)
+        return -EINVAL;
+
+    pthread_mutex_lock(&drm_name_map.lock);
+retry:
+    if (!drm_name_map.types[type].built) {
+        ret = drmNameMapBuild(type);
+        if (ret)
+            goto out;
+        retried = 1;
+    }
+
+    /* Nothing at all may just mean the nodes still need to be created. */
+    ret = -ENODEV;
+    if (!drm_name_map.types[type].count)
+        goto out;
+
+    unknown = 0;
+    for (i = 0; i < drm_name_map.types[type].count; i++) {
+        node = &drm_name_map.types[type].nodes[i];
+
+        /* A node we know nothing about could be the one. */
+        if ((name && !node->name) || (busid && !node->busid)) {
+            unknown = 1;
+            continue;
+        }
+        if (name && strcmp(node->name, name))
+            continue;
+        /* Domains are left to drmCheckBusid(), which knows whether the
+         * kernel reports them. */
+        if (busid && !drmMatchBusID(node->busid, busid, 0))
+            continue;
+
+        fd = open(node->node, O_RDWR, 0);
+        if (fd >= 0 && (fstat(fd, &st) || st.st_rdev != node->rdev)) {
+            close(fd);
+            fd = -1;
         }
+        if (fd < 0)
+            goto rebuild;
 
-        /* store target at local_devices[0] for ease to use below */
-        if (find_rdev == sbuf.st_rdev && i) {
-            local_devices[i] = local_devices[0];
-            local_devices[0] = d;
+        if (busid) {
+            if (drmCheckBusid(fd, busid)) {
+                ret = fd;
+                goto out;
+            }
+        } else {
+            id = drmGetBusid(fd);
+            drmMsg("drmGetBusid returned '%s'\n", id ? id : "NULL");
+            if (!id || !*id) {
+                drmFreeBusid(id);
+                ret = fd;
+                goto out;
+            }
+            drmFreeBusid(id);
         }
-        else
-            local_devices[i] = d;
-        i++;
+        drmFdCacheForget(fd);
+        close(fd);
     }
-    node_count = i;
 
-    drmFoldDuplicatedDevices(local_devices, node_count);
+    ret = unknown ? -ENODEV : -ENOENT;
+    if (retried || !drmNameMapStale(type))
+        goto out;
 
-    *device = local_devices[0];
-    drmFreeDevices(&local_devices[1], node_count - 1);
+rebuild:
+    /* The node went away or was replaced: look again, but only once. */
+    ret = -ENODEV;
+    if (!retried) {
+        drmNameMapDrop(type);
+        goto retry;
+    }
 
-    closedir(sysdir);
-    free(local_devices);
-    if (*device == NULL)
+out:
+    pthread_mutex_unlock(&drm_name_map.lock);
+    return ret;
+}
+
+/**
+ * Get the generation of the device cache.
+ *
+ * \return a counter which changes whenever drmGetDevices2() may return
+ * different results than before, e.g. after a hotplug.
+ *
+ * \internal
+ * Checks the mtime of the DRM device directory, which is cheap enough to be
+ * called on every iteration of an event loop.
+ */
+uint32_t drmGetDevicesGeneration(void)
+{
+    uint32_t generation;
+
+    pthread_mutex_lock(&drm_node_cache.lock);
+    drmNodeCacheRevalidate();
+    generation = drm_node_cache.generation;
+    pthread_mutex_unlock(&drm_node_cache.lock);
+
+    return generation;
+}
+
+/**
+ * Drop cached information about a device.
+ *
+ * \param rdev device number of the node a uevent was received for, or 0 to
+ * drop everything.
+ *
+ * Device nodes being added or removed are noticed automatically.  This is
+ * meant for changes which leave the device directory untouched, such as a
+ * "change" uevent, or for callers who want to be sure.
+ */
+void drmDevicesCacheInvalidate(dev_t rdev)
+{
+    int i;
+
+    pthread_mutex_lock(&drm_node_cache.lock);
+    for (i = 0; i < drm_node_cache.count; i++)
+        if (!rdev || drm_node_cache.entries[i]->rdev == rdev)
+            drmNodeCacheResetInfo(drm_node_cache.entries[i]);
+    drm_node_cache.stale = 1;
+    pthread_mutex_unlock(&drm_node_cache.lock);
+}
+
+/**
+ * Get information about the opened drm device
+ *
+ * \param fd file descriptor of the drm device
+ * \param flags feature/behaviour bitmask
+ * \param device the address of a drmDevicePtr where the information
+ *               will be allocated in stored
+ *
+ * \return zero on success, negative error code otherwise.
+ *
+ * \note Unlike drmGetDevice it does not retrieve the pci device revision field
+ * unless the DRM_DEVICE_GET_PCI_REVISION \p flag is set.  With
+ * DRM_DEVICE_GET_BUS_INFO_ONLY the deviceinfo is not retrieved at all.
+ *
+ * \internal
+ * Served from the device cache, so asking again for a device which was seen
+ * before costs an fstat(), a stat() of the device directory and a hash
+ * lookup.
+ */
+int drmGetDevice2(int fd, uint32_t flags, drmDevicePtr *device)
+{
+#ifdef __OpenBSD__
+    /*
+     * DRI device nodes on OpenBSD are not in their own directory, they reside
+     * in /dev along with a large number of statically generated /dev nodes.
+     * Avoid stat'ing all of /dev needlessly by implementing this custom path.
+     */
+    drmDevicePtr     d;
+    struct stat      sbuf;
+    char             node[PATH_MAX + 1];
+    const char      *dev_name;
+    int              node_type, subsystem_type;
+    int              maj, min, n, ret, base;
+
+    if (fd == -1 || device == NULL)
+        return -EINVAL;
+
+    if (fstat(fd, &sbuf))
+        return -errno;
+
+    maj = major(sbuf.st_rdev);
+    min = minor(sbuf.st_rdev);
+
+    if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
+        return -EINVAL;
+
+    node_type = drmGetMinorType(min);
+    if (node_type == -1)
         return -ENODEV;
+
+    switch (node_type) {
+    case DRM_NODE_PRIMARY:
+        dev_name = DRM_DEV_NAME;
+        break;
+    case DRM_NODE_CONTROL:
+        dev_name = DRM_CONTROL_DEV_NAME;
+        break;
+    case DRM_NODE_RENDER:
+        dev_name = DRM_RENDER_DEV_NAME;
+        break;
+    default:
+        return -EINVAL;
+    };
+
+    base = drmGetMinorBase(node_type);
+    if (base < 0)
+        return -EINVAL;
+
+    n = snprintf(node, PATH_MAX, dev_name, DRM_DIR_NAME, min - base);
+    if (n == -1 || n >= PATH_MAX)
+      return -errno;
+    if (stat(node, &sbuf))
+        return -EINVAL;
+
+    subsystem_type = drmParseSubsystemType(maj, min);
+    if (subsystem_type != DRM_BUS_PCI)
+        return -ENODEV;
+
+    ret = drmProcessPciDevice(&d, node, node_type, maj, min, true, flags);
+    if (ret)
+        return ret;
+
+    *device = d;
+
     return 0;
+#else
+    struct drm_node_cache_entry *entry, *other;
+    struct stat sbuf;
+    drmDevicePtr d;
+    int ret, i;
 
-free_devices:
-    drmFreeDevices(local_devices, i);
-    closedir(sysdir);
+    if (drm_device_validate_flags(flags))
+        return -EINVAL;
 
-free_locals:
-    free(local_devices);
+    if (fd == -1 || device == NULL)
+        return -EINVAL;
+
+    if (fstat(fd, &sbuf))
+        return -errno;
+
+    if (major(sbuf.st_rdev) != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
+        return -EINVAL;
+
+    pthread_mutex_lock(&drm_node_cache.lock);
+
+    ret = drmNodeCacheFind(sbuf.st_rdev, &entry);
+    if (ret)
+        goto unlock;
+
+    ret = drmNodeCacheGetDevice(entry,
+                                !(flags & DRM_DEVICE_GET_BUS_INFO_ONLY),
+                                flags, &d);
+    if (ret)
+        goto unlock;
+
+    /* Add the other nodes of the same device. */
+    for (i = 0; i < drm_node_cache.count; i++) {
+        other = drm_node_cache.entries[i];
+        if (other->node_type == entry->node_type ||
+            drmNodeCacheGetBusInfo(other) ||
+            !drmNodeCacheSameDevice(entry, other))
+            continue;
+
+        d->available_nodes |= 1 << other->node_type;
+        memcpy(d->nodes[other->node_type], other->node, drmGetMaxNodeName());
+    }
+
+    *device = d;
+
+unlock:
+    pthread_mutex_unlock(&drm_node_cache.lock);
     return ret;
 #endif
 }
@@ -3927,106 +5270,48 @@ int drmGetDevice(int fd, drmDevicePtr *device)
  *         capped by the max_devices.
  *
  * \note Unlike drmGetDevices it does not retrieve the pci device revision field
- * unless the DRM_DEVICE_GET_PCI_REVISION \p flag is set.
+ * unless the DRM_DEVICE_GET_PCI_REVISION \p flag is set.  With
+ * DRM_DEVICE_GET_BUS_INFO_ONLY the deviceinfo is not retrieved at all.
+ *
+ * \internal
+ * Served from the device cache, see drmGetDevicesGeneration().
  */
 int drmGetDevices2(uint32_t flags, drmDevicePtr devices[], int max_devices)
 {
     drmDevicePtr *local_devices;
     drmDevicePtr device;
-    DIR *sysdir;
-    struct dirent *dent;
-    struct stat sbuf;
-    char node[PATH_MAX + 1];
-    int node_type, subsystem_type;
-    int maj, min;
+    bool fetch_deviceinfo;
     int ret, i, node_count, device_count;
-    int max_count = 16;
 
     if (drm_device_validate_flags(flags))
         return -EINVAL;
 
-    local_devices = calloc(max_count, sizeof(drmDevicePtr));
-    if (local_devices == NULL)
-        return -ENOMEM;
-
-    sysdir = opendir(DRM_DIR_NAME);
-    if (!sysdir) {
-        ret = -errno;
-        goto free_locals;
-    }
-
-    i = 0;
-    while ((dent = readdir(sysdir))) {
-        node_type = drmGetNodeType(dent->d_name);
-        if (node_type < 0)
-            continue;
-
-        snprintf(node, PATH_MAX, "%s/%s", DRM_DIR_NAME, dent->d_name);
-        if (stat(node, &sbuf))
-            continue;
-
-        maj = major(sbuf.st_rdev);
-        min = minor(sbuf.st_rdev);
-
-        if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
-            continue;
-
-        subsystem_type = drmParseSubsystemType(maj, min);
-
-        if (subsystem_type < 0)
-            continue;
-
-        switch (subsystem_type) {
-        case DRM_BUS_PCI:
-            ret = drmProcessPciDevice(&device, node, node_type,
-                                      maj, min, devices != NULL, flags);
-            if (ret)
-                continue;
-
-            break;
+    fetch_deviceinfo = devices != NULL &&
+                       !(flags & DRM_DEVICE_GET_BUS_INFO_ONLY);
 
-        case DRM_BUS_USB:
-            ret = drmProcessUsbDevice(&device, node, node_type, maj, min,
-                                      devices != NULL, flags);
-            if (ret)
-                continue;
+    pthread_mutex_lock(&drm_node_cache.lock);
 
-            break;
-
-        case DRM_BUS_PLATFORM:
-            ret = drmProcessPlatformDevice(&device, node, node_type, maj, min,
-                                           devices != NULL, flags);
-            if (ret)
-                continue;
-
-            break;
-
-        case DRM_BUS_HOST1X:
-            ret = drmProcessHost1xDevice(&device, node, node_type, maj, min,
-                                         devices != NULL, flags);
-            if (ret)
-                continue;
+    ret = drmNodeCacheRevalidate();
+    if (ret)
+        goto unlock;
 
-            break;
+    local_devices = calloc(drm_node_cache.count + 1, sizeof(drmDevicePtr));
+    if (local_devices == NULL) {
+        ret = -ENOMEM;
+        goto unlock;
+    }
 
-        default:
+    node_count = 0;
+    for (i = 0; i < drm_node_cache.count; i++) {
+        ret = drmNodeCacheGetDevice(drm_node_cache.entries[i],
+                                    fetch_deviceinfo, flags, &device);
+        if (ret)
             continue;
-        }
-
-        if (i >= max_count) {
-            drmDevicePtr *temp;
 
-            max_count += 16;
-            temp = realloc(local_devices, max_count * sizeof(drmDevicePtr));
-            if (!temp)
-                goto free_devices;
-            local_devices = temp;
-        }
-
-        local_devices[i] = device;
-        i++;
+        local_devices[node_count++] = device;
     }
-    node_count = i;
+
+    pthread_mutex_unlock(&drm_node_cache.lock);
 
     drmFoldDuplicatedDevices(local_devices, node_count);
 
@@ -4043,16 +5328,11 @@ int drmGetDevices2(uint32_t flags, drmDevicePtr devices[], int max_devices)
         device_count++;
     }
 
-    closedir(sysdir);
     free(local_devices);
     return device_count;
 
-free_devices:
-    drmFreeDevices(local_devices, i);
-    closedir(sysdir);
-
-free_locals:
-    free(local_devices);
+unlock:
+    pthread_mutex_unlock(&drm_node_cache.lock);
     return ret;
 }
 
@@ -4073,11 +5353,30 @@ int drmGetDevices(drmDevicePtr devices[], int max_devices)
     return drmGetDevices2(DRM_DEVICE_GET_PCI_REVISION, devices, max_devices);
 }
 
+#ifdef __linux__
+static char *drmGetDevNameFromSysfs(unsigned int maj, unsigned int min)
+{
+    char path[PATH_MAX + 1], *value;
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%d:%d", maj, min);
+
+    value = sysfs_uevent_get(path, "DEVNAME");
+    if (!value)
+        return NULL;
+
+    snprintf(path, sizeof(path), "/dev/%s", value);
+    free(value);
+
+    return strdup(path);
+}
+#endif
+
 char *drmGetDeviceNameFromFd2(int fd)
 {
 #ifdef __linux__
+    struct drm_node_cache_entry *entry;
     struct stat sbuf;
-    char path[PATH_MAX + 1], *value;
+    char *name = NULL;
     unsigned int maj, min;
 
     if (fstat(fd, &sbuf))
@@ -4089,16 +5388,20 @@ char *drmGetDeviceNameFromFd2(int fd)
     if (maj != DRM_MAJOR || !S_ISCHR(sbuf.st_mode))
         return NULL;
 
-    snprintf(path, sizeof(path), "/sys/dev/char/%d:%d", maj, min);
-
-    value = sysfs_uevent_get(path, "DEVNAME");
-    if (!value)
-        return NULL;
-
-    snprintf(path, sizeof(path), "/dev/%s", value);
-    free(value);
+    /* Nodes living outside of DRM_DIR_NAME are not cached. */
+    pthread_mutex_lock(&drm_node_cache.lock);
+    if (drmNodeCacheRevalidate() == 0 &&
+        (entry = drmNodeCacheLookup(sbuf.st_rdev))) {
+        if (!entry->devname)
+            entry->devname = drmGetDevNameFromSysfs(maj, min);
+        if (entry->devname)
+            name = strdup(entry->devname);
+        pthread_mutex_unlock(&drm_node_cache.lock);
+        return name;
+    }
+    pthread_mutex_unlock(&drm_node_cache.lock);
 
-    return strdup(path);
+    return drmGetDevNameFromSysfs(maj, min);
 #else
     struct stat      sbuf;
     char             node[PATH_MAX + 1];
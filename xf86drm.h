@@ -119,6 +119,81 @@ typedef struct drmHashEntry {
 } drmHashEntry;
 
 extern int drmIoctl(int fd, unsigned long request, void *arg);
+
+/**
+ * Per-request drmIoctl() statistics.
+ *
+ * \sa drmIoctlStatsEnable(), drmGetIoctlStats() and drmResetIoctlStats().
+ */
+#define DRM_IOCTL_STATS_MAX_NR  256 /**< Indexed by DRM_IOCTL_NR() */
+#define DRM_IOCTL_STATS_BUCKETS 32
+
+typedef struct _drmIoctlStat {
+    uint64_t calls;    /**< Number of drmIoctl() calls */
+    uint64_t retries;  /**< Restarts after EINTR or EAGAIN */
+    uint64_t errors;   /**< Calls that eventually failed */
+    uint64_t total_ns; /**< Accumulated latency, including restarts */
+    uint64_t max_ns;   /**< Worst observed latency */
+    /** Calls with a latency of [2^i, 2^(i+1)) nanoseconds, the last bucket
+     * also counts everything slower. */
+    uint64_t histogram[DRM_IOCTL_STATS_BUCKETS];
+} drmIoctlStat, *drmIoctlStatPtr;
+
+extern int drmIoctlStatsEnable(int enable);
+extern int drmGetIoctlStats(drmIoctlStatPtr stats, int count);
+extern void drmResetIoctlStats(void);
+
+/**
+ * Userspace replacement for the kernel side of drmIoctl() and drmMmap().
+ *
+ * \c ioctl follows the ioctl(2) convention of returning -1 and setting errno
+ * on failure; it must forward requests on file descriptors it does not own
+ * to the kernel.  \c mmap and \c munmap are optional and default to the
+ * system calls.
+ *
+ * \sa drmSetIoctlBackend() and drmNullBackend().
+ */
+typedef struct _drmIoctlBackend {
+    int (*ioctl)(void *priv, int fd, unsigned long request, void *arg);
+    void *(*mmap)(void *priv, void *addr, size_t length, int prot, int flags,
+                  int fd, uint64_t offset);
+    int (*munmap)(void *priv, void *addr, size_t length);
+    void *priv;
+} drmIoctlBackend, *drmIoctlBackendPtr;
+
+extern int drmSetIoctlBackend(const drmIoctlBackend *backend);
+extern void *drmMmap(void *addr, size_t length, int prot, int flags,
+                     int fd, uint64_t offset);
+extern int drmMunmap(void *addr, size_t length);
+
+/**
+ * Reference backend emulating buffer management for amdgpu, i915, msm and
+ * etnaviv without any hardware.  Devices are created with
+ * drmNullDeviceOpen() once the backend has been installed.
+ */
+extern const drmIoctlBackend *drmNullBackend(void);
+extern int drmNullDeviceOpen(const char *driver);
+
+/**
+ * Memory allocator for the objects libdrm hands out.
+ *
+ * Every callback follows its C library namesake and gets \c priv as its
+ * first argument.  \c free_fn is also called with pointers the other
+ * callbacks returned before, but never with NULL.  The members carry a
+ * suffix so that they still compile where malloc() and friends are macros.
+ *
+ * \sa drmSetAllocator().
+ */
+typedef struct _drmAllocator {
+    void *(*malloc_fn)(void *priv, size_t size);
+    void *(*calloc_fn)(void *priv, size_t nmemb, size_t size);
+    void *(*realloc_fn)(void *priv, void *ptr, size_t size);
+    void (*free_fn)(void *priv, void *ptr);
+    void *priv;
+} drmAllocator, *drmAllocatorPtr;
+
+extern int drmSetAllocator(const drmAllocator *allocator);
+
 extern void *drmGetHashTable(void);
 extern drmHashEntry *drmGetEntry(int fd);
 
@@ -689,6 +764,7 @@ extern int           drmWaitVBlank(int fd, drmVBlankPtr vbl);
 extern void          drmSetServerInfo(drmServerInfoPtr info);
 extern int           drmError(int err, const char *label);
 extern void          *drmMalloc(int size);
+extern void          *drmRealloc(void *pt, size_t size);
 extern void          drmFree(void *pt);
 
 /* Hash table routines */
@@ -706,7 +782,7 @@ extern int           drmRandomDestroy(void *state);
 extern unsigned long drmRandom(void *state);
 extern double        drmRandomDouble(void *state);
 
-/* Skip list routines */
+/* Ordered map routines, historically a skip list */
 
 extern void *drmSLCreate(void);
 extern int  drmSLDestroy(void *l);
@@ -719,6 +795,10 @@ extern void drmSLDump(void *l);
 extern int  drmSLLookupNeighbors(void *l, unsigned long key,
 				 unsigned long *prev_key, void **prev_value,
 				 unsigned long *next_key, void **next_value);
+extern int  drmSLFirstRange(void *l, unsigned long first, unsigned long last,
+			    unsigned long *key, void **value);
+extern int  drmSLInsertBulk(void *l, const unsigned long *keys,
+			    void * const *values, int count);
 
 extern int drmOpenOnce(void *unused, const char *BusID, int *newlyopened);
 extern int drmOpenOnceWithType(const char *BusID, int *newlyopened, int type);
@@ -759,6 +839,40 @@ typedef struct _drmEventContext {
 
 extern int drmHandleEvent(int fd, drmEventContextPtr evctx);
 
+/*
+ * Event dispatcher: an alternative to drmHandleEvent() that reads the fd
+ * into a reusable buffer until the kernel's event queue is empty and hands
+ * every event, including ones drmEventContext has no slot for, to the
+ * handler registered for its type.  Handlers get the time from the event's
+ * kernel time stamp to its dispatch, or 0 for events that carry none.
+ */
+typedef void (*drmEventHandlerFunc)(int fd, const struct drm_event *event,
+				    uint64_t latency_ns, void *data);
+
+typedef struct _drmEventDispatcher drmEventDispatcher, *drmEventDispatcherPtr;
+
+typedef struct _drmEventStats {
+	uint64_t count_reads;
+	uint64_t count_events;
+	uint64_t count_unhandled;
+	uint64_t total_latency_ns;
+	uint64_t max_latency_ns;
+} drmEventStats, *drmEventStatsPtr;
+
+/* Handles the event types no handler was set for. */
+#define DRM_EVENT_DEFAULT 0
+
+extern drmEventDispatcherPtr drmEventDispatcherCreate(size_t buffer_size);
+extern void drmEventDispatcherDestroy(drmEventDispatcherPtr dispatcher);
+extern int drmEventDispatcherSetHandler(drmEventDispatcherPtr dispatcher,
+					uint32_t type,
+					drmEventHandlerFunc handler,
+					void *data);
+extern int drmEventDispatch(int fd, drmEventDispatcherPtr dispatcher);
+extern void drmEventDispatcherGetStats(drmEventDispatcherPtr dispatcher,
+				       drmEventStatsPtr stats);
+extern void drmEventDispatcherResetStats(drmEventDispatcherPtr dispatcher);
+
 extern char *drmGetDeviceNameFromFd(int fd);
 
 /* Improved version of drmGetDeviceNameFromFd which attributes for any type of
@@ -848,9 +962,13 @@ extern int drmGetDevices(drmDevicePtr devices[], int max_devices);
 extern void drmFreeDevices(drmDevicePtr devices[], int count);
 
 #define DRM_DEVICE_GET_PCI_REVISION (1 << 0)
+#define DRM_DEVICE_GET_BUS_INFO_ONLY (1 << 1)
 extern int drmGetDevice2(int fd, uint32_t flags, drmDevicePtr *device);
 extern int drmGetDevices2(uint32_t flags, drmDevicePtr devices[], int max_devices);
 
+extern uint32_t drmGetDevicesGeneration(void);
+extern void drmDevicesCacheInvalidate(dev_t rdev);
+
 extern int drmDevicesEqual(drmDevicePtr a, drmDevicePtr b);
 
 extern int drmSyncobjCreate(int fd, uint32_t flags, uint32_t *handle);
@@ -27,10 +27,12 @@
  *
  * DESCRIPTION
  *
- * This file contains a straightforward implementation of a fixed-sized
- * hash table using self-organizing linked lists [Knuth73, pp. 398-399] for
- * collision resolution.  There are two potentially interesting things
- * about this implementation:
+ * This file contains an implementation of linear hashing [Larson88]: the
+ * table starts out with HASH_MIN_SIZE buckets and grows by splitting a
+ * single bucket whenever the average chain gets longer than HASH_LOAD, so
+ * the cost of expanding the table is spread evenly over the insertions.
+ * There are a few potentially interesting things about this
+ * implementation:
  *
  * 1) The table is power-of-two sized.  Prime sized tables are more
  * traditional, but do not have a significant advantage over power-of-two
@@ -40,19 +42,25 @@
  * 2) The hash computation uses a table of random integers [Hanson97,
  * pp. 39-41].
  *
- * FUTURE ENHANCEMENTS
+ * 3) Buckets are kept in segments which double in size, so the directory
+ * of segments never needs to be reallocated and a bucket never moves in
+ * memory.
  *
- * With a table size of 512, the current implementation is sufficient for a
- * few hundred keys.  Since this is well above the expected size of the
- * tables for which this implementation was designed, the implementation of
- * dynamic hash tables was postponed until the need arises.  A common (and
- * naive) approach to dynamic hash table implementation simply creates a
- * new hash table when necessary, rehashes all the data into the new table,
- * and destroys the old table.  The approach in [Larson88] is superior in
- * two ways: 1) only a portion of the table is expanded when needed,
- * distributing the expansion cost over several insertions, and 2) portions
- * of the table can be locked, enabling a scalable thread-safe
- * implementation.
+ * 4) The table is thread-safe.  Buckets are protected by HASH_LOCKS
+ * striped locks, indexed by the low bits of the hash.  Since the table
+ * never has fewer buckets than there are locks, a bucket and the one it
+ * is split into always share a lock, and so do all the buckets a key can
+ * ever be found in.  Lookups therefore never have to retry, and splitting
+ * a bucket only needs its own lock.
+ *
+ * 5) Iteration visits the hash values in reverse-binary order of their
+ * low bits, as a bucket only ever splits into buckets that come later in
+ * that order.  Every key which is present during the whole iteration is
+ * returned exactly once, even when buckets are split in between.  Keys
+ * inserted or deleted meanwhile may or may not be returned.  Chains are
+ * kept sorted by key, so that a partially visited bucket can be resumed.
+ *
+ * The table never shrinks, deleting keys only shortens the chains.
  *
  * REFERENCES
  *
@@ -76,48 +84,97 @@
 
 #define HASH_MAGIC 0xdeadbeef
 
+static pthread_mutex_t scatter_lock = PTHREAD_MUTEX_INITIALIZER;
+static int             scatter_init = 0;
+static unsigned long   scatter[256];
+
 static unsigned long HashHash(unsigned long key)
 {
     unsigned long        hash = 0;
     unsigned long        tmp  = key;
-    static int           init = 0;
-    static unsigned long scatter[256];
-    int                  i;
-
-    if (!init) {
-	void *state;
-	state = drmRandomCreate(37);
-	for (i = 0; i < 256; i++) scatter[i] = drmRandom(state);
-	drmRandomDestroy(state);
-	++init;
-    }
 
     while (tmp) {
 	hash = (hash << 1) + scatter[tmp & 0xff];
 	tmp >>= 8;
     }
 
-    hash %= HASH_SIZE;
+				/* The low bits pick the bucket and the lock,
+				   but only see the high bytes of the key */
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+
 #if DEBUG
     printf( "Hash(%lu) = %lu\n", key, hash);
 #endif
     return hash;
 }
 
+/* The mask selecting the bucket of a hash value for the keys of the given
+   bucket.  Buckets which have already been split in the current round, as
+   well as the buckets they were split into, use one more bit. */
+
+static unsigned long HashMask(unsigned long index, unsigned long size)
+{
+    unsigned long mask = size - 1;
+
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+
+    if ((index | ((mask >> 1) + 1)) >= size) mask >>= 1;
+    return mask;
+}
+
+static unsigned long HashAddress(unsigned long hash, unsigned long size)
+{
+    unsigned long mask = size - 1;
+
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+
+    if ((hash & mask) >= size) mask >>= 1;
+    return hash & mask;
+}
+
+static pthread_mutex_t *HashLock(HashTablePtr table, unsigned long hash)
+{
+    return &table->locks[hash & (HASH_LOCKS - 1)];
+}
+
 void *drmHashCreate(void)
 {
     HashTablePtr table;
     int          i;
 
-    table           = drmMalloc(sizeof(*table));
+    pthread_mutex_lock(&scatter_lock);
+    if (!scatter_init) {
+	void *state;
+	state = drmRandomCreate(37);
+	for (i = 0; i < 256; i++) scatter[i] = drmRandom(state);
+	drmRandomDestroy(state);
+	++scatter_init;
+    }
+    pthread_mutex_unlock(&scatter_lock);
+
+    table           = calloc(1, sizeof(*table));
     if (!table) return NULL;
+    table->segments[0] = calloc(1, HASH_MIN_SIZE * sizeof(HashBucketPtr));
+    if (!table->segments[0]) {
+	free(table);
+	return NULL;
+    }
     table->magic    = HASH_MAGIC;
-    table->entries  = 0;
-    table->hits     = 0;
-    table->partials = 0;
-    table->misses   = 0;
+    atomic_set(&table->entries, 0);
+    atomic_set(&table->size, HASH_MIN_SIZE);
 
-    for (i = 0; i < HASH_SIZE; i++) table->buckets[i] = NULL;
+    for (i = 0; i < HASH_LOCKS; i++) pthread_mutex_init(&table->locks[i], NULL);
+    pthread_mutex_init(&table->expand_lock, NULL);
     return table;
 }
 
@@ -126,117 +183,227 @@ int drmHashDestroy(void *t)
     HashTablePtr  table = (HashTablePtr)t;
     HashBucketPtr bucket;
     HashBucketPtr next;
-    int           i;
+    unsigned long i, size;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    for (i = 0; i < HASH_SIZE; i++) {
-	for (bucket = table->buckets[i]; bucket;) {
+    size = atomic_read(&table->size);
+    for (i = 0; i < size; i++) {
+	for (bucket = *HashSlot(table, i); bucket;) {
 	    next = bucket->next;
-	    drmFree(bucket);
+	    free(bucket);
 	    bucket = next;
 	}
     }
-    drmFree(table);
+    for (i = 0; i < HASH_SEGMENTS; i++) free(table->segments[i]);
+    for (i = 0; i < HASH_LOCKS; i++) pthread_mutex_destroy(&table->locks[i]);
+    pthread_mutex_destroy(&table->expand_lock);
+    free(table);
     return 0;
 }
 
-/* Find the bucket and organize the list so that this bucket is at the
-   top. */
+/* Split the next bucket in line, unless somebody else is already busy
+   doing so. */
 
-static HashBucketPtr HashFind(HashTablePtr table,
-			      unsigned long key, unsigned long *h)
+static void HashExpand(HashTablePtr table)
 {
-    unsigned long hash = HashHash(key);
-    HashBucketPtr prev = NULL;
-    HashBucketPtr bucket;
+    unsigned long   size, parent, mask, length;
+    HashBucketPtr   *from, *to, bucket;
+    pthread_mutex_t *lock;
+    int             segment;
+
+    if (pthread_mutex_trylock(&table->expand_lock)) return;
+
+    size = atomic_read(&table->size);
+    if (size >= HASH_MAX_SIZE ||
+	(unsigned long)atomic_read(&table->entries) <= size * HASH_LOAD)
+	goto out;
+
+				/* The new bucket may start a segment */
+    for (segment = 0, length = HASH_MIN_SIZE; size > length; segment++)
+	length <<= 1;
+    if (size == length) {
+	table->segments[segment + 1] = calloc(1, length * sizeof(HashBucketPtr));
+	if (!table->segments[segment + 1]) goto out;
+    }
 
-    if (h) *h = hash;
-
-    for (bucket = table->buckets[hash]; bucket; bucket = bucket->next) {
-	if (bucket->key == key) {
-	    if (prev) {
-				/* Organize */
-		prev->next           = bucket->next;
-		bucket->next         = table->buckets[hash];
-		table->buckets[hash] = bucket;
-		++table->partials;
-	    } else {
-		++table->hits;
-	    }
-	    return bucket;
+    mask   = HashMask(size, size + 1);
+    parent = size & (mask >> 1);
+    lock   = HashLock(table, parent);
+
+    pthread_mutex_lock(lock);
+    from = HashSlot(table, parent);
+    to   = HashSlot(table, size);
+    while ((bucket = *from)) {
+	if ((bucket->hash & mask) == parent) {
+	    from = &bucket->next;
+	} else {
+	    *from        = bucket->next;
+	    bucket->next = NULL;
+	    *to          = bucket;
+	    to           = &bucket->next;
 	}
-	prev = bucket;
     }
-    ++table->misses;
-    return NULL;
+    atomic_set(&table->size, size + 1);
+    pthread_mutex_unlock(lock);
+
+out:
+    pthread_mutex_unlock(&table->expand_lock);
+}
+
+/* Find the place of a key in its chain.  Must be called with the lock of
+   the hash held. */
+
+static HashBucketPtr *HashFind(HashTablePtr table,
+			       unsigned long key, unsigned long hash)
+{
+    HashBucketPtr *prev;
+
+    prev = HashSlot(table, HashAddress(hash, atomic_read(&table->size)));
+    while (*prev && (*prev)->key < key) prev = &(*prev)->next;
+    return prev;
 }
 
 int drmHashLookup(void *t, unsigned long key, void **value)
 {
-    HashTablePtr  table = (HashTablePtr)t;
-    HashBucketPtr bucket;
+    HashTablePtr    table = (HashTablePtr)t;
+    HashBucketPtr   bucket;
+    unsigned long   hash;
+    pthread_mutex_t *lock;
+    int             ret = 1;
 
     if (!table || table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    bucket = HashFind(table, key, NULL);
-    if (!bucket) return 1;	/* Not found */
-    *value = bucket->value;
-    return 0;			/* Found */
+    hash = HashHash(key);
+    lock = HashLock(table, hash);
+    pthread_mutex_lock(lock);
+    bucket = *HashFind(table, key, hash);
+    if (bucket && bucket->key == key) {
+	*value = bucket->value;
+	ret    = 0;		/* Found */
+    }
+    pthread_mutex_unlock(lock);
+    return ret;
 }
 
 int drmHashInsert(void *t, unsigned long key, void *value)
 {
-    HashTablePtr  table = (HashTablePtr)t;
-    HashBucketPtr bucket;
-    unsigned long hash;
+    HashTablePtr    table = (HashTablePtr)t;
+    HashBucketPtr   bucket, *prev;
+    unsigned long   hash;
+    pthread_mutex_t *lock;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    if (HashFind(table, key, &hash)) return 1; /* Already in table */
+    hash = HashHash(key);
+    lock = HashLock(table, hash);
+    pthread_mutex_lock(lock);
+    prev = HashFind(table, key, hash);
+    if (*prev && (*prev)->key == key) {
+	pthread_mutex_unlock(lock);
+	return 1;		/* Already in table */
+    }
 
-    bucket               = drmMalloc(sizeof(*bucket));
-    if (!bucket) return -1;	/* Error */
+    bucket               = calloc(1, sizeof(*bucket));
+    if (!bucket) {
+	pthread_mutex_unlock(lock);
+	return -1;		/* Error */
+    }
     bucket->key          = key;
+    bucket->hash         = hash;
     bucket->value        = value;
-    bucket->next         = table->buckets[hash];
-    table->buckets[hash] = bucket;
+    bucket->next         = *prev;
+    *prev                = bucket;
+    pthread_mutex_unlock(lock);
 #if DEBUG
     printf("Inserted %lu at %lu/%p\n", key, hash, bucket);
 #endif
+
+    if ((unsigned long)atomic_inc_return(&table->entries) >
+	(unsigned long)atomic_read(&table->size) * HASH_LOAD)
+	HashExpand(table);
     return 0;			/* Added to table */
 }
 
 int drmHashDelete(void *t, unsigned long key)
 {
-    HashTablePtr  table = (HashTablePtr)t;
-    unsigned long hash;
-    HashBucketPtr bucket;
+    HashTablePtr    table = (HashTablePtr)t;
+    HashBucketPtr   bucket, *prev;
+    unsigned long   hash;
+    pthread_mutex_t *lock;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    bucket = HashFind(table, key, &hash);
+    hash = HashHash(key);
+    lock = HashLock(table, hash);
+    pthread_mutex_lock(lock);
+    prev = HashFind(table, key, hash);
+    bucket = *prev;
+    if (!bucket || bucket->key != key) {
+	pthread_mutex_unlock(lock);
+	return 1;		/* Not found */
+    }
+    *prev = bucket->next;
+    pthread_mutex_unlock(lock);
+
+    atomic_dec(&table->entries, 1);
+    free(bucket);
+    return 0;
+}
 
-    if (!bucket) return 1;	/* Not found */
+/* Step to the next hash value prefix in reverse-binary order, which flips
+   the highest bit first.  Returns 0 once all prefixes were visited. */
 
-    table->buckets[hash] = bucket->next;
-    drmFree(bucket);
+static unsigned long HashNextCursor(unsigned long cursor, unsigned long mask)
+{
+    unsigned long bit;
+
+    for (bit = (mask >> 1) + 1; bit; bit >>= 1) {
+	if (!(cursor & bit)) return cursor | bit;
+	cursor &= ~bit;
+    }
     return 0;
 }
 
 int drmHashNext(void *t, unsigned long *key, void **value)
 {
-    HashTablePtr  table = (HashTablePtr)t;
+    HashTablePtr    table = (HashTablePtr)t;
+    HashBucketPtr   bucket, found;
+    unsigned long   size, index;
+    pthread_mutex_t *lock;
+
+    while (!table->done) {
+				/* All buckets holding keys of the current
+				   prefix share a lock */
+	lock = HashLock(table, table->cursor);
+	pthread_mutex_lock(lock);
+	size = atomic_read(&table->size);
+	if (!table->mask) table->mask = HashMask(table->cursor, size);
+
+	found = NULL;
+	for (index = table->cursor; index < size; index += table->mask + 1) {
+	    for (bucket = *HashSlot(table, index); bucket; bucket = bucket->next) {
+		if ((bucket->hash & table->mask) != table->cursor) continue;
+		if (table->have_last && bucket->key <= table->last) continue;
+		if (!found || bucket->key < found->key) found = bucket;
+		break;
+	    }
+	}
 
-    while (table->p0 < HASH_SIZE) {
-	if (table->p1) {
-	    *key       = table->p1->key;
-	    *value     = table->p1->value;
-	    table->p1  = table->p1->next;
+	if (found) {
+	    *key             = found->key;
+	    *value           = found->value;
+	    table->last      = found->key;
+	    table->have_last = 1;
+	    pthread_mutex_unlock(lock);
 	    return 1;
 	}
-	table->p1 = table->buckets[table->p0];
-	++table->p0;
+	pthread_mutex_unlock(lock);
+
+	table->cursor    = HashNextCursor(table->cursor, table->mask);
+	table->mask      = 0;
+	table->have_last = 0;
+	table->done      = !table->cursor;
     }
     return 0;
 }
@@ -247,7 +414,9 @@ int drmHashFirst(void *t, unsigned long *key, void **value)
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    table->p0 = 0;
-    table->p1 = table->buckets[0];
+    table->cursor    = 0;
+    table->mask      = 0;
+    table->have_last = 0;
+    table->done      = 0;
     return drmHashNext(table, key, value);
 }
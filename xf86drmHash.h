@@ -24,24 +24,46 @@
  * Authors: Rickard E. (Rik) Faith <faith@valinux.com>
  */
 
-#define HASH_SIZE  512		/* Good for about 100 entries */
-				/* If you change this value, you probably
-                                   have to change the HashHash hashing
-                                   function! */
+#include <pthread.h>
+
+#include "xf86atomic.h"
+
+#define HASH_MIN_SIZE  64	/* Buckets of a new table, a power of two */
+#define HASH_MAX_SIZE  (1 << 24)
+#define HASH_SEGMENTS  19	/* Segment 0 holds HASH_MIN_SIZE buckets,
+				   segment n > 0 HASH_MIN_SIZE << (n - 1) */
+#define HASH_LOCKS     16	/* Must divide HASH_MIN_SIZE */
+#define HASH_LOAD      2	/* Average chain length before expanding */
 
 typedef struct HashBucket {
     unsigned long     key;
+    unsigned long     hash;
     void              *value;
-    struct HashBucket *next;
+    struct HashBucket *next;	/* Sorted by key */
 } HashBucket, *HashBucketPtr;
 
 typedef struct HashTable {
     unsigned long    magic;
-    unsigned long    entries;
-    unsigned long    hits;	/* At top of linked list */
-    unsigned long    partials;	/* Not at top of linked list */
-    unsigned long    misses;	/* Not in table */
-    HashBucketPtr    buckets[HASH_SIZE];
-    int              p0;
-    HashBucketPtr    p1;
+    atomic_t         entries;
+    atomic_t         size;	/* Buckets in use */
+    HashBucketPtr    *segments[HASH_SEGMENTS];
+    pthread_mutex_t  locks[HASH_LOCKS];
+    pthread_mutex_t  expand_lock;
+				/* Iteration state */
+    unsigned long    cursor;
+    unsigned long    mask;
+    unsigned long    last;
+    int              have_last;
+    int              done;
 } HashTable, *HashTablePtr;
+
+static inline HashBucketPtr *HashSlot(HashTablePtr table, unsigned long index)
+{
+    unsigned long base = HASH_MIN_SIZE;
+    int           segment;
+
+    if (index < HASH_MIN_SIZE) return &table->segments[0][index];
+
+    for (segment = 1; index >= 2 * base; segment++) base <<= 1;
+    return &table->segments[segment][index - base];
+}
@@ -51,14 +51,17 @@
 #endif
 #include <stdio.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "xf86drmMode.h"
 #include "xf86drm.h"
 #include <drm.h>
+#include <drm_fourcc.h>
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
 
 #define memclear(s) memset(&s, 0, sizeof(s))
 
@@ -75,6 +78,14 @@ static inline int DRM_IOCTL(int fd, unsigned long cmd, void *arg)
  * Util functions
  */
 
+static uint32_t drmModeHashKey(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	return (uint32_t)key;
+}
+
 static void* drmAllocCpy(char *array, int count, int entry_size)
 {
 	char *r;
@@ -133,15 +144,47 @@ void drmModeFreeCrtc(drmModeCrtcPtr ptr)
 	drmFree(ptr);
 }
 
+/*
+ * Connectors, planes and properties are returned in a single allocation,
+ * the arrays following the struct.  The size is kept after the struct, so
+ * the free functions can still free arrays a caller swapped in.
+ */
+
+#define BLOCK_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+typedef struct _drmModeConnectorBlock {
+	drmModeConnector connector;
+	size_t size;
+} drmModeConnectorBlock;
+
+typedef struct _drmModePropertyBlock {
+	drmModePropertyRes property;
+	size_t size;
+} drmModePropertyBlock;
+
+typedef struct _drmModePlaneBlock {
+	drmModePlane plane;
+	size_t size;
+} drmModePlaneBlock;
+
+static void drmModeBlockFree(void *block, size_t size, void *ptr)
+{
+	if (ptr && ((char *)ptr < (char *)block ||
+		    (char *)ptr >= (char *)block + size))
+		drmFree(ptr);
+}
+
 void drmModeFreeConnector(drmModeConnectorPtr ptr)
 {
+	drmModeConnectorBlock *block = (drmModeConnectorBlock *)ptr;
+
 	if (!ptr)
 		return;
 
-	drmFree(ptr->encoders);
-	drmFree(ptr->prop_values);
-	drmFree(ptr->props);
-	drmFree(ptr->modes);
+	drmModeBlockFree(block, block->size, ptr->encoders);
+	drmModeBlockFree(block, block->size, ptr->prop_values);
+	drmModeBlockFree(block, block->size, ptr->props);
+	drmModeBlockFree(block, block->size, ptr->modes);
 	drmFree(ptr);
 }
 
@@ -487,8 +530,11 @@ static drmModeConnectorPtr
 _drmModeGetConnector(int fd, uint32_t connector_id, int probe)
 {
 	struct drm_mode_get_connector conn, counts;
-	drmModeConnectorPtr r = NULL;
+	drmModeConnectorBlock *block;
+	drmModeConnectorPtr r;
 	struct drm_mode_modeinfo stack_mode;
+	size_t size;
+	char *ptr;
 
 	memclear(conn);
 	conn.connector_id = connector_id;
@@ -503,33 +549,45 @@ _drmModeGetConnector(int fd, uint32_t connector_id, int probe)
 retry:
 	counts = conn;
 
-	if (conn.count_props) {
-		conn.props_ptr = VOID2U64(drmMalloc(conn.count_props*sizeof(uint32_t)));
-		if (!conn.props_ptr)
-			goto err_allocs;
-		conn.prop_values_ptr = VOID2U64(drmMalloc(conn.count_props*sizeof(uint64_t)));
-		if (!conn.prop_values_ptr)
-			goto err_allocs;
+	/* 64 bit values first, to keep them aligned. */
+	size = BLOCK_ALIGN(sizeof(*block)) +
+	       counts.count_props * (sizeof(uint64_t) + sizeof(uint32_t)) +
+	       counts.count_modes * sizeof(struct drm_mode_modeinfo) +
+	       counts.count_encoders * sizeof(uint32_t);
+	if (!(block = drmMalloc(size)))
+		return 0;
+	block->size = size;
+	r = &block->connector;
+
+	ptr = (char *)block + BLOCK_ALIGN(sizeof(*block));
+	if (counts.count_props) {
+		r->prop_values = (uint64_t *)ptr;
+		ptr += counts.count_props * sizeof(uint64_t);
+		r->props = (uint32_t *)ptr;
+		ptr += counts.count_props * sizeof(uint32_t);
 	}
-
-	if (conn.count_modes) {
-		conn.modes_ptr = VOID2U64(drmMalloc(conn.count_modes*sizeof(struct drm_mode_modeinfo)));
-		if (!conn.modes_ptr)
-			goto err_allocs;
+	if (counts.count_modes) {
+		r->modes = (drmModeModeInfoPtr)ptr;
+		ptr += counts.count_modes * sizeof(struct drm_mode_modeinfo);
+	}
+	if (counts.count_encoders)
+		r->encoders = (uint32_t *)ptr;
+
+	conn.props_ptr = VOID2U64(r->props);
+	conn.prop_values_ptr = VOID2U64(r->prop_values);
+	conn.encoders_ptr = VOID2U64(r->encoders);
+	if (counts.count_modes) {
+		conn.modes_ptr = VOID2U64(r->modes);
 	} else {
 		conn.count_modes = 1;
 		conn.modes_ptr = VOID2U64(&stack_mode);
 	}
 
-	if (conn.count_encoders) {
-		conn.encoders_ptr = VOID2U64(drmMalloc(conn.count_encoders*sizeof(uint32_t)));
-		if (!conn.encoders_ptr)
-			goto err_allocs;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn)) {
+		drmFree(block);
+		return 0;
 	}
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn))
-		goto err_allocs;
-
 	/* The number of available connectors and etc may have changed with a
 	 * hotplug event in between the ioctls, in which case the field is
 	 * silently ignored by the kernel.
@@ -537,19 +595,10 @@ retry:
 	if (counts.count_props < conn.count_props ||
 	    counts.count_modes < conn.count_modes ||
 	    counts.count_encoders < conn.count_encoders) {
-		drmFree(U642VOID(conn.props_ptr));
-		drmFree(U642VOID(conn.prop_values_ptr));
-		if (U642VOID(conn.modes_ptr) != &stack_mode)
-			drmFree(U642VOID(conn.modes_ptr));
-		drmFree(U642VOID(conn.encoders_ptr));
-
+		drmFree(block);
 		goto retry;
 	}
 
-	if(!(r = drmMalloc(sizeof(*r)))) {
-		goto err_allocs;
-	}
-
 	r->connector_id = conn.connector_id;
 	r->encoder_id = conn.encoder_id;
 	r->connection   = conn.connection;
@@ -559,32 +608,19 @@ retry:
 	r->subpixel     = conn.subpixel + 1;
 	r->count_modes  = conn.count_modes;
 	r->count_props  = conn.count_props;
-	r->props        = drmAllocCpy(U642VOID(conn.props_ptr), conn.count_props, sizeof(uint32_t));
-	r->prop_values  = drmAllocCpy(U642VOID(conn.prop_values_ptr), conn.count_props, sizeof(uint64_t));
-	r->modes        = drmAllocCpy(U642VOID(conn.modes_ptr), conn.count_modes, sizeof(struct drm_mode_modeinfo));
 	r->count_encoders = conn.count_encoders;
-	r->encoders     = drmAllocCpy(U642VOID(conn.encoders_ptr), conn.count_encoders, sizeof(uint32_t));
 	r->connector_type  = conn.connector_type;
 	r->connector_type_id = conn.connector_type_id;
 
-	if ((r->count_props && !r->props) ||
-	    (r->count_props && !r->prop_values) ||
-	    (r->count_modes && !r->modes) ||
-	    (r->count_encoders && !r->encoders)) {
-		drmFree(r->props);
-		drmFree(r->prop_values);
-		drmFree(r->modes);
-		drmFree(r->encoders);
-		drmFree(r);
-		r = 0;
+	/* Like drmAllocCpy(), leave empty arrays NULL. */
+	if (!r->count_props) {
+		r->props = NULL;
+		r->prop_values = NULL;
 	}
-
-err_allocs:
-	drmFree(U642VOID(conn.prop_values_ptr));
-	drmFree(U642VOID(conn.props_ptr));
-	if (U642VOID(conn.modes_ptr) != &stack_mode)
-		drmFree(U642VOID(conn.modes_ptr));
-	drmFree(U642VOID(conn.encoders_ptr));
+	if (!r->count_modes)
+		r->modes = NULL;
+	if (!r->count_encoders)
+		r->encoders = NULL;
 
 	return r;
 }
@@ -624,7 +660,11 @@ int drmModeDetachMode(int fd, uint32_t connector_id, drmModeModeInfoPtr mode_inf
 drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id)
 {
 	struct drm_mode_get_property prop;
+	drmModePropertyBlock *block;
 	drmModePropertyPtr r;
+	uint32_t count_enums = 0, count_blobs = 0;
+	size_t size;
+	char *ptr;
 
 	memclear(prop);
 	prop.prop_id = property_id;
@@ -632,56 +672,67 @@ drmModePropertyPtr drmModeGetProperty(int fd, uint32_t property_id)
 	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop))
 		return 0;
 
-	if (prop.count_values)
-		prop.values_ptr = VOID2U64(drmMalloc(prop.count_values * sizeof(uint64_t)));
-
-	if (prop.count_enum_blobs && (prop.flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK)))
-		prop.enum_blob_ptr = VOID2U64(drmMalloc(prop.count_enum_blobs * sizeof(struct drm_mode_property_enum)));
-
-	if (prop.count_enum_blobs && (prop.flags & DRM_MODE_PROP_BLOB)) {
-		prop.values_ptr = VOID2U64(drmMalloc(prop.count_enum_blobs * sizeof(uint32_t)));
-		prop.enum_blob_ptr = VOID2U64(drmMalloc(prop.count_enum_blobs * sizeof(uint32_t)));
+	if (prop.flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK))
+		count_enums = prop.count_enum_blobs;
+	else if (prop.flags & DRM_MODE_PROP_BLOB)
+		count_blobs = prop.count_enum_blobs;
+
+	/* Blob properties return their lengths as 32 bit values. */
+	size = BLOCK_ALIGN(sizeof(*block)) +
+	       BLOCK_ALIGN(count_blobs ? count_blobs * sizeof(uint32_t) :
+					 prop.count_values * sizeof(uint64_t)) +
+	       count_enums * sizeof(struct drm_mode_property_enum) +
+	       count_blobs * sizeof(uint32_t);
+	if (!(block = drmMalloc(size)))
+		return NULL;
+	block->size = size;
+	r = &block->property;
+
+	ptr = (char *)block + BLOCK_ALIGN(sizeof(*block));
+	if (count_blobs) {
+		r->values = (uint64_t *)ptr;
+		ptr += BLOCK_ALIGN(count_blobs * sizeof(uint32_t));
+		r->blob_ids = (uint32_t *)ptr;
+	} else if (prop.count_values) {
+		r->values = (uint64_t *)ptr;
+		ptr += prop.count_values * sizeof(uint64_t);
 	}
+	if (count_enums)
+		r->enums = (struct drm_mode_property_enum *)ptr;
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop)) {
-		r = NULL;
-		goto err_allocs;
-	}
+	prop.values_ptr = VOID2U64(r->values);
+	prop.enum_blob_ptr = count_blobs ? VOID2U64(r->blob_ids) :
+					   VOID2U64(r->enums);
 
-	if (!(r = drmMalloc(sizeof(*r))))
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop)) {
+		drmFree(block);
 		return NULL;
+	}
 
 	r->prop_id = prop.prop_id;
 	r->count_values = prop.count_values;
 
 	r->flags = prop.flags;
-	if (prop.count_values)
-		r->values = drmAllocCpy(U642VOID(prop.values_ptr), prop.count_values, sizeof(uint64_t));
-	if (prop.flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK)) {
+	if (count_enums)
 		r->count_enums = prop.count_enum_blobs;
-		r->enums = drmAllocCpy(U642VOID(prop.enum_blob_ptr), prop.count_enum_blobs, sizeof(struct drm_mode_property_enum));
-	} else if (prop.flags & DRM_MODE_PROP_BLOB) {
-		r->values = drmAllocCpy(U642VOID(prop.values_ptr), prop.count_enum_blobs, sizeof(uint32_t));
-		r->blob_ids = drmAllocCpy(U642VOID(prop.enum_blob_ptr), prop.count_enum_blobs, sizeof(uint32_t));
+	else if (count_blobs)
 		r->count_blobs = prop.count_enum_blobs;
-	}
 	strncpy(r->name, prop.name, DRM_PROP_NAME_LEN);
 	r->name[DRM_PROP_NAME_LEN-1] = 0;
 
-err_allocs:
-	drmFree(U642VOID(prop.values_ptr));
-	drmFree(U642VOID(prop.enum_blob_ptr));
-
 	return r;
 }
 
 void drmModeFreeProperty(drmModePropertyPtr ptr)
 {
+	drmModePropertyBlock *block = (drmModePropertyBlock *)ptr;
+
 	if (!ptr)
 		return;
 
-	drmFree(ptr->values);
-	drmFree(ptr->enums);
+	drmModeBlockFree(block, block->size, ptr->values);
+	drmModeBlockFree(block, block->size, ptr->enums);
+	drmModeBlockFree(block, block->size, ptr->blob_ids);
 	drmFree(ptr);
 }
 
@@ -942,6 +993,211 @@ int drmHandleEvent(int fd, drmEventContextPtr evctx)
 	return 0;
 }
 
+/*
+ * Event dispatcher
+ */
+
+#define EVENT_TABLE_SIZE	16
+#define EVENT_VENDOR_BASE	0x80000000u
+#define EVENT_BUFFER_SIZE	16384
+/* No event the kernel sends is anywhere near this big, so a read that left
+ * this much of the buffer unused found the queue empty. */
+#define EVENT_MAX_SIZE		1024
+
+struct drm_event_slot {
+	drmEventHandlerFunc handler;
+	void *data;
+};
+
+struct _drmEventDispatcher {
+	char *buffer;
+	size_t size;
+
+	struct drm_event_slot generic[EVENT_TABLE_SIZE];
+	struct drm_event_slot vendor[EVENT_TABLE_SIZE];
+	struct drm_event_slot fallback;
+
+	drmEventStats stats;
+};
+
+drmEventDispatcherPtr drmEventDispatcherCreate(size_t buffer_size)
+{
+	drmEventDispatcherPtr dispatcher;
+
+	if (!buffer_size)
+		buffer_size = EVENT_BUFFER_SIZE;
+	if (buffer_size < 2 * EVENT_MAX_SIZE)
+		buffer_size = 2 * EVENT_MAX_SIZE;
+
+	dispatcher = calloc(1, sizeof(*dispatcher));
+	if (!dispatcher)
+		return NULL;
+
+	dispatcher->buffer = malloc(buffer_size);
+	if (!dispatcher->buffer) {
+		free(dispatcher);
+		return NULL;
+	}
+	dispatcher->size = buffer_size;
+
+	return dispatcher;
+}
+
+void drmEventDispatcherDestroy(drmEventDispatcherPtr dispatcher)
+{
+	if (!dispatcher)
+		return;
+
+	free(dispatcher->buffer);
+	free(dispatcher);
+}
+
+static struct drm_event_slot *
+drmEventDispatcherSlot(drmEventDispatcherPtr dispatcher, uint32_t type)
+{
+	if (type == DRM_EVENT_DEFAULT)
+		return &dispatcher->fallback;
+	if (type < EVENT_TABLE_SIZE)
+		return &dispatcher->generic[type];
+	if (type >= EVENT_VENDOR_BASE && type - EVENT_VENDOR_BASE < EVENT_TABLE_SIZE)
+		return &dispatcher->vendor[type - EVENT_VENDOR_BASE];
+
+	return NULL;
+}
+
+int drmEventDispatcherSetHandler(drmEventDispatcherPtr dispatcher,
+				 uint32_t type, drmEventHandlerFunc handler,
+				 void *data)
+{
+	struct drm_event_slot *slot;
+
+	if (!dispatcher)
+		return -EINVAL;
+
+	slot = drmEventDispatcherSlot(dispatcher, type);
+	if (!slot)
+		return -EINVAL;
+
+	slot->handler = handler;
+	slot->data = data;
+	return 0;
+}
+
+/* Returns when the kernel stamped the event, in CLOCK_MONOTONIC
+ * nanoseconds, or 0 if the event has no time stamp. */
+static uint64_t drmEventTimestamp(const struct drm_event *e)
+{
+	const struct drm_event_vblank *vblank;
+	const struct drm_event_crtc_sequence *seq;
+
+	switch (e->type) {
+	case DRM_EVENT_VBLANK:
+	case DRM_EVENT_FLIP_COMPLETE:
+		if (e->length < sizeof(*vblank))
+			return 0;
+		vblank = (const struct drm_event_vblank *)e;
+		return vblank->tv_sec * 1000000000ull + vblank->tv_usec * 1000ull;
+	case DRM_EVENT_CRTC_SEQUENCE:
+		if (e->length < sizeof(*seq))
+			return 0;
+		seq = (const struct drm_event_crtc_sequence *)e;
+		return seq->time_ns > 0 ? (uint64_t)seq->time_ns : 0;
+	default:
+		return 0;
+	}
+}
+
+static void drmEventDispatchOne(int fd, drmEventDispatcherPtr dispatcher,
+				const struct drm_event *e)
+{
+	struct drm_event_slot *slot;
+	uint64_t stamp, latency = 0;
+	struct timespec ts;
+
+	slot = drmEventDispatcherSlot(dispatcher, e->type);
+	if (!slot || !slot->handler)
+		slot = &dispatcher->fallback;
+
+	dispatcher->stats.count_events++;
+	if (!slot->handler) {
+		dispatcher->stats.count_unhandled++;
+		return;
+	}
+
+	stamp = drmEventTimestamp(e);
+	if (stamp && !clock_gettime(CLOCK_MONOTONIC, &ts)) {
+		uint64_t now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+
+		latency = now > stamp ? now - stamp : 0;
+		dispatcher->stats.total_latency_ns += latency;
+		if (latency > dispatcher->stats.max_latency_ns)
+			dispatcher->stats.max_latency_ns = latency;
+	}
+
+	slot->handler(fd, e, latency, slot->data);
+}
+
+int drmEventDispatch(int fd, drmEventDispatcherPtr dispatcher)
+{
+	const struct drm_event *e;
+	struct pollfd pfd;
+	int count = 0;
+	ssize_t len, i;
+
+	if (!dispatcher)
+		return -EINVAL;
+
+	/* As with drmHandleEvent(), each read returns only complete events. */
+	for (;;) {
+		len = read(fd, dispatcher->buffer, dispatcher->size);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && count)
+				break;
+			return -errno;
+		}
+		dispatcher->stats.count_reads++;
+
+		for (i = 0; i + (ssize_t)sizeof(*e) <= len; i += e->length) {
+			e = (const struct drm_event *)(dispatcher->buffer + i);
+			if (e->length < sizeof(*e) || e->length > len - i)
+				return -EIO;
+
+			drmEventDispatchOne(fd, dispatcher, e);
+			count++;
+		}
+		if (i != len)
+			return -EIO;
+
+		if (dispatcher->size - len >= EVENT_MAX_SIZE)
+			break;
+
+		/* The fd may well be blocking, only read again when more
+		 * events are already queued. */
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+			break;
+	}
+
+	return count;
+}
+
+void drmEventDispatcherGetStats(drmEventDispatcherPtr dispatcher,
+				drmEventStatsPtr stats)
+{
+	if (dispatcher && stats)
+		*stats = dispatcher->stats;
+}
+
+void drmEventDispatcherResetStats(drmEventDispatcherPtr dispatcher)
+{
+	if (dispatcher)
+		memclear(dispatcher->stats);
+}
+
 int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
 		    uint32_t flags, void *user_data)
 {
@@ -1001,7 +1257,9 @@ int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
 drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
 {
 	struct drm_mode_get_plane ovr, counts;
-	drmModePlanePtr r = 0;
+	drmModePlaneBlock *block;
+	drmModePlanePtr r;
+	size_t size;
 
 retry:
 	memclear(ovr);
@@ -1011,50 +1269,49 @@ retry:
 
 	counts = ovr;
 
-	if (ovr.count_format_types) {
-		ovr.format_type_ptr = VOID2U64(drmMalloc(ovr.count_format_types *
-							 sizeof(uint32_t)));
-		if (!ovr.format_type_ptr)
-			goto err_allocs;
+	size = BLOCK_ALIGN(sizeof(*block)) +
+	       counts.count_format_types * sizeof(uint32_t);
+	if (!(block = drmMalloc(size)))
+		return 0;
+	block->size = size;
+	r = &block->plane;
+
+	if (counts.count_format_types) {
+		r->formats = (uint32_t *)((char *)block +
+					  BLOCK_ALIGN(sizeof(*block)));
+		ovr.format_type_ptr = VOID2U64(r->formats);
 	}
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
-		goto err_allocs;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr)) {
+		drmFree(block);
+		return 0;
+	}
 
 	if (counts.count_format_types < ovr.count_format_types) {
-		drmFree(U642VOID(ovr.format_type_ptr));
+		drmFree(block);
 		goto retry;
 	}
 
-	if (!(r = drmMalloc(sizeof(*r))))
-		goto err_allocs;
-
 	r->count_formats = ovr.count_format_types;
 	r->plane_id = ovr.plane_id;
 	r->crtc_id = ovr.crtc_id;
 	r->fb_id = ovr.fb_id;
 	r->possible_crtcs = ovr.possible_crtcs;
 	r->gamma_size = ovr.gamma_size;
-	r->formats = drmAllocCpy(U642VOID(ovr.format_type_ptr),
-				 ovr.count_format_types, sizeof(uint32_t));
-	if (ovr.count_format_types && !r->formats) {
-		drmFree(r->formats);
-		drmFree(r);
-		r = 0;
-	}
-
-err_allocs:
-	drmFree(U642VOID(ovr.format_type_ptr));
+	if (!r->count_formats)
+		r->formats = NULL;
 
 	return r;
 }
 
 void drmModeFreePlane(drmModePlanePtr ptr)
 {
+	drmModePlaneBlock *block = (drmModePlaneBlock *)ptr;
+
 	if (!ptr)
 		return;
 
-	drmFree(ptr->formats);
+	drmModeBlockFree(block, block->size, ptr->formats);
 	drmFree(ptr);
 }
 
@@ -1202,25 +1459,38 @@ struct _drmModeAtomicReqItem {
 	uint32_t object_id;
 	uint32_t property_id;
 	uint64_t value;
+	uint32_t cursor; /* only set while committing */
 };
 
 struct _drmModeAtomicReq {
 	uint32_t cursor;
 	uint32_t size_items;
 	drmModeAtomicReqItemPtr items;
+
+	/* Scratch space for drmModeAtomicCommit, kept across commits, so a
+	 * request must not be committed from several threads at once. All
+	 * arrays live in the allocation starting at sorted. */
+	uint32_t size_scratch;
+	drmModeAtomicReqItemPtr sorted;
+	uint64_t *prop_values;
+	uint32_t *objs;
+	uint32_t *count_props;
+	uint32_t *props;
 };
 
 drmModeAtomicReqPtr drmModeAtomicAlloc(void)
 {
 	drmModeAtomicReqPtr req;
 
-	req = drmMalloc(sizeof *req);
+	req = calloc(1, sizeof *req);
 	if (!req)
 		return NULL;
 
 	req->items = NULL;
 	req->cursor = 0;
 	req->size_items = 0;
+	req->size_scratch = 0;
+	req->sorted = NULL;
 
 	return req;
 }
@@ -1232,15 +1502,17 @@ drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr old)
 	if (!old)
 		return NULL;
 
-	new = drmMalloc(sizeof *new);
+	new = calloc(1, sizeof *new);
 	if (!new)
 		return NULL;
 
 	new->cursor = old->cursor;
 	new->size_items = old->size_items;
+	new->size_scratch = 0;
+	new->sorted = NULL;
 
 	if (old->size_items) {
-		new->items = drmMalloc(old->size_items * sizeof(*new->items));
+		new->items = calloc(1, old->size_items * sizeof(*new->items));
 		if (!new->items) {
 			free(new);
 			return NULL;
@@ -1330,158 +1602,2752 @@ void drmModeAtomicFree(drmModeAtomicReqPtr req)
 		return;
 
 	if (req->items)
-		drmFree(req->items);
-	drmFree(req);
+		free(req->items);
+	free(req->sorted);
+	free(req);
 }
 
+/* Sort by object ID, then by property ID.  Ties are broken by the order
+ * the properties were added in, which makes the sort stable. */
 static int sort_req_list(const void *misc, const void *other)
 {
 	const drmModeAtomicReqItem *first = misc;
 	const drmModeAtomicReqItem *second = other;
 
-	if (first->object_id < second->object_id)
-		return -1;
-	else if (first->object_id > second->object_id)
-		return 1;
-	else
-		return second->property_id - first->property_id;
+	if (first->object_id != second->object_id)
+		return first->object_id < second->object_id ? -1 : 1;
+	if (first->property_id != second->property_id)
+		return first->property_id < second->property_id ? -1 : 1;
+	return first->cursor < second->cursor ? -1 : first->cursor > second->cursor;
 }
 
-int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
-			void *user_data)
+static int drmModeAtomicReserveScratch(drmModeAtomicReqPtr req)
 {
-	drmModeAtomicReqPtr sorted;
-	struct drm_mode_atomic atomic;
-	uint32_t *objs_ptr = NULL;
-	uint32_t *count_props_ptr = NULL;
-	uint32_t *props_ptr = NULL;
-	uint64_t *prop_values_ptr = NULL;
-	uint32_t last_obj_id = 0;
-	uint32_t i;
-	int obj_idx = -1;
-	int ret = -1;
-
-	if (!req)
-		return -EINVAL;
+	uint32_t size;
+	char *ptr;
 
-	if (req->cursor == 0)
+	if (req->cursor <= req->size_scratch)
 		return 0;
 
-	sorted = drmModeAtomicDuplicate(req);
-	if (sorted == NULL)
+	size = req->size_scratch * 2;
+	if (size < req->cursor)
+		size = req->cursor;
+
+	ptr = calloc(1, size * (sizeof(*req->sorted) +
+				sizeof(*req->prop_values) +
+				sizeof(*req->objs) +
+				sizeof(*req->count_props) +
+				sizeof(*req->props)));
+	if (!ptr)
 		return -ENOMEM;
 
-	memclear(atomic);
+	free(req->sorted);
+	req->size_scratch = size;
+	req->sorted = (drmModeAtomicReqItemPtr)ptr;
+	ptr += size * sizeof(*req->sorted);
+	req->prop_values = (uint64_t *)ptr;
+	ptr += size * sizeof(*req->prop_values);
+	req->objs = (uint32_t *)ptr;
+	ptr += size * sizeof(*req->objs);
+	req->count_props = (uint32_t *)ptr;
+	ptr += size * sizeof(*req->count_props);
+	req->props = (uint32_t *)ptr;
 
-	/* Sort the list by object ID, then by property ID. */
-	qsort(sorted->items, sorted->cursor, sizeof(*sorted->items),
-	      sort_req_list);
+	return 0;
+}
 
-	/* Now the list is sorted, eliminate duplicate property sets. */
-	for (i = 0; i < sorted->cursor; i++) {
-		if (sorted->items[i].object_id != last_obj_id) {
-			atomic.count_objs++;
-			last_obj_id = sorted->items[i].object_id;
-		}
+/*
+ * Atomic state tracking
+ *
+ * The last committed value of every (object, property) pair is kept in an
+ * open addressed table, so a commit can leave out everything the kernel
+ * already has.
+ */
 
-		if (i == sorted->cursor - 1)
-			continue;
+#define ATOMIC_STATE_MIN_SIZE 64
 
-		if (sorted->items[i].object_id != sorted->items[i + 1].object_id ||
-		    sorted->items[i].property_id != sorted->items[i + 1].property_id)
-			continue;
+typedef struct _drmModeAtomicStateSlot {
+	uint64_t key;		/* object_id << 32 | property_id, 0 if empty */
+	uint64_t value;
+} drmModeAtomicStateSlot;
 
-		memmove(&sorted->items[i], &sorted->items[i + 1],
-			(sorted->cursor - i - 1) * sizeof(*sorted->items));
-		sorted->cursor--;
-	}
+struct _drmModeAtomicState {
+	drmModeAtomicStateSlot *slots;
+	uint32_t count_slots, size_slots;
+};
 
-	objs_ptr = drmMalloc(atomic.count_objs * sizeof objs_ptr[0]);
-	if (!objs_ptr) {
-		errno = ENOMEM;
-		goto out;
-	}
+static drmModeAtomicStateSlot *
+drmModeAtomicStateFind(drmModeAtomicStateSlot *slots, uint32_t size,
+		       uint64_t key)
+{
+	uint32_t i = drmModeHashKey(key) & (size - 1);
 
-	count_props_ptr = drmMalloc(atomic.count_objs * sizeof count_props_ptr[0]);
-	if (!count_props_ptr) {
-		errno = ENOMEM;
-		goto out;
-	}
+	while (slots[i].key && slots[i].key != key)
+		i = (i + 1) & (size - 1);
 
-	props_ptr = drmMalloc(sorted->cursor * sizeof props_ptr[0]);
-	if (!props_ptr) {
-		errno = ENOMEM;
-		goto out;
-	}
+	return &slots[i];
+}
 
-	prop_values_ptr = drmMalloc(sorted->cursor * sizeof prop_values_ptr[0]);
-	if (!prop_values_ptr) {
-		errno = ENOMEM;
-		goto out;
-	}
+static int drmModeAtomicStateSet(drmModeAtomicStatePtr state, uint64_t key,
+				 uint64_t value)
+{
+	drmModeAtomicStateSlot *slot;
+	uint32_t i;
+
+	if ((state->count_slots + 1) * 2 > state->size_slots) {
+		uint32_t size = state->size_slots * 2;
+		drmModeAtomicStateSlot *slots;
 
-	for (i = 0, last_obj_id = 0; i < sorted->cursor; i++) {
-		if (sorted->items[i].object_id != last_obj_id) {
-			obj_idx++;
-			objs_ptr[obj_idx] = sorted->items[i].object_id;
-			last_obj_id = objs_ptr[obj_idx];
+		slots = calloc(size, sizeof(*slots));
+		if (!slots)
+			return -ENOMEM;
+		for (i = 0; i < state->size_slots; i++) {
+			if (!state->slots[i].key)
+				continue;
+			slot = drmModeAtomicStateFind(slots, size,
+						      state->slots[i].key);
+			*slot = state->slots[i];
 		}
+		free(state->slots);
+		state->slots = slots;
+		state->size_slots = size;
+	}
+
+	slot = drmModeAtomicStateFind(state->slots, state->size_slots, key);
+	if (!slot->key)
+		state->count_slots++;
+	slot->key = key;
+	slot->value = value;
+
+	return 0;
+}
+
+/* Properties that act on every commit they are in rather than hold a
+ * value: the same value again is another fence or another damage. */
+static const char *const atomic_state_volatile[] = {
+	"IN_FENCE_FD",
+	"OUT_FENCE_PTR",
+	"FB_DAMAGE_CLIPS",
+};
+
+static bool drmModeAtomicStateIsVolatile(int fd, drmModeAtomicStatePtr state,
+					 uint32_t property_id)
+{
+	struct drm_mode_get_property prop;
+	drmModeAtomicStateSlot *slot;
+	bool is_volatile = false;
+	unsigned i;
 
-		count_props_ptr[obj_idx]++;
-		props_ptr[i] = sorted->items[i].property_id;
-		prop_values_ptr[i] = sorted->items[i].value;
+	/* Remembered under object id 0, which no object has. */
+	slot = drmModeAtomicStateFind(state->slots, state->size_slots,
+				      property_id);
+	if (slot->key)
+		return slot->value;
 
+	memclear(prop);
+	prop.prop_id = property_id;
+	if (!DRM_IOCTL(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop)) {
+		for (i = 0; i < sizeof(atomic_state_volatile) /
+			    sizeof(atomic_state_volatile[0]); i++)
+			if (!strncmp(prop.name, atomic_state_volatile[i],
+				     DRM_PROP_NAME_LEN))
+				is_volatile = true;
 	}
 
-	atomic.flags = flags;
-	atomic.objs_ptr = VOID2U64(objs_ptr);
-	atomic.count_props_ptr = VOID2U64(count_props_ptr);
-	atomic.props_ptr = VOID2U64(props_ptr);
-	atomic.prop_values_ptr = VOID2U64(prop_values_ptr);
-	atomic.user_data = VOID2U64(user_data);
+	/* Out of memory only costs asking again. */
+	drmModeAtomicStateSet(state, property_id, is_volatile);
+	return is_volatile;
+}
 
-	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+static bool drmModeAtomicStateUnchanged(int fd, drmModeAtomicStatePtr state,
+					drmModeAtomicReqItemPtr item)
+{
+	drmModeAtomicStateSlot *slot;
 
-out:
-	drmFree(objs_ptr);
-	drmFree(count_props_ptr);
-	drmFree(props_ptr);
-	drmFree(prop_values_ptr);
-	drmModeAtomicFree(sorted);
+	slot = drmModeAtomicStateFind(state->slots, state->size_slots,
+				      (uint64_t)item->object_id << 32 |
+				      item->property_id);
+	if (!slot->key || slot->value != item->value)
+		return false;
 
-	return ret;
+	return !drmModeAtomicStateIsVolatile(fd, state, item->property_id);
 }
 
-int
-drmModeCreatePropertyBlob(int fd, const void *data, size_t length, uint32_t *id)
+drmModeAtomicStatePtr drmModeAtomicStateCreate(void)
 {
-	struct drm_mode_create_blob create;
-	int ret;
+	drmModeAtomicStatePtr state;
 
-	if (length >= 0xffffffff)
-		return -ERANGE;
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return NULL;
 
-	memclear(create);
+	state->size_slots = ATOMIC_STATE_MIN_SIZE;
+	state->slots = calloc(state->size_slots, sizeof(*state->slots));
+	if (!state->slots) {
+		free(state);
+		return NULL;
+	}
 
-	create.length = length;
-	create.data = (uintptr_t) data;
-	create.blob_id = 0;
-	*id = 0;
+	return state;
+}
 
-	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &create);
-	if (ret != 0)
-		return ret;
+void drmModeAtomicStateFree(drmModeAtomicStatePtr state)
+{
+	if (!state)
+		return;
 
-	*id = create.blob_id;
+	free(state->slots);
+	free(state);
+}
+
+void drmModeAtomicStateInvalidate(drmModeAtomicStatePtr state)
+{
+	if (!state)
+		return;
+
+	memset(state->slots, 0, state->size_slots * sizeof(*state->slots));
+	state->count_slots = 0;
+}
+
+int drmModeAtomicStateGetValue(drmModeAtomicStatePtr state, uint32_t object_id,
+			       uint32_t property_id, uint64_t *value)
+{
+	drmModeAtomicStateSlot *slot;
+
+	if (!state || !value)
+		return -EINVAL;
+
+	slot = drmModeAtomicStateFind(state->slots, state->size_slots,
+				      (uint64_t)object_id << 32 | property_id);
+	if (!slot->key)
+		return -ENOENT;
+
+	*value = slot->value;
 	return 0;
 }
 
-int
-drmModeDestroyPropertyBlob(int fd, uint32_t id)
+static int drmModeAtomicCommitState(int fd, drmModeAtomicReqPtr req,
+				    drmModeAtomicStatePtr state,
+				    uint32_t flags, void *user_data)
 {
-	struct drm_mode_destroy_blob destroy;
+	drmModeAtomicReqItemPtr item;
+	struct drm_mode_atomic atomic;
+	uint32_t count_props = 0;
+	uint32_t i, j, k;
+	bool emitted = false;
+	int ret;
 
-	memclear(destroy);
-	destroy.blob_id = id;
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+	if (!req)
+		return -EINVAL;
+
+	if (req->cursor == 0)
+		return 0;
+
+	ret = drmModeAtomicReserveScratch(req);
+	if (ret)
+		return ret;
+
+	memclear(atomic);
+
+	for (i = 0; i < req->cursor; i++) {
+		req->sorted[i] = req->items[i];
+		req->sorted[i].cursor = i;
+	}
+	qsort(req->sorted, req->cursor, sizeof(*req->sorted), sort_req_list);
+
+	/* Build the arrays for the kernel in one pass.  Of several values
+	 * for the same property only the last one added is kept, which
+	 * sorts last. */
+	for (i = 0; i < req->cursor; i++) {
+		bool last_of_object;
+
+		item = &req->sorted[i];
+		if (i == 0 || item[-1].object_id != item->object_id)
+			emitted = false;
+		last_of_object = i + 1 == req->cursor ||
+				 item[1].object_id != item->object_id;
+
+		if (!last_of_object &&
+		    item[1].property_id == item->property_id)
+			continue;
+
+		/* Values the kernel already has are left out, and objects
+		 * with nothing left with them.  Unless an event was asked
+		 * for: that is only sent for the CRTCs in the commit, so
+		 * every object keeps at least one property then. */
+		if (state && drmModeAtomicStateUnchanged(fd, state, item) &&
+		    !(last_of_object && !emitted &&
+		      (flags & DRM_MODE_PAGE_FLIP_EVENT)))
+			continue;
+
+		if (atomic.count_objs == 0 ||
+		    req->objs[atomic.count_objs - 1] != item->object_id) {
+			req->objs[atomic.count_objs] = item->object_id;
+			req->count_props[atomic.count_objs] = 0;
+			atomic.count_objs++;
+		}
+
+		req->count_props[atomic.count_objs - 1]++;
+		req->props[count_props] = item->property_id;
+		req->prop_values[count_props] = item->value;
+		count_props++;
+		emitted = true;
+	}
+
+	if (atomic.count_objs == 0)
+		return 0;
+
+	atomic.flags = flags;
+	atomic.objs_ptr = VOID2U64(req->objs);
+	atomic.count_props_ptr = VOID2U64(req->count_props);
+	atomic.props_ptr = VOID2U64(req->props);
+	atomic.prop_values_ptr = VOID2U64(req->prop_values);
+	atomic.user_data = VOID2U64(user_data);
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	if (ret || !state || (flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		return ret;
+
+	for (i = 0, k = 0; i < atomic.count_objs; i++) {
+		for (j = 0; j < req->count_props[i]; j++, k++) {
+			/* Out of memory only costs resending the value. */
+			if (drmModeAtomicStateSet(state,
+						  (uint64_t)req->objs[i] << 32 |
+						  req->props[k],
+						  req->prop_values[k]))
+				drmModeAtomicStateInvalidate(state);
+		}
+	}
+
+	return 0;
+}
+
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+			void *user_data)
+{
+	return drmModeAtomicCommitState(fd, req, NULL, flags, user_data);
+}
+
+int drmModeAtomicCommitTracked(int fd, drmModeAtomicReqPtr req,
+			       drmModeAtomicStatePtr state, uint32_t flags,
+			       void *user_data)
+{
+	if (!state)
+		return -EINVAL;
+
+	return drmModeAtomicCommitState(fd, req, state, flags, user_data);
+}
+
+int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t length, uint32_t *id)
+{
+	struct drm_mode_create_blob create;
+	int ret;
+
+	if (length >= 0xffffffff)
+		return -ERANGE;
+
+	memclear(create);
+
+	create.length = length;
+	create.data = (uintptr_t) data;
+	create.blob_id = 0;
+	*id = 0;
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &create);
+	if (ret != 0)
+		return ret;
+
+	*id = create.blob_id;
+	return 0;
+}
+
+int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	struct drm_mode_destroy_blob destroy;
+
+	memclear(destroy);
+	destroy.blob_id = id;
+	return DRM_IOCTL(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+}
+
+/*
+ * Blob cache
+ *
+ * Blobs are found by a hash of their contents, and compared in full before
+ * being shared, so the cache keeps a copy of every blob's data.
+ */
+
+typedef struct _drmModeBlobCacheEntry {
+	struct _drmModeBlobCacheEntry *next;	/* same hash */
+	uint64_t hash;
+	uint32_t id;
+	uint32_t refcount;
+	size_t size;
+	char data[];
+} drmModeBlobCacheEntry;
+
+struct _drmModeBlobCache {
+	int fd;
+	void *by_hash;		/* hash -> chain of entries */
+	void *by_id;		/* blob id -> entry */
+	drmModeBlobCacheStats stats;
+};
+
+static uint64_t drmModeBlobHash(const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	uint64_t hash = 0xcbf29ce484222325ull ^ size;
+	uint64_t word;
+
+	/* A word at a time; LUTs are tens of kilobytes. */
+	for (; size >= sizeof(word); p += sizeof(word), size -= sizeof(word)) {
+		memcpy(&word, p, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ull;
+		hash ^= hash >> 29;
+	}
+	for (; size; p++, size--)
+		hash = (hash ^ *p) * 0x100000001b3ull;
+
+	return drmModeHashKey(hash) | (uint64_t)drmModeHashKey(hash >> 32) << 32;
+}
+
+drmModeBlobCachePtr drmModeBlobCacheCreate(int fd)
+{
+	drmModeBlobCachePtr cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->fd = fd;
+	cache->by_hash = drmHashCreate();
+	cache->by_id = drmHashCreate();
+	if (!cache->by_hash || !cache->by_id) {
+		if (cache->by_hash)
+			drmHashDestroy(cache->by_hash);
+		if (cache->by_id)
+			drmHashDestroy(cache->by_id);
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void drmModeBlobCacheFree(drmModeBlobCachePtr cache)
+{
+	drmModeBlobCacheEntry *entry;
+	unsigned long key;
+	void *value;
+
+	if (!cache)
+		return;
+
+	if (drmHashFirst(cache->by_id, &key, &value)) {
+		do {
+			entry = value;
+			drmModeDestroyPropertyBlob(cache->fd, entry->id);
+			free(entry);
+		} while (drmHashNext(cache->by_id, &key, &value));
+	}
+
+	drmHashDestroy(cache->by_id);
+	drmHashDestroy(cache->by_hash);
+	free(cache);
+}
+
+int drmModeBlobCacheGet(drmModeBlobCachePtr cache, const void *data,
+			size_t size, uint32_t *id)
+{
+	drmModeBlobCacheEntry *entry, *head = NULL;
+	uint64_t hash;
+	void *value;
+	int ret;
+
+	if (!cache || !id || (size && !data))
+		return -EINVAL;
+
+	hash = drmModeBlobHash(data, size);
+	if (!drmHashLookup(cache->by_hash, (unsigned long)hash, &value))
+		head = value;
+
+	for (entry = head; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->size == size &&
+		    !memcmp(entry->data, data, size)) {
+			entry->refcount++;
+			cache->stats.count_hits++;
+			*id = entry->id;
+			return 0;
+		}
+	}
+
+	entry = malloc(sizeof(*entry) + size);
+	if (!entry)
+		return -ENOMEM;
+
+	ret = drmModeCreatePropertyBlob(cache->fd, data, size, &entry->id);
+	if (ret) {
+		free(entry);
+		return ret;
+	}
+
+	entry->hash = hash;
+	entry->refcount = 1;
+	entry->size = size;
+	memcpy(entry->data, data, size);
+	entry->next = NULL;
+
+	if (drmHashInsert(cache->by_id, entry->id, entry) ||
+	    (!head && drmHashInsert(cache->by_hash, (unsigned long)hash, entry))) {
+		drmHashDelete(cache->by_id, entry->id);
+		drmModeDestroyPropertyBlob(cache->fd, entry->id);
+		free(entry);
+		return -ENOMEM;
+	}
+
+	/* Collisions queue up behind the first blob with the hash. */
+	if (head) {
+		entry->next = head->next;
+		head->next = entry;
+	}
+
+	cache->stats.count_misses++;
+	cache->stats.count_blobs++;
+	cache->stats.total_bytes += size;
+	*id = entry->id;
+	return 0;
+}
+
+int drmModeBlobCacheRef(drmModeBlobCachePtr cache, uint32_t id)
+{
+	void *value;
+
+	if (!cache)
+		return -EINVAL;
+
+	if (drmHashLookup(cache->by_id, id, &value))
+		return -ENOENT;
+
+	((drmModeBlobCacheEntry *)value)->refcount++;
+	return 0;
+}
+
+int drmModeBlobCacheRelease(drmModeBlobCachePtr cache, uint32_t id)
+{
+	drmModeBlobCacheEntry *entry, *head, *prev;
+	unsigned long key;
+	void *value;
+
+	if (!cache)
+		return -EINVAL;
+
+	if (drmHashLookup(cache->by_id, id, &value))
+		return -ENOENT;
+
+	entry = value;
+	if (--entry->refcount)
+		return 0;
+
+	/* Unlink from the chain of blobs with the same hash. */
+	key = (unsigned long)entry->hash;
+	drmHashLookup(cache->by_hash, key, &value);
+	head = value;
+	if (head == entry) {
+		drmHashDelete(cache->by_hash, key);
+		if (entry->next)
+			drmHashInsert(cache->by_hash, key, entry->next);
+	} else {
+		for (prev = head; prev->next != entry; prev = prev->next)
+			;
+		prev->next = entry->next;
+	}
+	drmHashDelete(cache->by_id, id);
+
+	cache->stats.count_blobs--;
+	cache->stats.total_bytes -= entry->size;
+	free(entry);
+
+	return drmModeDestroyPropertyBlob(cache->fd, id);
+}
+
+void drmModeBlobCacheGetStats(drmModeBlobCachePtr cache,
+			      drmModeBlobCacheStatsPtr stats)
+{
+	if (cache && stats)
+		*stats = cache->stats;
+}
+
+/*
+ * Property name cache
+ *
+ * Resolving a property name to its id otherwise takes one
+ * drmModeObjectGetProperties() for the object plus one drmModeGetProperty()
+ * per property it has, every time.  The cache interns each property name
+ * once, remembers which atom every property id maps to (property ids are
+ * global to the device, so one GETPROPERTY per id is enough) and keeps an
+ * (object, atom) -> property id table that is filled one object at a time.
+ */
+
+#define PROP_CACHE_MIN_SIZE 64
+
+typedef struct _drmModePropertyCacheSlot {
+	uint64_t key;		/* object_id << 32 | atom + 1, 0 if empty */
+	uint32_t prop_id;
+} drmModePropertyCacheSlot;
+
+struct _drmModePropertyCache {
+	int fd;
+
+	/* Interned names, and an open addressed index into them. */
+	char (*names)[DRM_PROP_NAME_LEN];
+	uint32_t count_names, size_names;
+	int32_t *name_index;
+	uint32_t size_name_index;
+
+	/* property id -> atom + 1 */
+	void *prop_atoms;
+	/* object id -> 1 for every object whose properties were fetched */
+	void *objects;
+
+	drmModePropertyCacheSlot *slots;
+	uint32_t count_slots, size_slots;
+};
+
+static uint32_t drmModePropertyCacheHashName(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < DRM_PROP_NAME_LEN && name[i]; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+	return hash;
+}
+
+/* Returns the atom of name, or -1 if it was never interned. */
+static int drmModePropertyCacheFindName(drmModePropertyCachePtr cache,
+					const char *name)
+{
+	uint32_t mask = cache->size_name_index - 1;
+	uint32_t i = drmModePropertyCacheHashName(name) & mask;
+	int32_t atom;
+
+	while ((atom = cache->name_index[i]) >= 0) {
+		if (!strncmp(cache->names[atom], name, DRM_PROP_NAME_LEN))
+			return atom;
+		i = (i + 1) & mask;
+	}
+
+	return -1;
+}
+
+static int drmModePropertyCacheInternName(drmModePropertyCachePtr cache,
+					  const char *name)
+{
+	uint32_t mask, i, j;
+	int atom;
+
+	atom = drmModePropertyCacheFindName(cache, name);
+	if (atom >= 0)
+		return atom;
+
+	if (cache->count_names == cache->size_names) {
+		uint32_t size = cache->size_names * 2;
+		char (*names)[DRM_PROP_NAME_LEN];
+
+		names = realloc(cache->names, size * sizeof(*names));
+		if (!names)
+			return -ENOMEM;
+		cache->names = names;
+		cache->size_names = size;
+	}
+
+	/* Keep the index at most half full. */
+	if ((cache->count_names + 1) * 2 > cache->size_name_index) {
+		uint32_t size = cache->size_name_index * 2;
+		int32_t *index = malloc(size * sizeof(*index));
+
+		if (!index)
+			return -ENOMEM;
+		memset(index, 0xff, size * sizeof(*index));
+		for (j = 0; j < cache->count_names; j++) {
+			i = drmModePropertyCacheHashName(cache->names[j]) & (size - 1);
+			while (index[i] >= 0)
+				i = (i + 1) & (size - 1);
+			index[i] = j;
+		}
+		free(cache->name_index);
+		cache->name_index = index;
+		cache->size_name_index = size;
+	}
+
+	atom = cache->count_names++;
+	strncpy(cache->names[atom], name, DRM_PROP_NAME_LEN);
+	cache->names[atom][DRM_PROP_NAME_LEN - 1] = 0;
+
+	mask = cache->size_name_index - 1;
+	i = drmModePropertyCacheHashName(cache->names[atom]) & mask;
+	while (cache->name_index[i] >= 0)
+		i = (i + 1) & mask;
+	cache->name_index[i] = atom;
+
+	return atom;
+}
+
+static drmModePropertyCacheSlot *
+drmModePropertyCacheFindSlot(drmModePropertyCacheSlot *slots, uint32_t size,
+			     uint64_t key)
+{
+	uint32_t i = drmModeHashKey(key) & (size - 1);
+
+	while (slots[i].key && slots[i].key != key)
+		i = (i + 1) & (size - 1);
+
+	return &slots[i];
+}
+
+static int drmModePropertyCacheAddSlot(drmModePropertyCachePtr cache,
+				       uint64_t key, uint32_t prop_id)
+{
+	drmModePropertyCacheSlot *slot;
+	uint32_t i;
+
+	if ((cache->count_slots + 1) * 2 > cache->size_slots) {
+		uint32_t size = cache->size_slots * 2;
+		drmModePropertyCacheSlot *slots;
+
+		slots = calloc(size, sizeof(*slots));
+		if (!slots)
+			return -ENOMEM;
+		for (i = 0; i < cache->size_slots; i++) {
+			if (!cache->slots[i].key)
+				continue;
+			slot = drmModePropertyCacheFindSlot(slots, size,
+							    cache->slots[i].key);
+			*slot = cache->slots[i];
+		}
+		free(cache->slots);
+		cache->slots = slots;
+		cache->size_slots = size;
+	}
+
+	slot = drmModePropertyCacheFindSlot(cache->slots, cache->size_slots, key);
+	if (!slot->key)
+		cache->count_slots++;
+	slot->key = key;
+	slot->prop_id = prop_id;
+
+	return 0;
+}
+
+/* Returns the atom of a property id, asking the kernel for its name only
+ * the first time the id is seen. */
+static int drmModePropertyCacheGetAtom(drmModePropertyCachePtr cache,
+				       uint32_t prop_id)
+{
+	struct drm_mode_get_property prop;
+	void *value;
+	int atom, ret;
+
+	if (!drmHashLookup(cache->prop_atoms, prop_id, &value))
+		return (int)(uintptr_t)value - 1;
+
+	/* With all counts zero the kernel only fills in the name, flags and
+	 * counts, so one ioctl is enough. */
+	memclear(prop);
+	prop.prop_id = prop_id;
+	ret = DRM_IOCTL(cache->fd, DRM_IOCTL_MODE_GETPROPERTY, &prop);
+	if (ret)
+		return ret;
+
+	atom = drmModePropertyCacheInternName(cache, prop.name);
+	if (atom < 0)
+		return atom;
+
+	if (drmHashInsert(cache->prop_atoms, prop_id,
+			  (void *)(uintptr_t)(atom + 1)) < 0)
+		return -ENOMEM;
+
+	return atom;
+}
+
+static int drmModePropertyCacheFetch(drmModePropertyCachePtr cache,
+				     uint32_t object_id)
+{
+	drmModeObjectPropertiesPtr props;
+	void *value;
+	uint32_t i;
+	int atom, ret = 0;
+
+	if (!drmHashLookup(cache->objects, object_id, &value))
+		return 0;
+
+	props = drmModeObjectGetProperties(cache->fd, object_id,
+					   DRM_MODE_OBJECT_ANY);
+	if (!props)
+		return errno ? -errno : -ENOMEM;
+
+	for (i = 0; i < props->count_props; i++) {
+		atom = drmModePropertyCacheGetAtom(cache, props->props[i]);
+		if (atom < 0) {
+			ret = atom;
+			break;
+		}
+
+		ret = drmModePropertyCacheAddSlot(cache,
+						  (uint64_t)object_id << 32 | (atom + 1),
+						  props->props[i]);
+		if (ret)
+			break;
+	}
+
+	drmModeFreeObjectProperties(props);
+
+	if (!ret && drmHashInsert(cache->objects, object_id, (void *)1) < 0)
+		ret = -ENOMEM;
+
+	return ret;
+}
+
+static int drmModePropertyCacheFetchList(drmModePropertyCachePtr cache,
+					 const uint32_t *ids, int count)
+{
+	int i, ret;
+
+	for (i = 0; i < count; i++) {
+		ret = drmModePropertyCacheFetch(cache, ids[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+drmModePropertyCachePtr drmModePropertyCacheCreate(int fd)
+{
+	drmModePropertyCachePtr cache;
+	drmModePlaneResPtr plane_res;
+	drmModeResPtr res;
+	int ret;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->fd = fd;
+	cache->size_names = PROP_CACHE_MIN_SIZE;
+	cache->names = malloc(cache->size_names * sizeof(*cache->names));
+	cache->size_name_index = PROP_CACHE_MIN_SIZE * 2;
+	cache->name_index = malloc(cache->size_name_index *
+				   sizeof(*cache->name_index));
+	cache->size_slots = PROP_CACHE_MIN_SIZE * 2;
+	cache->slots = calloc(cache->size_slots, sizeof(*cache->slots));
+	cache->prop_atoms = drmHashCreate();
+	cache->objects = drmHashCreate();
+	if (!cache->names || !cache->name_index || !cache->slots ||
+	    !cache->prop_atoms || !cache->objects)
+		goto err;
+	memset(cache->name_index, 0xff,
+	       cache->size_name_index * sizeof(*cache->name_index));
+
+	res = drmModeGetResources(fd);
+	if (!res)
+		goto err;
+
+	ret = drmModePropertyCacheFetchList(cache, res->crtcs, res->count_crtcs);
+	if (!ret)
+		ret = drmModePropertyCacheFetchList(cache, res->connectors,
+						    res->count_connectors);
+	drmModeFreeResources(res);
+	if (ret)
+		goto err;
+
+	/* Planes are only listed once the client enabled universal planes;
+	 * anything missing here is fetched on first use instead. */
+	plane_res = drmModeGetPlaneResources(fd);
+	if (plane_res) {
+		ret = drmModePropertyCacheFetchList(cache, plane_res->planes,
+						    plane_res->count_planes);
+		drmModeFreePlaneResources(plane_res);
+		if (ret)
+			goto err;
+	}
+
+	return cache;
+
+err:
+	drmModePropertyCacheFree(cache);
+	return NULL;
+}
+
+void drmModePropertyCacheFree(drmModePropertyCachePtr cache)
+{
+	if (!cache)
+		return;
+
+	if (cache->objects)
+		drmHashDestroy(cache->objects);
+	if (cache->prop_atoms)
+		drmHashDestroy(cache->prop_atoms);
+	free(cache->slots);
+	free(cache->name_index);
+	free(cache->names);
+	free(cache);
+}
+
+void drmModePropertyCacheInvalidate(drmModePropertyCachePtr cache)
+{
+	void *objects;
+
+	if (!cache)
+		return;
+
+	/* Objects come and go with hotplug, but property ids and their names
+	 * stay valid for the lifetime of the device, so keep those. */
+	objects = drmHashCreate();
+	if (objects) {
+		drmHashDestroy(cache->objects);
+		cache->objects = objects;
+	} else {
+		unsigned long key;
+		void *value;
+
+		while (drmHashFirst(cache->objects, &key, &value) == 1)
+			drmHashDelete(cache->objects, key);
+	}
+
+	memset(cache->slots, 0, cache->size_slots * sizeof(*cache->slots));
+	cache->count_slots = 0;
+}
+
+int drmModePropertyCacheGetId(drmModePropertyCachePtr cache,
+			      uint32_t object_id, const char *name)
+{
+	drmModePropertyCacheSlot *slot;
+	int atom, ret;
+
+	if (!cache || !object_id || !name)
+		return -EINVAL;
+
+	ret = drmModePropertyCacheFetch(cache, object_id);
+	if (ret)
+		return ret;
+
+	atom = drmModePropertyCacheFindName(cache, name);
+	if (atom < 0)
+		return -ENOENT;
+
+	slot = drmModePropertyCacheFindSlot(cache->slots, cache->size_slots,
+					    (uint64_t)object_id << 32 | (atom + 1));
+	if (!slot->key)
+		return -ENOENT;
+
+	return slot->prop_id;
+}
+
+int drmModeAtomicAddPropertyByName(drmModeAtomicReqPtr req,
+				   drmModePropertyCachePtr cache,
+				   uint32_t object_id, const char *name,
+				   uint64_t value)
+{
+	int prop_id;
+
+	if (!req)
+		return -EINVAL;
+
+	prop_id = drmModePropertyCacheGetId(cache, object_id, name);
+	if (prop_id < 0)
+		return prop_id;
+
+	return drmModeAtomicAddProperty(req, object_id, prop_id, value);
+}
+
+/*
+ * KMS snapshot
+ *
+ * drmModeGetSnapshot() first asks the kernel how big every object is, then
+ * lays the whole graph out in a single allocation and has the second round
+ * of ioctls write straight into it.  If anything grows in between, because
+ * of a hotplug, the snapshot is simply taken again.
+ */
+
+struct drm_mode_snapshot_counts {
+	uint32_t count_modes;
+	uint32_t count_encoders;
+	uint32_t count_props;
+	uint32_t count_formats;
+};
+
+/* Remembers where the snapshot came from, so that drmModeFreeSnapshot()
+ * can hand it back. */
+struct drm_mode_snapshot_block {
+	drmModeSnapshot snap;
+	const drmAllocator *arena;
+};
+
+struct drm_mode_snapshot_ids {
+	struct drm_mode_card_res res;
+	uint32_t count_planes;
+	uint32_t *fbs, *crtcs, *connectors, *encoders, *planes;
+	/* connectors, then crtcs, then planes */
+	struct drm_mode_snapshot_counts *counts;
+};
+
+static void *drmModeSnapshotAlloc(char *base, size_t *offset, size_t size)
+{
+	void *ptr;
+
+	if (!size)
+		return NULL;
+
+	ptr = base ? base + *offset : NULL;
+	*offset += (size + 7) & ~(size_t)7;
+	return ptr;
+}
+
+/* Computes the size of the snapshot, and if base is not NULL points all
+ * of its arrays into the space that follows it. */
+static size_t drmModeSnapshotLayout(char *base,
+				    const struct drm_mode_snapshot_ids *ids,
+				    uint32_t flags)
+{
+	const struct drm_mode_card_res *res = &ids->res;
+	const struct drm_mode_snapshot_counts *counts;
+	drmModeSnapshotPtr snap = (drmModeSnapshotPtr)base;
+	drmModeConnectorPtr connectors;
+	drmModeObjectPropertiesPtr props;
+	drmModePlanePtr planes;
+	size_t offset = 0;
+	uint32_t i;
+
+	drmModeSnapshotAlloc(base, &offset,
+			     sizeof(struct drm_mode_snapshot_block));
+
+#define SNAPSHOT_ARRAY(field, count) \
+	do { \
+		void *ptr = drmModeSnapshotAlloc(base, &offset, \
+						 (count) * sizeof(*(field))); \
+		if (base) \
+			(field) = ptr; \
+	} while (0)
+
+	SNAPSHOT_ARRAY(snap->res.fbs, res->count_fbs);
+	SNAPSHOT_ARRAY(snap->res.crtcs, res->count_crtcs);
+	SNAPSHOT_ARRAY(snap->res.connectors, res->count_connectors);
+	SNAPSHOT_ARRAY(snap->res.encoders, res->count_encoders);
+	SNAPSHOT_ARRAY(snap->connectors, res->count_connectors);
+	SNAPSHOT_ARRAY(snap->encoders, res->count_encoders);
+	SNAPSHOT_ARRAY(snap->crtcs, res->count_crtcs);
+	SNAPSHOT_ARRAY(snap->planes, ids->count_planes);
+	if (flags & DRM_MODE_SNAPSHOT_PROPERTIES) {
+		SNAPSHOT_ARRAY(snap->crtc_props, res->count_crtcs);
+		SNAPSHOT_ARRAY(snap->plane_props, ids->count_planes);
+	}
+
+	counts = ids->counts;
+	connectors = base ? snap->connectors : NULL;
+	for (i = 0; i < res->count_connectors; i++, counts++) {
+		drmModeConnector dummy, *conn = base ? &connectors[i] : &dummy;
+
+		/* Always leave room for one mode: asking for none makes the
+		 * kernel probe the connector again. */
+		SNAPSHOT_ARRAY(conn->modes, counts->count_modes ?
+			       counts->count_modes : 1);
+		SNAPSHOT_ARRAY(conn->encoders, counts->count_encoders);
+		SNAPSHOT_ARRAY(conn->props, counts->count_props);
+		SNAPSHOT_ARRAY(conn->prop_values, counts->count_props);
+	}
+
+	props = base ? snap->crtc_props : NULL;
+	for (i = 0; i < res->count_crtcs; i++, counts++) {
+		drmModeObjectProperties dummy, *obj = props ? &props[i] : &dummy;
+
+		if (!(flags & DRM_MODE_SNAPSHOT_PROPERTIES))
+			continue;
+		SNAPSHOT_ARRAY(obj->props, counts->count_props);
+		SNAPSHOT_ARRAY(obj->prop_values, counts->count_props);
+	}
+
+	planes = base ? snap->planes : NULL;
+	props = base ? snap->plane_props : NULL;
+	for (i = 0; i < ids->count_planes; i++, counts++) {
+		drmModePlane dummy_plane, *plane = planes ? &planes[i] : &dummy_plane;
+		drmModeObjectProperties dummy, *obj = props ? &props[i] : &dummy;
+
+		SNAPSHOT_ARRAY(plane->formats, counts->count_formats);
+		if (!(flags & DRM_MODE_SNAPSHOT_PROPERTIES))
+			continue;
+		SNAPSHOT_ARRAY(obj->props, counts->count_props);
+		SNAPSHOT_ARRAY(obj->prop_values, counts->count_props);
+	}
+
+#undef SNAPSHOT_ARRAY
+
+	return offset;
+}
+
+static int drmModeSnapshotCountProperties(int fd, uint32_t object_id,
+					  uint32_t *count)
+{
+	struct drm_mode_obj_get_properties properties;
+	int ret;
+
+	memclear(properties);
+	properties.obj_id = object_id;
+	properties.obj_type = DRM_MODE_OBJECT_ANY;
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties);
+	if (ret)
+		return ret;
+
+	*count = properties.count_props;
+	return 0;
+}
+
+/* Decides whether a connector that was looked at without probing should be
+ * probed after all. */
+typedef int (*drmModeSnapshotProbeFunc)(void *data, uint32_t connector_id,
+					uint32_t connection);
+
+/* Fetches all object ids and the size of every object, into one temporary
+ * allocation. */
+static int drmModeSnapshotCount(int fd, uint32_t flags,
+				drmModeSnapshotProbeFunc probe, void *data,
+				struct drm_mode_snapshot_ids *ids)
+{
+	struct drm_mode_card_res res;
+	struct drm_mode_get_plane_res plane_res;
+	struct drm_mode_get_connector conn;
+	struct drm_mode_modeinfo stack_mode;
+	struct drm_mode_get_plane plane;
+	struct drm_mode_snapshot_counts *counts;
+	uint32_t count_ids, count_objects, i;
+	char *ptr;
+	int ret;
+
+	memclear(res);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETRESOURCES, &res);
+	if (ret)
+		return ret;
+
+	memclear(plane_res);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &plane_res);
+	if (ret)
+		return ret;
+
+	count_ids = res.count_fbs + res.count_crtcs + res.count_connectors +
+		    res.count_encoders + plane_res.count_planes;
+	count_objects = res.count_connectors + res.count_crtcs +
+			plane_res.count_planes;
+
+	ptr = drmMalloc(count_objects * sizeof(*ids->counts) +
+			count_ids * sizeof(uint32_t) + 1);
+	if (!ptr)
+		return -ENOMEM;
+
+	ids->counts = (struct drm_mode_snapshot_counts *)ptr;
+	ptr += count_objects * sizeof(*ids->counts);
+	ids->fbs = (uint32_t *)ptr;
+	ids->crtcs = ids->fbs + res.count_fbs;
+	ids->connectors = ids->crtcs + res.count_crtcs;
+	ids->encoders = ids->connectors + res.count_connectors;
+	ids->planes = ids->encoders + res.count_encoders;
+
+	ids->res = res;
+	ids->res.fb_id_ptr = VOID2U64(ids->fbs);
+	ids->res.crtc_id_ptr = VOID2U64(ids->crtcs);
+	ids->res.connector_id_ptr = VOID2U64(ids->connectors);
+	ids->res.encoder_id_ptr = VOID2U64(ids->encoders);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETRESOURCES, &ids->res);
+	if (ret)
+		return ret;
+
+	ids->count_planes = plane_res.count_planes;
+	plane_res.plane_id_ptr = VOID2U64(ids->planes);
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &plane_res);
+	if (ret)
+		return ret;
+
+	/* See drmModeGetResources(). */
+	if (res.count_fbs < ids->res.count_fbs ||
+	    res.count_crtcs < ids->res.count_crtcs ||
+	    res.count_connectors < ids->res.count_connectors ||
+	    res.count_encoders < ids->res.count_encoders ||
+	    ids->count_planes < plane_res.count_planes)
+		return -EAGAIN;
+	ids->count_planes = plane_res.count_planes;
+
+	counts = ids->counts;
+	for (i = 0; i < ids->res.count_connectors; i++, counts++) {
+		memclear(conn);
+		conn.connector_id = ids->connectors[i];
+		if (!(flags & DRM_MODE_SNAPSHOT_PROBE)) {
+			conn.count_modes = 1;
+			conn.modes_ptr = VOID2U64(&stack_mode);
+		}
+
+		ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn);
+		if (ret)
+			return ret;
+
+		if (!(flags & DRM_MODE_SNAPSHOT_PROBE) && probe &&
+		    probe(data, conn.connector_id, conn.connection)) {
+			memclear(conn);
+			conn.connector_id = ids->connectors[i];
+			ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn);
+			if (ret)
+				return ret;
+		}
+
+		counts->count_modes = conn.count_modes;
+		counts->count_encoders = conn.count_encoders;
+		counts->count_props = conn.count_props;
+	}
+
+	for (i = 0; i < ids->res.count_crtcs; i++, counts++) {
+		if (!(flags & DRM_MODE_SNAPSHOT_PROPERTIES))
+			continue;
+		ret = drmModeSnapshotCountProperties(fd, ids->crtcs[i],
+						     &counts->count_props);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < ids->count_planes; i++, counts++) {
+		memclear(plane);
+		plane.plane_id = ids->planes[i];
+		ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETPLANE, &plane);
+		if (ret)
+			return ret;
+		counts->count_formats = plane.count_format_types;
+
+		if (!(flags & DRM_MODE_SNAPSHOT_PROPERTIES))
+			continue;
+		ret = drmModeSnapshotCountProperties(fd, ids->planes[i],
+						     &counts->count_props);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int drmModeSnapshotGetProperties(int fd, uint32_t object_id,
+					uint32_t count,
+					drmModeObjectPropertiesPtr props)
+{
+	struct drm_mode_obj_get_properties properties;
+	int ret;
+
+	memclear(properties);
+	properties.obj_id = object_id;
+	properties.obj_type = DRM_MODE_OBJECT_ANY;
+	properties.count_props = count;
+	properties.props_ptr = VOID2U64(props->props);
+	properties.prop_values_ptr = VOID2U64(props->prop_values);
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties);
+	if (ret)
+		return ret;
+
+	if (count < properties.count_props)
+		return -EAGAIN;
+
+	props->count_props = properties.count_props;
+	return 0;
+}
+
+static int drmModeSnapshotFill(int fd, uint32_t flags,
+			       const struct drm_mode_snapshot_ids *ids,
+			       drmModeSnapshotPtr snap)
+{
+	const struct drm_mode_snapshot_counts *counts = ids->counts;
+	struct drm_mode_get_connector conn;
+	struct drm_mode_get_encoder enc;
+	struct drm_mode_crtc crtc;
+	struct drm_mode_get_plane ovr;
+	uint32_t i;
+	int ret;
+
+	snap->res.count_fbs = ids->res.count_fbs;
+	snap->res.count_crtcs = ids->res.count_crtcs;
+	snap->res.count_connectors = ids->res.count_connectors;
+	snap->res.count_encoders = ids->res.count_encoders;
+	snap->res.min_width = ids->res.min_width;
+	snap->res.max_width = ids->res.max_width;
+	snap->res.min_height = ids->res.min_height;
+	snap->res.max_height = ids->res.max_height;
+	snap->count_planes = ids->count_planes;
+
+	/* Zero sized copies are fine, the pointers are only NULL then. */
+	if (ids->res.count_fbs)
+		memcpy(snap->res.fbs, ids->fbs,
+		       ids->res.count_fbs * sizeof(uint32_t));
+	if (ids->res.count_crtcs)
+		memcpy(snap->res.crtcs, ids->crtcs,
+		       ids->res.count_crtcs * sizeof(uint32_t));
+	if (ids->res.count_connectors)
+		memcpy(snap->res.connectors, ids->connectors,
+		       ids->res.count_connectors * sizeof(uint32_t));
+	if (ids->res.count_encoders)
+		memcpy(snap->res.encoders, ids->encoders,
+		       ids->res.count_encoders * sizeof(uint32_t));
+
+	for (i = 0; i < ids->res.count_connectors; i++, counts++) {
+		drmModeConnectorPtr r = &snap->connectors[i];
+
+		memclear(conn);
+		conn.connector_id = ids->connectors[i];
+		conn.count_modes = counts->count_modes ? counts->count_modes : 1;
+		conn.modes_ptr = VOID2U64(r->modes);
+		conn.count_encoders = counts->count_encoders;
+		conn.encoders_ptr = VOID2U64(r->encoders);
+		conn.count_props = counts->count_props;
+		conn.props_ptr = VOID2U64(r->props);
+		conn.prop_values_ptr = VOID2U64(r->prop_values);
+
+		ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn);
+		if (ret)
+			return ret;
+
+		if (counts->count_modes < conn.count_modes ||
+		    counts->count_encoders < conn.count_encoders ||
+		    counts->count_props < conn.count_props)
+			return -EAGAIN;
+
+		r->connector_id = conn.connector_id;
+		r->encoder_id = conn.encoder_id;
+		r->connection = conn.connection;
+		r->mmWidth = conn.mm_width;
+		r->mmHeight = conn.mm_height;
+		/* convert subpixel from kernel to userspace */
+		r->subpixel = conn.subpixel + 1;
+		r->count_modes = conn.count_modes;
+		r->count_props = conn.count_props;
+		r->count_encoders = conn.count_encoders;
+		r->connector_type = conn.connector_type;
+		r->connector_type_id = conn.connector_type_id;
+		if (!r->count_modes)
+			r->modes = NULL;
+	}
+
+	for (i = 0; i < ids->res.count_encoders; i++) {
+		drmModeEncoderPtr r = &snap->encoders[i];
+
+		memclear(enc);
+		enc.encoder_id = ids->encoders[i];
+		ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETENCODER, &enc);
+		if (ret)
+			return ret;
+
+		r->encoder_id = enc.encoder_id;
+		r->crtc_id = enc.crtc_id;
+		r->encoder_type = enc.encoder_type;
+		r->possible_crtcs = enc.possible_crtcs;
+		r->possible_clones = enc.possible_clones;
+	}
+
+	for (i = 0; i < ids->res.count_crtcs; i++, counts++) {
+		drmModeCrtcPtr r = &snap->crtcs[i];
+
+		memclear(crtc);
+		crtc.crtc_id = ids->crtcs[i];
+		ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCRTC, &crtc);
+		if (ret)
+			return ret;
+
+		r->crtc_id = crtc.crtc_id;
+		r->x = crtc.x;
+		r->y = crtc.y;
+		r->mode_valid = crtc.mode_valid;
+		if (r->mode_valid) {
+			memcpy(&r->mode, &crtc.mode, sizeof(struct drm_mode_modeinfo));
+			r->width = crtc.mode.hdisplay;
+			r->height = crtc.mode.vdisplay;
+		}
+		r->buffer_id = crtc.fb_id;
+		r->gamma_size = crtc.gamma_size;
+
+		if (!(flags & DRM_MODE_SNAPSHOT_PROPERTIES))
+			continue;
+		ret = drmModeSnapshotGetProperties(fd, ids->crtcs[i],
+						   counts->count_props,
+						   &snap->crtc_props[i]);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < ids->count_planes; i++, counts++) {
+		drmModePlanePtr r = &snap->planes[i];
+
+		memclear(ovr);
+		ovr.plane_id = ids->planes[i];
+		ovr.count_format_types = counts->count_formats;
+		ovr.format_type_ptr = VOID2U64(r->formats);
+		ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETPLANE, &ovr);
+		if (ret)
+			return ret;
+
+		if (counts->count_formats < ovr.count_format_types)
+			return -EAGAIN;
+
+		r->count_formats = ovr.count_format_types;
+		r->plane_id = ovr.plane_id;
+		r->crtc_id = ovr.crtc_id;
+		r->fb_id = ovr.fb_id;
+		r->possible_crtcs = ovr.possible_crtcs;
+		r->gamma_size = ovr.gamma_size;
+
+		if (!(flags & DRM_MODE_SNAPSHOT_PROPERTIES))
+			continue;
+		ret = drmModeSnapshotGetProperties(fd, ids->planes[i],
+						   counts->count_props,
+						   &snap->plane_props[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static drmModeSnapshotPtr drmModeSnapshotMalloc(const drmAllocator *arena,
+						size_t size)
+{
+	struct drm_mode_snapshot_block *block;
+
+	if (!arena)
+		return drmMalloc(size);
+
+	block = arena->malloc_fn(arena->priv, size);
+	if (!block)
+		return NULL;
+
+	memset(block, 0, size);
+	block->arena = arena;
+	return &block->snap;
+}
+
+static void *drmModeSnapshotLibcMalloc(void *priv, size_t size)
+{
+	return malloc(size);
+}
+
+static void drmModeSnapshotLibcFree(void *priv, void *ptr)
+{
+	free(ptr);
+}
+
+/* For the snapshots libdrm keeps for itself, which must not end up in the
+ * application's allocator. */
+static const drmAllocator drm_mode_snapshot_libc = {
+	.malloc_fn = drmModeSnapshotLibcMalloc,
+	.free_fn = drmModeSnapshotLibcFree,
+};
+
+static drmModeSnapshotPtr
+drmModeGetSnapshotProbe(int fd, uint32_t flags, const drmAllocator *arena,
+			drmModeSnapshotProbeFunc probe, void *data)
+{
+	struct drm_mode_snapshot_ids ids;
+	drmModeSnapshotPtr snap;
+	int ret;
+
+	do {
+		snap = NULL;
+		memclear(ids);
+
+		ret = drmModeSnapshotCount(fd, flags, probe, data, &ids);
+		if (!ret) {
+			snap = drmModeSnapshotMalloc(arena,
+				drmModeSnapshotLayout(NULL, &ids, flags));
+			if (snap) {
+				drmModeSnapshotLayout((char *)snap, &ids, flags);
+				ret = drmModeSnapshotFill(fd, flags, &ids, snap);
+			} else {
+				ret = -ENOMEM;
+			}
+		}
+
+		drmFree(ids.counts);
+
+		/* An object going away in between is a hotplug as well. */
+		if (ret == -ENOENT)
+			ret = -EAGAIN;
+		if (ret) {
+			drmModeFreeSnapshot(snap);
+			snap = NULL;
+		}
+	} while (ret == -EAGAIN);
+
+	if (ret)
+		errno = -ret;
+
+	return snap;
+}
+
+drmModeSnapshotPtr drmModeGetSnapshot(int fd, uint32_t flags)
+{
+	return drmModeGetSnapshotProbe(fd, flags, NULL, NULL, NULL);
+}
+
+drmModeSnapshotPtr drmModeGetSnapshotArena(int fd, uint32_t flags,
+					   const drmAllocator *arena)
+{
+	if (arena && !arena->malloc_fn) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return drmModeGetSnapshotProbe(fd, flags, arena, NULL, NULL);
+}
+
+void drmModeFreeSnapshot(drmModeSnapshotPtr snap)
+{
+	struct drm_mode_snapshot_block *block = (void *)snap;
+	const drmAllocator *arena;
+
+	if (!snap)
+		return;
+
+	arena = block->arena;
+	if (!arena)
+		drmFree(snap);
+	else if (arena->free_fn)
+		arena->free_fn(arena->priv, snap);
+}
+
+/*
+ * Hotplug diffing
+ *
+ * The state is the snapshot taken by the previous update.  A new one is
+ * taken without probing, which still reports the connection status the
+ * kernel's hotplug handling detected, and only connectors that are new or
+ * whose status changed get probed for their modes.
+ */
+
+struct _drmModeHotplugState {
+	drmModeSnapshotPtr snap;
+	uint64_t epoch;
+
+	drmModeHotplugChangePtr changes;
+	uint32_t count_changes, size_changes;
+};
+
+static drmModeConnectorPtr
+drmModeSnapshotFindConnector(drmModeSnapshotPtr snap, uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < snap->res.count_connectors; i++)
+		if (snap->connectors[i].connector_id == id)
+			return &snap->connectors[i];
+
+	return NULL;
+}
+
+static drmModeEncoderPtr
+drmModeSnapshotFindEncoder(drmModeSnapshotPtr snap, uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < snap->res.count_encoders; i++)
+		if (snap->encoders[i].encoder_id == id)
+			return &snap->encoders[i];
+
+	return NULL;
+}
+
+static drmModeCrtcPtr
+drmModeSnapshotFindCrtc(drmModeSnapshotPtr snap, uint32_t id)
+{
+	int i;
+
+	for (i = 0; i < snap->res.count_crtcs; i++)
+		if (snap->crtcs[i].crtc_id == id)
+			return &snap->crtcs[i];
+
+	return NULL;
+}
+
+static int drmModeHotplugNeedsProbe(void *data, uint32_t connector_id,
+				    uint32_t connection)
+{
+	drmModeHotplugStatePtr state = data;
+	drmModeConnectorPtr old;
+
+	old = drmModeSnapshotFindConnector(state->snap, connector_id);
+
+	return !old || old->connection != (drmModeConnection)connection;
+}
+
+static int drmModeHotplugAddChange(drmModeHotplugStatePtr state,
+				   uint32_t object_type, uint32_t object_id,
+				   uint32_t flags)
+{
+	drmModeHotplugChangePtr change;
+
+	if (!flags)
+		return 0;
+
+	if (state->count_changes == state->size_changes) {
+		uint32_t size = state->size_changes ? state->size_changes * 2 : 16;
+
+		change = realloc(state->changes, size * sizeof(*change));
+		if (!change)
+			return -ENOMEM;
+		state->changes = change;
+		state->size_changes = size;
+	}
+
+	change = &state->changes[state->count_changes++];
+	change->object_type = object_type;
+	change->object_id = object_id;
+	change->flags = flags;
+
+	return 0;
+}
+
+static uint32_t drmModeHotplugDiffConnector(drmModeConnectorPtr old,
+					    drmModeConnectorPtr new)
+{
+	uint32_t flags = 0;
+
+	if (old->connection != new->connection)
+		flags |= DRM_MODE_HOTPLUG_CONNECTION;
+
+	if (old->count_modes != new->count_modes ||
+	    (new->count_modes &&
+	     memcmp(old->modes, new->modes,
+		    new->count_modes * sizeof(*new->modes))))
+		flags |= DRM_MODE_HOTPLUG_MODES;
+
+	if (old->count_props != new->count_props ||
+	    (new->count_props &&
+	     (memcmp(old->props, new->props,
+		     new->count_props * sizeof(*new->props)) ||
+	      memcmp(old->prop_values, new->prop_values,
+		     new->count_props * sizeof(*new->prop_values)))))
+		flags |= DRM_MODE_HOTPLUG_PROPERTIES;
+
+	if (old->encoder_id != new->encoder_id ||
+	    old->mmWidth != new->mmWidth ||
+	    old->mmHeight != new->mmHeight ||
+	    old->subpixel != new->subpixel ||
+	    old->count_encoders != new->count_encoders ||
+	    (new->count_encoders &&
+	     memcmp(old->encoders, new->encoders,
+		    new->count_encoders * sizeof(*new->encoders))))
+		flags |= DRM_MODE_HOTPLUG_STATE;
+
+	return flags;
+}
+
+static uint32_t drmModeHotplugDiffEncoder(drmModeEncoderPtr old,
+					  drmModeEncoderPtr new)
+{
+	if (old->crtc_id != new->crtc_id ||
+	    old->possible_crtcs != new->possible_crtcs ||
+	    old->possible_clones != new->possible_clones)
+		return DRM_MODE_HOTPLUG_STATE;
+
+	return 0;
+}
+
+static uint32_t drmModeHotplugDiffCrtc(drmModeCrtcPtr old, drmModeCrtcPtr new)
+{
+	if (old->buffer_id != new->buffer_id ||
+	    old->x != new->x || old->y != new->y ||
+	    old->mode_valid != new->mode_valid ||
+	    (new->mode_valid &&
+	     memcmp(&old->mode, &new->mode, sizeof(new->mode))))
+		return DRM_MODE_HOTPLUG_STATE;
+
+	return 0;
+}
+
+/* Records the changes from state->snap to snap. */
+static int drmModeHotplugDiff(drmModeHotplugStatePtr state,
+			      drmModeSnapshotPtr snap)
+{
+	drmModeSnapshotPtr old = state->snap;
+	drmModeConnectorPtr conn;
+	drmModeEncoderPtr enc;
+	drmModeCrtcPtr crtc;
+	uint32_t flags;
+	int i, ret;
+
+	for (i = 0; i < snap->res.count_connectors; i++) {
+		conn = drmModeSnapshotFindConnector(old, snap->connectors[i].connector_id);
+		flags = conn ? drmModeHotplugDiffConnector(conn, &snap->connectors[i]) :
+			       DRM_MODE_HOTPLUG_ADDED;
+		ret = drmModeHotplugAddChange(state, DRM_MODE_OBJECT_CONNECTOR,
+					      snap->connectors[i].connector_id,
+					      flags);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < old->res.count_connectors; i++) {
+		if (drmModeSnapshotFindConnector(snap, old->connectors[i].connector_id))
+			continue;
+		ret = drmModeHotplugAddChange(state, DRM_MODE_OBJECT_CONNECTOR,
+					      old->connectors[i].connector_id,
+					      DRM_MODE_HOTPLUG_REMOVED);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < snap->res.count_encoders; i++) {
+		enc = drmModeSnapshotFindEncoder(old, snap->encoders[i].encoder_id);
+		flags = enc ? drmModeHotplugDiffEncoder(enc, &snap->encoders[i]) :
+			      DRM_MODE_HOTPLUG_ADDED;
+		ret = drmModeHotplugAddChange(state, DRM_MODE_OBJECT_ENCODER,
+					      snap->encoders[i].encoder_id,
+					      flags);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < old->res.count_encoders; i++) {
+		if (drmModeSnapshotFindEncoder(snap, old->encoders[i].encoder_id))
+			continue;
+		ret = drmModeHotplugAddChange(state, DRM_MODE_OBJECT_ENCODER,
+					      old->encoders[i].encoder_id,
+					      DRM_MODE_HOTPLUG_REMOVED);
+		if (ret)
+			return ret;
+	}
+
+	/* CRTCs don't come and go, but compare them the same way anyway. */
+	for (i = 0; i < snap->res.count_crtcs; i++) {
+		crtc = drmModeSnapshotFindCrtc(old, snap->crtcs[i].crtc_id);
+		flags = crtc ? drmModeHotplugDiffCrtc(crtc, &snap->crtcs[i]) :
+			       DRM_MODE_HOTPLUG_ADDED;
+		ret = drmModeHotplugAddChange(state, DRM_MODE_OBJECT_CRTC,
+					      snap->crtcs[i].crtc_id, flags);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0; i < old->res.count_crtcs; i++) {
+		if (drmModeSnapshotFindCrtc(snap, old->crtcs[i].crtc_id))
+			continue;
+		ret = drmModeHotplugAddChange(state, DRM_MODE_OBJECT_CRTC,
+					      old->crtcs[i].crtc_id,
+					      DRM_MODE_HOTPLUG_REMOVED);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+drmModeHotplugStatePtr drmModeHotplugStateCreate(int fd)
+{
+	drmModeHotplugStatePtr state;
+
+	state = calloc(1, sizeof(*state));
+	if (!state)
+		return NULL;
+
+	state->snap = drmModeGetSnapshotProbe(fd, DRM_MODE_SNAPSHOT_PROBE,
+					      &drm_mode_snapshot_libc,
+					      NULL, NULL);
+	if (!state->snap) {
+		free(state);
+		return NULL;
+	}
+
+	return state;
+}
+
+void drmModeHotplugStateFree(drmModeHotplugStatePtr state)
+{
+	if (!state)
+		return;
+
+	drmModeFreeSnapshot(state->snap);
+	free(state->changes);
+	free(state);
+}
+
+drmModeSnapshotPtr drmModeHotplugStateGetSnapshot(drmModeHotplugStatePtr state)
+{
+	return state ? state->snap : NULL;
+}
+
+uint64_t drmModeHotplugStateGetEpoch(drmModeHotplugStatePtr state)
+{
+	return state ? state->epoch : 0;
+}
+
+int drmModeHotplugUpdate(int fd, drmModeHotplugStatePtr state,
+			 const drmModeHotplugChange **changes)
+{
+	drmModeSnapshotPtr snap;
+	int ret;
+
+	if (!state || !changes)
+		return -EINVAL;
+
+	*changes = NULL;
+	state->count_changes = 0;
+
+	snap = drmModeGetSnapshotProbe(fd, 0, &drm_mode_snapshot_libc,
+				       drmModeHotplugNeedsProbe, state);
+	if (!snap)
+		return -errno;
+
+	ret = drmModeHotplugDiff(state, snap);
+	if (ret) {
+		state->count_changes = 0;
+		drmModeFreeSnapshot(snap);
+		return ret;
+	}
+
+	drmModeFreeSnapshot(state->snap);
+	state->snap = snap;
+	if (state->count_changes) {
+		state->epoch++;
+		*changes = state->changes;
+	}
+
+	return state->count_changes;
+}
+
+/*
+ * Flip queue
+ */
+
+struct drm_mode_flip_crtc {
+	uint32_t crtc_id;
+	bool pending;
+	void *user_data;
+	uint64_t submit_ns;
+	/* The vblank the pending flip should land on, 0 if unknown. */
+	uint64_t expected;
+
+	/* The last completion, with the sequence extended to 64 bits. */
+	bool have_last;
+	uint64_t last_sequence;
+	uint64_t last_ns;
+
+	drmModeFlipStats stats;
+};
+
+struct _drmModeFlipQueue {
+	int fd;
+	drmEventDispatcherPtr dispatcher;
+	drmModeFlipHandler handler;
+	void *data;
+
+	drmModeFlipClock clock;
+	void *clock_data;
+
+	struct drm_mode_flip_crtc *crtcs;
+	uint32_t count_crtcs, size_crtcs;
+};
+
+static uint64_t drmModeFlipMonotonic(void *data)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void drmModeFlipQueueEvent(int fd, const struct drm_event *event,
+				  uint64_t latency_ns, void *data)
+{
+	drmModeFlipQueueHandleEvent(data, event);
+}
+
+drmModeFlipQueuePtr drmModeFlipQueueCreate(int fd,
+					   drmEventDispatcherPtr dispatcher,
+					   drmModeFlipHandler handler,
+					   void *data)
+{
+	drmModeFlipQueuePtr queue;
+
+	queue = calloc(1, sizeof(*queue));
+	if (!queue)
+		return NULL;
+
+	queue->fd = fd;
+	queue->handler = handler;
+	queue->data = data;
+	queue->clock = drmModeFlipMonotonic;
+
+	if (dispatcher) {
+		if (drmEventDispatcherSetHandler(dispatcher,
+						 DRM_EVENT_FLIP_COMPLETE,
+						 drmModeFlipQueueEvent, queue)) {
+			free(queue);
+			return NULL;
+		}
+		queue->dispatcher = dispatcher;
+	}
+
+	return queue;
+}
+
+void drmModeFlipQueueDestroy(drmModeFlipQueuePtr queue)
+{
+	if (!queue)
+		return;
+
+	if (queue->dispatcher) {
+		struct drm_event_slot *slot;
+
+		/* Leave alone a handler that was set after ours. */
+		slot = drmEventDispatcherSlot(queue->dispatcher,
+					      DRM_EVENT_FLIP_COMPLETE);
+		if (slot->handler == drmModeFlipQueueEvent &&
+		    slot->data == queue) {
+			slot->handler = NULL;
+			slot->data = NULL;
+		}
+	}
+	free(queue->crtcs);
+	free(queue);
+}
+
+void drmModeFlipQueueSetClock(drmModeFlipQueuePtr queue,
+			      drmModeFlipClock clock, void *data)
+{
+	if (!queue)
+		return;
+
+	queue->clock = clock ? clock : drmModeFlipMonotonic;
+	queue->clock_data = data;
+}
+
+static struct drm_mode_flip_crtc *
+drmModeFlipQueueFind(drmModeFlipQueuePtr queue, uint32_t crtc_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < queue->count_crtcs; i++)
+		if (queue->crtcs[i].crtc_id == crtc_id)
+			return &queue->crtcs[i];
+
+	return NULL;
+}
+
+static struct drm_mode_flip_crtc *
+drmModeFlipQueueGet(drmModeFlipQueuePtr queue, uint32_t crtc_id)
+{
+	struct drm_mode_flip_crtc *crtc;
+
+	crtc = drmModeFlipQueueFind(queue, crtc_id);
+	if (crtc)
+		return crtc;
+
+	if (queue->count_crtcs == queue->size_crtcs) {
+		uint32_t size = queue->size_crtcs ? queue->size_crtcs * 2 : 4;
+
+		crtc = realloc(queue->crtcs, size * sizeof(*crtc));
+		if (!crtc)
+			return NULL;
+		queue->crtcs = crtc;
+		queue->size_crtcs = size;
+	}
+
+	crtc = &queue->crtcs[queue->count_crtcs++];
+	memset(crtc, 0, sizeof(*crtc));
+	crtc->crtc_id = crtc_id;
+	return crtc;
+}
+
+/* The first vblank after now, extrapolated from the last completion. */
+static int drmModeFlipPredict(const struct drm_mode_flip_crtc *crtc,
+			      uint64_t now, uint64_t *sequence,
+			      uint64_t *time_ns)
+{
+	uint64_t n;
+
+	if (!crtc->have_last || !crtc->stats.period_ns)
+		return -EAGAIN;
+
+	n = now > crtc->last_ns ?
+		(now - crtc->last_ns) / crtc->stats.period_ns + 1 : 1;
+
+	if (sequence)
+		*sequence = crtc->last_sequence + n;
+	if (time_ns)
+		*time_ns = crtc->last_ns + n * crtc->stats.period_ns;
+	return 0;
+}
+
+static void drmModeFlipQueueSubmitted(drmModeFlipQueuePtr queue,
+				      struct drm_mode_flip_crtc *crtc,
+				      uint64_t now, uint64_t target,
+				      void *user_data)
+{
+	crtc->pending = true;
+	crtc->user_data = user_data;
+	crtc->submit_ns = now;
+	crtc->expected = target;
+	if (!crtc->expected)
+		drmModeFlipPredict(crtc, now, &crtc->expected, NULL);
+}
+
+int drmModeFlipQueueFlip(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+			 uint32_t fb_id, uint64_t target_sequence,
+			 void *user_data)
+{
+	struct drm_mode_flip_crtc *crtc;
+	uint64_t now;
+	int ret;
+
+	if (!queue)
+		return -EINVAL;
+
+	crtc = drmModeFlipQueueGet(queue, crtc_id);
+	if (!crtc)
+		return -ENOMEM;
+	if (crtc->pending)
+		return -EBUSY;
+
+	now = queue->clock(queue->clock_data);
+
+	/* The kernel event only tells us the CRTC on newer kernels, so pass
+	 * it along as the user data as well. */
+	if (target_sequence)
+		ret = drmModePageFlipTarget(queue->fd, crtc_id, fb_id,
+					    DRM_MODE_PAGE_FLIP_EVENT |
+					    DRM_MODE_PAGE_FLIP_TARGET_ABSOLUTE,
+					    (void *)(uintptr_t)crtc_id,
+					    (uint32_t)target_sequence);
+	else
+		ret = drmModePageFlip(queue->fd, crtc_id, fb_id,
+				      DRM_MODE_PAGE_FLIP_EVENT,
+				      (void *)(uintptr_t)crtc_id);
+	if (ret)
+		return ret;
+
+	drmModeFlipQueueSubmitted(queue, crtc, now, target_sequence, user_data);
+	return 0;
+}
+
+int drmModeFlipQueueCommit(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+			   drmModeAtomicReqPtr req, uint32_t flags,
+			   void *user_data)
+{
+	struct drm_mode_flip_crtc *crtc;
+	uint64_t now;
+	int ret;
+
+	if (!queue)
+		return -EINVAL;
+
+	crtc = drmModeFlipQueueGet(queue, crtc_id);
+	if (!crtc)
+		return -ENOMEM;
+	if (crtc->pending)
+		return -EBUSY;
+
+	now = queue->clock(queue->clock_data);
+
+	ret = drmModeAtomicCommit(queue->fd, req,
+				  flags | DRM_MODE_ATOMIC_NONBLOCK |
+				  DRM_MODE_PAGE_FLIP_EVENT,
+				  (void *)(uintptr_t)crtc_id);
+	if (ret)
+		return ret;
+
+	drmModeFlipQueueSubmitted(queue, crtc, now, 0, user_data);
+	return 0;
+}
+
+int drmModeFlipQueueHandleEvent(drmModeFlipQueuePtr queue,
+				const struct drm_event *event)
+{
+	const struct drm_event_vblank *vblank;
+	struct drm_mode_flip_crtc *crtc;
+	uint64_t sequence, time_ns, latency, period;
+	uint32_t crtc_id;
+
+	if (!queue || !event || event->type != DRM_EVENT_FLIP_COMPLETE ||
+	    event->length < sizeof(*vblank))
+		return 0;
+
+	vblank = (const struct drm_event_vblank *)event;
+	crtc_id = vblank->crtc_id ? vblank->crtc_id :
+				    (uint32_t)vblank->user_data;
+	crtc = drmModeFlipQueueFind(queue, crtc_id);
+	if (!crtc || !crtc->pending)
+		return 0;
+
+	time_ns = vblank->tv_sec * 1000000000ull + vblank->tv_usec * 1000ull;
+	sequence = vblank->sequence;
+	if (crtc->have_last) {
+		/* Extend the 32 bit counter, and refine the refresh period
+		 * from the time between the last two completions. */
+		sequence = crtc->last_sequence +
+			   (uint32_t)(vblank->sequence - (uint32_t)crtc->last_sequence);
+		if (sequence > crtc->last_sequence && time_ns > crtc->last_ns) {
+			period = (time_ns - crtc->last_ns) /
+				 (sequence - crtc->last_sequence);
+			crtc->stats.period_ns = crtc->stats.period_ns ?
+				(crtc->stats.period_ns * 7 + period) / 8 : period;
+		}
+	} else if (crtc->expected) {
+		sequence = (crtc->expected & ~0xffffffffull) | vblank->sequence;
+	}
+
+	if (crtc->expected && sequence > crtc->expected)
+		crtc->stats.count_missed += sequence - crtc->expected;
+
+	latency = time_ns > crtc->submit_ns ? time_ns - crtc->submit_ns : 0;
+	crtc->stats.count_flips++;
+	crtc->stats.total_latency_ns += latency;
+	if (latency > crtc->stats.max_latency_ns)
+		crtc->stats.max_latency_ns = latency;
+
+	crtc->have_last = true;
+	crtc->last_sequence = sequence;
+	crtc->last_ns = time_ns;
+	crtc->pending = false;
+
+	if (queue->handler)
+		queue->handler(crtc_id, sequence, time_ns, crtc->user_data);
+
+	return 1;
+}
+
+int drmModeFlipQueuePending(drmModeFlipQueuePtr queue, uint32_t crtc_id)
+{
+	struct drm_mode_flip_crtc *crtc;
+
+	if (!queue)
+		return -EINVAL;
+
+	crtc = drmModeFlipQueueFind(queue, crtc_id);
+	return crtc && crtc->pending;
+}
+
+int drmModeFlipQueuePredict(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+			    uint64_t *sequence, uint64_t *time_ns)
+{
+	struct drm_mode_flip_crtc *crtc;
+
+	if (!queue)
+		return -EINVAL;
+
+	crtc = drmModeFlipQueueFind(queue, crtc_id);
+	if (!crtc)
+		return -EAGAIN;
+
+	return drmModeFlipPredict(crtc, queue->clock(queue->clock_data),
+				  sequence, time_ns);
+}
+
+int drmModeFlipQueueGetStats(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+			     drmModeFlipStatsPtr stats)
+{
+	struct drm_mode_flip_crtc *crtc;
+
+	if (!queue || !stats)
+		return -EINVAL;
+
+	crtc = drmModeFlipQueueFind(queue, crtc_id);
+	if (!crtc)
+		return -ENOENT;
+
+	*stats = crtc->stats;
+	return 0;
+}
+
+/*
+ * Plane format index
+ *
+ * IN_FORMATS lists formats, and for every modifier a bitmask of the formats
+ * it applies to.  The index keeps those bitmasks with one bit per format,
+ * finds formats and modifiers through small open addressed tables, and
+ * keeps every format's modifier list ready, all in one allocation.
+ */
+
+struct _drmModeFormatIndex {
+	uint32_t count_formats;
+	uint32_t count_modifiers;
+	uint32_t words;			/* per modifier bitmask */
+	uint32_t format_mask, modifier_mask;
+
+	uint32_t *formats;
+	int32_t *format_slots;		/* fourcc hash -> index in formats */
+	uint64_t *modifiers;
+	int32_t *modifier_slots;	/* modifier hash -> index in modifiers */
+	uint64_t *bits;			/* count_modifiers * words */
+	uint32_t *lists;		/* count_formats + 1 offsets into list */
+	uint64_t *list;
+};
+
+static uint32_t drmModeFormatIndexSlots(uint32_t count)
+{
+	uint32_t size = 8;
+
+	while (size < count * 2)
+		size *= 2;
+
+	return size;
+}
+
+static int drmModeFormatIndexFindFormat(const drmModeFormatIndex *index,
+					uint32_t format)
+{
+	uint32_t i = drmModeHashKey(format) & index->format_mask;
+	int32_t slot;
+
+	while ((slot = index->format_slots[i]) >= 0) {
+		if (index->formats[slot] == format)
+			return slot;
+		i = (i + 1) & index->format_mask;
+	}
+
+	return -1;
+}
+
+static int drmModeFormatIndexFindModifier(const drmModeFormatIndex *index,
+					  uint64_t modifier)
+{
+	uint32_t i = drmModeHashKey(modifier) & index->modifier_mask;
+	int32_t slot;
+
+	while ((slot = index->modifier_slots[i]) >= 0) {
+		if (index->modifiers[slot] == modifier)
+			return slot;
+		i = (i + 1) & index->modifier_mask;
+	}
+
+	return -1;
+}
+
+/* Returns the index of modifier, adding it if it is new. */
+static int drmModeFormatIndexAddModifier(drmModeFormatIndex *index,
+					 uint64_t modifier)
+{
+	uint32_t i = drmModeHashKey(modifier) & index->modifier_mask;
+	int32_t slot;
+
+	while ((slot = index->modifier_slots[i]) >= 0) {
+		if (index->modifiers[slot] == modifier)
+			return slot;
+		i = (i + 1) & index->modifier_mask;
+	}
+
+	slot = index->count_modifiers++;
+	index->modifiers[slot] = modifier;
+	index->modifier_slots[i] = slot;
+	return slot;
+}
+
+static drmModeFormatIndexPtr
+drmModeFormatIndexAlloc(uint32_t count_formats, uint32_t max_modifiers,
+			uint32_t max_list)
+{
+	uint32_t format_slots = drmModeFormatIndexSlots(count_formats);
+	uint32_t modifier_slots = drmModeFormatIndexSlots(max_modifiers);
+	uint32_t words = (count_formats + 63) / 64;
+	drmModeFormatIndexPtr index;
+	size_t size;
+	char *ptr;
+
+	/* The 64 bit arrays go first to keep them aligned. */
+	size = sizeof(*index) +
+	       (size_t)max_modifiers * sizeof(uint64_t) +
+	       (size_t)max_modifiers * words * sizeof(uint64_t) +
+	       (size_t)max_list * sizeof(uint64_t) +
+	       (size_t)count_formats * sizeof(uint32_t) +
+	       (size_t)format_slots * sizeof(int32_t) +
+	       (size_t)modifier_slots * sizeof(int32_t) +
+	       (size_t)(count_formats + 1) * sizeof(uint32_t);
+
+	index = drmMalloc(size);
+	if (!index)
+		return NULL;
+
+	ptr = (char *)(index + 1);
+	index->modifiers = (uint64_t *)ptr;
+	ptr += (size_t)max_modifiers * sizeof(uint64_t);
+	index->bits = (uint64_t *)ptr;
+	ptr += (size_t)max_modifiers * words * sizeof(uint64_t);
+	index->list = (uint64_t *)ptr;
+	ptr += (size_t)max_list * sizeof(uint64_t);
+	index->formats = (uint32_t *)ptr;
+	ptr += (size_t)count_formats * sizeof(uint32_t);
+	index->format_slots = (int32_t *)ptr;
+	ptr += (size_t)format_slots * sizeof(int32_t);
+	index->modifier_slots = (int32_t *)ptr;
+	ptr += (size_t)modifier_slots * sizeof(int32_t);
+	index->lists = (uint32_t *)ptr;
+
+	memset(index->format_slots, 0xff, format_slots * sizeof(int32_t));
+	memset(index->modifier_slots, 0xff, modifier_slots * sizeof(int32_t));
+	index->words = words;
+	index->format_mask = format_slots - 1;
+	index->modifier_mask = modifier_slots - 1;
+
+	return index;
+}
+
+static void drmModeFormatIndexAddFormats(drmModeFormatIndexPtr index,
+					 const uint32_t *formats,
+					 uint32_t count)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < count; i++) {
+		/* A repeated format keeps its first position. */
+		if (drmModeFormatIndexFindFormat(index, formats[i]) >= 0)
+			continue;
+
+		j = drmModeHashKey(formats[i]) & index->format_mask;
+		while (index->format_slots[j] >= 0)
+			j = (j + 1) & index->format_mask;
+
+		index->format_slots[j] = index->count_formats;
+		index->formats[index->count_formats++] = formats[i];
+	}
+}
+
+/* Fills in every format's list of modifiers from the bitmasks. */
+static void drmModeFormatIndexBuildLists(drmModeFormatIndexPtr index)
+{
+	uint32_t f, m, n = 0;
+
+	for (f = 0; f < index->count_formats; f++) {
+		index->lists[f] = n;
+		for (m = 0; m < index->count_modifiers; m++) {
+			if (index->bits[m * index->words + f / 64] &
+			    (1ull << (f % 64)))
+				index->list[n++] = index->modifiers[m];
+		}
+	}
+	index->lists[f] = n;
+}
+
+drmModeFormatIndexPtr drmModeFormatIndexCreate(const void *data, size_t size)
+{
+	const struct drm_format_modifier_blob *blob = data;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	drmModeFormatIndexPtr index;
+	uint32_t i, b, max_list = 0;
+	uint64_t mask;
+	int m, f;
+
+	if (!data || size < sizeof(*blob) || blob->version < FORMAT_BLOB_CURRENT ||
+	    blob->formats_offset > size ||
+	    (size - blob->formats_offset) / sizeof(*formats) < blob->count_formats ||
+	    blob->modifiers_offset > size ||
+	    (size - blob->modifiers_offset) / sizeof(*mods) < blob->count_modifiers) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	formats = (const uint32_t *)((const char *)data + blob->formats_offset);
+	mods = (const struct drm_format_modifier *)((const char *)data +
+						    blob->modifiers_offset);
+
+	for (i = 0; i < blob->count_modifiers; i++)
+		for (mask = mods[i].formats; mask; mask &= mask - 1)
+			max_list++;
+
+	index = drmModeFormatIndexAlloc(blob->count_formats,
+					blob->count_modifiers, max_list);
+	if (!index) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	drmModeFormatIndexAddFormats(index, formats, blob->count_formats);
+
+	for (i = 0; i < blob->count_modifiers; i++) {
+		m = drmModeFormatIndexAddModifier(index, mods[i].modifier);
+		for (mask = mods[i].formats; mask; mask &= mask - 1) {
+			b = mods[i].offset + __builtin_ctzll(mask);
+			if (b >= blob->count_formats)
+				continue;
+			/* Bits refer to the blob's format list, which may
+			 * have had repeats dropped. */
+			f = drmModeFormatIndexFindFormat(index, formats[b]);
+			index->bits[m * index->words + f / 64] |= 1ull << (f % 64);
+		}
+	}
+
+	drmModeFormatIndexBuildLists(index);
+	return index;
+}
+
+drmModeFormatIndexPtr drmModeFormatIndexCreateFromPlane(drmModePlanePtr plane)
+{
+	drmModeFormatIndexPtr index;
+	uint32_t f;
+
+	if (!plane) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	index = drmModeFormatIndexAlloc(plane->count_formats, 1,
+					plane->count_formats);
+	if (!index) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	drmModeFormatIndexAddFormats(index, plane->formats, plane->count_formats);
+	if (index->count_formats) {
+		drmModeFormatIndexAddModifier(index, DRM_FORMAT_MOD_INVALID);
+		for (f = 0; f < index->count_formats; f++)
+			index->bits[f / 64] |= 1ull << (f % 64);
+	}
+
+	drmModeFormatIndexBuildLists(index);
+	return index;
+}
+
+drmModeFormatIndexPtr drmModeGetPlaneFormatIndex(int fd, uint32_t plane_id)
+{
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyBlobPtr blob = NULL;
+	drmModeFormatIndexPtr index;
+	drmModePropertyPtr prop;
+	drmModePlanePtr plane;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return NULL;
+
+	for (i = 0; i < props->count_props && !blob; i++) {
+		prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "IN_FORMATS") && props->prop_values[i])
+			blob = drmModeGetPropertyBlob(fd, props->prop_values[i]);
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	if (blob) {
+		index = drmModeFormatIndexCreate(blob->data, blob->length);
+		drmModeFreePropertyBlob(blob);
+		return index;
+	}
+
+	/* Without modifier support the plane's format list is all there is. */
+	plane = drmModeGetPlane(fd, plane_id);
+	if (!plane)
+		return NULL;
+
+	index = drmModeFormatIndexCreateFromPlane(plane);
+	drmModeFreePlane(plane);
+	return index;
+}
+
+void drmModeFreeFormatIndex(drmModeFormatIndexPtr index)
+{
+	drmFree(index);
+}
+
+int drmModeFormatIndexHasFormat(drmModeFormatIndexPtr index, uint32_t format)
+{
+	return index && drmModeFormatIndexFindFormat(index, format) >= 0;
+}
+
+int drmModeFormatIndexSupports(drmModeFormatIndexPtr index, uint32_t format,
+			       uint64_t modifier)
+{
+	int f, m;
+
+	if (!index)
+		return 0;
+
+	f = drmModeFormatIndexFindFormat(index, format);
+	m = drmModeFormatIndexFindModifier(index, modifier);
+	if (f < 0 || m < 0)
+		return 0;
+
+	return !!(index->bits[m * index->words + f / 64] & (1ull << (f % 64)));
+}
+
+int drmModeFormatIndexGetModifiers(drmModeFormatIndexPtr index,
+				   uint32_t format, const uint64_t **modifiers)
+{
+	int f;
+
+	if (!index || !modifiers)
+		return -EINVAL;
+
+	f = drmModeFormatIndexFindFormat(index, format);
+	if (f < 0) {
+		*modifiers = NULL;
+		return 0;
+	}
+
+	*modifiers = &index->list[index->lists[f]];
+	return index->lists[f + 1] - index->lists[f];
+}
+
+/*
+ * Plane assignment
+ *
+ * Layers are placed bottom to top, each on the lowest plane above the one
+ * the layer below got that can scan it out, as far as the plane's CRTCs,
+ * formats and the TEST_ONLY commit of the configuration so far plus this
+ * layer go.  Test results are remembered by a hash of the configuration,
+ * built from the caller's keys for the base state and for each layer, so
+ * a scene that did not change needs no test commits at all.
+ */
+
+#define PLANE_SOLVER_MEMO_SIZE 1024
+
+struct drm_mode_solver_plane {
+	uint32_t plane_id;
+	uint32_t possible_crtcs;
+	uint64_t zpos;
+	drmModeFormatIndexPtr formats;
+};
+
+struct _drmModePlaneSolver {
+	int fd;
+
+	struct drm_mode_solver_plane *planes;
+	uint32_t count_planes, size_planes;
+
+	/* configuration hash | 1 if the test passed, 0 if empty */
+	uint64_t memo[PLANE_SOLVER_MEMO_SIZE];
+	uint32_t count_memo;
+
+	drmModePlaneSolverStats stats;
+};
+
+static uint64_t drmModePlaneSolverMix(uint64_t hash, uint64_t value)
+{
+	hash = (hash ^ value) * 0x9e3779b97f4a7c15ull;
+	return hash ^ (hash >> 32);
+}
+
+/* The low bit of a memo entry holds the result, the next one keeps it
+ * from being 0. */
+static uint64_t drmModePlaneSolverMemoKey(uint64_t hash)
+{
+	return (hash & ~1ull) | 2;
+}
+
+/* Returns 1 or 0 for a remembered result, -1 if there is none. */
+static int drmModePlaneSolverRecall(drmModePlaneSolverPtr solver,
+				    uint64_t hash)
+{
+	uint32_t i;
+
+	hash = drmModePlaneSolverMemoKey(hash);
+	i = drmModeHashKey(hash) & (PLANE_SOLVER_MEMO_SIZE - 1);
+	while (solver->memo[i]) {
+		if ((solver->memo[i] & ~1ull) == hash)
+			return solver->memo[i] & 1;
+		i = (i + 1) & (PLANE_SOLVER_MEMO_SIZE - 1);
+	}
+
+	return -1;
+}
+
+static void drmModePlaneSolverRemember(drmModePlaneSolverPtr solver,
+				       uint64_t hash, int passed)
+{
+	uint32_t i;
+
+	/* Start over rather than let probe sequences grow long. */
+	if (solver->count_memo * 4 >= PLANE_SOLVER_MEMO_SIZE * 3)
+		drmModePlaneSolverInvalidate(solver);
+
+	hash = drmModePlaneSolverMemoKey(hash);
+	i = drmModeHashKey(hash) & (PLANE_SOLVER_MEMO_SIZE - 1);
+	while (solver->memo[i])
+		i = (i + 1) & (PLANE_SOLVER_MEMO_SIZE - 1);
+
+	solver->memo[i] = hash | !!passed;
+	solver->count_memo++;
+}
+
+drmModePlaneSolverPtr drmModePlaneSolverCreate(int fd)
+{
+	drmModePlaneSolverPtr solver;
+
+	solver = calloc(1, sizeof(*solver));
+	if (!solver)
+		return NULL;
+
+	solver->fd = fd;
+	return solver;
+}
+
+void drmModePlaneSolverFree(drmModePlaneSolverPtr solver)
+{
+	if (!solver)
+		return;
+
+	free(solver->planes);
+	free(solver);
+}
+
+int drmModePlaneSolverAddPlane(drmModePlaneSolverPtr solver, uint32_t plane_id,
+			       uint32_t possible_crtcs, uint64_t zpos,
+			       drmModeFormatIndexPtr formats)
+{
+	struct drm_mode_solver_plane *plane;
+	uint32_t i;
+
+	if (!solver || !plane_id)
+		return -EINVAL;
+
+	if (solver->count_planes == solver->size_planes) {
+		uint32_t size = solver->size_planes ? solver->size_planes * 2 : 8;
+
+		plane = realloc(solver->planes, size * sizeof(*plane));
+		if (!plane)
+			return -ENOMEM;
+		solver->planes = plane;
+		solver->size_planes = size;
+	}
+
+	/* Keep the planes sorted by zpos, bottom first. */
+	for (i = solver->count_planes; i > 0; i--) {
+		if (solver->planes[i - 1].zpos <= zpos)
+			break;
+		solver->planes[i] = solver->planes[i - 1];
+	}
+
+	plane = &solver->planes[i];
+	plane->plane_id = plane_id;
+	plane->possible_crtcs = possible_crtcs;
+	plane->zpos = zpos;
+	plane->formats = formats;
+	solver->count_planes++;
+
+	drmModePlaneSolverInvalidate(solver);
+	return 0;
+}
+
+void drmModePlaneSolverInvalidate(drmModePlaneSolverPtr solver)
+{
+	if (!solver)
+		return;
+
+	memset(solver->memo, 0, sizeof(solver->memo));
+	solver->count_memo = 0;
+}
+
+int drmModePlaneSolverSolve(drmModePlaneSolverPtr solver, uint32_t crtc_index,
+			    drmModeAtomicReqPtr base, uint64_t base_key,
+			    drmModePlaneSolverLayerPtr layers, uint32_t count,
+			    drmModePlaneSolverBuildFunc build, void *data,
+			    drmModeAtomicReqPtr *result)
+{
+	struct drm_mode_solver_plane *plane;
+	drmModeAtomicReqPtr req;
+	uint64_t hash, candidate;
+	uint32_t i, p, next = 0;
+	int cursor, passed, placed = 0, ret;
+
+	if (!solver || !build || !result || (count && !layers) ||
+	    crtc_index >= 32)
+		return -EINVAL;
+
+	/* Trial fragments are added to and rewound from a copy of the base
+	 * request, rather than merged into fresh duplicates. */
+	req = base ? drmModeAtomicDuplicate(base) : drmModeAtomicAlloc();
+	if (!req)
+		return -ENOMEM;
+
+	hash = drmModePlaneSolverMix(base_key, crtc_index);
+
+	for (i = 0; i < count; i++) {
+		drmModePlaneSolverLayerPtr layer = &layers[i];
+
+		layer->plane_id = 0;
+
+		for (p = next; p < solver->count_planes; p++) {
+			plane = &solver->planes[p];
+
+			if (!(plane->possible_crtcs & (1u << crtc_index)))
+				continue;
+			if (plane->formats &&
+			    !drmModeFormatIndexSupports(plane->formats,
+							layer->format,
+							layer->modifier))
+				continue;
+
+			candidate = drmModePlaneSolverMix(hash, layer->key);
+			candidate = drmModePlaneSolverMix(candidate, plane->plane_id);
+
+			passed = drmModePlaneSolverRecall(solver, candidate);
+			if (passed == 0) {
+				solver->stats.count_memo_hits++;
+				continue;
+			}
+
+			cursor = drmModeAtomicGetCursor(req);
+			ret = build(data, req, i, plane->plane_id);
+			if (ret < 0)
+				goto err;
+
+			if (passed < 0) {
+				solver->stats.count_tests++;
+				ret = drmModeAtomicCommit(solver->fd, req,
+							  DRM_MODE_ATOMIC_TEST_ONLY,
+							  NULL);
+				passed = !ret;
+				/* Only the kernel rejecting the configuration
+				 * says something about the next try. */
+				if (passed || ret == -EINVAL || ret == -ERANGE)
+					drmModePlaneSolverRemember(solver,
+								   candidate,
+								   passed);
+			} else {
+				solver->stats.count_memo_hits++;
+			}
+
+			if (!passed) {
+				drmModeAtomicSetCursor(req, cursor);
+				continue;
+			}
+
+			layer->plane_id = plane->plane_id;
+			hash = candidate;
+			placed++;
+			break;
+		}
+
+		/* Layers above a composited one are composited with it, on
+		 * a plane of their own they could end up below it. */
+		if (!layer->plane_id) {
+			while (++i < count)
+				layers[i].plane_id = 0;
+			break;
+		}
+
+		/* Layers above must go on higher planes. */
+		while (next < solver->count_planes &&
+		       solver->planes[next].zpos <= solver->planes[p].zpos)
+			next++;
+	}
+
+	*result = req;
+	return placed;
+
+err:
+	drmModeAtomicFree(req);
+	return ret;
+}
+
+void drmModePlaneSolverGetStats(drmModePlaneSolverPtr solver,
+				drmModePlaneSolverStatsPtr stats)
+{
+	if (solver && stats)
+		*stats = solver->stats;
 }
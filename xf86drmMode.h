@@ -338,6 +338,29 @@ typedef struct _drmModePlaneRes {
 	uint32_t *planes;
 } drmModePlaneRes, *drmModePlaneResPtr;
 
+/*
+ * A snapshot of the whole KMS object graph, in one allocation.  Connectors,
+ * encoders and CRTCs are in the order of the ids in res, planes in the order
+ * of drmModeGetPlaneResources().  None of the objects may be passed to the
+ * individual drmModeFree*() functions, use drmModeFreeSnapshot() instead.
+ */
+#define DRM_MODE_SNAPSHOT_PROBE      (1 << 0) /**< Probe connectors, as drmModeGetConnector() */
+#define DRM_MODE_SNAPSHOT_PROPERTIES (1 << 1) /**< Fill crtc_props and plane_props */
+
+typedef struct _drmModeSnapshot {
+	drmModeRes res;
+
+	drmModeConnectorPtr connectors;
+	drmModeEncoderPtr encoders;
+	drmModeCrtcPtr crtcs;
+
+	uint32_t count_planes;
+	drmModePlanePtr planes;
+
+	drmModeObjectPropertiesPtr crtc_props;
+	drmModeObjectPropertiesPtr plane_props;
+} drmModeSnapshot, *drmModeSnapshotPtr;
+
 extern void drmModeFreeModeInfo( drmModeModeInfoPtr ptr );
 extern void drmModeFreeResources( drmModeResPtr ptr );
 extern void drmModeFreeFB( drmModeFBPtr ptr );
@@ -517,10 +540,232 @@ extern int drmModeAtomicCommit(int fd,
 			       uint32_t flags,
 			       void *user_data);
 
+/*
+ * drmModeGetSnapshotArena() takes the snapshot's memory from arena instead
+ * of the allocator installed with drmSetAllocator().  Only its malloc_fn
+ * and free_fn callbacks are used, and free_fn may be NULL when the arena is
+ * released as a whole: drmModeFreeSnapshot() then leaves the memory alone.
+ */
+struct _drmAllocator; /* from xf86drm.h */
+
+extern drmModeSnapshotPtr drmModeGetSnapshot(int fd, uint32_t flags);
+extern drmModeSnapshotPtr drmModeGetSnapshotArena(int fd, uint32_t flags,
+						  const struct _drmAllocator *arena);
+extern void drmModeFreeSnapshot(drmModeSnapshotPtr snap);
+
+/*
+ * Hotplug diffing: the state remembers the KMS graph as of the last update,
+ * drmModeHotplugUpdate() returns only what changed since then and probes
+ * only connectors that appeared or changed their connection status.  The
+ * returned changes stay valid until the next update, and the epoch is
+ * bumped by every update that found any.
+ */
+#define DRM_MODE_HOTPLUG_ADDED      (1 << 0)
+#define DRM_MODE_HOTPLUG_REMOVED    (1 << 1)
+#define DRM_MODE_HOTPLUG_CONNECTION (1 << 2) /**< Connector status */
+#define DRM_MODE_HOTPLUG_MODES      (1 << 3) /**< Connector mode list */
+#define DRM_MODE_HOTPLUG_PROPERTIES (1 << 4) /**< Connector property values */
+#define DRM_MODE_HOTPLUG_STATE      (1 << 5) /**< Anything else, e.g. routing */
+
+typedef struct _drmModeHotplugChange {
+	uint32_t object_type; /**< DRM_MODE_OBJECT_CONNECTOR, _ENCODER or _CRTC */
+	uint32_t object_id;
+	uint32_t flags;
+} drmModeHotplugChange, *drmModeHotplugChangePtr;
+
+typedef struct _drmModeHotplugState drmModeHotplugState, *drmModeHotplugStatePtr;
+
+extern drmModeHotplugStatePtr drmModeHotplugStateCreate(int fd);
+extern void drmModeHotplugStateFree(drmModeHotplugStatePtr state);
+extern drmModeSnapshotPtr drmModeHotplugStateGetSnapshot(drmModeHotplugStatePtr state);
+extern uint64_t drmModeHotplugStateGetEpoch(drmModeHotplugStatePtr state);
+extern int drmModeHotplugUpdate(int fd, drmModeHotplugStatePtr state,
+				const drmModeHotplugChange **changes);
+
+/*
+ * Flip queue: owns the pending flip of every CRTC it is used with, submits
+ * flips with drmModePageFlipTarget() or non-blocking atomic commits, and
+ * learns each CRTC's refresh from the completion time stamps to predict
+ * upcoming vblanks and count missed ones.  Completions are fed in with
+ * drmModeFlipQueueHandleEvent(), or by the event dispatcher the queue was
+ * created with.
+ */
+typedef struct _drmModeFlipQueue drmModeFlipQueue, *drmModeFlipQueuePtr;
+struct _drmEventDispatcher; /* from xf86drm.h */
+
+typedef void (*drmModeFlipHandler)(uint32_t crtc_id, uint64_t sequence,
+				   uint64_t time_ns, void *user_data);
+
+/* Returns the current CLOCK_MONOTONIC time in nanoseconds. */
+typedef uint64_t (*drmModeFlipClock)(void *data);
+
+typedef struct _drmModeFlipStats {
+	uint64_t count_flips;	/**< Completed flips */
+	uint64_t count_missed;	/**< Vblanks flips landed later than asked */
+	uint64_t total_latency_ns; /**< Sum of submission to scanout times */
+	uint64_t max_latency_ns;
+	uint64_t period_ns;	/**< Estimated refresh period, 0 if unknown */
+} drmModeFlipStats, *drmModeFlipStatsPtr;
+
+extern drmModeFlipQueuePtr drmModeFlipQueueCreate(int fd,
+						  struct _drmEventDispatcher *dispatcher,
+						  drmModeFlipHandler handler,
+						  void *data);
+extern void drmModeFlipQueueDestroy(drmModeFlipQueuePtr queue);
+extern void drmModeFlipQueueSetClock(drmModeFlipQueuePtr queue,
+				     drmModeFlipClock clock, void *data);
+extern int drmModeFlipQueueFlip(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+				uint32_t fb_id, uint64_t target_sequence,
+				void *user_data);
+extern int drmModeFlipQueueCommit(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+				  drmModeAtomicReqPtr req, uint32_t flags,
+				  void *user_data);
+extern int drmModeFlipQueueHandleEvent(drmModeFlipQueuePtr queue,
+				       const struct drm_event *event);
+extern int drmModeFlipQueuePending(drmModeFlipQueuePtr queue, uint32_t crtc_id);
+extern int drmModeFlipQueuePredict(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+				   uint64_t *sequence, uint64_t *time_ns);
+extern int drmModeFlipQueueGetStats(drmModeFlipQueuePtr queue, uint32_t crtc_id,
+				    drmModeFlipStatsPtr stats);
+
+/*
+ * Plane format index: the formats and modifiers a plane supports, parsed
+ * once from its IN_FORMATS blob so that queries are table lookups.  For
+ * planes without IN_FORMATS the format list is used, with every format
+ * supporting just DRM_FORMAT_MOD_INVALID, the implicit modifier.  Keep the
+ * index alongside the plane object; it does not change while the plane
+ * exists.
+ */
+typedef struct _drmModeFormatIndex drmModeFormatIndex, *drmModeFormatIndexPtr;
+
+extern drmModeFormatIndexPtr drmModeFormatIndexCreate(const void *in_formats,
+						      size_t size);
+extern drmModeFormatIndexPtr drmModeFormatIndexCreateFromPlane(drmModePlanePtr plane);
+extern drmModeFormatIndexPtr drmModeGetPlaneFormatIndex(int fd, uint32_t plane_id);
+extern void drmModeFreeFormatIndex(drmModeFormatIndexPtr index);
+extern int drmModeFormatIndexHasFormat(drmModeFormatIndexPtr index,
+				       uint32_t format);
+extern int drmModeFormatIndexSupports(drmModeFormatIndexPtr index,
+				      uint32_t format, uint64_t modifier);
+extern int drmModeFormatIndexGetModifiers(drmModeFormatIndexPtr index,
+					  uint32_t format,
+					  const uint64_t **modifiers);
+
+/*
+ * Plane assignment: places layers, given bottom to top, on the planes
+ * added to the solver, pruning by CRTC, format and zpos and validating
+ * with TEST_ONLY commits.  The build callback adds the properties putting
+ * a layer on a plane to the request.  A layer's key must change whenever
+ * anything about it that could affect whether a configuration is valid
+ * changes, and likewise for the base key; test results are remembered by
+ * those keys.  Layers left with plane_id 0 are for the caller to composite;
+ * once a layer is, so is every layer above it, keeping the stacking order.
+ */
+typedef struct _drmModePlaneSolver drmModePlaneSolver, *drmModePlaneSolverPtr;
+
+typedef struct _drmModePlaneSolverLayer {
+	uint64_t key;
+	uint32_t format;
+	uint64_t modifier;
+	uint32_t plane_id; /**< Out: the plane chosen, or 0 */
+} drmModePlaneSolverLayer, *drmModePlaneSolverLayerPtr;
+
+typedef struct _drmModePlaneSolverStats {
+	uint64_t count_tests;	  /**< TEST_ONLY commits issued */
+	uint64_t count_memo_hits; /**< Test results that were remembered */
+} drmModePlaneSolverStats, *drmModePlaneSolverStatsPtr;
+
+typedef int (*drmModePlaneSolverBuildFunc)(void *data, drmModeAtomicReqPtr req,
+					   uint32_t layer, uint32_t plane_id);
+
+extern drmModePlaneSolverPtr drmModePlaneSolverCreate(int fd);
+extern void drmModePlaneSolverFree(drmModePlaneSolverPtr solver);
+extern int drmModePlaneSolverAddPlane(drmModePlaneSolverPtr solver,
+				      uint32_t plane_id,
+				      uint32_t possible_crtcs,
+				      uint64_t zpos,
+				      drmModeFormatIndexPtr formats);
+extern void drmModePlaneSolverInvalidate(drmModePlaneSolverPtr solver);
+extern int drmModePlaneSolverSolve(drmModePlaneSolverPtr solver,
+				   uint32_t crtc_index,
+				   drmModeAtomicReqPtr base, uint64_t base_key,
+				   drmModePlaneSolverLayerPtr layers,
+				   uint32_t count,
+				   drmModePlaneSolverBuildFunc build, void *data,
+				   drmModeAtomicReqPtr *result);
+extern void drmModePlaneSolverGetStats(drmModePlaneSolverPtr solver,
+				       drmModePlaneSolverStatsPtr stats);
+
+/*
+ * Property name cache: resolves (object id, property name) to a property id,
+ * querying the kernel only once per object and property.  Call
+ * drmModePropertyCacheInvalidate() after a hotplug event.
+ */
+typedef struct _drmModePropertyCache drmModePropertyCache, *drmModePropertyCachePtr;
+
+extern drmModePropertyCachePtr drmModePropertyCacheCreate(int fd);
+extern void drmModePropertyCacheFree(drmModePropertyCachePtr cache);
+extern void drmModePropertyCacheInvalidate(drmModePropertyCachePtr cache);
+extern int drmModePropertyCacheGetId(drmModePropertyCachePtr cache,
+				     uint32_t object_id, const char *name);
+extern int drmModeAtomicAddPropertyByName(drmModeAtomicReqPtr req,
+					  drmModePropertyCachePtr cache,
+					  uint32_t object_id,
+					  const char *name,
+					  uint64_t value);
+
+/*
+ * Atomic state tracking: drmModeAtomicCommitTracked() remembers the values
+ * of successful commits and leaves out of later ones every property whose
+ * value did not change, except for the fence and damage properties, which
+ * act on every commit.  Call drmModeAtomicStateInvalidate() whenever the
+ * kernel state may have changed behind the tracker's back, e.g. after a VT
+ * switch, to have the next commit send everything again.
+ */
+typedef struct _drmModeAtomicState drmModeAtomicState, *drmModeAtomicStatePtr;
+
+extern drmModeAtomicStatePtr drmModeAtomicStateCreate(void);
+extern void drmModeAtomicStateFree(drmModeAtomicStatePtr state);
+extern void drmModeAtomicStateInvalidate(drmModeAtomicStatePtr state);
+extern int drmModeAtomicStateGetValue(drmModeAtomicStatePtr state,
+				      uint32_t object_id,
+				      uint32_t property_id,
+				      uint64_t *value);
+extern int drmModeAtomicCommitTracked(int fd,
+				      drmModeAtomicReqPtr req,
+				      drmModeAtomicStatePtr state,
+				      uint32_t flags,
+				      void *user_data);
+
 extern int drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
 				     uint32_t *id);
 extern int drmModeDestroyPropertyBlob(int fd, uint32_t id);
 
+/*
+ * Blob cache: hands out the id of a live blob with identical contents
+ * instead of creating a new one.  Every drmModeBlobCacheGet() or
+ * drmModeBlobCacheRef() must be balanced by a drmModeBlobCacheRelease(),
+ * the last of which destroys the blob.  Freeing the cache destroys all
+ * blobs it still holds.
+ */
+typedef struct _drmModeBlobCache drmModeBlobCache, *drmModeBlobCachePtr;
+
+typedef struct _drmModeBlobCacheStats {
+	uint64_t count_hits;	/**< Gets that shared a live blob */
+	uint64_t count_misses;	/**< Gets that created a blob */
+	uint32_t count_blobs;	/**< Live blobs */
+	uint64_t total_bytes;	/**< Size of the live blobs */
+} drmModeBlobCacheStats, *drmModeBlobCacheStatsPtr;
+
+extern drmModeBlobCachePtr drmModeBlobCacheCreate(int fd);
+extern void drmModeBlobCacheFree(drmModeBlobCachePtr cache);
+extern int drmModeBlobCacheGet(drmModeBlobCachePtr cache, const void *data,
+			       size_t size, uint32_t *id);
+extern int drmModeBlobCacheRef(drmModeBlobCachePtr cache, uint32_t id);
+extern int drmModeBlobCacheRelease(drmModeBlobCachePtr cache, uint32_t id);
+extern void drmModeBlobCacheGetStats(drmModeBlobCachePtr cache,
+				     drmModeBlobCacheStatsPtr stats);
+
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,1339 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Null ioctl backend.
+ *
+ * Emulates just enough of the kernel to run buffer management code without
+ * a GPU: GEM objects, CPU mappings, flink names, PRIME and syncobjs, plus the
+ * allocation, mapping and submission ioctls of amdgpu, i915, msm and
+ * etnaviv.  Submissions complete immediately and every fence or syncobj is
+ * always signaled.
+ *
+ * Each device is backed by an anonymous file which serves both as the file
+ * descriptor handed to the application, so the device can be recognised by
+ * its inode on every call, and as the heap the objects live in.  Fake mmap
+ * offsets are translated into heap offsets by the mmap hook, so objects can
+ * be mapped through any device they have been imported into.
+ *
+ * Devices are never destroyed.  Exported or flinked objects stay alive until
+ * the process exits since there is no way to tell when the last reference
+ * outside of the backend goes away.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "xf86drm.h"
+#include "libdrm_macros.h"
+#include "i915_drm.h"
+#include "amdgpu_drm.h"
+
+#ifndef __user
+#  define __user
+#endif
+
+#include "freedreno/msm/msm_drm.h"
+#include "etnaviv/etnaviv_drm.h"
+
+#define memclear(s) memset(&s, 0, sizeof(s))
+
+#define NULL_OFFSET_BASE    (1ull << 32)
+#define NULL_HEAP_GROW      (64ull << 20)
+
+struct null_bo {
+    int refcount;
+    int heap_fd;            /* -1 for userptr objects */
+    uint64_t heap_offset;
+    uint64_t size;
+    uint64_t map_offset;    /* fake offset to pass to mmap() */
+    uint64_t user_ptr;
+    int prime_fd;           /* -1 until exported */
+    uint32_t name;          /* flink name, 0 until flinked */
+
+    /* Driver specific state, handed back verbatim. */
+    uint64_t alignment;
+    uint64_t domains;
+    uint64_t domain_flags;
+    uint32_t tiling_mode;
+    uint32_t stride;
+    void *metadata;
+};
+
+struct null_driver;
+
+struct null_device {
+    const struct null_driver *driver;
+    dev_t st_dev;
+    ino_t st_ino;
+    int heap_fd;
+    uint64_t heap_top;
+    uint64_t heap_size;
+    void *handles;          /* handle -> struct null_bo */
+    void *imports;          /* struct null_bo -> handle */
+    void *syncobjs;         /* handle -> device */
+    uint32_t next_handle;
+    uint32_t next_syncobj;
+    uint32_t next_ctx;
+    uint32_t next_bo_list;
+    uint64_t seqno;
+};
+
+struct null_driver {
+    const char *name;
+    const char *date;
+    const char *desc;
+    int major, minor, patchlevel;
+    int (*ioctl)(struct null_device *dev, unsigned int nr, void *arg);
+};
+
+static pthread_mutex_t null_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *null_devices;  /* st_ino -> struct null_device */
+static void *null_offsets;  /* map_offset >> 12 -> struct null_bo */
+static void *null_exports;  /* st_ino of the PRIME fd -> struct null_bo */
+static void *null_names;    /* flink name -> struct null_bo */
+static uint64_t null_next_offset = NULL_OFFSET_BASE;
+static uint32_t null_next_name = 1;
+
+static uint64_t null_page_align(uint64_t size)
+{
+    uint64_t page = sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) & ~(page - 1);
+}
+
+static int null_create_file(const char *name)
+{
+    char path[] = "/tmp/libdrm-null-XXXXXX";
+    int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+#else
+    (void) name;
+#endif
+
+    fd = mkstemp(path);
+    if (fd < 0)
+        return -errno;
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static struct null_device *null_lookup_device(int fd)
+{
+    struct null_device *dev;
+    struct stat st;
+    void *value;
+
+    if (!null_devices || fstat(fd, &st))
+        return NULL;
+
+    if (drmHashLookup(null_devices, st.st_ino, &value))
+        return NULL;
+
+    dev = value;
+    return dev->st_dev == st.st_dev ? dev : NULL;
+}
+
+/*
+ * Objects
+ */
+
+static struct null_bo *null_bo_create(struct null_device *dev, uint64_t size)
+{
+    struct null_bo *bo;
+    uint64_t offset;
+
+    if (!size)
+        return NULL;
+
+    size = null_page_align(size);
+    offset = dev->heap_top;
+    if (offset + size > dev->heap_size) {
+        uint64_t heap_size = offset + size + NULL_HEAP_GROW;
+
+        if (ftruncate(dev->heap_fd, heap_size))
+            return NULL;
+        dev->heap_size = heap_size;
+    }
+
+    bo = calloc(1, sizeof(*bo));
+    if (!bo)
+        return NULL;
+
+    bo->heap_fd = dev->heap_fd;
+    bo->heap_offset = offset;
+    bo->size = size;
+    bo->prime_fd = -1;
+    bo->map_offset = null_next_offset;
+    if (drmHashInsert(null_offsets, bo->map_offset >> 12, bo)) {
+        free(bo);
+        return NULL;
+    }
+
+    null_next_offset += size;
+    dev->heap_top += size;
+    return bo;
+}
+
+static struct null_bo *null_bo_create_userptr(uint64_t ptr, uint64_t size)
+{
+    struct null_bo *bo;
+
+    if (!ptr || !size)
+        return NULL;
+
+    bo = calloc(1, sizeof(*bo));
+    if (!bo)
+        return NULL;
+
+    bo->heap_fd = -1;
+    bo->user_ptr = ptr;
+    bo->size = size;
+    bo->prime_fd = -1;
+    return bo;
+}
+
+static void null_bo_unref(struct null_bo *bo)
+{
+    if (--bo->refcount)
+        return;
+
+    if (bo->heap_fd >= 0) {
+        drmHashDelete(null_offsets, bo->map_offset >> 12);
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+        fallocate(bo->heap_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  bo->heap_offset, bo->size);
+#endif
+    }
+    free(bo->metadata);
+    free(bo);
+}
+
+static int null_handle_add(struct null_device *dev, struct null_bo *bo,
+                           uint32_t *handle)
+{
+    void *value;
+
+    if (!drmHashLookup(dev->imports, (unsigned long)bo, &value)) {
+        *handle = (uint32_t)(unsigned long)value;
+        return 0;
+    }
+
+    do {
+        *handle = ++dev->next_handle;
+    } while (!*handle || !drmHashLookup(dev->handles, *handle, &value));
+
+    if (drmHashInsert(dev->handles, *handle, bo))
+        return -ENOMEM;
+    if (drmHashInsert(dev->imports, (unsigned long)bo,
+                      (void *)(unsigned long)*handle)) {
+        drmHashDelete(dev->handles, *handle);
+        return -ENOMEM;
+    }
+
+    bo->refcount++;
+    return 0;
+}
+
+static int null_handle_new(struct null_device *dev, struct null_bo *bo,
+                           uint32_t *handle)
+{
+    int ret;
+
+    if (!bo)
+        return -ENOMEM;
+
+    ret = null_handle_add(dev, bo, handle);
+    if (ret) {
+        bo->refcount = 1;
+        null_bo_unref(bo);
+    }
+    return ret;
+}
+
+static struct null_bo *null_handle_lookup(struct null_device *dev,
+                                          uint32_t handle)
+{
+    void *value;
+
+    if (drmHashLookup(dev->handles, handle, &value))
+        return NULL;
+    return value;
+}
+
+static int null_handle_close(struct null_device *dev, uint32_t handle)
+{
+    struct null_bo *bo = null_handle_lookup(dev, handle);
+
+    if (!bo)
+        return -EINVAL;
+
+    drmHashDelete(dev->handles, handle);
+    drmHashDelete(dev->imports, (unsigned long)bo);
+    null_bo_unref(bo);
+    return 0;
+}
+
+static int null_bo_rw(struct null_bo *bo, uint64_t offset, uint64_t size,
+                      void *data, int write)
+{
+    ssize_t ret;
+
+    if (offset > bo->size || size > bo->size - offset)
+        return -EINVAL;
+
+    if (bo->heap_fd < 0) {
+        void *ptr = (void *)(uintptr_t)(bo->user_ptr + offset);
+
+        if (write)
+            memcpy(ptr, data, size);
+        else
+            memcpy(data, ptr, size);
+        return 0;
+    }
+
+    if (write)
+        ret = pwrite(bo->heap_fd, data, size, bo->heap_offset + offset);
+    else
+        ret = pread(bo->heap_fd, data, size, bo->heap_offset + offset);
+
+    if (ret < 0)
+        return -errno;
+    return (uint64_t)ret == size ? 0 : -EIO;
+}
+
+/*
+ * Fences are not tracked, the token handed out for a syncobj or sync_file
+ * is an anonymous file that is only ever checked for validity.
+ */
+static int null_fence_fd(int flags)
+{
+    int fd = null_create_file("drm-null-fence");
+
+    if (fd >= 0 && !(flags & DRM_CLOEXEC))
+        fcntl(fd, F_SETFD, 0);
+    return fd;
+}
+
+static int null_syncobj_new(struct null_device *dev, uint32_t *handle)
+{
+    *handle = ++dev->next_syncobj;
+    if (!*handle)
+        *handle = ++dev->next_syncobj;
+
+    return drmHashInsert(dev->syncobjs, *handle, dev) ? -ENOMEM : 0;
+}
+
+static int null_syncobj_check(struct null_device *dev, uint64_t handles,
+                              uint32_t count)
+{
+    const uint32_t *h = (const uint32_t *)(uintptr_t)handles;
+    void *value;
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        if (drmHashLookup(dev->syncobjs, h[i], &value))
+            return -ENOENT;
+    return 0;
+}
+
+/*
+ * Core ioctls
+ */
+
+static void null_copy_string(const char *src, size_t *len, char *dst)
+{
+    size_t n = strlen(src);
+
+    if (*len && dst)
+        memcpy(dst, src, *len < n ? *len : n);
+    *len = n;
+}
+
+static int null_core_ioctl(struct null_device *dev, unsigned int nr,
+                           void *arg)
+{
+    switch (nr) {
+    case DRM_IOCTL_NR(DRM_IOCTL_VERSION): {
+        drm_version_t *v = arg;
+
+        v->version_major = dev->driver->major;
+        v->version_minor = dev->driver->minor;
+        v->version_patchlevel = dev->driver->patchlevel;
+        null_copy_string(dev->driver->name, &v->name_len, v->name);
+        null_copy_string(dev->driver->date, &v->date_len, v->date);
+        null_copy_string(dev->driver->desc, &v->desc_len, v->desc);
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_GET_UNIQUE): {
+        drm_unique_t *u = arg;
+        char unique[32];
+
+        snprintf(unique, sizeof(unique), "null:%s", dev->driver->name);
+        null_copy_string(unique, &u->unique_len, u->unique);
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_GET_MAGIC): {
+        drm_auth_t *auth = arg;
+
+        auth->magic = (drm_magic_t)dev->st_ino;
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_GET_CLIENT): {
+        drm_client_t *client = arg;
+
+        if (client->idx)
+            return -EINVAL;
+        client->auth = 1;
+        client->pid = getpid();
+        client->uid = getuid();
+        client->magic = 0;
+        client->iocs = 0;
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_GET_CAP): {
+        struct drm_get_cap *cap = arg;
+
+        switch (cap->capability) {
+        case DRM_CAP_DUMB_BUFFER:
+        case DRM_CAP_TIMESTAMP_MONOTONIC:
+        case DRM_CAP_SYNCOBJ:
+            cap->value = 1;
+            return 0;
+        case DRM_CAP_PRIME:
+            cap->value = DRM_PRIME_CAP_IMPORT | DRM_PRIME_CAP_EXPORT;
+            return 0;
+        default:
+            cap->value = 0;
+            return -EINVAL;
+        }
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SET_CLIENT_CAP):
+    case DRM_IOCTL_NR(DRM_IOCTL_SET_VERSION):
+    case DRM_IOCTL_NR(DRM_IOCTL_AUTH_MAGIC):
+    case DRM_IOCTL_NR(DRM_IOCTL_SET_MASTER):
+    case DRM_IOCTL_NR(DRM_IOCTL_DROP_MASTER):
+        return 0;
+    case DRM_IOCTL_NR(DRM_IOCTL_GEM_CLOSE): {
+        struct drm_gem_close *gem_close = arg;
+
+        return null_handle_close(dev, gem_close->handle);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_GEM_FLINK): {
+        struct drm_gem_flink *flink = arg;
+        struct null_bo *bo = null_handle_lookup(dev, flink->handle);
+
+        if (!bo)
+            return -ENOENT;
+        if (!bo->name) {
+            if (drmHashInsert(null_names, null_next_name, bo))
+                return -ENOMEM;
+            bo->name = null_next_name++;
+            bo->refcount++;
+        }
+        flink->name = bo->name;
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_GEM_OPEN): {
+        struct drm_gem_open *gem_open = arg;
+        void *value;
+        int ret;
+
+        if (drmHashLookup(null_names, gem_open->name, &value))
+            return -ENOENT;
+        ret = null_handle_add(dev, value, &gem_open->handle);
+        if (!ret)
+            gem_open->size = ((struct null_bo *)value)->size;
+        return ret;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_PRIME_HANDLE_TO_FD): {
+        struct drm_prime_handle *prime = arg;
+        struct null_bo *bo = null_handle_lookup(dev, prime->handle);
+        struct stat st;
+        int fd;
+
+        if (!bo)
+            return -ENOENT;
+        if (bo->heap_fd < 0)
+            return -EPERM;
+        if (bo->prime_fd < 0) {
+            fd = null_create_file("drm-null-dmabuf");
+            if (fd < 0)
+                return fd;
+            if (fstat(fd, &st) || drmHashInsert(null_exports, st.st_ino, bo)) {
+                close(fd);
+                return -ENOMEM;
+            }
+            bo->prime_fd = fd;
+            bo->refcount++;
+        }
+
+        fd = fcntl(bo->prime_fd, (prime->flags & DRM_CLOEXEC) ?
+                   F_DUPFD_CLOEXEC : F_DUPFD, 0);
+        if (fd < 0)
+            return -errno;
+        prime->fd = fd;
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_PRIME_FD_TO_HANDLE): {
+        struct drm_prime_handle *prime = arg;
+        struct stat st;
+        void *value;
+
+        if (fstat(prime->fd, &st))
+            return -errno;
+        if (drmHashLookup(null_exports, st.st_ino, &value))
+            return -EINVAL;
+        return null_handle_add(dev, value, &prime->handle);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_MODE_CREATE_DUMB): {
+        struct drm_mode_create_dumb *create = arg;
+
+        if (!create->width || !create->height || !create->bpp)
+            return -EINVAL;
+        create->pitch = ((create->width * ((create->bpp + 7) / 8)) + 63) & ~63;
+        create->size = null_page_align((uint64_t)create->pitch *
+                                       create->height);
+        return null_handle_new(dev, null_bo_create(dev, create->size),
+                               &create->handle);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_MODE_MAP_DUMB): {
+        struct drm_mode_map_dumb *map = arg;
+        struct null_bo *bo = null_handle_lookup(dev, map->handle);
+
+        if (!bo)
+            return -ENOENT;
+        map->offset = bo->map_offset;
+        return 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_MODE_DESTROY_DUMB): {
+        struct drm_mode_destroy_dumb *destroy = arg;
+
+        return null_handle_close(dev, destroy->handle);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_CREATE): {
+        struct drm_syncobj_create *create = arg;
+
+        return null_syncobj_new(dev, &create->handle);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_DESTROY): {
+        struct drm_syncobj_destroy *destroy = arg;
+
+        return drmHashDelete(dev->syncobjs, destroy->handle) ? -EINVAL : 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_HANDLE_TO_FD): {
+        struct drm_syncobj_handle *handle = arg;
+        int ret;
+
+        ret = null_syncobj_check(dev, (uintptr_t)&handle->handle, 1);
+        if (ret)
+            return ret;
+        handle->fd = null_fence_fd(DRM_CLOEXEC);
+        return handle->fd < 0 ? handle->fd : 0;
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_FD_TO_HANDLE): {
+        struct drm_syncobj_handle *handle = arg;
+        struct stat st;
+
+        if (fstat(handle->fd, &st))
+            return -errno;
+        if (handle->flags & DRM_SYNCOBJ_FD_TO_HANDLE_FLAGS_IMPORT_SYNC_FILE)
+            return null_syncobj_check(dev, (uintptr_t)&handle->handle, 1);
+        return null_syncobj_new(dev, &handle->handle);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_WAIT): {
+        struct drm_syncobj_wait *wait = arg;
+
+        wait->first_signaled = 0;
+        return null_syncobj_check(dev, wait->handles, wait->count_handles);
+    }
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_RESET):
+    case DRM_IOCTL_NR(DRM_IOCTL_SYNCOBJ_SIGNAL): {
+        struct drm_syncobj_array *array = arg;
+
+        return null_syncobj_check(dev, array->handles, array->count_handles);
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * amdgpu
+ */
+
+static int null_amdgpu_info(struct null_device *dev, struct drm_amdgpu_info *info)
+{
+    void *out = (void *)(uintptr_t)info->return_pointer;
+    size_t size = info->return_size;
+
+    if (!out || !size)
+        return -EINVAL;
+
+    memset(out, 0, size);
+
+    switch (info->query) {
+    case AMDGPU_INFO_ACCEL_WORKING: {
+        uint32_t accel_working = 1;
+
+        memcpy(out, &accel_working, size < 4 ? size : 4);
+        return 0;
+    }
+    case AMDGPU_INFO_DEV_INFO: {
+        struct drm_amdgpu_info_device dev_info;
+
+        memclear(dev_info);
+        dev_info.device_id = 0x687f;
+        dev_info.family = AMDGPU_FAMILY_AI;
+        dev_info.num_shader_engines = 4;
+        dev_info.num_shader_arrays_per_engine = 1;
+        dev_info.gpu_counter_freq = 27000;
+        dev_info.max_engine_clock = 1600000;
+        dev_info.max_memory_clock = 945000;
+        dev_info.cu_active_number = 64;
+        dev_info.enabled_rb_pipes_mask = 0xffff;
+        dev_info.num_rb_pipes = 16;
+        dev_info.num_hw_gfx_contexts = 8;
+        dev_info.virtual_address_offset = 1ull << 20;
+        dev_info.virtual_address_max = 1ull << 40;
+        dev_info.virtual_address_alignment = sysconf(_SC_PAGESIZE);
+        dev_info.pte_fragment_size = 2 << 20;
+        dev_info.gart_page_size = sysconf(_SC_PAGESIZE);
+        dev_info.vram_type = AMDGPU_VRAM_TYPE_HBM;
+        dev_info.vram_bit_width = 2048;
+        dev_info.wave_front_size = 64;
+        dev_info.num_cu_per_sh = 16;
+        memcpy(out, &dev_info, size < sizeof(dev_info) ? size : sizeof(dev_info));
+        return 0;
+    }
+    case AMDGPU_INFO_VRAM_GTT: {
+        struct drm_amdgpu_info_vram_gtt vram_gtt;
+
+        vram_gtt.vram_size = 8ull << 30;
+        vram_gtt.vram_cpu_accessible_size = 256ull << 20;
+        vram_gtt.gtt_size = 8ull << 30;
+        memcpy(out, &vram_gtt, size < sizeof(vram_gtt) ? size : sizeof(vram_gtt));
+        return 0;
+    }
+    case AMDGPU_INFO_VRAM_USAGE:
+    case AMDGPU_INFO_VIS_VRAM_USAGE:
+    case AMDGPU_INFO_GTT_USAGE:
+        memcpy(out, &dev->heap_top, size < 8 ? size : 8);
+        return 0;
+    case AMDGPU_INFO_HW_IP_COUNT: {
+        uint32_t count = info->query_hw_ip.type <= AMDGPU_HW_IP_DMA;
+
+        memcpy(out, &count, size < 4 ? size : 4);
+        return 0;
+    }
+    case AMDGPU_INFO_HW_IP_INFO: {
+        struct drm_amdgpu_info_hw_ip ip;
+
+        memclear(ip);
+        if (info->query_hw_ip.type <= AMDGPU_HW_IP_DMA) {
+            ip.hw_ip_version_major = 9;
+            ip.ib_start_alignment = 256;
+            ip.ib_size_alignment = 4;
+            ip.available_rings = 1;
+        }
+        memcpy(out, &ip, size < sizeof(ip) ? size : sizeof(ip));
+        return 0;
+    }
+    default:
+        /* Everything else, including register reads, reads as zero. */
+        return 0;
+    }
+}
+
+static int null_amdgpu_ioctl(struct null_device *dev, unsigned int nr,
+                             void *arg)
+{
+    switch (nr) {
+    case DRM_AMDGPU_GEM_CREATE: {
+        union drm_amdgpu_gem_create *create = arg;
+        struct drm_amdgpu_gem_create_in in = create->in;
+        struct null_bo *bo = null_bo_create(dev, in.bo_size);
+
+        if (bo) {
+            bo->alignment = in.alignment;
+            bo->domains = in.domains;
+            bo->domain_flags = in.domain_flags;
+        }
+        memclear(create->out);
+        return null_handle_new(dev, bo, &create->out.handle);
+    }
+    case DRM_AMDGPU_GEM_USERPTR: {
+        struct drm_amdgpu_gem_userptr *userptr = arg;
+
+        return null_handle_new(dev, null_bo_create_userptr(userptr->addr,
+                                                           userptr->size),
+                               &userptr->handle);
+    }
+    case DRM_AMDGPU_GEM_MMAP: {
+        union drm_amdgpu_gem_mmap *map = arg;
+        struct null_bo *bo = null_handle_lookup(dev, map->in.handle);
+
+        if (!bo)
+            return -ENOENT;
+        if (bo->heap_fd < 0)
+            return -EPERM;
+        map->out.addr_ptr = bo->map_offset;
+        return 0;
+    }
+    case DRM_AMDGPU_GEM_METADATA: {
+        struct drm_amdgpu_gem_metadata *metadata = arg;
+        struct null_bo *bo = null_handle_lookup(dev, metadata->handle);
+
+        if (!bo)
+            return -ENOENT;
+        if (metadata->op == AMDGPU_GEM_METADATA_OP_SET_METADATA) {
+            if (metadata->data.data_size_bytes > sizeof(metadata->data.data))
+                return -EINVAL;
+            if (!bo->metadata)
+                bo->metadata = malloc(sizeof(metadata->data));
+            if (!bo->metadata)
+                return -ENOMEM;
+            memcpy(bo->metadata, &metadata->data, sizeof(metadata->data));
+        } else if (metadata->op == AMDGPU_GEM_METADATA_OP_GET_METADATA) {
+            if (bo->metadata)
+                memcpy(&metadata->data, bo->metadata, sizeof(metadata->data));
+            else
+                memclear(metadata->data);
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+    }
+    case DRM_AMDGPU_GEM_OP: {
+        struct drm_amdgpu_gem_op *op = arg;
+        struct null_bo *bo = null_handle_lookup(dev, op->handle);
+
+        if (!bo)
+            return -ENOENT;
+        if (op->op == AMDGPU_GEM_OP_GET_GEM_CREATE_INFO) {
+            struct drm_amdgpu_gem_create_in *info =
+                (void *)(uintptr_t)op->value;
+
+            info->bo_size = bo->size;
+            info->alignment = bo->alignment;
+            info->domains = bo->domains;
+            info->domain_flags = bo->domain_flags;
+        } else if (op->op == AMDGPU_GEM_OP_SET_PLACEMENT) {
+            bo->domains = op->value;
+        } else {
+            return -EINVAL;
+        }
+        return 0;
+    }
+    case DRM_AMDGPU_GEM_VA: {
+        struct drm_amdgpu_gem_va *va = arg;
+
+        if (va->operation != AMDGPU_VA_OP_CLEAR &&
+            !null_handle_lookup(dev, va->handle))
+            return -ENOENT;
+        return 0;
+    }
+    case DRM_AMDGPU_GEM_WAIT_IDLE: {
+        union drm_amdgpu_gem_wait_idle *wait = arg;
+
+        if (!null_handle_lookup(dev, wait->in.handle))
+            return -ENOENT;
+        memclear(wait->out);
+        return 0;
+    }
+    case DRM_AMDGPU_CTX: {
+        union drm_amdgpu_ctx *ctx = arg;
+
+        switch (ctx->in.op) {
+        case AMDGPU_CTX_OP_ALLOC_CTX:
+            memclear(ctx->out);
+            ctx->out.alloc.ctx_id = ++dev->next_ctx;
+            return 0;
+        case AMDGPU_CTX_OP_FREE_CTX:
+            return 0;
+        case AMDGPU_CTX_OP_QUERY_STATE:
+            memclear(ctx->out);
+            return 0;
+        default:
+            return -EINVAL;
+        }
+    }
+    case DRM_AMDGPU_BO_LIST: {
+        union drm_amdgpu_bo_list *list = arg;
+
+        switch (list->in.operation) {
+        case AMDGPU_BO_LIST_OP_CREATE:
+            memclear(list->out);
+            list->out.list_handle = ++dev->next_bo_list;
+            return 0;
+        case AMDGPU_BO_LIST_OP_DESTROY:
+        case AMDGPU_BO_LIST_OP_UPDATE:
+            return 0;
+        default:
+            return -EINVAL;
+        }
+    }
+    case DRM_AMDGPU_CS: {
+        union drm_amdgpu_cs *cs = arg;
+
+        memclear(cs->out);
+        cs->out.handle = ++dev->seqno;
+        return 0;
+    }
+    case DRM_AMDGPU_WAIT_CS: {
+        union drm_amdgpu_wait_cs *wait = arg;
+
+        memclear(wait->out);
+        return 0;
+    }
+    case DRM_AMDGPU_WAIT_FENCES: {
+        union drm_amdgpu_wait_fences *wait = arg;
+
+        memclear(wait->out);
+        wait->out.status = 1;
+        return 0;
+    }
+    case DRM_AMDGPU_FENCE_TO_HANDLE: {
+        union drm_amdgpu_fence_to_handle *fence = arg;
+        uint32_t what = fence->in.what;
+        int fd;
+
+        memclear(fence->out);
+        switch (what) {
+        case AMDGPU_FENCE_TO_HANDLE_GET_SYNCOBJ:
+            return null_syncobj_new(dev, &fence->out.handle);
+        case AMDGPU_FENCE_TO_HANDLE_GET_SYNCOBJ_FD:
+        case AMDGPU_FENCE_TO_HANDLE_GET_SYNC_FILE_FD:
+            fd = null_fence_fd(DRM_CLOEXEC);
+            if (fd < 0)
+                return fd;
+            fence->out.handle = fd;
+            return 0;
+        default:
+            return -EINVAL;
+        }
+    }
+    case DRM_AMDGPU_INFO:
+        return null_amdgpu_info(dev, arg);
+    case DRM_AMDGPU_VM: {
+        union drm_amdgpu_vm *vm = arg;
+
+        memclear(vm->out);
+        return 0;
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * i915
+ */
+
+static int null_i915_ioctl(struct null_device *dev, unsigned int nr,
+                           void *arg)
+{
+    switch (nr) {
+    case DRM_I915_GETPARAM: {
+        drm_i915_getparam_t *gp = arg;
+
+        switch (gp->param) {
+        case I915_PARAM_CHIPSET_ID:
+            *gp->value = 0x1912;
+            break;
+        case I915_PARAM_REVISION:
+            *gp->value = 7;
+            break;
+        case I915_PARAM_NUM_FENCES_AVAIL:
+            *gp->value = 32;
+            break;
+        default:
+            *gp->value = 1;
+            break;
+        }
+        return 0;
+    }
+    case DRM_I915_GEM_GET_APERTURE: {
+        struct drm_i915_gem_get_aperture *aperture = arg;
+
+        aperture->aper_size = 4ull << 30;
+        aperture->aper_available_size = aperture->aper_size - dev->heap_top;
+        return 0;
+    }
+    case DRM_I915_GEM_CREATE: {
+        struct drm_i915_gem_create *create = arg;
+
+        return null_handle_new(dev, null_bo_create(dev, create->size),
+                               &create->handle);
+    }
+    case DRM_I915_GEM_USERPTR: {
+        struct drm_i915_gem_userptr *userptr = arg;
+
+        return null_handle_new(dev,
+                               null_bo_create_userptr(userptr->user_ptr,
+                                                      userptr->user_size),
+                               &userptr->handle);
+    }
+    case DRM_I915_GEM_MMAP: {
+        struct drm_i915_gem_mmap *map = arg;
+        struct null_bo *bo = null_handle_lookup(dev, map->handle);
+        void *ptr;
+
+        if (!bo)
+            return -ENOENT;
+        if (bo->heap_fd < 0)
+            return -EINVAL;
+        if (map->offset > bo->size || map->size > bo->size - map->offset)
+            return -EINVAL;
+        ptr = drm_sys_mmap(NULL, map->size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, bo->heap_fd,
+                           bo->heap_offset + map->offset);
+        if (ptr == MAP_FAILED)
+            return -errno;
+        map->addr_ptr = (uintptr_t)ptr;
+        return 0;
+    }
+    case DRM_I915_GEM_MMAP_GTT: {
+        struct drm_i915_gem_mmap_gtt *map = arg;
+        struct null_bo *bo = null_handle_lookup(dev, map->handle);
+
+        if (!bo)
+            return -ENOENT;
+        if (bo->heap_fd < 0)
+            return -EINVAL;
+        map->offset = bo->map_offset;
+        return 0;
+    }
+    case DRM_I915_GEM_PREAD: {
+        struct drm_i915_gem_pread *rd = arg;
+        struct null_bo *bo = null_handle_lookup(dev, rd->handle);
+
+        if (!bo)
+            return -ENOENT;
+        return null_bo_rw(bo, rd->offset, rd->size,
+                          (void *)(uintptr_t)rd->data_ptr, 0);
+    }
+    case DRM_I915_GEM_PWRITE: {
+        struct drm_i915_gem_pwrite *wr = arg;
+        struct null_bo *bo = null_handle_lookup(dev, wr->handle);
+
+        if (!bo)
+            return -ENOENT;
+        return null_bo_rw(bo, wr->offset, wr->size,
+                          (void *)(uintptr_t)wr->data_ptr, 1);
+    }
+    case DRM_I915_GEM_SET_TILING: {
+        struct drm_i915_gem_set_tiling *tiling = arg;
+        struct null_bo *bo = null_handle_lookup(dev, tiling->handle);
+
+        if (!bo)
+            return -ENOENT;
+        bo->tiling_mode = tiling->tiling_mode;
+        bo->stride = tiling->stride;
+        tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+        return 0;
+    }
+    case DRM_I915_GEM_GET_TILING: {
+        struct drm_i915_gem_get_tiling *tiling = arg;
+        struct null_bo *bo = null_handle_lookup(dev, tiling->handle);
+
+        if (!bo)
+            return -ENOENT;
+        tiling->tiling_mode = bo->tiling_mode;
+        tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+        tiling->phys_swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+        return 0;
+    }
+    case DRM_I915_GEM_BUSY: {
+        struct drm_i915_gem_busy *busy = arg;
+
+        if (!null_handle_lookup(dev, busy->handle))
+            return -ENOENT;
+        busy->busy = 0;
+        return 0;
+    }
+    case DRM_I915_GEM_WAIT: {
+        struct drm_i915_gem_wait *wait = arg;
+
+        if (!null_handle_lookup(dev, wait->bo_handle))
+            return -ENOENT;
+        return 0;
+    }
+    case DRM_I915_GEM_MADVISE: {
+        struct drm_i915_gem_madvise *madvise = arg;
+
+        if (!null_handle_lookup(dev, madvise->handle))
+            return -ENOENT;
+        madvise->retained = 1;
+        return 0;
+    }
+    case DRM_I915_GEM_CONTEXT_CREATE: {
+        struct drm_i915_gem_context_create *create = arg;
+
+        create->ctx_id = ++dev->next_ctx;
+        return 0;
+    }
+    case DRM_I915_GEM_SET_DOMAIN:
+    case DRM_I915_GEM_SW_FINISH:
+    case DRM_I915_GEM_SET_CACHING:
+    case DRM_I915_GEM_EXECBUFFER2:
+    case DRM_I915_GEM_CONTEXT_DESTROY:
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*
+ * msm and etnaviv share the same layout for most of their ioctls.
+ */
+
+static int null_msm_ioctl(struct null_device *dev, unsigned int nr,
+                          void *arg)
+{
+    switch (nr) {
+    case DRM_MSM_GET_PARAM: {
+        struct drm_msm_param *param = arg;
+
+        switch (param->param) {
+        case MSM_PARAM_GPU_ID:
+            param->value = 330;
+            return 0;
+        case MSM_PARAM_GMEM_SIZE:
+            param->value = 1 << 20;
+            return 0;
+        case MSM_PARAM_CHIP_ID:
+            param->value = 0x03030000;
+            return 0;
+        default:
+            return -EINVAL;
+        }
+    }
+    case DRM_MSM_GEM_NEW: {
+        struct drm_msm_gem_new *create = arg;
+
+        return null_handle_new(dev, null_bo_create(dev, create->size),
+                               &create->handle);
+    }
+    case DRM_MSM_GEM_INFO: {
+        struct drm_msm_gem_info *info = arg;
+        struct null_bo *bo = null_handle_lookup(dev, info->handle);
+
+        if (!bo)
+            return -ENOENT;
+        info->offset = bo->map_offset;
+        return 0;
+    }
+    case DRM_MSM_GEM_CPU_PREP:
+    case DRM_MSM_GEM_CPU_FINI: {
+        /* Both start with the handle. */
+        uint32_t *handle = arg;
+
+        return null_handle_lookup(dev, *handle) ? 0 : -ENOENT;
+    }
+    case DRM_MSM_GEM_SUBMIT: {
+        struct drm_msm_gem_submit *submit = arg;
+
+        submit->fence = ++dev->seqno;
+        if (submit->flags & MSM_SUBMIT_FENCE_FD_OUT) {
+            submit->fence_fd = null_fence_fd(DRM_CLOEXEC);
+            if (submit->fence_fd < 0)
+                return submit->fence_fd;
+        }
+        return 0;
+    }
+    case DRM_MSM_WAIT_FENCE:
+        return 0;
+    case DRM_MSM_GEM_MADVISE: {
+        struct drm_msm_gem_madvise *madvise = arg;
+
+        if (!null_handle_lookup(dev, madvise->handle))
+            return -ENOENT;
+        madvise->retained = 1;
+        return 0;
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+static int null_etnaviv_ioctl(struct null_device *dev, unsigned int nr,
+                              void *arg)
+{
+    switch (nr) {
+    case DRM_ETNAVIV_GET_PARAM: {
+        struct drm_etnaviv_param *param = arg;
+
+        if (param->pipe)
+            return -ENXIO;
+        switch (param->param) {
+        case ETNAVIV_PARAM_GPU_MODEL:
+            param->value = 0x2000;
+            return 0;
+        case ETNAVIV_PARAM_GPU_REVISION:
+            param->value = 0x5108;
+            return 0;
+        default:
+            param->value = 0;
+            return 0;
+        }
+    }
+    case DRM_ETNAVIV_GEM_NEW: {
+        struct drm_etnaviv_gem_new *create = arg;
+
+        return null_handle_new(dev, null_bo_create(dev, create->size),
+                               &create->handle);
+    }
+    case DRM_ETNAVIV_GEM_USERPTR: {
+        struct drm_etnaviv_gem_userptr *userptr = arg;
+
+        return null_handle_new(dev,
+                               null_bo_create_userptr(userptr->user_ptr,
+                                                      userptr->user_size),
+                               &userptr->handle);
+    }
+    case DRM_ETNAVIV_GEM_INFO: {
+        struct drm_etnaviv_gem_info *info = arg;
+        struct null_bo *bo = null_handle_lookup(dev, info->handle);
+
+        if (!bo)
+            return -ENOENT;
+        if (bo->heap_fd < 0)
+            return -EINVAL;
+        info->offset = bo->map_offset;
+        return 0;
+    }
+    case DRM_ETNAVIV_GEM_CPU_PREP:
+    case DRM_ETNAVIV_GEM_CPU_FINI: {
+        uint32_t *handle = arg;
+
+        return null_handle_lookup(dev, *handle) ? 0 : -ENOENT;
+    }
+    case DRM_ETNAVIV_GEM_WAIT: {
+        struct drm_etnaviv_gem_wait *wait = arg;
+
+        return null_handle_lookup(dev, wait->handle) ? 0 : -ENOENT;
+    }
+    case DRM_ETNAVIV_GEM_SUBMIT: {
+        struct drm_etnaviv_gem_submit *submit = arg;
+
+        submit->fence = ++dev->seqno;
+        if (submit->flags & ETNA_SUBMIT_FENCE_FD_OUT) {
+            submit->fence_fd = null_fence_fd(DRM_CLOEXEC);
+            if (submit->fence_fd < 0)
+                return submit->fence_fd;
+        }
+        return 0;
+    }
+    case DRM_ETNAVIV_WAIT_FENCE:
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct null_driver null_drivers[] = {
+    { "amdgpu", "20150101", "AMD GPU", 3, 20, 0, null_amdgpu_ioctl },
+    { "i915", "20170619", "Intel Graphics", 1, 6, 0, null_i915_ioctl },
+    { "msm", "20130625", "MSM Snapdragon DRM", 1, 2, 0, null_msm_ioctl },
+    { "etnaviv", "20151214", "etnaviv DRM", 1, 1, 0, null_etnaviv_ioctl },
+};
+
+/*
+ * Backend entry points
+ */
+
+static int null_ioctl(void *priv, int fd, unsigned long request, void *arg)
+{
+    struct null_device *dev;
+    unsigned int nr = DRM_IOCTL_NR(request);
+    int ret;
+
+    (void) priv;
+
+    pthread_mutex_lock(&null_mutex);
+    dev = null_lookup_device(fd);
+    if (!dev) {
+        pthread_mutex_unlock(&null_mutex);
+        return ioctl(fd, request, arg);
+    }
+
+    if (nr >= DRM_COMMAND_BASE && nr < DRM_COMMAND_END)
+        ret = dev->driver->ioctl(dev, nr - DRM_COMMAND_BASE, arg);
+    else
+        ret = null_core_ioctl(dev, nr, arg);
+    pthread_mutex_unlock(&null_mutex);
+
+    if (ret) {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+static void *null_mmap(void *priv, void *addr, size_t length, int prot,
+                       int flags, int fd, uint64_t offset)
+{
+    struct null_bo *bo;
+    uint64_t heap_offset;
+    int heap_fd;
+    void *value;
+
+    (void) priv;
+
+    pthread_mutex_lock(&null_mutex);
+    if (!null_lookup_device(fd)) {
+        pthread_mutex_unlock(&null_mutex);
+        return drm_sys_mmap(addr, length, prot, flags, fd, offset);
+    }
+
+    if (drmHashLookup(null_offsets, offset >> 12, &value)) {
+        pthread_mutex_unlock(&null_mutex);
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    bo = value;
+    if (bo->map_offset != offset || length > bo->size) {
+        pthread_mutex_unlock(&null_mutex);
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+    heap_fd = bo->heap_fd;
+    heap_offset = bo->heap_offset;
+    pthread_mutex_unlock(&null_mutex);
+
+    return drm_sys_mmap(addr, length, prot, flags, heap_fd, heap_offset);
+}
+
+static const drmIoctlBackend null_backend = {
+    .ioctl = null_ioctl,
+    .mmap = null_mmap,
+};
+
+/**
+ * Get the null ioctl backend.
+ *
+ * \return a backend suitable for drmSetIoctlBackend().
+ */
+const drmIoctlBackend *drmNullBackend(void)
+{
+    return &null_backend;
+}
+
+/**
+ * Create a device emulated by the null backend.
+ *
+ * \param driver name of the driver to emulate, one of "amdgpu", "i915",
+ * "msm" or "etnaviv".
+ *
+ * \return a file descriptor for the new device, or a negative error code.
+ *
+ * \internal
+ * The returned descriptor may be duplicated and closed like any other, the
+ * backend holds on to a private duplicate for the heap.
+ */
+int drmNullDeviceOpen(const char *driver)
+{
+    const struct null_driver *drv = NULL;
+    struct null_device *dev;
+    struct stat st;
+    unsigned int i;
+    int fd, ret;
+
+    if (!driver)
+        return -EINVAL;
+
+    for (i = 0; i < sizeof(null_drivers) / sizeof(null_drivers[0]); i++)
+        if (!strcmp(null_drivers[i].name, driver))
+            drv = &null_drivers[i];
+    if (!drv)
+        return -ENODEV;
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev)
+        return -ENOMEM;
+
+    fd = null_create_file("drm-null");
+    if (fd < 0) {
+        free(dev);
+        return fd;
+    }
+
+    dev->driver = drv;
+    dev->heap_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    dev->handles = drmHashCreate();
+    dev->imports = drmHashCreate();
+    dev->syncobjs = drmHashCreate();
+    if (dev->heap_fd < 0 || !dev->handles || !dev->imports ||
+        !dev->syncobjs || fstat(fd, &st)) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    dev->st_dev = st.st_dev;
+    dev->st_ino = st.st_ino;
+
+    pthread_mutex_lock(&null_mutex);
+    if (!null_devices) {
+        null_devices = drmHashCreate();
+        null_offsets = drmHashCreate();
+        null_exports = drmHashCreate();
+        null_names = drmHashCreate();
+    }
+    ret = -ENOMEM;
+    if (null_devices && null_offsets && null_exports && null_names)
+        ret = drmHashInsert(null_devices, st.st_ino, dev) ? -EEXIST : 0;
+    pthread_mutex_unlock(&null_mutex);
+    if (ret)
+        goto err;
+
+    return fd;
+
+err:
+    if (dev->syncobjs)
+        drmHashDestroy(dev->syncobjs);
+    if (dev->imports)
+        drmHashDestroy(dev->imports);
+    if (dev->handles)
+        drmHashDestroy(dev->handles);
+    if (dev->heap_fd >= 0)
+        close(dev->heap_fd);
+    close(fd);
+    free(dev);
+    return ret;
+}
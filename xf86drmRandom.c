@@ -83,7 +83,7 @@ void *drmRandomCreate(unsigned long seed)
 {
     RandomState  *state;
 
-    state           = drmMalloc(sizeof(*state));
+    state           = calloc(1, sizeof(*state));
     if (!state) return NULL;
     state->magic    = RANDOM_MAGIC;
 #if 0
@@ -111,7 +111,7 @@ void *drmRandomCreate(unsigned long seed)
 
 int drmRandomDestroy(void *state)
 {
-    drmFree(state);
+    free(state);
     return 0;
 }
 
@@ -27,25 +27,50 @@
  *
  * DESCRIPTION
  *
- * This file contains a straightforward skip list implementation.n
+ * This file contains an ordered map from integer keys to pointers.  By
+ * default it is a B+ tree [Comer79]: keys and values are kept in arrays of
+ * BT_KEYS entries per node, so a lookup touches a handful of cache lines
+ * instead of one node per key, and the leaves are linked to each other for
+ * iteration.  Keys appended in ascending order fill leaves completely and
+ * go straight into the last leaf without descending the tree.  Nodes are
+ * only freed once they become empty rather than being merged when they
+ * fall below half full, which keeps deletion simple and costs little in
+ * practice [Johnson93].  Every list has its own lock, so lists can be used
+ * from several threads.
+ *
+ * Building with DRM_SL_SKIP_LIST defined selects the original
+ * straightforward skip list implementation instead.
  *
  * FUTURE ENHANCEMENTS
  *
  * REFERENCES
  *
+ * [Comer79] Douglas Comer.  The Ubiquitous B-Tree.  ACM Computing Surveys
+ * 11(2), June 1979, pp. 121-137.
+ *
+ * [Johnson93] Theodore Johnson and Dennis Shasha.  B-Trees with Inserts and
+ * Deletes: Why Free-at-Empty Is Better Than Merge-at-Half.  Journal of
+ * Computer and System Sciences 47(1), August 1993, pp. 45-76.
+ *
  * [Pugh90] William Pugh.  Skip Lists: A Probabilistic Alternative to
  * Balanced Trees. CACM 33(6), June 1990, pp. 668-676.
  *
  */
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "xf86drm.h"
 
 #define SL_LIST_MAGIC  0xfacade00LU
 #define SL_ENTRY_MAGIC 0x00fab1edLU
 #define SL_FREED_MAGIC 0xdecea5edLU
+
+#ifdef DRM_SL_SKIP_LIST
+
 #define SL_MAX_LEVEL   16
 #define SL_RANDOM_SEED 0xc01055a1LU
 
@@ -67,6 +92,7 @@ typedef struct SkipList {
     int              count;
     SLEntryPtr       head;
     SLEntryPtr       p0;	/* Position for iteration */
+    unsigned long    end;	/* Last key of the iteration */
 } SkipList, *SkipListPtr;
 
 static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
@@ -75,7 +101,7 @@ static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
     
     if (max_level < 0 || max_level > SL_MAX_LEVEL) max_level = SL_MAX_LEVEL;
 
-    entry         = drmMalloc(sizeof(*entry)
+    entry         = calloc(1, sizeof(*entry)
 			     + (max_level + 1) * sizeof(entry->forward[0]));
     if (!entry) return NULL;
     entry->magic  = SL_ENTRY_MAGIC;
@@ -102,7 +128,7 @@ void *drmSLCreate(void)
     SkipListPtr  list;
     int          i;
 
-    list           = drmMalloc(sizeof(*list));
+    list           = calloc(1, sizeof(*list));
     if (!list) return NULL;
     list->magic    = SL_LIST_MAGIC;
     list->level    = 0;
@@ -126,11 +152,11 @@ int drmSLDestroy(void *l)
 	if (entry->magic != SL_ENTRY_MAGIC) return -1; /* Bad magic */
 	next         = entry->forward[0];
 	entry->magic = SL_FREED_MAGIC;
-	drmFree(entry);
+	free(entry);
     }
 
     list->magic = SL_FREED_MAGIC;
-    drmFree(list);
+    free(list);
     return 0;
 }
 
@@ -204,7 +230,7 @@ int drmSLDelete(void *l, unsigned long key)
     }
 
     entry->magic = SL_FREED_MAGIC;
-    drmFree(entry);
+    free(entry);
 
     while (list->level && !list->head->forward[list->level]) --list->level;
     --list->count;
@@ -220,7 +246,7 @@ int drmSLLookup(void *l, unsigned long key, void **value)
     entry = SLLocate(list, key, update);
 
     if (entry && entry->key == key) {
-	*value = entry;
+	*value = entry->value;
 	return 0;
     }
     *value = NULL;
@@ -262,7 +288,7 @@ int drmSLNext(void *l, unsigned long *key, void **value)
 
     entry    = list->p0;
 
-    if (entry) {
+    if (entry && entry->key <= list->end) {
 	list->p0 = entry->forward[0];
 	*key     = entry->key;
 	*value   = entry->value;
@@ -278,10 +304,39 @@ int drmSLFirst(void *l, unsigned long *key, void **value)
     
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
     
-    list->p0 = list->head->forward[0];
+    list->p0  = list->head->forward[0];
+    list->end = ULONG_MAX;
+    return drmSLNext(list, key, value);
+}
+
+int drmSLFirstRange(void *l, unsigned long first, unsigned long last,
+		    unsigned long *key, void **value)
+{
+    SkipListPtr   list = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    list->p0  = SLLocate(list, first, update);
+    list->end = last;
     return drmSLNext(list, key, value);
 }
 
+int drmSLInsertBulk(void *l, const unsigned long *keys, void * const *values,
+		    int count)
+{
+    int added = 0;
+    int i;
+    int ret;
+
+    for (i = 0; i < count; i++) {
+	ret = drmSLInsert(l, keys[i], values ? values[i] : NULL);
+	if (ret < 0) return -1;
+	if (!ret) ++added;
+    }
+    return added;
+}
+
 /* Dump internal data structures for debugging. */
 void drmSLDump(void *l)
 {
@@ -316,3 +371,591 @@ void drmSLDump(void *l)
 	}
     }
 }
+
+#else /* !DRM_SL_SKIP_LIST */
+
+#define BT_KEYS        32	/* Keys per node */
+
+typedef struct BTLeaf {
+    int               count;
+    struct BTLeaf     *prev;
+    struct BTLeaf     *next;
+    unsigned long     keys[BT_KEYS];
+    void              *values[BT_KEYS];
+} BTLeaf, *BTLeafPtr;
+
+typedef struct BTInner {
+    int               count;	/* Keys, there is one more child */
+    unsigned long     keys[BT_KEYS];
+    void              *children[BT_KEYS + 1];
+} BTInner, *BTInnerPtr;
+
+#define BT_NODE_SIZE   (sizeof(BTLeaf) > sizeof(BTInner) ? \
+			sizeof(BTLeaf) : sizeof(BTInner))
+
+typedef struct BTree {
+    unsigned long     magic;	/* SL_LIST_MAGIC */
+    int               height;	/* Levels of inner nodes */
+    int               count;
+    void              *root;
+    BTLeafPtr         first;
+    BTLeafPtr         last;
+    pthread_mutex_t   lock;
+    void              *spare;	/* Reserved nodes, see BTReserve() */
+    int               spares;
+    unsigned long     generation; /* Bumped by every change */
+				/* Position for iteration */
+    BTLeafPtr         leaf;
+    int               index;
+    unsigned long     leaf_generation;
+    unsigned long     from;	/* Next key to return, at least */
+    unsigned long     end;
+    int               done;
+} BTree, *BTreePtr;
+
+/* Index of the first key which is not less than the given one. */
+static int BTLowerBound(const unsigned long *keys, int count, unsigned long key)
+{
+    int lo = 0, hi = count, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (keys[mid] < key) lo = mid + 1;
+	else                 hi = mid;
+    }
+    return lo;
+}
+
+/* Index of the child of an inner node which holds the given key. */
+static int BTChild(BTInnerPtr inner, unsigned long key)
+{
+    int lo = 0, hi = inner->count, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (inner->keys[mid] <= key) lo = mid + 1;
+	else                         hi = mid;
+    }
+    return lo;
+}
+
+static BTLeafPtr BTFindLeaf(BTreePtr tree, unsigned long key)
+{
+    void *node = tree->root;
+    int  level;
+
+    for (level = tree->height; level > 0; level--)
+	node = ((BTInnerPtr)node)->children[BTChild(node, key)];
+    return node;
+}
+
+/* Make sure an insertion can split a node on every level without running
+   out of memory half way. */
+
+static int BTReserve(BTreePtr tree)
+{
+    void *node;
+
+    while (tree->spares < tree->height + 2) {
+	node = calloc(1, BT_NODE_SIZE);
+	if (!node) return -1;
+	*(void **)node = tree->spare;
+	tree->spare    = node;
+	++tree->spares;
+    }
+    return 0;
+}
+
+static void *BTAllocNode(BTreePtr tree)
+{
+    void *node = tree->spare;
+
+    tree->spare = *(void **)node;
+    --tree->spares;
+    memset(node, 0, BT_NODE_SIZE);
+    return node;
+}
+
+void *drmSLCreate(void)
+{
+    BTreePtr tree;
+
+    tree           = calloc(1, sizeof(*tree));
+    if (!tree) return NULL;
+    tree->root     = calloc(1, BT_NODE_SIZE);
+    if (!tree->root) {
+	free(tree);
+	return NULL;
+    }
+    tree->magic    = SL_LIST_MAGIC;
+    tree->first    = tree->root;
+    tree->last     = tree->root;
+    tree->done     = 1;
+    pthread_mutex_init(&tree->lock, NULL);
+
+    return tree;
+}
+
+static void BTFreeNode(void *node, int level)
+{
+    BTInnerPtr inner = node;
+    int        i;
+
+    if (level > 0) {
+	for (i = 0; i <= inner->count; i++)
+	    BTFreeNode(inner->children[i], level - 1);
+    }
+    free(node);
+}
+
+int drmSLDestroy(void *l)
+{
+    BTreePtr tree = (BTreePtr)l;
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    BTFreeNode(tree->root, tree->height);
+    while (tree->spare) {
+	void *next = *(void **)tree->spare;
+	free(tree->spare);
+	tree->spare = next;
+    }
+    pthread_mutex_destroy(&tree->lock);
+    tree->magic = SL_FREED_MAGIC;
+    free(tree);
+    return 0;
+}
+
+/* Insert into a leaf, splitting it if it is full.  The last leaf of the
+   tree is split so that it stays full, as it is most likely being filled
+   with ascending keys. */
+
+static int BTInsertLeaf(BTreePtr tree, BTLeafPtr leaf,
+			unsigned long key, void *value,
+			unsigned long *split_key, void **split_node)
+{
+    unsigned long keys[BT_KEYS + 1];
+    void          *values[BT_KEYS + 1];
+    BTLeafPtr     right;
+    int           pos, left;
+
+    pos = BTLowerBound(leaf->keys, leaf->count, key);
+    if (pos < leaf->count && leaf->keys[pos] == key) return 1;
+
+    if (leaf->count < BT_KEYS) {
+	memmove(&leaf->keys[pos + 1], &leaf->keys[pos],
+		(leaf->count - pos) * sizeof(leaf->keys[0]));
+	memmove(&leaf->values[pos + 1], &leaf->values[pos],
+		(leaf->count - pos) * sizeof(leaf->values[0]));
+	leaf->keys[pos]   = key;
+	leaf->values[pos] = value;
+	++leaf->count;
+	return 0;
+    }
+
+    right = BTAllocNode(tree);
+
+    memcpy(keys, leaf->keys, pos * sizeof(keys[0]));
+    memcpy(values, leaf->values, pos * sizeof(values[0]));
+    keys[pos]   = key;
+    values[pos] = value;
+    memcpy(&keys[pos + 1], &leaf->keys[pos],
+	   (BT_KEYS - pos) * sizeof(keys[0]));
+    memcpy(&values[pos + 1], &leaf->values[pos],
+	   (BT_KEYS - pos) * sizeof(values[0]));
+
+    left = (leaf == tree->last && pos == BT_KEYS) ? BT_KEYS : (BT_KEYS + 1) / 2;
+
+    memcpy(leaf->keys, keys, left * sizeof(keys[0]));
+    memcpy(leaf->values, values, left * sizeof(values[0]));
+    leaf->count  = left;
+    right->count = BT_KEYS + 1 - left;
+    memcpy(right->keys, &keys[left], right->count * sizeof(keys[0]));
+    memcpy(right->values, &values[left], right->count * sizeof(values[0]));
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next) leaf->next->prev = right;
+    else            tree->last       = right;
+    leaf->next  = right;
+
+    *split_key  = right->keys[0];
+    *split_node = right;
+    return 0;
+}
+
+static int BTInsertNode(BTreePtr tree, void *node, int level, int rightmost,
+			unsigned long key, void *value,
+			unsigned long *split_key, void **split_node)
+{
+    BTInnerPtr    inner = node;
+    BTInnerPtr    right;
+    unsigned long keys[BT_KEYS + 1];
+    void          *children[BT_KEYS + 2];
+    unsigned long child_key;
+    void          *child_node = NULL;
+    int           pos, left, ret;
+
+    if (level == 0)
+	return BTInsertLeaf(tree, node, key, value, split_key, split_node);
+
+    pos = BTChild(inner, key);
+    ret = BTInsertNode(tree, inner->children[pos], level - 1,
+		       rightmost && pos == inner->count, key, value,
+		       &child_key, &child_node);
+    if (ret || !child_node) return ret;
+
+    if (inner->count < BT_KEYS) {
+	memmove(&inner->keys[pos + 1], &inner->keys[pos],
+		(inner->count - pos) * sizeof(inner->keys[0]));
+	memmove(&inner->children[pos + 2], &inner->children[pos + 1],
+		(inner->count - pos) * sizeof(inner->children[0]));
+	inner->keys[pos]         = child_key;
+	inner->children[pos + 1] = child_node;
+	++inner->count;
+	return 0;
+    }
+
+    right = BTAllocNode(tree);
+
+    memcpy(keys, inner->keys, pos * sizeof(keys[0]));
+    keys[pos] = child_key;
+    memcpy(&keys[pos + 1], &inner->keys[pos],
+	   (BT_KEYS - pos) * sizeof(keys[0]));
+    memcpy(children, inner->children, (pos + 1) * sizeof(children[0]));
+    children[pos + 1] = child_node;
+    memcpy(&children[pos + 2], &inner->children[pos + 1],
+	   (BT_KEYS - pos) * sizeof(children[0]));
+
+				/* keys[left] moves up to the parent */
+    left = (rightmost && pos == BT_KEYS) ? BT_KEYS : BT_KEYS / 2;
+
+    inner->count = left;
+    memcpy(inner->keys, keys, left * sizeof(keys[0]));
+    memcpy(inner->children, children, (left + 1) * sizeof(children[0]));
+    right->count = BT_KEYS - left;
+    memcpy(right->keys, &keys[left + 1], right->count * sizeof(keys[0]));
+    memcpy(right->children, &children[left + 1],
+	   (right->count + 1) * sizeof(children[0]));
+
+    *split_key  = keys[left];
+    *split_node = right;
+    return 0;
+}
+
+/* Must be called with the lock held. */
+static int BTInsert(BTreePtr tree, unsigned long key, void *value)
+{
+    BTLeafPtr     last = tree->last;
+    BTInnerPtr    root;
+    unsigned long split_key;
+    void          *split_node = NULL;
+    int           ret;
+
+				/* Appending needs no descent */
+    if (last->count && last->count < BT_KEYS &&
+	key > last->keys[last->count - 1]) {
+	last->keys[last->count]   = key;
+	last->values[last->count] = value;
+	++last->count;
+	ret = 0;
+    } else {
+	if (BTReserve(tree)) return -1;
+	ret = BTInsertNode(tree, tree->root, tree->height, 1, key, value,
+			   &split_key, &split_node);
+    }
+    if (ret) return ret;
+
+    if (split_node) {
+	root = BTAllocNode(tree);
+	root->count       = 1;
+	root->keys[0]     = split_key;
+	root->children[0] = tree->root;
+	root->children[1] = split_node;
+	tree->root        = root;
+	++tree->height;
+    }
+
+    ++tree->count;
+    ++tree->generation;
+    return 0;			/* Added to table */
+}
+
+int drmSLInsert(void *l, unsigned long key, void *value)
+{
+    BTreePtr tree = (BTreePtr)l;
+    int      ret;
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    pthread_mutex_lock(&tree->lock);
+    ret = BTInsert(tree, key, value);
+    pthread_mutex_unlock(&tree->lock);
+    return ret;
+}
+
+int drmSLInsertBulk(void *l, const unsigned long *keys, void * const *values,
+		    int count)
+{
+    BTreePtr tree  = (BTreePtr)l;
+    int      added = 0;
+    int      i;
+    int      ret;
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    pthread_mutex_lock(&tree->lock);
+    for (i = 0; i < count; i++) {
+	ret = BTInsert(tree, keys[i], values ? values[i] : NULL);
+	if (ret < 0) {
+	    added = -1;
+	    break;
+	}
+	if (!ret) ++added;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return added;
+}
+
+static void BTUnlinkLeaf(BTreePtr tree, BTLeafPtr leaf)
+{
+    if (leaf->prev) leaf->prev->next = leaf->next;
+    else            tree->first      = leaf->next;
+    if (leaf->next) leaf->next->prev = leaf->prev;
+    else            tree->last       = leaf->prev;
+}
+
+/* Remove a key from the subtree.  Nodes which become empty are freed by
+   their parent. */
+
+static int BTDeleteNode(BTreePtr tree, void *node, int level,
+			unsigned long key, int *empty)
+{
+    BTInnerPtr inner = node;
+    BTLeafPtr  leaf  = node;
+    void       *child;
+    int        child_empty = 0;
+    int        pos;
+
+    if (level == 0) {
+	pos = BTLowerBound(leaf->keys, leaf->count, key);
+	if (pos == leaf->count || leaf->keys[pos] != key) return 1;
+
+	memmove(&leaf->keys[pos], &leaf->keys[pos + 1],
+		(leaf->count - pos - 1) * sizeof(leaf->keys[0]));
+	memmove(&leaf->values[pos], &leaf->values[pos + 1],
+		(leaf->count - pos - 1) * sizeof(leaf->values[0]));
+	--leaf->count;
+	*empty = !leaf->count && tree->first != tree->last; /* Keep one */
+	return 0;
+    }
+
+    pos   = BTChild(inner, key);
+    child = inner->children[pos];
+    if (BTDeleteNode(tree, child, level - 1, key, &child_empty)) return 1;
+
+    *empty = 0;
+    if (!child_empty) return 0;
+
+    if (level == 1) BTUnlinkLeaf(tree, child);
+    free(child);
+
+    if (!inner->count) {
+	*empty = 1;
+	return 0;
+    }
+
+				/* Drop the key separating it from a
+				   neighbor */
+    memmove(&inner->keys[pos ? pos - 1 : 0], &inner->keys[pos ? pos : 1],
+	    (inner->count - (pos ? pos : 1)) * sizeof(inner->keys[0]));
+    memmove(&inner->children[pos], &inner->children[pos + 1],
+	    (inner->count - pos) * sizeof(inner->children[0]));
+    --inner->count;
+    return 0;
+}
+
+int drmSLDelete(void *l, unsigned long key)
+{
+    BTreePtr   tree = (BTreePtr)l;
+    BTInnerPtr root;
+    int        empty;		/* Never set for the root */
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    pthread_mutex_lock(&tree->lock);
+    if (BTDeleteNode(tree, tree->root, tree->height, key, &empty)) {
+	pthread_mutex_unlock(&tree->lock);
+	return 1;		/* Not found */
+    }
+
+				/* Drop roots with a single child */
+    while (tree->height > 0) {
+	root = tree->root;
+	if (root->count > 0) break;
+	tree->root = root->children[0];
+	free(root);
+	--tree->height;
+    }
+
+    --tree->count;
+    ++tree->generation;
+    pthread_mutex_unlock(&tree->lock);
+    return 0;
+}
+
+int drmSLLookup(void *l, unsigned long key, void **value)
+{
+    BTreePtr  tree = (BTreePtr)l;
+    BTLeafPtr leaf;
+    int       pos;
+    int       ret = -1;
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    *value = NULL;
+    pthread_mutex_lock(&tree->lock);
+    leaf = BTFindLeaf(tree, key);
+    pos  = BTLowerBound(leaf->keys, leaf->count, key);
+    if (pos < leaf->count && leaf->keys[pos] == key) {
+	*value = leaf->values[pos];
+	ret    = 0;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return ret;
+}
+
+/* Same results as the skip list: the previous key is the largest one less
+   than the given key, or 0 if there is none, and the next key is the
+   smallest one not less than the given key. */
+
+int drmSLLookupNeighbors(void *l, unsigned long key,
+			 unsigned long *prev_key, void **prev_value,
+			 unsigned long *next_key, void **next_value)
+{
+    BTreePtr      tree = (BTreePtr)l;
+    BTLeafPtr     leaf;
+    int           pos;
+    int           retcode = 1;
+
+    *prev_key   = *next_key   = key;
+    *prev_value = *next_value = NULL;
+
+    if (tree->magic != SL_LIST_MAGIC) return 0; /* Bad magic */
+
+    pthread_mutex_lock(&tree->lock);
+    leaf = BTFindLeaf(tree, key);
+    pos  = BTLowerBound(leaf->keys, leaf->count, key);
+
+    *prev_key = 0;
+    if (pos > 0) {
+	*prev_key   = leaf->keys[pos - 1];
+	*prev_value = leaf->values[pos - 1];
+    } else if (leaf->prev) {
+	*prev_key   = leaf->prev->keys[leaf->prev->count - 1];
+	*prev_value = leaf->prev->values[leaf->prev->count - 1];
+    }
+
+    if (pos == leaf->count) {
+	leaf = leaf->next;
+	pos  = 0;
+    }
+    if (leaf && pos < leaf->count) {
+	*next_key   = leaf->keys[pos];
+	*next_value = leaf->values[pos];
+	++retcode;
+    }
+    pthread_mutex_unlock(&tree->lock);
+    return retcode;
+}
+
+/* Iteration remembers its leaf, and finds its place again by key if the
+   tree was changed in between. */
+
+int drmSLNext(void *l, unsigned long *key, void **value)
+{
+    BTreePtr      tree = (BTreePtr)l;
+    BTLeafPtr     leaf;
+    int           ret = 0;
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    pthread_mutex_lock(&tree->lock);
+    if (tree->done) goto out;
+
+    if (tree->leaf_generation != tree->generation) {
+	tree->leaf            = BTFindLeaf(tree, tree->from);
+	tree->index           = BTLowerBound(tree->leaf->keys, tree->leaf->count,
+					     tree->from);
+	tree->leaf_generation = tree->generation;
+    }
+
+    leaf = tree->leaf;
+    while (leaf && tree->index == leaf->count) {
+	leaf        = leaf->next;
+	tree->leaf  = leaf;
+	tree->index = 0;
+    }
+
+    if (!leaf || leaf->keys[tree->index] > tree->end) {
+	tree->done = 1;
+	goto out;
+    }
+
+    *key   = leaf->keys[tree->index];
+    *value = leaf->values[tree->index];
+    ++tree->index;
+    if (*key == ULONG_MAX) tree->done = 1;
+    tree->from = *key + 1;
+    ret = 1;
+
+out:
+    pthread_mutex_unlock(&tree->lock);
+    return ret;
+}
+
+int drmSLFirstRange(void *l, unsigned long first, unsigned long last,
+		    unsigned long *key, void **value)
+{
+    BTreePtr      tree = (BTreePtr)l;
+
+    if (tree->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    pthread_mutex_lock(&tree->lock);
+    tree->from            = first;
+    tree->end             = last;
+    tree->done            = first > last;
+    tree->leaf_generation = tree->generation - 1; /* Seek */
+    pthread_mutex_unlock(&tree->lock);
+    return drmSLNext(tree, key, value);
+}
+
+int drmSLFirst(void *l, unsigned long *key, void **value)
+{
+    return drmSLFirstRange(l, 0, ULONG_MAX, key, value);
+}
+
+/* Dump internal data structures for debugging. */
+void drmSLDump(void *l)
+{
+    BTreePtr      tree = (BTreePtr)l;
+    BTLeafPtr     leaf;
+    int           i;
+
+    if (tree->magic != SL_LIST_MAGIC) {
+	printf("Bad magic: 0x%08lx (expected 0x%08lx)\n",
+	       tree->magic, SL_LIST_MAGIC);
+	return;
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    printf("Height = %d, count = %d\n", tree->height, tree->count);
+    for (leaf = tree->first; leaf; leaf = leaf->next) {
+	printf("\nLeaf %p has %2d keys\n", leaf, leaf->count);
+	for (i = 0; i < leaf->count; i++)
+	    printf("   %2d: <0x%08lx, %p>\n", i, leaf->keys[i], leaf->values[i]);
+    }
+    pthread_mutex_unlock(&tree->lock);
+}
+
+#endif /* !DRM_SL_SKIP_LIST */